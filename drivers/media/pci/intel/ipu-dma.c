@@ -182,11 +182,10 @@ static void *ipu_dma_alloc(struct device *dev, size_t size,
 	struct ipu_mmu *mmu = to_ipu_bus_device(dev)->mmu;
 	struct pci_dev *pdev = to_ipu_bus_device(dev)->isp->pdev;
 	struct page **pages;
-	struct iova *iova;
 	struct vm_info *info;
 	int i;
 	int rval;
-	unsigned long count;
+	unsigned long count, iova_pfn;
 	dma_addr_t pci_dma_addr, ipu_iova;
 
 	info = kzalloc(sizeof(*info), GFP_KERNEL);
@@ -196,18 +195,18 @@ static void *ipu_dma_alloc(struct device *dev, size_t size,
 	size = PAGE_ALIGN(size);
 	count = size >> PAGE_SHIFT;
 
-	iova = alloc_iova(&mmu->dmap->iovad, count,
-			  dma_get_mask(dev) >> PAGE_SHIFT, 0);
-	if (!iova)
+	iova_pfn = ipu_mmu_alloc_iova(mmu, count,
+				      dma_get_mask(dev) >> PAGE_SHIFT);
+	if (!iova_pfn)
 		goto out_kfree;
 
 	pages = __dma_alloc_buffer(dev, size, gfp, attrs);
 	if (!pages)
 		goto out_free_iova;
 
-	dev_dbg(dev, "dma_alloc: iova low pfn %lu, high pfn %lu\n", iova->pfn_lo,
-		iova->pfn_hi);
-	for (i = 0; iova->pfn_lo + i <= iova->pfn_hi; i++) {
+	dev_dbg(dev, "dma_alloc: iova low pfn %lu, high pfn %lu\n", iova_pfn,
+		iova_pfn + count - 1);
+	for (i = 0; i < count; i++) {
 		pci_dma_addr = dma_map_page_attrs(&pdev->dev, pages[i], 0,
 						  PAGE_SIZE, DMA_BIDIRECTIONAL,
 						  attrs);
@@ -219,7 +218,7 @@ static void *ipu_dma_alloc(struct device *dev, size_t size,
 		}
 
 		rval = ipu_mmu_map(mmu->dmap->mmu_info,
-				   (iova->pfn_lo + i) << PAGE_SHIFT,
+				   (iova_pfn + i) << PAGE_SHIFT,
 				   pci_dma_addr, PAGE_SIZE);
 		if (rval) {
 			dev_err(dev, "ipu_mmu_map for pci_dma[%d] %pad failed",
@@ -235,7 +234,7 @@ static void *ipu_dma_alloc(struct device *dev, size_t size,
 	if (!info->vaddr)
 		goto out_unmap;
 
-	*dma_handle = iova->pfn_lo << PAGE_SHIFT;
+	*dma_handle = iova_pfn << PAGE_SHIFT;
 
 	info->pages = pages;
 	info->ipu_iova = *dma_handle;
@@ -246,7 +245,7 @@ static void *ipu_dma_alloc(struct device *dev, size_t size,
 
 out_unmap:
 	for (i--; i >= 0; i--) {
-		ipu_iova = (iova->pfn_lo + i) << PAGE_SHIFT;
+		ipu_iova = (iova_pfn + i) << PAGE_SHIFT;
 		pci_dma_addr = ipu_mmu_iova_to_phys(mmu->dmap->mmu_info,
 						    ipu_iova);
 		dma_unmap_page_attrs(&pdev->dev, pci_dma_addr, PAGE_SIZE,
@@ -258,7 +257,7 @@ out_unmap:
 	__dma_free_buffer(dev, pages, size, attrs);
 
 out_free_iova:
-	__free_iova(&mmu->dmap->iovad, iova);
+	ipu_mmu_free_iova(mmu, iova_pfn, count);
 out_kfree:
 	kfree(info);
 
@@ -277,14 +276,11 @@ static void ipu_dma_free(struct device *dev, size_t size, void *vaddr,
 	struct pci_dev *pdev = to_ipu_bus_device(dev)->isp->pdev;
 	struct page **pages;
 	struct vm_info *info;
-	struct iova *iova = find_iova(&mmu->dmap->iovad,
-				      dma_handle >> PAGE_SHIFT);
+	unsigned long iova_pfn = dma_handle >> PAGE_SHIFT;
+	unsigned long count;
 	dma_addr_t pci_dma_addr, ipu_iova;
 	int i;
 
-	if (WARN_ON(!iova))
-		return;
-
 	info = get_vm_info(mmu, dma_handle);
 	if (WARN_ON(!info))
 		return;
@@ -298,27 +294,27 @@ static void ipu_dma_free(struct device *dev, size_t size, void *vaddr,
 	list_del(&info->list);
 
 	size = PAGE_ALIGN(size);
+	/* The IOVA range is sized as allocated, not as passed in here */
+	count = info->size >> PAGE_SHIFT;
 
 	pages = info->pages;
 
 	vunmap(vaddr);
 
-	for (i = 0; i < size >> PAGE_SHIFT; i++) {
-		ipu_iova = (iova->pfn_lo + i) << PAGE_SHIFT;
+	for (i = 0; i < count; i++) {
+		ipu_iova = (iova_pfn + i) << PAGE_SHIFT;
 		pci_dma_addr = ipu_mmu_iova_to_phys(mmu->dmap->mmu_info,
 						    ipu_iova);
 		dma_unmap_page_attrs(&pdev->dev, pci_dma_addr, PAGE_SIZE,
 				     DMA_BIDIRECTIONAL, attrs);
 	}
 
-	ipu_mmu_unmap(mmu->dmap->mmu_info, iova->pfn_lo << PAGE_SHIFT,
-		      iova_size(iova) << PAGE_SHIFT);
+	ipu_mmu_unmap(mmu->dmap->mmu_info, iova_pfn << PAGE_SHIFT,
+		      count << PAGE_SHIFT);
 
 	__dma_free_buffer(dev, pages, size, attrs);
 
-	mmu->tlb_invalidate(mmu);
-
-	__free_iova(&mmu->dmap->iovad, iova);
+	ipu_mmu_free_iova(mmu, iova_pfn, count);
 
 	kfree(info);
 }
@@ -397,20 +393,17 @@ static void ipu_dma_unmap_sg(struct device *dev,
 			     unsigned long attrs)
 #endif
 {
-	int i, npages, count;
+	int i, count;
 	struct scatterlist *sg;
 	dma_addr_t pci_dma_addr;
 	struct ipu_mmu *mmu = to_ipu_bus_device(dev)->mmu;
 	struct pci_dev *pdev = to_ipu_bus_device(dev)->isp->pdev;
-	struct iova *iova = find_iova(&mmu->dmap->iovad,
-				      sg_dma_address(sglist) >> PAGE_SHIFT);
+	unsigned long iova_pfn = sg_dma_address(sglist) >> PAGE_SHIFT;
+	unsigned long npages;
 
 	if (!nents)
 		return;
 
-	if (WARN_ON(!iova))
-		return;
-
 #if LINUX_VERSION_CODE < KERNEL_VERSION(4, 8, 0)
 	if (!dma_get_attr(DMA_ATTR_SKIP_CPU_SYNC, attrs))
 #else
@@ -418,18 +411,20 @@ static void ipu_dma_unmap_sg(struct device *dev,
 #endif
 		ipu_dma_sync_sg_for_cpu(dev, sglist, nents, DMA_BIDIRECTIONAL);
 
-	/* get the nents as orig_nents given by caller */
+	/*
+	 * get the nents as orig_nents given by caller. The mapped entries
+	 * are followed by a zero length one, see ipu_dma_map_sg(), and
+	 * they size the IOVA range without looking it up.
+	 */
 	count = 0;
-	npages = iova_size(iova);
+	npages = 0;
 	for_each_sg(sglist, sg, nents, i) {
 		if (sg_dma_len(sg) == 0 ||
 		    sg_dma_address(sg) == DMA_MAPPING_ERROR)
 			break;
 
-		npages -= PAGE_ALIGN(sg_dma_len(sg)) >> PAGE_SHIFT;
+		npages += PAGE_ALIGN(sg_dma_len(sg)) >> PAGE_SHIFT;
 		count++;
-		if (npages <= 0)
-			break;
 	}
 
 	/* before ipu mmu unmap, return the pci dma address back to sg
@@ -447,15 +442,13 @@ static void ipu_dma_unmap_sg(struct device *dev,
 	}
 
 	dev_dbg(dev, "ipu_mmu_unmap low pfn %lu high pfn %lu\n",
-		iova->pfn_lo, iova->pfn_hi);
-	ipu_mmu_unmap(mmu->dmap->mmu_info, iova->pfn_lo << PAGE_SHIFT,
-		      iova_size(iova) << PAGE_SHIFT);
+		iova_pfn, iova_pfn + npages - 1);
+	ipu_mmu_unmap(mmu->dmap->mmu_info, iova_pfn << PAGE_SHIFT,
+		      npages << PAGE_SHIFT);
 
-	mmu->tlb_invalidate(mmu);
+	ipu_mmu_free_iova(mmu, iova_pfn, npages);
 
 	dma_unmap_sg_attrs(&pdev->dev, sglist, nents, dir, attrs);
-
-	__free_iova(&mmu->dmap->iovad, iova);
 }
 
 static int ipu_dma_map_sg(struct device *dev, struct scatterlist *sglist,
@@ -469,10 +462,10 @@ static int ipu_dma_map_sg(struct device *dev, struct scatterlist *sglist,
 	struct ipu_mmu *mmu = to_ipu_bus_device(dev)->mmu;
 	struct pci_dev *pdev = to_ipu_bus_device(dev)->isp->pdev;
 	struct scatterlist *sg;
-	struct iova *iova;
-	size_t npages = 0;
-	unsigned long iova_addr;
-	int i, count;
+	size_t npages = 0, run_size;
+	unsigned long iova_pfn, iova_addr, run_iova;
+	dma_addr_t run_paddr;
+	int i, count, rval;
 
 	dev_dbg(dev, "pci_dma_map_sg trying to map %d ents\n", nents);
 	count  = dma_map_sg_attrs(&pdev->dev, sglist, nents, dir, attrs);
@@ -486,18 +479,26 @@ static int ipu_dma_map_sg(struct device *dev, struct scatterlist *sglist,
 	for_each_sg(sglist, sg, count, i)
 		npages += PAGE_ALIGN(sg_dma_len(sg)) >> PAGE_SHIFT;
 
-	iova = alloc_iova(&mmu->dmap->iovad, npages,
-			  dma_get_mask(dev) >> PAGE_SHIFT, 0);
-	if (!iova)
+	iova_pfn = ipu_mmu_alloc_iova(mmu, npages,
+				      dma_get_mask(dev) >> PAGE_SHIFT);
+	if (!iova_pfn) {
+		dma_unmap_sg_attrs(&pdev->dev, sglist, nents, dir, attrs);
 		return 0;
+	}
 
-	dev_dbg(dev, "dmamap: iova low pfn %lu, high pfn %lu\n", iova->pfn_lo,
-		iova->pfn_hi);
+	dev_dbg(dev, "dmamap: iova low pfn %lu, high pfn %lu\n", iova_pfn,
+		iova_pfn + npages - 1);
 
-	iova_addr = iova->pfn_lo;
+	/*
+	 * The IOVA range is contiguous, so entries that are contiguous on the
+	 * PCI side as well are mapped with a single ipu_mmu_map() call. The
+	 * PCI addresses are only replaced once everything is mapped.
+	 */
+	iova_addr = iova_pfn;
+	run_iova = iova_addr;
+	run_paddr = 0;
+	run_size = 0;
 	for_each_sg(sglist, sg, count, i) {
-		int rval;
-
 		dev_dbg(dev, "mapping entry %d: iova 0x%lx phy %pad size %d\n",
 			i, iova_addr << PAGE_SHIFT,
 			&sg_dma_address(sg), sg_dma_len(sg));
@@ -505,16 +506,36 @@ static int ipu_dma_map_sg(struct device *dev, struct scatterlist *sglist,
 		dev_dbg(dev, "mapping entry %d: sg->length = %d\n", i,
 			sg->length);
 
-		rval = ipu_mmu_map(mmu->dmap->mmu_info, iova_addr << PAGE_SHIFT,
-				   sg_dma_address(sg),
-				   PAGE_ALIGN(sg_dma_len(sg)));
-		if (rval)
-			goto out_fail;
+		if (run_size && sg_dma_address(sg) != run_paddr + run_size) {
+			rval = ipu_mmu_map(mmu->dmap->mmu_info,
+					   run_iova << PAGE_SHIFT, run_paddr,
+					   run_size);
+			if (rval)
+				goto out_fail;
+			run_size = 0;
+		}
 
-		sg_dma_address(sg) = iova_addr << PAGE_SHIFT;
+		if (!run_size) {
+			run_iova = iova_addr;
+			run_paddr = sg_dma_address(sg);
+		}
+		run_size += PAGE_ALIGN(sg_dma_len(sg));
+		iova_addr += PAGE_ALIGN(sg_dma_len(sg)) >> PAGE_SHIFT;
+	}
+
+	rval = ipu_mmu_map(mmu->dmap->mmu_info, run_iova << PAGE_SHIFT,
+			   run_paddr, run_size);
+	if (rval)
+		goto out_fail;
 
+	iova_addr = iova_pfn;
+	for_each_sg(sglist, sg, count, i) {
+		sg_dma_address(sg) = iova_addr << PAGE_SHIFT;
 		iova_addr += PAGE_ALIGN(sg_dma_len(sg)) >> PAGE_SHIFT;
 	}
+	/* Terminate the mapped entries for ipu_dma_unmap_sg() */
+	if (count < nents && sg)
+		sg_dma_len(sg) = 0;
 
 #if LINUX_VERSION_CODE < KERNEL_VERSION(4, 8, 0)
 	if (!dma_get_attr(DMA_ATTR_SKIP_CPU_SYNC, attrs))
@@ -528,7 +549,12 @@ static int ipu_dma_map_sg(struct device *dev, struct scatterlist *sglist,
 	return count;
 
 out_fail:
-	ipu_dma_unmap_sg(dev, sglist, i, dir, attrs);
+	/* Everything below the failed run is mapped */
+	if (run_iova > iova_pfn)
+		ipu_mmu_unmap(mmu->dmap->mmu_info, iova_pfn << PAGE_SHIFT,
+			      (run_iova - iova_pfn) << PAGE_SHIFT);
+	ipu_mmu_free_iova(mmu, iova_pfn, npages);
+	dma_unmap_sg_attrs(&pdev->dev, sglist, nents, dir, attrs);
 
 	return 0;
 }
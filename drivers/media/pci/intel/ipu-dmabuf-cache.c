@@ -0,0 +1,350 @@
+// SPDX-License-Identifier: GPL-2.0
+// Copyright (C) 2013 - 2024 Intel Corporation
+
+#include <linux/debugfs.h>
+#include <linux/device.h>
+#include <linux/dma-buf.h>
+#include <linux/module.h>
+#include <linux/sizes.h>
+#include <linux/slab.h>
+#include <linux/version.h>
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(5, 10, 0)
+#include <linux/dma-resv.h>
+#endif
+
+#include "ipu-dmabuf-cache.h"
+
+static unsigned int dmabuf_cache_entries = 32;
+module_param(dmabuf_cache_entries, uint, 0644);
+MODULE_PARM_DESC(dmabuf_cache_entries,
+		 "Max number of cached dma-buf mappings (0: no caching)");
+
+static unsigned int dmabuf_cache_budget_mb = 256;
+module_param(dmabuf_cache_budget_mb, uint, 0644);
+MODULE_PARM_DESC(dmabuf_cache_budget_mb,
+		 "Max size in MiB of the dma-bufs kept mapped by the cache");
+
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(5, 10, 0)
+static void ipu_dmabuf_move_notify(struct dma_buf_attachment *attach)
+{
+	struct ipu_dmabuf_map *map = attach->importer_priv;
+
+	/* Mappings are pinned while in use, so only idle ones can move */
+	WRITE_ONCE(map->stale, true);
+}
+
+static const struct dma_buf_attach_ops ipu_dmabuf_attach_ops = {
+	.allow_peer2peer = false,
+	.move_notify = ipu_dmabuf_move_notify,
+};
+#endif
+
+static int ipu_dmabuf_map_pin(struct ipu_dmabuf_map *map)
+{
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(5, 10, 0)
+	int ret;
+
+	dma_resv_lock(map->dbuf->resv, NULL);
+	ret = dma_buf_pin(map->attach);
+	/* The exporter moved the buffer while the mapping was idle */
+	if (!ret && map->stale) {
+		dma_buf_unpin(map->attach);
+		ret = -ESTALE;
+	}
+	dma_resv_unlock(map->dbuf->resv);
+
+	return ret;
+#else
+	return 0;
+#endif
+}
+
+static void ipu_dmabuf_map_unpin(struct ipu_dmabuf_map *map)
+{
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(5, 10, 0)
+	dma_resv_lock(map->dbuf->resv, NULL);
+	dma_buf_unpin(map->attach);
+	dma_resv_unlock(map->dbuf->resv);
+#endif
+}
+
+static struct ipu_dmabuf_map *
+ipu_dmabuf_map_create(struct ipu_dmabuf_cache *cache, struct device *dev,
+		      struct dma_buf *dbuf)
+{
+	struct ipu_dmabuf_map *map;
+	int ret;
+
+	map = kzalloc(sizeof(*map), GFP_KERNEL);
+	if (!map)
+		return ERR_PTR(-ENOMEM);
+
+	map->cache = cache;
+	map->dev = dev;
+	map->dbuf = dbuf;
+	map->size = dbuf->size;
+	map->users = 1;
+	INIT_LIST_HEAD(&map->lru);
+	get_dma_buf(dbuf);
+
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(5, 10, 0)
+	map->attach = dma_buf_dynamic_attach(dbuf, dev, &ipu_dmabuf_attach_ops,
+					     map);
+#else
+	map->attach = dma_buf_attach(dbuf, dev);
+#endif
+	if (IS_ERR(map->attach)) {
+		ret = PTR_ERR(map->attach);
+		goto out_put;
+	}
+
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(5, 10, 0)
+	dma_resv_lock(dbuf->resv, NULL);
+	ret = dma_buf_pin(map->attach);
+	if (!ret) {
+		map->sgt = dma_buf_map_attachment(map->attach,
+						  DMA_BIDIRECTIONAL);
+		if (IS_ERR_OR_NULL(map->sgt))
+			dma_buf_unpin(map->attach);
+	}
+	dma_resv_unlock(dbuf->resv);
+	if (ret)
+		goto out_detach;
+#else
+	map->sgt = dma_buf_map_attachment(map->attach, DMA_BIDIRECTIONAL);
+#endif
+	if (IS_ERR_OR_NULL(map->sgt)) {
+		ret = map->sgt ? PTR_ERR(map->sgt) : -ENOMEM;
+		goto out_detach;
+	}
+
+	return map;
+
+out_detach:
+	dma_buf_detach(dbuf, map->attach);
+out_put:
+	dma_buf_put(dbuf);
+	kfree(map);
+
+	return ERR_PTR(ret);
+}
+
+static void ipu_dmabuf_map_destroy(struct ipu_dmabuf_map *map)
+{
+	struct dma_buf *dbuf = map->dbuf;
+
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(5, 10, 0)
+	dma_resv_lock(dbuf->resv, NULL);
+	dma_buf_unmap_attachment(map->attach, map->sgt, DMA_BIDIRECTIONAL);
+	dma_resv_unlock(dbuf->resv);
+#else
+	dma_buf_unmap_attachment(map->attach, map->sgt, DMA_BIDIRECTIONAL);
+#endif
+	dma_buf_detach(dbuf, map->attach);
+	dma_buf_put(dbuf);
+	kfree(map);
+}
+
+static struct ipu_dmabuf_map *
+ipu_dmabuf_cache_lookup(struct ipu_dmabuf_cache *cache, struct device *dev,
+			struct dma_buf *dbuf)
+{
+	struct ipu_dmabuf_map *map;
+
+	hash_for_each_possible(cache->hash, map, hnode, (unsigned long)dbuf) {
+		if (map->dbuf == dbuf && map->dev == dev)
+			return map;
+	}
+
+	return NULL;
+}
+
+static void ipu_dmabuf_cache_unhash(struct ipu_dmabuf_cache *cache,
+				    struct ipu_dmabuf_map *map)
+{
+	hash_del(&map->hnode);
+	map->hashed = false;
+	cache->entries--;
+	cache->bytes -= map->size;
+}
+
+/* Move idle mappings to @victims until the cache is within its limits */
+static void ipu_dmabuf_cache_trim(struct ipu_dmabuf_cache *cache,
+				  struct list_head *victims)
+{
+	unsigned int max_entries = READ_ONCE(dmabuf_cache_entries);
+	size_t budget = (size_t)READ_ONCE(dmabuf_cache_budget_mb) * SZ_1M;
+	struct ipu_dmabuf_map *map, *tmp;
+
+	list_for_each_entry_safe(map, tmp, &cache->lru, lru) {
+		if (cache->entries <= max_entries && cache->bytes <= budget)
+			break;
+
+		ipu_dmabuf_cache_unhash(cache, map);
+		list_move_tail(&map->lru, victims);
+		cache->evictions++;
+	}
+}
+
+/* Unmapping takes the exporter's locks, so it is done without cache->lock */
+static void ipu_dmabuf_cache_release(struct list_head *victims)
+{
+	struct ipu_dmabuf_map *map, *tmp;
+
+	list_for_each_entry_safe(map, tmp, victims, lru) {
+		list_del(&map->lru);
+		ipu_dmabuf_map_destroy(map);
+	}
+}
+
+/*
+ * Return a mapping of @dbuf for @dev, attaching and mapping it only if no
+ * cached one is found. The mapping stays valid until ipu_dmabuf_cache_put().
+ */
+struct ipu_dmabuf_map *ipu_dmabuf_cache_get(struct ipu_dmabuf_cache *cache,
+					    struct device *dev,
+					    struct dma_buf *dbuf)
+{
+	struct ipu_dmabuf_map *map, *new;
+	LIST_HEAD(victims);
+	int ret;
+
+	mutex_lock(&cache->lock);
+	map = ipu_dmabuf_cache_lookup(cache, dev, dbuf);
+	if (map && !map->users) {
+		ret = ipu_dmabuf_map_pin(map);
+		if (ret) {
+			if (ret == -ESTALE)
+				cache->invalidations++;
+			ipu_dmabuf_cache_unhash(cache, map);
+			list_move(&map->lru, &victims);
+			map = NULL;
+		}
+	}
+
+	if (map) {
+		if (!map->users++)
+			list_del_init(&map->lru);
+		cache->hits++;
+		mutex_unlock(&cache->lock);
+		return map;
+	}
+
+	cache->misses++;
+	mutex_unlock(&cache->lock);
+
+	ipu_dmabuf_cache_release(&victims);
+
+	new = ipu_dmabuf_map_create(cache, dev, dbuf);
+	if (IS_ERR(new) || !READ_ONCE(dmabuf_cache_entries))
+		return new;
+
+	/* On a race with another get of the same buffer ours stays private */
+	mutex_lock(&cache->lock);
+	if (!ipu_dmabuf_cache_lookup(cache, dev, dbuf)) {
+		hash_add(cache->hash, &new->hnode, (unsigned long)dbuf);
+		new->hashed = true;
+		cache->entries++;
+		cache->bytes += new->size;
+	}
+	mutex_unlock(&cache->lock);
+
+	return new;
+}
+EXPORT_SYMBOL(ipu_dmabuf_cache_get);
+
+void ipu_dmabuf_cache_put(struct ipu_dmabuf_map *map)
+{
+	struct ipu_dmabuf_cache *cache = map->cache;
+	LIST_HEAD(victims);
+
+	mutex_lock(&cache->lock);
+	if (--map->users) {
+		mutex_unlock(&cache->lock);
+		return;
+	}
+
+	ipu_dmabuf_map_unpin(map);
+	if (map->hashed) {
+		list_add_tail(&map->lru, &cache->lru);
+		ipu_dmabuf_cache_trim(cache, &victims);
+	} else {
+		list_add(&map->lru, &victims);
+	}
+	mutex_unlock(&cache->lock);
+
+	ipu_dmabuf_cache_release(&victims);
+}
+EXPORT_SYMBOL(ipu_dmabuf_cache_put);
+
+/* Drop the idle mappings of @dev, or of all devices if @dev is NULL */
+void ipu_dmabuf_cache_flush(struct ipu_dmabuf_cache *cache,
+			    struct device *dev)
+{
+	struct ipu_dmabuf_map *map, *tmp;
+	LIST_HEAD(victims);
+
+	mutex_lock(&cache->lock);
+	list_for_each_entry_safe(map, tmp, &cache->lru, lru) {
+		if (dev && map->dev != dev)
+			continue;
+
+		ipu_dmabuf_cache_unhash(cache, map);
+		list_move_tail(&map->lru, &victims);
+	}
+	mutex_unlock(&cache->lock);
+
+	ipu_dmabuf_cache_release(&victims);
+}
+EXPORT_SYMBOL(ipu_dmabuf_cache_flush);
+
+void ipu_dmabuf_cache_init(struct ipu_dmabuf_cache *cache)
+{
+	mutex_init(&cache->lock);
+	hash_init(cache->hash);
+	INIT_LIST_HEAD(&cache->lru);
+}
+
+#ifdef CONFIG_DEBUG_FS
+static ssize_t ipu_dmabuf_cache_stats_read(struct file *file,
+					   char __user *buf, size_t len,
+					   loff_t *ppos)
+{
+	struct ipu_dmabuf_cache *cache = file->private_data;
+	char tmp[256];
+	int pos;
+
+	mutex_lock(&cache->lock);
+	pos = scnprintf(tmp, sizeof(tmp),
+			"max_entries: %u\nbudget_mb: %u\n"
+			"entries: %u\nbytes: %zu\nhits: %llu\nmisses: %llu\n"
+			"evictions: %llu\ninvalidations: %llu\n",
+			READ_ONCE(dmabuf_cache_entries),
+			READ_ONCE(dmabuf_cache_budget_mb),
+			cache->entries, cache->bytes, cache->hits,
+			cache->misses, cache->evictions,
+			cache->invalidations);
+	mutex_unlock(&cache->lock);
+
+	return simple_read_from_buffer(buf, len, ppos, tmp, pos);
+}
+
+static const struct file_operations ipu_dmabuf_cache_stats_fops = {
+	.open = simple_open,
+	.read = ipu_dmabuf_cache_stats_read,
+	.llseek = default_llseek,
+};
+
+int ipu_dmabuf_cache_debugfs_add(struct ipu_dmabuf_cache *cache,
+				 struct dentry *dir, const char *name)
+{
+	struct dentry *file;
+
+	file = debugfs_create_file(name, 0400, dir, cache,
+				   &ipu_dmabuf_cache_stats_fops);
+	if (IS_ERR_OR_NULL(file))
+		return -ENOMEM;
+
+	return 0;
+}
+#endif
@@ -0,0 +1,65 @@
+/* SPDX-License-Identifier: GPL-2.0 */
+/* Copyright (C) 2013 - 2024 Intel Corporation */
+
+#ifndef IPU_DMABUF_CACHE_H
+#define IPU_DMABUF_CACHE_H
+
+#include <linux/hashtable.h>
+#include <linux/list.h>
+#include <linux/mutex.h>
+#include <linux/types.h>
+
+struct dentry;
+struct device;
+struct dma_buf;
+struct dma_buf_attachment;
+struct sg_table;
+
+#define IPU_DMABUF_CACHE_HASH_BITS	6
+
+struct ipu_dmabuf_cache;
+
+/*
+ * An imported dma-buf attached to and mapped for one IPU bus device. The
+ * mapping outlives its users on the cache LRU so that a dma-buf which comes
+ * back is not attached and mapped again.
+ */
+struct ipu_dmabuf_map {
+	struct ipu_dmabuf_cache *cache;
+	struct hlist_node hnode;	/* cache->hash, keyed by dbuf */
+	struct list_head lru;		/* cache->lru while idle */
+	struct device *dev;
+	struct dma_buf *dbuf;
+	struct dma_buf_attachment *attach;
+	struct sg_table *sgt;
+	size_t size;
+	unsigned int users;
+	bool hashed;
+	bool stale;	/* Moved by the exporter, set under dbuf->resv */
+};
+
+struct ipu_dmabuf_cache {
+	struct mutex lock;	/* Protects everything below */
+	DECLARE_HASHTABLE(hash, IPU_DMABUF_CACHE_HASH_BITS);
+	struct list_head lru;	/* Idle mappings, oldest first */
+	unsigned int entries;
+	size_t bytes;
+	u64 hits;
+	u64 misses;
+	u64 evictions;
+	u64 invalidations;
+};
+
+void ipu_dmabuf_cache_init(struct ipu_dmabuf_cache *cache);
+struct ipu_dmabuf_map *ipu_dmabuf_cache_get(struct ipu_dmabuf_cache *cache,
+					    struct device *dev,
+					    struct dma_buf *dbuf);
+void ipu_dmabuf_cache_put(struct ipu_dmabuf_map *map);
+void ipu_dmabuf_cache_flush(struct ipu_dmabuf_cache *cache,
+			    struct device *dev);
+#ifdef CONFIG_DEBUG_FS
+int ipu_dmabuf_cache_debugfs_add(struct ipu_dmabuf_cache *cache,
+				 struct dentry *dir, const char *name);
+#endif
+
+#endif /* IPU_DMABUF_CACHE_H */
@@ -509,5 +509,50 @@ void ipu_recv_put_token(struct ipu_fw_com_context *ctx, int q_nbr)
 }
 EXPORT_SYMBOL_GPL(ipu_recv_put_token);
 
+/*
+ * Batched receive: snapshot the queue indexes once and return the number
+ * of pending tokens, the first of which is at index *rd. The tokens are
+ * accessed in place with ipu_recv_token() and released together by
+ * ipu_recv_put_tokens().
+ */
+unsigned int ipu_recv_get_tokens(struct ipu_fw_com_context *ctx, int q_nbr,
+				 unsigned int *rd)
+{
+	struct ipu_fw_sys_queue *q = &ctx->output_queue[q_nbr];
+	void __iomem *q_dmem = ctx->dmem_addr + q->wr_reg * 4;
+	unsigned int wr;
+
+	wr = readl(q_dmem + FW_COM_WR_REG);
+	*rd = readl(q_dmem + FW_COM_RD_REG);
+
+	if (!is_index_valid(q, wr) || !is_index_valid(q, *rd))
+		return 0;
+
+	return num_messages(wr, *rd, q->size);
+}
+EXPORT_SYMBOL_GPL(ipu_recv_get_tokens);
+
+void *ipu_recv_token(struct ipu_fw_com_context *ctx, int q_nbr,
+		     unsigned int rd, unsigned int i)
+{
+	struct ipu_fw_sys_queue *q = &ctx->output_queue[q_nbr];
+	unsigned int index = (rd + i) % q->size;
+
+	return (void *)(unsigned long)q->host_address +
+		(index * q->token_size);
+}
+EXPORT_SYMBOL_GPL(ipu_recv_token);
+
+void ipu_recv_put_tokens(struct ipu_fw_com_context *ctx, int q_nbr,
+			 unsigned int rd, unsigned int n)
+{
+	struct ipu_fw_sys_queue *q = &ctx->output_queue[q_nbr];
+	void __iomem *q_dmem = ctx->dmem_addr + q->wr_reg * 4;
+
+	/* Release all tokens with one index update */
+	writel((rd + n) % q->size, q_dmem + FW_COM_RD_REG);
+}
+EXPORT_SYMBOL_GPL(ipu_recv_put_tokens);
+
 MODULE_LICENSE("GPL");
 MODULE_DESCRIPTION("Intel ipu fw comm library");
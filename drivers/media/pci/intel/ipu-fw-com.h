@@ -42,6 +42,12 @@ int ipu_fw_com_release(struct ipu_fw_com_context *ctx, unsigned int force);
 
 void *ipu_recv_get_token(struct ipu_fw_com_context *ctx, int q_nbr);
 void ipu_recv_put_token(struct ipu_fw_com_context *ctx, int q_nbr);
+unsigned int ipu_recv_get_tokens(struct ipu_fw_com_context *ctx, int q_nbr,
+				 unsigned int *rd);
+void *ipu_recv_token(struct ipu_fw_com_context *ctx, int q_nbr,
+		     unsigned int rd, unsigned int i);
+void ipu_recv_put_tokens(struct ipu_fw_com_context *ctx, int q_nbr,
+			 unsigned int rd, unsigned int n);
 void *ipu_send_get_token(struct ipu_fw_com_context *ctx, int q_nbr);
 void ipu_send_put_token(struct ipu_fw_com_context *ctx, int q_nbr);
 
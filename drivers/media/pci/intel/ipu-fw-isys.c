@@ -466,6 +466,26 @@ void ipu_fw_isys_put_resp(void *context, unsigned int queue)
 	ipu_recv_put_token(context, queue);
 }
 
+unsigned int ipu_fw_isys_get_resps(void *context, unsigned int queue,
+				   unsigned int *rd)
+{
+	return ipu_recv_get_tokens(context, queue, rd);
+}
+
+struct ipu_fw_isys_resp_info_abi *
+ipu_fw_isys_resp(void *context, unsigned int queue, unsigned int rd,
+		 unsigned int i)
+{
+	return (struct ipu_fw_isys_resp_info_abi *)
+	    ipu_recv_token(context, queue, rd, i);
+}
+
+void ipu_fw_isys_put_resps(void *context, unsigned int queue,
+			   unsigned int rd, unsigned int n)
+{
+	ipu_recv_put_tokens(context, queue, rd, n);
+}
+
 void ipu_fw_isys_set_params(struct ipu_fw_isys_stream_cfg_data_abi *stream_cfg)
 {
 	unsigned int i;
@@ -813,4 +813,11 @@ struct ipu_fw_isys_resp_info_abi *
 ipu_fw_isys_get_resp(void *context, unsigned int queue,
 		     struct ipu_fw_isys_resp_info_abi *response);
 void ipu_fw_isys_put_resp(void *context, unsigned int queue);
+unsigned int ipu_fw_isys_get_resps(void *context, unsigned int queue,
+				   unsigned int *rd);
+struct ipu_fw_isys_resp_info_abi *
+ipu_fw_isys_resp(void *context, unsigned int queue, unsigned int rd,
+		 unsigned int i);
+void ipu_fw_isys_put_resps(void *context, unsigned int queue,
+			   unsigned int rd, unsigned int n);
 #endif
@@ -95,6 +95,17 @@ static const struct v4l2_ctrl_config compression_ctrl_cfg = {
 	.def = 0,
 };
 
+static const struct v4l2_ctrl_config vc_ctrl_cfg = {
+	.ops = NULL,
+	.id = V4L2_CID_IPU_ISYS_VC,
+	.name = "ISYS BE-SOC virtual channel",
+	.type = V4L2_CTRL_TYPE_INTEGER,
+	.min = 0,
+	.max = IPU_ISYS_MAX_VC - 1,
+	.step = 1,
+	.def = 0,
+};
+
 static int set_stream(struct v4l2_subdev *sd, int enable)
 {
 	return 0;
@@ -104,6 +115,29 @@ static const struct v4l2_subdev_video_ops csi2_be_soc_sd_video_ops = {
 	.s_stream = set_stream,
 };
 
+/*
+ * A BE-SOC captures the stream sent on its CSI-2 port by default.
+ * Selecting another virtual channel, or a sink format of another data
+ * type than @code of the port, routes a separate stream of the port to
+ * it instead, described by its own sink format.
+ */
+bool ipu_isys_csi2_be_soc_routed(struct ipu_isys_csi2_be_soc *csi2_be_soc,
+				 u32 code)
+{
+	struct ipu_isys_subdev *asd = &csi2_be_soc->asd;
+	u32 sink_code;
+
+	if (v4l2_ctrl_g_ctrl(csi2_be_soc->av.vc_ctrl))
+		return true;
+
+	mutex_lock(&asd->mutex);
+	sink_code = asd->ffmt[CSI2_BE_SOC_PAD_SINK].code;
+	mutex_unlock(&asd->mutex);
+
+	return ipu_isys_mbus_code_to_mipi(sink_code) !=
+	       ipu_isys_mbus_code_to_mipi(code);
+}
+
 static int
 __subdev_link_validate(struct v4l2_subdev *sd, struct media_link *link,
 		       struct v4l2_subdev_format *source_fmt,
@@ -113,8 +147,19 @@ __subdev_link_validate(struct v4l2_subdev *sd, struct media_link *link,
 	struct ipu_isys_pipeline *ip = container_of(mp,
 						    struct ipu_isys_pipeline,
 						    pipe);
+	struct ipu_isys_csi2_be_soc *csi2_be_soc = to_ipu_isys_csi2_be_soc(sd);
+	unsigned int index = csi2_be_soc - csi2_be_soc->asd.isys->csi2_be_soc;
+
+	ip->csi2_be_soc = csi2_be_soc;
+
+	/* The VC validated here is the one streamed, until the pipe stops */
+	if (!test_and_set_bit(index, &ip->vc_grabbed))
+		v4l2_ctrl_grab(csi2_be_soc->av.vc_ctrl, true);
+
+	/* A routed stream does not have the format of the port */
+	if (ipu_isys_csi2_be_soc_routed(csi2_be_soc, source_fmt->format.code))
+		return ipu_isys_subdev_link_validate_pipe(sd, link);
 
-	ip->csi2_be_soc = to_ipu_isys_csi2_be_soc(sd);
 	return ipu_isys_subdev_link_validate(sd, link, source_fmt, sink_fmt);
 }
 
@@ -366,6 +411,16 @@ int ipu_isys_csi2_be_soc_init(struct ipu_isys_csi2_be_soc *csi2_be_soc,
 		goto fail;
 	}
 	csi2_be_soc->av.compression = 0;
+
+	csi2_be_soc->av.vc_ctrl =
+		v4l2_ctrl_new_custom(&csi2_be_soc->av.ctrl_handler,
+				     &vc_ctrl_cfg, NULL);
+	if (!csi2_be_soc->av.vc_ctrl) {
+		dev_err(&isys->adev->dev,
+			"failed to create BE-SOC vc ctrl\n");
+		rval = -ENOMEM;
+		goto fail;
+	}
 	csi2_be_soc->av.vdev.ctrl_handler =
 		&csi2_be_soc->av.ctrl_handler;
 
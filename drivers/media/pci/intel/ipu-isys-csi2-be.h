@@ -59,5 +59,7 @@ struct ipu_isys_csi2_be_soc {
 int ipu_isys_csi2_be_soc_init(struct ipu_isys_csi2_be_soc *csi2_be_soc,
 			      struct ipu_isys *isys, int index);
 void ipu_isys_csi2_be_soc_cleanup(struct ipu_isys_csi2_be_soc *csi2_be);
+bool ipu_isys_csi2_be_soc_routed(struct ipu_isys_csi2_be_soc *csi2_be_soc,
+				 u32 code);
 
 #endif /* IPU_ISYS_CSI2_BE_H */
@@ -3,6 +3,7 @@
 
 #include <linux/device.h>
 #include <linux/module.h>
+#include <linux/rcupdate.h>
 #include <linux/version.h>
 
 #include <media/ipu-isys.h>
@@ -530,6 +531,7 @@ int ipu_isys_csi2_init(struct ipu_isys_csi2 *csi2,
 	csi2->asd.ctrl_init = csi_ctrl_init;
 	csi2->asd.isys = isys;
 	init_completion(&csi2->eof_completion);
+	spin_lock_init(&csi2->sync_lock);
 	rval = ipu_isys_subdev_init(&csi2->asd, &csi2_sd_ops, 0,
 				    NR_OF_CSI2_PADS,
 				    NR_OF_CSI2_SOURCE_PADS,
@@ -574,73 +576,79 @@ fail:
 	return rval;
 }
 
-void ipu_isys_csi2_sof_event(struct ipu_isys_csi2 *csi2)
+/*
+ * The frame sync handlers look up the firmware stream of a virtual channel
+ * under RCU only, the stream is published and withdrawn by
+ * ipu_isys_csi2_set_vc_stream().
+ */
+void ipu_isys_csi2_set_vc_stream(struct ipu_isys_csi2 *csi2, unsigned int vc,
+				 struct ipu_isys_fw_stream *fs)
+{
+	if (fs) {
+		rcu_assign_pointer(csi2->vc_stream[vc], fs);
+		return;
+	}
+
+	RCU_INIT_POINTER(csi2->vc_stream[vc], NULL);
+	/* The stream may be reused once no frame sync handler sees it */
+	synchronize_rcu();
+}
+
+void ipu_isys_csi2_sof_event(struct ipu_isys_csi2 *csi2, unsigned int vc)
 {
-	struct ipu_isys_pipeline *ip = NULL;
+	struct ipu_isys_fw_stream *fs;
 	struct v4l2_event ev = {
 		.type = V4L2_EVENT_FRAME_SYNC,
+		.id = vc,
 	};
 	struct video_device *vdev = csi2->asd.sd.devnode;
 	unsigned long flags;
-	unsigned int i;
 
-	spin_lock_irqsave(&csi2->isys->lock, flags);
+	spin_lock_irqsave(&csi2->sync_lock, flags);
 	csi2->in_frame = true;
+	spin_unlock_irqrestore(&csi2->sync_lock, flags);
 
-	for (i = 0; i < IPU_ISYS_MAX_STREAMS; i++) {
-		if (csi2->isys->pipes[i] &&
-		    csi2->isys->pipes[i]->csi2 == csi2) {
-			ip = csi2->isys->pipes[i];
-			break;
-		}
-	}
-
+	rcu_read_lock();
+	fs = rcu_dereference(csi2->vc_stream[vc]);
 	/* Pipe already vanished */
-	if (!ip) {
-		spin_unlock_irqrestore(&csi2->isys->lock, flags);
+	if (!fs) {
+		rcu_read_unlock();
 		return;
 	}
 
-	ev.u.frame_sync.frame_sequence = atomic_inc_return(&ip->sequence) - 1;
-	spin_unlock_irqrestore(&csi2->isys->lock, flags);
+	ev.u.frame_sync.frame_sequence = atomic_inc_return(&fs->sequence) - 1;
+	rcu_read_unlock();
 
 	v4l2_event_queue(vdev, &ev);
 	dev_dbg(&csi2->isys->adev->dev,
-		"sof_event::csi2-%i sequence: %i\n",
-		csi2->index, ev.u.frame_sync.frame_sequence);
+		"sof_event::csi2-%i vc %u sequence: %i\n",
+		csi2->index, vc, ev.u.frame_sync.frame_sequence);
 }
 
-void ipu_isys_csi2_eof_event(struct ipu_isys_csi2 *csi2)
+void ipu_isys_csi2_eof_event(struct ipu_isys_csi2 *csi2, unsigned int vc)
 {
-	struct ipu_isys_pipeline *ip = NULL;
+	struct ipu_isys_fw_stream *fs;
 	unsigned long flags;
-	unsigned int i;
 	u32 frame_sequence;
 
-	spin_lock_irqsave(&csi2->isys->lock, flags);
+	spin_lock_irqsave(&csi2->sync_lock, flags);
 	csi2->in_frame = false;
 	if (csi2->wait_for_sync)
 		complete(&csi2->eof_completion);
+	spin_unlock_irqrestore(&csi2->sync_lock, flags);
 
-	for (i = 0; i < IPU_ISYS_MAX_STREAMS; i++) {
-		if (csi2->isys->pipes[i] &&
-		    csi2->isys->pipes[i]->csi2 == csi2) {
-			ip = csi2->isys->pipes[i];
-			break;
-		}
-	}
-
-	if (ip) {
-		frame_sequence = atomic_read(&ip->sequence);
-		spin_unlock_irqrestore(&csi2->isys->lock, flags);
+	rcu_read_lock();
+	fs = rcu_dereference(csi2->vc_stream[vc]);
+	if (fs) {
+		frame_sequence = atomic_read(&fs->sequence);
+		rcu_read_unlock();
 
 		dev_dbg(&csi2->isys->adev->dev,
-			"eof_event::csi2-%i sequence: %i\n",
-			csi2->index, frame_sequence);
+			"eof_event::csi2-%i vc %u sequence: %i\n",
+			csi2->index, vc, frame_sequence);
 		return;
 	}
-
-	spin_unlock_irqrestore(&csi2->isys->lock, flags);
+	rcu_read_unlock();
 }
 
 /* Call this function only _after_ the sensor has been stopped */
@@ -648,16 +656,16 @@ void ipu_isys_csi2_wait_last_eof(struct ipu_isys_csi2 *csi2)
 {
 	unsigned long flags, tout;
 
-	spin_lock_irqsave(&csi2->isys->lock, flags);
+	spin_lock_irqsave(&csi2->sync_lock, flags);
 
 	if (!csi2->in_frame) {
-		spin_unlock_irqrestore(&csi2->isys->lock, flags);
+		spin_unlock_irqrestore(&csi2->sync_lock, flags);
 		return;
 	}
 
 	reinit_completion(&csi2->eof_completion);
 	csi2->wait_for_sync = true;
-	spin_unlock_irqrestore(&csi2->isys->lock, flags);
+	spin_unlock_irqrestore(&csi2->sync_lock, flags);
 	tout = wait_for_completion_timeout(&csi2->eof_completion,
 					   IPU_EOF_TIMEOUT_JIFFIES);
 	if (!tout)
@@ -83,6 +83,9 @@ struct ipu_isys_csi2 {
 	struct ipu_isys_subdev asd;
 	struct ipu_isys_video av;
 	struct completion eof_completion;
+	/* Firmware stream per virtual channel, published at stream on/off */
+	struct ipu_isys_fw_stream __rcu *vc_stream[IPU_ISYS_MAX_VC];
+	spinlock_t sync_lock;	/* Protects in_frame and wait_for_sync */
 
 	void __iomem *base;
 	u32 receiver_errors;
@@ -148,8 +151,10 @@ void ipu_isys_csi2_cleanup(struct ipu_isys_csi2 *csi2);
 struct ipu_isys_buffer *
 ipu_isys_csi2_get_short_packet_buffer(struct ipu_isys_pipeline *ip,
 				      struct ipu_isys_buffer_list *bl);
-void ipu_isys_csi2_sof_event(struct ipu_isys_csi2 *csi2);
-void ipu_isys_csi2_eof_event(struct ipu_isys_csi2 *csi2);
+void ipu_isys_csi2_set_vc_stream(struct ipu_isys_csi2 *csi2, unsigned int vc,
+				 struct ipu_isys_fw_stream *fs);
+void ipu_isys_csi2_sof_event(struct ipu_isys_csi2 *csi2, unsigned int vc);
+void ipu_isys_csi2_eof_event(struct ipu_isys_csi2 *csi2, unsigned int vc);
 void ipu_isys_csi2_wait_last_eof(struct ipu_isys_csi2 *csi2);
 
 /* interface for platform specific */
@@ -3,7 +3,9 @@
 
 #include <linux/completion.h>
 #include <linux/device.h>
+#include <linux/dma-buf.h>
 #include <linux/module.h>
+#include <linux/slab.h>
 #include <linux/string.h>
 
 #include <media/media-entity.h>
@@ -99,6 +101,253 @@ static void ipu_isys_queue_unlock(struct vb2_queue *q)
 	mutex_unlock(&av->mutex);
 }
 
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(4, 8, 0)
+/*
+ * Imported dma-bufs are mapped through the device-wide isp->dmabuf_cache so
+ * that a buffer requeued on another index is not mapped again. MMAP and
+ * USERPTR buffers are left to videobuf2-dma-contig.
+ *
+ * Every memop that may see an imported buffer is overridden, so that
+ * videobuf2-dma-contig never gets one. The ones shared by all memory
+ * types and only given the private pointer tell the two apart by its
+ * first word: ours points to the module's own memops table, which
+ * videobuf2-dma-contig has no reference to whatever its layout is.
+ * struct vb2_dc_buf starts with the struct device pointer on 4.8 to 6.9.
+ */
+struct ipu_isys_dmabuf {
+	const struct vb2_mem_ops *ops;	/* Must stay first */
+	struct device *dev;
+	struct dma_buf *dbuf;
+	unsigned long size;
+	struct ipu_dmabuf_map *map;	/* Set while mapped */
+	dma_addr_t dma_addr;
+	void *vaddr;			/* Kernel mapping, set on demand */
+};
+
+static struct vb2_mem_ops ipu_isys_mem_ops;
+
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(5, 16, 0)
+static void *ipu_isys_attach_dmabuf(struct vb2_buffer *vb, struct device *dev,
+				    struct dma_buf *dbuf, unsigned long size)
+#else
+static void *ipu_isys_attach_dmabuf(struct device *dev, struct dma_buf *dbuf,
+				    unsigned long size,
+				    enum dma_data_direction dma_dir)
+#endif
+{
+	struct ipu_isys_dmabuf *buf;
+
+	BUILD_BUG_ON(offsetof(struct ipu_isys_dmabuf, ops));
+
+	if (dbuf->size < size)
+		return ERR_PTR(-EFAULT);
+
+	buf = kzalloc(sizeof(*buf), GFP_KERNEL);
+	if (!buf)
+		return ERR_PTR(-ENOMEM);
+
+	buf->ops = &ipu_isys_mem_ops;
+	buf->dev = dev;
+	buf->dbuf = dbuf;
+	buf->size = size;
+
+	return buf;
+}
+
+static bool ipu_isys_is_dmabuf(void *buf_priv)
+{
+	struct ipu_isys_dmabuf *buf = buf_priv;
+
+	return buf->ops == &ipu_isys_mem_ops;
+}
+
+/* The cached mapping is bidirectional, the exporter does the CPU syncs */
+static void ipu_isys_prepare(void *buf_priv)
+{
+	if (!ipu_isys_is_dmabuf(buf_priv))
+		vb2_dma_contig_memops.prepare(buf_priv);
+}
+
+static void ipu_isys_finish(void *buf_priv)
+{
+	if (!ipu_isys_is_dmabuf(buf_priv))
+		vb2_dma_contig_memops.finish(buf_priv);
+}
+
+static int ipu_isys_map_dmabuf(void *buf_priv)
+{
+	struct ipu_isys_dmabuf *buf = buf_priv;
+	struct ipu_device *isp = to_ipu_bus_device(buf->dev)->isp;
+	struct ipu_dmabuf_map *map;
+	unsigned long contig = 0;
+	struct scatterlist *sg;
+	dma_addr_t expected;
+	unsigned int i;
+
+	if (WARN_ON(buf->map))
+		return -EINVAL;
+
+	map = ipu_dmabuf_cache_get(&isp->dmabuf_cache, buf->dev, buf->dbuf);
+	if (IS_ERR(map))
+		return PTR_ERR(map);
+
+	/* Firmware takes a single address per plane */
+	expected = sg_dma_address(map->sgt->sgl);
+	for_each_sg(map->sgt->sgl, sg, map->sgt->nents, i) {
+		if (sg_dma_address(sg) != expected)
+			break;
+		expected += sg_dma_len(sg);
+		contig += sg_dma_len(sg);
+	}
+	if (contig < buf->size) {
+		dev_err(buf->dev, "dma-buf is not contiguous (%lu < %lu)\n",
+			contig, buf->size);
+		ipu_dmabuf_cache_put(map);
+		return -EFAULT;
+	}
+
+	buf->map = map;
+	buf->dma_addr = sg_dma_address(map->sgt->sgl);
+
+	return 0;
+}
+
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(5, 16, 0)
+static void *ipu_isys_vaddr(struct vb2_buffer *vb, void *buf_priv)
+#else
+static void *ipu_isys_vaddr(void *buf_priv)
+#endif
+{
+	struct ipu_isys_dmabuf *buf = buf_priv;
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(5, 18, 0) || \
+	LINUX_VERSION_CODE == KERNEL_VERSION(5, 15, 255) || \
+	LINUX_VERSION_CODE == KERNEL_VERSION(5, 15, 71)
+	struct iosys_map dmap;
+#elif LINUX_VERSION_CODE >= KERNEL_VERSION(5, 10, 0) && LINUX_VERSION_CODE != KERNEL_VERSION(5, 10, 46)
+	struct dma_buf_map dmap;
+#endif
+
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(5, 16, 0)
+	if (vb->memory != VB2_MEMORY_DMABUF)
+		return vb2_dma_contig_memops.vaddr(vb, buf_priv);
+#else
+	if (!ipu_isys_is_dmabuf(buf_priv))
+		return vb2_dma_contig_memops.vaddr(buf_priv);
+#endif
+	if (buf->vaddr || !buf->map)
+		return buf->vaddr;
+
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(5, 10, 0) && LINUX_VERSION_CODE != KERNEL_VERSION(5, 10, 46)
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 1, 255)
+	if (!dma_buf_vmap_unlocked(buf->dbuf, &dmap))
+#else
+	if (!dma_buf_vmap(buf->dbuf, &dmap))
+#endif
+		buf->vaddr = dmap.vaddr;
+#else
+	buf->vaddr = dma_buf_vmap(buf->dbuf);
+#endif
+
+	return buf->vaddr;
+}
+
+static void ipu_isys_vunmap(struct ipu_isys_dmabuf *buf)
+{
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(5, 18, 0) || \
+	LINUX_VERSION_CODE == KERNEL_VERSION(5, 15, 255) || \
+	LINUX_VERSION_CODE == KERNEL_VERSION(5, 15, 71)
+	struct iosys_map dmap;
+
+	if (!buf->vaddr)
+		return;
+
+	iosys_map_set_vaddr(&dmap, buf->vaddr);
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 1, 255)
+	dma_buf_vunmap_unlocked(buf->dbuf, &dmap);
+#else
+	dma_buf_vunmap(buf->dbuf, &dmap);
+#endif
+#elif LINUX_VERSION_CODE >= KERNEL_VERSION(5, 10, 0) && LINUX_VERSION_CODE != KERNEL_VERSION(5, 10, 46)
+	struct dma_buf_map dmap;
+
+	if (!buf->vaddr)
+		return;
+
+	dma_buf_map_set_vaddr(&dmap, buf->vaddr);
+	dma_buf_vunmap(buf->dbuf, &dmap);
+#else
+	if (!buf->vaddr)
+		return;
+
+	dma_buf_vunmap(buf->dbuf, buf->vaddr);
+#endif
+	buf->vaddr = NULL;
+}
+
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(5, 16, 0)
+static void *ipu_isys_cookie(struct vb2_buffer *vb, void *buf_priv)
+#else
+static void *ipu_isys_cookie(void *buf_priv)
+#endif
+{
+	struct ipu_isys_dmabuf *buf = buf_priv;
+
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(5, 16, 0)
+	if (vb->memory != VB2_MEMORY_DMABUF)
+		return vb2_dma_contig_memops.cookie(vb, buf_priv);
+#else
+	if (!ipu_isys_is_dmabuf(buf_priv))
+		return vb2_dma_contig_memops.cookie(buf_priv);
+#endif
+
+	return &buf->dma_addr;
+}
+
+/* Imported buffers are not refcounted by vb2 */
+static unsigned int ipu_isys_num_users(void *buf_priv)
+{
+	if (!ipu_isys_is_dmabuf(buf_priv))
+		return vb2_dma_contig_memops.num_users(buf_priv);
+
+	return 1;
+}
+
+static void ipu_isys_unmap_dmabuf(void *buf_priv)
+{
+	struct ipu_isys_dmabuf *buf = buf_priv;
+
+	if (WARN_ON(!buf->map))
+		return;
+
+	ipu_isys_vunmap(buf);
+	ipu_dmabuf_cache_put(buf->map);
+	buf->map = NULL;
+}
+
+static void ipu_isys_detach_dmabuf(void *buf_priv)
+{
+	struct ipu_isys_dmabuf *buf = buf_priv;
+
+	if (buf->map) {
+		ipu_isys_vunmap(buf);
+		ipu_dmabuf_cache_put(buf->map);
+	}
+	kfree(buf);
+}
+#endif
+
+dma_addr_t ipu_isys_buffer_dma_addr(struct vb2_buffer *vb, unsigned int plane)
+{
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(4, 8, 0)
+	if (vb->memory == VB2_MEMORY_DMABUF) {
+		struct ipu_isys_dmabuf *buf = vb->planes[plane].mem_priv;
+
+		return buf->dma_addr;
+	}
+#endif
+	return vb2_dma_contig_plane_dma_addr(vb, plane);
+}
+
 static int buf_init(struct vb2_buffer *vb)
 {
 	struct ipu_isys_queue *aq = vb2_queue_to_ipu_isys_queue(vb->vb2_queue);
@@ -172,6 +421,130 @@ static void buf_cleanup(struct vb2_buffer *vb)
 		aq->buf_cleanup(vb);
 }
 
+static bool ipu_isys_buf_ring_push(struct ipu_isys_buf_ring *ring,
+				   struct ipu_isys_buffer *ib)
+{
+	unsigned int head = ring->head;
+
+	if (head - smp_load_acquire(&ring->tail) >= IPU_ISYS_MAX_BUFS)
+		return false;
+
+	ring->bufs[head % IPU_ISYS_MAX_BUFS] = ib;
+	/* Publish the entry before the new head */
+	smp_store_release(&ring->head, head + 1);
+
+	return true;
+}
+
+static struct ipu_isys_buffer *
+ipu_isys_buf_ring_peek(struct ipu_isys_buf_ring *ring)
+{
+	unsigned int tail = ring->tail;
+
+	if (smp_load_acquire(&ring->head) == tail)
+		return NULL;
+
+	return ring->bufs[tail % IPU_ISYS_MAX_BUFS];
+}
+
+static void ipu_isys_buf_ring_pop(struct ipu_isys_buf_ring *ring)
+{
+	/* The producer may reuse the slot once it sees the new tail */
+	smp_store_release(&ring->tail, ring->tail + 1);
+}
+
+/* Consumer side put back in front, the producer lock must be held */
+static bool ipu_isys_buf_ring_unpop(struct ipu_isys_buf_ring *ring,
+				    struct ipu_isys_buffer *ib)
+{
+	unsigned int tail = ring->tail - 1;
+
+	if (ring->head - tail > IPU_ISYS_MAX_BUFS)
+		return false;
+
+	ring->bufs[tail % IPU_ISYS_MAX_BUFS] = ib;
+	WRITE_ONCE(ring->tail, tail);
+
+	return true;
+}
+
+static unsigned int ipu_isys_buffer_index(struct ipu_isys_buffer *ib)
+{
+#if LINUX_VERSION_CODE < KERNEL_VERSION(4, 4, 0)
+	return ipu_isys_buffer_to_vb2_buffer(ib)->v4l2_buf.index;
+#else
+	return ipu_isys_buffer_to_vb2_buffer(ib)->index;
+#endif
+}
+
+static void ipu_isys_queue_incoming(struct ipu_isys_queue *aq,
+				    struct ipu_isys_buffer *ib)
+{
+	unsigned long flags;
+	bool queued;
+
+	spin_lock_irqsave(&aq->lock, flags);
+	queued = ipu_isys_buf_ring_push(&aq->incoming, ib);
+	spin_unlock_irqrestore(&aq->lock, flags);
+
+	/* vb2 never has more than IPU_ISYS_MAX_BUFS buffers queued */
+	WARN_ON(!queued);
+}
+
+/*
+ * Return a buffer taken from incoming to the front of it, so that it is
+ * used again before anything queued after it. Consumer side only.
+ */
+static void ipu_isys_queue_putback(struct ipu_isys_queue *aq,
+				   struct ipu_isys_buffer *ib)
+{
+	unsigned long flags;
+	bool queued;
+
+	spin_lock_irqsave(&aq->lock, flags);
+	queued = ipu_isys_buf_ring_unpop(&aq->incoming, ib);
+	spin_unlock_irqrestore(&aq->lock, flags);
+
+	WARN_ON(!queued);
+}
+
+static void ipu_isys_queue_active(struct ipu_isys_queue *aq,
+				  struct ipu_isys_buffer *ib)
+{
+	unsigned int i = ipu_isys_buffer_index(ib);
+
+	if (WARN_ON(i >= IPU_ISYS_MAX_BUFS || READ_ONCE(aq->active[i])))
+		return;
+
+	ib->seq = aq->active_seq++;
+
+	/* Completion may run as soon as firmware has the buffer */
+	smp_store_release(&aq->active[i], ib);
+}
+
+/*
+ * Claim active buffer @i if it is at @addr. Completion and the cleanup
+ * paths race for the slot, the one clearing it owns the buffer.
+ */
+static struct ipu_isys_buffer *
+ipu_isys_queue_take_active(struct ipu_isys_queue *aq, unsigned int i,
+			   u32 addr)
+{
+	struct ipu_isys_buffer *ib = smp_load_acquire(&aq->active[i]);
+
+	if (!ib)
+		return NULL;
+
+	if ((u32)ipu_isys_buffer_dma_addr(ipu_isys_buffer_to_vb2_buffer(ib),
+					  0) != addr)
+		return NULL;
+
+	if (cmpxchg(&aq->active[i], ib, NULL) != ib)
+		return NULL;
+
+	return ib;
+}
+
 /*
  * Queue a buffer list back to incoming or active queues. The buffers
  * are removed from the buffer list.
@@ -201,13 +574,11 @@ void ipu_isys_buffer_list_queue(struct ipu_isys_buffer_list *bl,
 			    vb2_queue_to_ipu_isys_queue(vb->vb2_queue);
 
 			av = ipu_isys_queue_to_video(aq);
-			spin_lock_irqsave(&aq->lock, flags);
 			list_del(&ib->head);
 			if (op_flags & IPU_ISYS_BUFFER_LIST_FL_ACTIVE)
-				list_add(&ib->head, &aq->active);
+				ipu_isys_queue_active(aq, ib);
 			else if (op_flags & IPU_ISYS_BUFFER_LIST_FL_INCOMING)
-				list_add_tail(&ib->head, &aq->incoming);
-			spin_unlock_irqrestore(&aq->lock, flags);
+				ipu_isys_queue_putback(aq, ib);
 
 			if (op_flags & IPU_ISYS_BUFFER_LIST_FL_SET_STATE)
 				vb2_buffer_done(vb, state);
@@ -253,46 +624,46 @@ static void flush_firmware_streamon_fail(struct ipu_isys_pipeline *ip)
 	struct ipu_isys_video *pipe_av =
 	    container_of(ip, struct ipu_isys_video, ip);
 	struct ipu_isys_queue *aq;
-	unsigned long flags;
 
 	lockdep_assert_held(&pipe_av->mutex);
 
 	list_for_each_entry(aq, &ip->queues, node) {
 		struct ipu_isys_video *av = ipu_isys_queue_to_video(aq);
-		struct ipu_isys_buffer *ib, *ib_safe;
+		struct ipu_isys_buffer *bufs[IPU_ISYS_MAX_BUFS];
+		unsigned int i, j, n = 0;
 
-		spin_lock_irqsave(&aq->lock, flags);
-		list_for_each_entry_safe(ib, ib_safe, &aq->active, head) {
-			struct vb2_buffer *vb =
-			    ipu_isys_buffer_to_vb2_buffer(ib);
+		for (i = 0; i < IPU_ISYS_MAX_BUFS; i++) {
+			struct ipu_isys_buffer *ib = xchg(&aq->active[i], NULL);
+
+			if (!ib)
+				continue;
 
-			list_del(&ib->head);
 			if (av->streaming) {
 				dev_dbg(&av->isys->adev->dev,
 					"%s: queue buffer %u back to incoming\n",
-					av->vdev.name,
-#if LINUX_VERSION_CODE < KERNEL_VERSION(4, 4, 0)
-					vb->v4l2_buf.index);
-#else
-					vb->index);
-#endif
-				/* Queue already streaming, return to driver. */
-				list_add(&ib->head, &aq->incoming);
+					av->vdev.name, i);
+				/* Sort by the order they went to firmware */
+				for (j = n++; j && (int)(bufs[j - 1]->seq -
+							 ib->seq) > 0; j--)
+					bufs[j] = bufs[j - 1];
+				bufs[j] = ib;
 				continue;
 			}
 			/* Queue not yet streaming, return to user. */
 			dev_dbg(&av->isys->adev->dev,
 				"%s: return %u back to videobuf2\n",
-				av->vdev.name,
-#if LINUX_VERSION_CODE < KERNEL_VERSION(4, 4, 0)
-				vb->v4l2_buf.index);
-#else
-				vb->index);
-#endif
+				av->vdev.name, i);
 			vb2_buffer_done(ipu_isys_buffer_to_vb2_buffer(ib),
 					VB2_BUF_STATE_QUEUED);
 		}
-		spin_unlock_irqrestore(&aq->lock, flags);
+
+		/*
+		 * Queue already streaming, return to driver. They were all
+		 * queued before what is still in incoming, latest goes back
+		 * first so that the earliest ends up in front.
+		 */
+		while (n--)
+			ipu_isys_queue_putback(aq, bufs[n]);
 	}
 }
 
@@ -307,41 +678,26 @@ static int buffer_list_get(struct ipu_isys_pipeline *ip,
 {
 	struct ipu_isys_queue *aq;
 	struct ipu_isys_buffer *ib;
-	unsigned long flags;
 	int ret = 0;
 
 	bl->nbufs = 0;
 	INIT_LIST_HEAD(&bl->head);
 
+	/* Peek first so that a queue running dry leaves the others alone */
 	list_for_each_entry(aq, &ip->queues, node) {
-		struct ipu_isys_buffer *ib;
-
-		spin_lock_irqsave(&aq->lock, flags);
-		if (list_empty(&aq->incoming)) {
-			spin_unlock_irqrestore(&aq->lock, flags);
-			ret = -ENODATA;
-			goto error;
-		}
+		ib = ipu_isys_buf_ring_peek(&aq->incoming);
+		if (!ib || ib->req)
+			return -ENODATA;
+	}
 
-		ib = list_last_entry(&aq->incoming,
-				     struct ipu_isys_buffer, head);
-		if (ib->req) {
-			spin_unlock_irqrestore(&aq->lock, flags);
-			ret = -ENODATA;
-			goto error;
-		}
+	list_for_each_entry(aq, &ip->queues, node) {
+		ib = ipu_isys_buf_ring_peek(&aq->incoming);
+		ipu_isys_buf_ring_pop(&aq->incoming);
 
 		dev_dbg(&ip->isys->adev->dev, "buffer: %s: buffer %u\n",
 			ipu_isys_queue_to_video(aq)->vdev.name,
-#if LINUX_VERSION_CODE < KERNEL_VERSION(4, 4, 0)
-			ipu_isys_buffer_to_vb2_buffer(ib)->v4l2_buf.index
-#else
-			ipu_isys_buffer_to_vb2_buffer(ib)->index
-#endif
-		    );
-		list_del(&ib->head);
+			ipu_isys_buffer_index(ib));
 		list_add(&ib->head, &bl->head);
-		spin_unlock_irqrestore(&aq->lock, flags);
 
 		bl->nbufs++;
 	}
@@ -390,7 +746,7 @@ ipu_isys_buffer_to_fw_frame_buff_pin(struct vb2_buffer *vb,
 		set->output_pins[aq->fw_output].compress = 1;
 
 	set->output_pins[aq->fw_output].addr =
-	    vb2_dma_contig_plane_dma_addr(vb, 0);
+	    ipu_isys_buffer_dma_addr(vb, 0);
 	set->output_pins[aq->fw_output].out_buf_id =
 #if LINUX_VERSION_CODE < KERNEL_VERSION(4, 4, 0)
 	    vb->v4l2_buf.index + 1;
@@ -400,15 +756,17 @@ ipu_isys_buffer_to_fw_frame_buff_pin(struct vb2_buffer *vb,
 }
 
 /*
- * Convert a buffer list to a isys fw ABI framebuffer set. The
- * buffer list is not modified.
+ * Convert the buffers of firmware stream @stream in a buffer list to a
+ * isys fw ABI framebuffer set. The buffer list is not modified.
  */
 #define IPU_ISYS_FRAME_NUM_THRESHOLD  (30)
 void
 ipu_isys_buffer_to_fw_frame_buff(struct ipu_fw_isys_frame_buff_set_abi *set,
 				 struct ipu_isys_pipeline *ip,
+				 unsigned int stream,
 				 struct ipu_isys_buffer_list *bl)
 {
+	struct ipu_isys_fw_stream *fs = &ip->fw_streams[stream];
 	struct ipu_isys_buffer *ib;
 
 	WARN_ON(!bl->nbufs);
@@ -427,7 +785,7 @@ ipu_isys_buffer_to_fw_frame_buff(struct ipu_fw_isys_frame_buff_set_abi *set,
 	set->send_resp_capture_ack = 1;
 	set->send_resp_capture_done = 1;
 	if (!ip->interlaced &&
-	    atomic_read(&ip->sequence) >= IPU_ISYS_FRAME_NUM_THRESHOLD) {
+	    atomic_read(&fs->sequence) >= IPU_ISYS_FRAME_NUM_THRESHOLD) {
 		set->send_resp_capture_ack = 0;
 		set->send_resp_capture_done = 0;
 	}
@@ -439,6 +797,9 @@ ipu_isys_buffer_to_fw_frame_buff(struct ipu_fw_isys_frame_buff_set_abi *set,
 			struct ipu_isys_queue *aq =
 			    vb2_queue_to_ipu_isys_queue(vb->vb2_queue);
 
+			if (aq->fw_stream != stream)
+				continue;
+
 			if (aq->fill_frame_buff_set_pin)
 				aq->fill_frame_buff_set_pin(vb, set);
 		} else if (ib->type == IPU_ISYS_SHORT_PACKET_BUFFER) {
@@ -447,6 +808,10 @@ ipu_isys_buffer_to_fw_frame_buff(struct ipu_fw_isys_frame_buff_set_abi *set,
 			struct ipu_fw_isys_output_pin_payload_abi *output_pin =
 			    &set->output_pins[ip->short_packet_output_pin];
 
+			/* Short packets are captured on the first stream */
+			if (stream)
+				continue;
+
 			output_pin->addr = pb->dma_addr;
 			output_pin->out_buf_id = pb->index + 1;
 		} else {
@@ -455,48 +820,83 @@ ipu_isys_buffer_to_fw_frame_buff(struct ipu_fw_isys_frame_buff_set_abi *set,
 	}
 }
 
+/*
+ * Pass a buffer list to the firmware as one frame buffer set per
+ * firmware stream of the pipeline.
+ */
+static int ipu_isys_stream_capture(struct ipu_isys_pipeline *ip,
+				   struct ipu_isys_buffer_list *bl)
+{
+	enum ipu_fw_isys_send_type send_type =
+	    IPU_FW_ISYS_SEND_TYPE_STREAM_CAPTURE;
+	struct isys_fw_msgs *msgs[IPU_ISYS_MAX_VC];
+	struct ipu_fw_isys_frame_buff_set_abi *buf;
+	struct ipu_isys *isys = ip->isys;
+	struct ipu_isys_fw_stream *fs;
+	unsigned int i;
+	int rval = 0;
+
+	for (i = 0; i < ip->nr_fw_streams; i++) {
+		fs = &ip->fw_streams[i];
+		msgs[i] = ipu_get_fw_msg_buf(ip);
+		if (!msgs[i])
+			goto out_put_msgs;
+
+		buf = to_frame_msg_buf(msgs[i]);
+		ipu_isys_buffer_to_fw_frame_buff(buf, ip, i, bl);
+		ipu_fw_isys_dump_frame_buff_set(&isys->adev->dev, buf,
+						fs->nr_output_pins);
+	}
+
+	/*
+	 * We must queue the buffers in the buffer list to the
+	 * appropriate video buffer queues BEFORE passing them to the
+	 * firmware since we could get a buffer event back before we
+	 * have queued them ourselves to the active queue.
+	 */
+	ipu_isys_buffer_list_queue(bl, IPU_ISYS_BUFFER_LIST_FL_ACTIVE, 0);
+
+	for (i = 0; i < ip->nr_fw_streams; i++) {
+		int ret;
+
+		fs = &ip->fw_streams[i];
+		buf = to_frame_msg_buf(msgs[i]);
+		ret = ipu_fw_isys_complex_cmd(isys, fs->stream_handle,
+					      buf, to_dma_addr(msgs[i]),
+					      sizeof(*buf), send_type);
+		if (ret < 0 && !rval)
+			rval = ret;
+	}
+
+	return rval;
+
+out_put_msgs:
+	while (i--)
+		ipu_put_fw_msg_buf(ip, (uintptr_t)to_frame_msg_buf(msgs[i]));
+	ipu_isys_buffer_list_queue(bl, IPU_ISYS_BUFFER_LIST_FL_INCOMING, 0);
+
+	return -ENOMEM;
+}
+
 /* Start streaming for real. The buffer list must be available. */
 static int ipu_isys_stream_start(struct ipu_isys_pipeline *ip,
 				 struct ipu_isys_buffer_list *bl, bool error)
 {
-	struct ipu_isys_video *pipe_av =
-	    container_of(ip, struct ipu_isys_video, ip);
 	struct ipu_isys_buffer_list __bl;
 	int rval;
 
 	bl = &__bl;
 
 	do {
-		struct ipu_fw_isys_frame_buff_set_abi *buf = NULL;
-		struct isys_fw_msgs *msg;
-		enum ipu_fw_isys_send_type send_type =
-		    IPU_FW_ISYS_SEND_TYPE_STREAM_CAPTURE;
-
 		rval = buffer_list_get(ip, bl);
 		if (rval == -EINVAL)
 			goto out_requeue;
 		else if (rval < 0)
 			break;
 
-		msg = ipu_get_fw_msg_buf(ip);
-		if (!msg)
-			return -ENOMEM;
-
-		buf = to_frame_msg_buf(msg);
-
-		ipu_isys_buffer_to_fw_frame_buff(buf, ip, bl);
-
-		ipu_fw_isys_dump_frame_buff_set(&pipe_av->isys->adev->dev, buf,
-						ip->nr_output_pins);
-
-		ipu_isys_buffer_list_queue(bl,
-					   IPU_ISYS_BUFFER_LIST_FL_ACTIVE, 0);
-
-		rval = ipu_fw_isys_complex_cmd(pipe_av->isys,
-					       ip->stream_handle,
-					       buf, to_dma_addr(msg),
-					       sizeof(*buf),
-					       send_type);
+		rval = ipu_isys_stream_capture(ip, bl);
+		if (rval == -ENOMEM)
+			return rval;
 	} while (!WARN_ON(rval));
 
 	return 0;
@@ -523,13 +923,8 @@ static void buf_queue(struct vb2_buffer *vb)
 	struct media_pipeline *mp = media_entity_pipeline(&av->vdev.entity);
 	struct ipu_isys_pipeline *ip = to_ipu_isys_pipeline(mp);
 	struct ipu_isys_buffer_list bl;
-
-	struct ipu_fw_isys_frame_buff_set_abi *buf = NULL;
-	struct isys_fw_msgs *msg;
-
 	struct ipu_isys_video *pipe_av =
 	    container_of(ip, struct ipu_isys_video, ip);
-	unsigned long flags;
 	unsigned int i;
 	int rval;
 
@@ -544,11 +939,9 @@ static void buf_queue(struct vb2_buffer *vb)
 
 	for (i = 0; i < vb->num_planes; i++)
 		dev_dbg(&av->isys->adev->dev, "iova: plane %u iova 0x%x\n", i,
-			(u32)vb2_dma_contig_plane_dma_addr(vb, i));
+			(u32)ipu_isys_buffer_dma_addr(vb, i));
 
-	spin_lock_irqsave(&aq->lock, flags);
-	list_add(&ib->head, &aq->incoming);
-	spin_unlock_irqrestore(&aq->lock, flags);
+	ipu_isys_queue_incoming(aq, ib);
 
 	if (ib->req)
 		return;
@@ -586,18 +979,6 @@ static void buf_queue(struct vb2_buffer *vb)
 		goto out;
 	}
 
-	msg = ipu_get_fw_msg_buf(ip);
-	if (!msg) {
-		rval = -ENOMEM;
-		goto out;
-	}
-	buf = to_frame_msg_buf(msg);
-
-	ipu_isys_buffer_to_fw_frame_buff(buf, ip, &bl);
-
-	ipu_fw_isys_dump_frame_buff_set(&pipe_av->isys->adev->dev, buf,
-					ip->nr_output_pins);
-
 	if (!ip->streaming) {
 		dev_dbg(&av->isys->adev->dev,
 			"got a buffer to start streaming!\n");
@@ -608,19 +989,7 @@ static void buf_queue(struct vb2_buffer *vb)
 		goto out;
 	}
 
-	/*
-	 * We must queue the buffers in the buffer list to the
-	 * appropriate video buffer queues BEFORE passing them to the
-	 * firmware since we could get a buffer event back before we
-	 * have queued them ourselves to the active queue.
-	 */
-	ipu_isys_buffer_list_queue(&bl, IPU_ISYS_BUFFER_LIST_FL_ACTIVE, 0);
-
-	rval = ipu_fw_isys_complex_cmd(pipe_av->isys,
-				       ip->stream_handle,
-				       buf, to_dma_addr(msg),
-				       sizeof(*buf),
-				       IPU_FW_ISYS_SEND_TYPE_STREAM_CAPTURE);
+	rval = ipu_isys_stream_capture(ip, &bl);
 	if (!WARN_ON(rval < 0))
 		dev_dbg(&av->isys->adev->dev, "queued buffer\n");
 
@@ -682,69 +1051,41 @@ int ipu_isys_link_fmt_validate(struct ipu_isys_queue *aq)
 	return 0;
 }
 
-/* Return buffers back to videobuf2. */
+/*
+ * Return buffers back to videobuf2. The queue has left the pipeline so
+ * nothing else consumes its incoming ring any more.
+ */
 static void return_buffers(struct ipu_isys_queue *aq,
 			   enum vb2_buffer_state state)
 {
 	struct ipu_isys_video *av = ipu_isys_queue_to_video(aq);
-	unsigned long flags;
-
-	spin_lock_irqsave(&aq->lock, flags);
-	while (!list_empty(&aq->incoming)) {
-		struct ipu_isys_buffer *ib = list_first_entry(&aq->incoming,
-							      struct
-							      ipu_isys_buffer,
-							      head);
-		struct vb2_buffer *vb = ipu_isys_buffer_to_vb2_buffer(ib);
-
-		list_del(&ib->head);
-		spin_unlock_irqrestore(&aq->lock, flags);
+	struct ipu_isys_buffer *ib;
+	unsigned int i;
 
-		vb2_buffer_done(vb, state);
+	while ((ib = ipu_isys_buf_ring_peek(&aq->incoming))) {
+		ipu_isys_buf_ring_pop(&aq->incoming);
+		vb2_buffer_done(ipu_isys_buffer_to_vb2_buffer(ib), state);
 
 		dev_dbg(&av->isys->adev->dev,
 			"%s: stop_streaming incoming %u\n",
-			ipu_isys_queue_to_video(vb2_queue_to_ipu_isys_queue
-						(vb->vb2_queue))->vdev.name,
-#if LINUX_VERSION_CODE < KERNEL_VERSION(4, 4, 0)
-			vb->v4l2_buf.index);
-#else
-			vb->index);
-#endif
-
-		spin_lock_irqsave(&aq->lock, flags);
+			av->vdev.name, ipu_isys_buffer_index(ib));
 	}
 
 	/*
 	 * Something went wrong (FW crash / HW hang / not all buffers
-	 * returned from isys) if there are still buffers queued in active
-	 * queue. We have to clean up places a bit.
+	 * returned from isys) if there are still buffers owned by
+	 * firmware. We have to clean up places a bit.
 	 */
-	while (!list_empty(&aq->active)) {
-		struct ipu_isys_buffer *ib = list_first_entry(&aq->active,
-							      struct
-							      ipu_isys_buffer,
-							      head);
-		struct vb2_buffer *vb = ipu_isys_buffer_to_vb2_buffer(ib);
-
-		list_del(&ib->head);
-		spin_unlock_irqrestore(&aq->lock, flags);
+	for (i = 0; i < IPU_ISYS_MAX_BUFS; i++) {
+		ib = xchg(&aq->active[i], NULL);
+		if (!ib)
+			continue;
 
-		vb2_buffer_done(vb, state);
+		vb2_buffer_done(ipu_isys_buffer_to_vb2_buffer(ib), state);
 
 		dev_warn(&av->isys->adev->dev, "%s: cleaning active queue %u\n",
-			 ipu_isys_queue_to_video(vb2_queue_to_ipu_isys_queue
-						 (vb->vb2_queue))->vdev.name,
-#if LINUX_VERSION_CODE < KERNEL_VERSION(4, 4, 0)
-			 vb->v4l2_buf.index);
-#else
-			 vb->index);
-#endif
-
-		spin_lock_irqsave(&aq->lock, flags);
+			 av->vdev.name, i);
 	}
-
-	spin_unlock_irqrestore(&aq->lock, flags);
 }
 
 static int start_streaming(struct vb2_queue *q, unsigned int count)
@@ -878,6 +1219,7 @@ static void stop_streaming(struct vb2_queue *q)
 #define INVALID_TSC (2 | BIT_ULL(32))
 static unsigned int
 get_sof_sequence_by_timestamp(struct ipu_isys_pipeline *ip,
+			      struct ipu_isys_fw_stream *fs,
 			      struct ipu_fw_isys_resp_info_abi *info)
 {
 	struct ipu_isys *isys =
@@ -887,24 +1229,24 @@ get_sof_sequence_by_timestamp(struct ipu_isys_pipeline *ip,
 
 	/*
 	 * The timestamp is invalid as no TSC in some FPGA platform,
-	 * so get the sequence from pipeline directly in this case.
+	 * so get the sequence from the stream directly in this case.
 	 */
 	if (time == 0 || time == INVALID_TSC)
-		return atomic_read(&ip->sequence) - 1;
+		return atomic_read(&fs->sequence) - 1;
 
 	for (i = 0; i < IPU_ISYS_MAX_PARALLEL_SOF; i++)
-		if (time == ip->seq[i].timestamp) {
+		if (time == fs->seq[i].timestamp) {
 			dev_dbg(&isys->adev->dev,
 				"sof: using seq nr %u for ts 0x%16.16llx\n",
-				ip->seq[i].sequence, time);
-			return ip->seq[i].sequence;
+				fs->seq[i].sequence, time);
+			return fs->seq[i].sequence;
 		}
 
 	dev_dbg(&isys->adev->dev, "SOF: looking for 0x%16.16llx\n", time);
 	for (i = 0; i < IPU_ISYS_MAX_PARALLEL_SOF; i++)
 		dev_dbg(&isys->adev->dev,
 			"SOF: sequence %u, timestamp value 0x%16.16llx\n",
-			ip->seq[i].sequence, ip->seq[i].timestamp);
+			fs->seq[i].sequence, fs->seq[i].timestamp);
 	dev_dbg(&isys->adev->dev, "SOF sequence number not found\n");
 
 	return 0;
@@ -942,18 +1284,19 @@ ipu_isys_buf_calc_sequence_time(struct ipu_isys_buffer *ib,
 	struct device *dev = &av->isys->adev->dev;
 	struct media_pipeline *mp = media_entity_pipeline(&av->vdev.entity);
 	struct ipu_isys_pipeline *ip = to_ipu_isys_pipeline(mp);
+	struct ipu_isys_fw_stream *fs = &ip->fw_streams[aq->fw_stream];
 	u64 ns;
 	u32 sequence;
 
 	if (ip->has_sof) {
 		ns = (wall_clock_ts_on) ? ktime_get_real_ns() : ktime_get_ns();
 		ns -= get_sof_ns_delta(av, info);
-		sequence = get_sof_sequence_by_timestamp(ip, info);
+		sequence = get_sof_sequence_by_timestamp(ip, fs, info);
 	} else {
 		ns = ((wall_clock_ts_on) ? ktime_get_real_ns() :
 		      ktime_get_ns());
-		sequence = (atomic_inc_return(&ip->sequence) - 1)
-		    / ip->nr_queues;
+		sequence = (atomic_inc_return(&fs->sequence) - 1)
+		    / fs->nr_queues;
 	}
 
 #if LINUX_VERSION_CODE < KERNEL_VERSION(4, 4, 0)
@@ -1004,85 +1347,74 @@ void ipu_isys_queue_buf_ready(struct ipu_isys_pipeline *ip,
 {
 	struct ipu_isys *isys =
 	    container_of(ip, struct ipu_isys_video, ip)->isys;
-	struct ipu_isys_queue *aq = ip->output_pins[info->pin_id].aq;
-	struct ipu_isys_buffer *ib;
+	struct ipu_isys_queue *aq =
+	    ipu_isys_pipeline_output_pin(ip, info)->aq;
+	u64 id = info->pin.out_buf_id;
+	struct ipu_isys_buffer *ib = NULL;
 	struct vb2_buffer *vb;
 	unsigned long flags;
-	bool first = true;
+	unsigned int i;
 #if LINUX_VERSION_CODE < KERNEL_VERSION(4, 4, 0)
 	struct v4l2_buffer *buf;
 #else
 	struct vb2_v4l2_buffer *buf;
 #endif
 
-	dev_dbg(&isys->adev->dev, "buffer: %s: received buffer %8.8x\n",
-		ipu_isys_queue_to_video(aq)->vdev.name, info->pin.addr);
-
-	spin_lock_irqsave(&aq->lock, flags);
-	if (list_empty(&aq->active)) {
-		spin_unlock_irqrestore(&aq->lock, flags);
-		dev_err(&isys->adev->dev, "active queue empty\n");
-		return;
-	}
+	dev_dbg(&isys->adev->dev, "buffer: %s: received buffer %8.8x/%llu\n",
+		ipu_isys_queue_to_video(aq)->vdev.name, info->pin.addr, id);
 
-	list_for_each_entry_reverse(ib, &aq->active, head) {
-		dma_addr_t addr;
+	/* out_buf_id is the vb2 index + 1 */
+	if (id && id <= IPU_ISYS_MAX_BUFS)
+		ib = ipu_isys_queue_take_active(aq, id - 1, info->pin.addr);
 
-		vb = ipu_isys_buffer_to_vb2_buffer(ib);
-		addr = vb2_dma_contig_plane_dma_addr(vb, 0);
+	if (!ib) {
+		dev_err(&isys->adev->dev,
+			"WARN: buffer id %llu does not match address %8.8x\n",
+			id, info->pin.addr);
+		for (i = 0; i < IPU_ISYS_MAX_BUFS && !ib; i++)
+			ib = ipu_isys_queue_take_active(aq, i,
+							info->pin.addr);
+	}
 
-		if (info->pin.addr != addr) {
-			if (first)
-				dev_err(&isys->adev->dev,
-					"WARN: buffer address %pad expected!\n",
-					&addr);
-			first = false;
-			continue;
-		}
+	if (!ib) {
+		dev_err(&isys->adev->dev,
+			"WARNING: cannot find a matching video buffer!\n");
+		return;
+	}
 
-		if (info->error_info.error ==
-		    IPU_FW_ISYS_ERROR_HW_REPORTED_STR2MMIO) {
-			/*
-			 * Check for error message:
-			 * 'IPU_FW_ISYS_ERROR_HW_REPORTED_STR2MMIO'
-			 */
-			atomic_set(&ib->str2mmio_flag, 1);
-		}
-		dev_dbg(&isys->adev->dev, "buffer: found buffer %pad\n", &addr);
+	if (info->error_info.error ==
+	    IPU_FW_ISYS_ERROR_HW_REPORTED_STR2MMIO) {
+		/*
+		 * Check for error message:
+		 * 'IPU_FW_ISYS_ERROR_HW_REPORTED_STR2MMIO'
+		 */
+		atomic_set(&ib->str2mmio_flag, 1);
+	}
+	dev_dbg(&isys->adev->dev, "buffer: found buffer %8.8x\n",
+		info->pin.addr);
 
+	vb = ipu_isys_buffer_to_vb2_buffer(ib);
 #if LINUX_VERSION_CODE < KERNEL_VERSION(4, 4, 0)
-		buf = &vb->v4l2_buf;
+	buf = &vb->v4l2_buf;
 #else
-		buf = to_vb2_v4l2_buffer(vb);
+	buf = to_vb2_v4l2_buffer(vb);
 #endif
-		buf->field = V4L2_FIELD_NONE;
+	buf->field = V4L2_FIELD_NONE;
 
-		list_del(&ib->head);
-		spin_unlock_irqrestore(&aq->lock, flags);
+	ipu_isys_buf_calc_sequence_time(ib, info);
 
-		ipu_isys_buf_calc_sequence_time(ib, info);
-
-		/*
-		 * For interlaced buffers, the notification to user space
-		 * is postponed to capture_done event since the field
-		 * information is available only at that time.
-		 */
-		if (ip->interlaced) {
-			spin_lock_irqsave(&ip->short_packet_queue_lock, flags);
-			list_add(&ib->head, &ip->pending_interlaced_bufs);
-			spin_unlock_irqrestore(&ip->short_packet_queue_lock,
-					       flags);
-		} else {
-			ipu_isys_queue_buf_done(ib);
-		}
-
-		return;
+	/*
+	 * For interlaced buffers, the notification to user space
+	 * is postponed to capture_done event since the field
+	 * information is available only at that time.
+	 */
+	if (ip->interlaced) {
+		spin_lock_irqsave(&ip->short_packet_queue_lock, flags);
+		list_add(&ib->head, &ip->pending_interlaced_bufs);
+		spin_unlock_irqrestore(&ip->short_packet_queue_lock, flags);
+	} else {
+		ipu_isys_queue_buf_done(ib);
 	}
-
-	dev_err(&isys->adev->dev,
-		"WARNING: cannot find a matching video buffer!\n");
-
-	spin_unlock_irqrestore(&aq->lock, flags);
 }
 
 void
@@ -1122,9 +1454,31 @@ int ipu_isys_queue_init(struct ipu_isys_queue *aq)
 		aq->vbq.io_modes = VB2_USERPTR | VB2_MMAP | VB2_DMABUF;
 	aq->vbq.drv_priv = aq;
 	aq->vbq.ops = &ipu_isys_queue_ops;
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(4, 8, 0)
+	if (!ipu_isys_mem_ops.map_dmabuf) {
+		ipu_isys_mem_ops = vb2_dma_contig_memops;
+		ipu_isys_mem_ops.attach_dmabuf = ipu_isys_attach_dmabuf;
+		ipu_isys_mem_ops.detach_dmabuf = ipu_isys_detach_dmabuf;
+		ipu_isys_mem_ops.map_dmabuf = ipu_isys_map_dmabuf;
+		ipu_isys_mem_ops.unmap_dmabuf = ipu_isys_unmap_dmabuf;
+		ipu_isys_mem_ops.prepare = ipu_isys_prepare;
+		ipu_isys_mem_ops.finish = ipu_isys_finish;
+		ipu_isys_mem_ops.vaddr = ipu_isys_vaddr;
+		ipu_isys_mem_ops.cookie = ipu_isys_cookie;
+		ipu_isys_mem_ops.num_users = ipu_isys_num_users;
+	}
+	aq->vbq.mem_ops = &ipu_isys_mem_ops;
+#else
 	aq->vbq.mem_ops = &vb2_dma_contig_memops;
+#endif
 	aq->vbq.timestamp_flags = (wall_clock_ts_on) ?
 	    V4L2_BUF_FLAG_TIMESTAMP_UNKNOWN : V4L2_BUF_FLAG_TIMESTAMP_MONOTONIC;
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 8, 0)
+	/* Bounds the incoming ring and the active table */
+	aq->vbq.max_num_buffers = IPU_ISYS_MAX_BUFS;
+#elif LINUX_VERSION_CODE >= KERNEL_VERSION(4, 4, 0)
+	BUILD_BUG_ON(VB2_MAX_FRAME > IPU_ISYS_MAX_BUFS);
+#endif
 
 	rval = vb2_queue_init(&aq->vbq);
 	if (rval)
@@ -1141,8 +1495,6 @@ int ipu_isys_queue_init(struct ipu_isys_queue *aq)
 	aq->vbq.dev = &isys->adev->dev;
 #endif
 	spin_lock_init(&aq->lock);
-	INIT_LIST_HEAD(&aq->active);
-	INIT_LIST_HEAD(&aq->incoming);
 
 	return 0;
 }
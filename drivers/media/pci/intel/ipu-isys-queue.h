@@ -25,6 +25,22 @@ enum ipu_isys_buffer_type {
 	IPU_ISYS_SHORT_PACKET_BUFFER,
 };
 
+/* Max vb2 buffers per queue, firmware out_buf_id is the vb2 index + 1 */
+#define IPU_ISYS_MAX_BUFS		32
+
+struct ipu_isys_buffer;
+
+/*
+ * Single producer, single consumer ring of queued buffers. Producers are
+ * serialised by ipu_isys_queue.lock, the consumer holds the pipeline mutex.
+ * The consumer puts buffers back in front with the producer lock held.
+ */
+struct ipu_isys_buf_ring {
+	struct ipu_isys_buffer *bufs[IPU_ISYS_MAX_BUFS];
+	unsigned int head;	/* Written by the producer only */
+	unsigned int tail;	/* Written by the consumer only */
+};
+
 struct ipu_isys_queue {
 	struct list_head node;	/* struct ipu_isys_pipeline.queues */
 	struct vb2_queue vbq;
@@ -34,12 +50,17 @@ struct ipu_isys_queue {
 	struct device *dev;
 #endif
 	/*
-	 * @lock: serialise access to queued and pre_streamon_queued
+	 * @lock: serialise producers of incoming, buf_queue() and the
+	 * paths that put buffers back
 	 */
 	spinlock_t lock;
-	struct list_head active;
-	struct list_head incoming;
+	struct ipu_isys_buf_ring incoming;
+	/* Buffers owned by firmware, indexed by vb2 index */
+	struct ipu_isys_buffer *active[IPU_ISYS_MAX_BUFS];
+	unsigned int active_seq;	/* Next ipu_isys_buffer.seq */
 	u32 css_pin_type;
+	unsigned int fw_stream;	/* struct ipu_isys_pipeline.fw_streams */
+	unsigned int fw_input;
 	unsigned int fw_output;
 	int (*buf_init)(struct vb2_buffer *vb);
 	void (*buf_cleanup)(struct vb2_buffer *vb);
@@ -57,6 +78,7 @@ struct ipu_isys_buffer {
 	struct list_head req_head;
 	struct media_device_request *req;
 	atomic_t str2mmio_flag;
+	unsigned int seq;	/* Order it was handed to firmware in */
 };
 
 struct ipu_isys_video_buffer {
@@ -130,6 +152,7 @@ struct ipu_isys_request {
 	container_of(__req, struct ipu_isys_request, req)
 
 int ipu_isys_buf_prepare(struct vb2_buffer *vb);
+dma_addr_t ipu_isys_buffer_dma_addr(struct vb2_buffer *vb, unsigned int plane);
 
 void ipu_isys_buffer_list_queue(struct ipu_isys_buffer_list *bl,
 				unsigned long op_flags,
@@ -143,6 +166,7 @@ ipu_isys_buffer_to_fw_frame_buff_pin(struct vb2_buffer *vb,
 void
 ipu_isys_buffer_to_fw_frame_buff(struct ipu_fw_isys_frame_buff_set_abi *set,
 				 struct ipu_isys_pipeline *ip,
+				 unsigned int stream,
 				 struct ipu_isys_buffer_list *bl);
 int ipu_isys_link_fmt_validate(struct ipu_isys_queue *aq);
 
@@ -701,10 +701,9 @@ int ipu_isys_subdev_enum_mbus_code(struct v4l2_subdev *sd,
  * Besides validating the link, figure out the external pad and the
  * ISYS FW ABI source.
  */
-int ipu_isys_subdev_link_validate(struct v4l2_subdev *sd,
-				  struct media_link *link,
-				  struct v4l2_subdev_format *source_fmt,
-				  struct v4l2_subdev_format *sink_fmt)
+/* Record the source and ISL mode of a link in its pipeline */
+int ipu_isys_subdev_link_validate_pipe(struct v4l2_subdev *sd,
+				       struct media_link *link)
 {
 	struct v4l2_subdev *source_sd =
 	    media_entity_to_v4l2_subdev(link->source->entity);
@@ -738,6 +737,20 @@ int ipu_isys_subdev_link_validate(struct v4l2_subdev *sd,
 	if (asd->isl_mode != IPU_ISL_OFF)
 		ip->isl_mode = asd->isl_mode;
 
+	return 0;
+}
+
+int ipu_isys_subdev_link_validate(struct v4l2_subdev *sd,
+				  struct media_link *link,
+				  struct v4l2_subdev_format *source_fmt,
+				  struct v4l2_subdev_format *sink_fmt)
+{
+	int rval;
+
+	rval = ipu_isys_subdev_link_validate_pipe(sd, link);
+	if (rval)
+		return rval;
+
 	return v4l2_subdev_link_validate_default(sd, link, source_fmt,
 						 sink_fmt);
 }
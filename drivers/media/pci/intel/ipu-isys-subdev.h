@@ -197,6 +197,8 @@ int ipu_isys_subdev_enum_mbus_code(struct v4l2_subdev *sd,
 #endif
 				   struct v4l2_subdev_mbus_code_enum
 				   *code);
+int ipu_isys_subdev_link_validate_pipe(struct v4l2_subdev *sd,
+				       struct media_link *link);
 int ipu_isys_subdev_link_validate(struct v4l2_subdev *sd,
 				  struct media_link *link,
 				  struct v4l2_subdev_format *source_fmt,
@@ -1,6 +1,7 @@
 // SPDX-License-Identifier: GPL-2.0
 // Copyright (C) 2013 - 2024 Intel Corporation
 
+#include <linux/cache.h>
 #include <linux/delay.h>
 #include <linux/firmware.h>
 #include <linux/init_task.h>
@@ -50,6 +51,11 @@ module_param_array(video_nr, int, NULL, 0444);
 MODULE_PARM_DESC(video_nr,
 		 "video device numbers (-1=auto, 0=/dev/video0, etc.)");
 
+static bool fw_msg_prealloc;
+module_param(fw_msg_prealloc, bool, 0660);
+MODULE_PARM_DESC(fw_msg_prealloc,
+		 "Preallocate firmware messages at stream start, never grow");
+
 const struct ipu_isys_pixelformat ipu_isys_pfmts_be_soc[] = {
 	{V4L2_PIX_FMT_Y10, 16, 10, 0, MEDIA_BUS_FMT_Y10_1X10,
 	 IPU_FW_ISYS_FRAME_FORMAT_RAW16},
@@ -170,32 +176,61 @@ const struct ipu_isys_pixelformat ipu_isys_pfmts_packed[] = {
 	{}
 };
 
-static void free_fw_msg_bufs(struct ipu_isys_pipeline *ip)
+/* Pool messages are spaced by cache lines, the firmware reads them by DMA */
+#define IPU_ISYS_FW_MSG_STRIDE	ALIGN(sizeof(struct isys_fw_msgs), \
+				      L1_CACHE_BYTES)
+
+static bool fw_msg_in_pool(struct ipu_isys_pipeline *ip,
+			   struct isys_fw_msgs *msg)
+{
+	void *pool = ip->fw_msg_pool;
+
+	return pool && (void *)msg >= pool &&
+	       (void *)msg < pool + ip->fw_msg_pool_nr * IPU_ISYS_FW_MSG_STRIDE;
+}
+
+static void free_fw_msg(struct ipu_isys_pipeline *ip,
+			struct isys_fw_msgs *fwmsg)
 {
 	struct ipu_isys_video *av = container_of(ip, struct ipu_isys_video, ip);
-	struct isys_fw_msgs *fwmsg, *safe;
 
-	list_for_each_entry_safe(fwmsg, safe, &ip->framebuflist, head) {
-		dma_free_attrs(&av->isys->adev->dev,
-			       sizeof(struct isys_fw_msgs),
-			       fwmsg, fwmsg->dma_addr,
+	if (fw_msg_in_pool(ip, fwmsg))
+		return;
+
+	dma_free_attrs(&av->isys->adev->dev,
+		       sizeof(struct isys_fw_msgs),
+		       fwmsg, fwmsg->dma_addr,
 #if LINUX_VERSION_CODE < KERNEL_VERSION(4, 8, 0)
-			       NULL);
+		       NULL);
 #else
-			       0);
+		       0);
 #endif
-	}
+}
+
+static void free_fw_msg_bufs(struct ipu_isys_pipeline *ip)
+{
+	struct ipu_isys_video *av = container_of(ip, struct ipu_isys_video, ip);
+	struct isys_fw_msgs *fwmsg, *safe;
 
-	list_for_each_entry_safe(fwmsg, safe, &ip->framebuflist_fw, head) {
-		dma_free_attrs(&av->isys->adev->dev,
-			       sizeof(struct isys_fw_msgs),
-			       fwmsg, fwmsg->dma_addr,
+	list_for_each_entry_safe(fwmsg, safe, &ip->framebuflist, head)
+		free_fw_msg(ip, fwmsg);
+
+	list_for_each_entry_safe(fwmsg, safe, &ip->framebuflist_fw, head)
+		free_fw_msg(ip, fwmsg);
+
+	if (!ip->fw_msg_pool)
+		return;
+
+	dma_free_attrs(&av->isys->adev->dev,
+		       ip->fw_msg_pool_nr * IPU_ISYS_FW_MSG_STRIDE,
+		       ip->fw_msg_pool, ip->fw_msg_pool_dma_addr,
 #if LINUX_VERSION_CODE < KERNEL_VERSION(4, 8, 0)
-			       NULL);
+		       NULL);
 #else
-			       0);
+		       0);
 #endif
-	}
+	ip->fw_msg_pool = NULL;
+	ip->fw_msg_pool_nr = 0;
 }
 
 static int alloc_fw_msg_bufs(struct ipu_isys_pipeline *ip, int amount)
@@ -204,9 +239,10 @@ static int alloc_fw_msg_bufs(struct ipu_isys_pipeline *ip, int amount)
 		container_of(ip, struct ipu_isys_video, ip);
 	struct ipu_isys *isys;
 	dma_addr_t dma_addr;
-	struct isys_fw_msgs *addr;
+	struct isys_fw_msgs *addr, *safe;
 	unsigned int i;
 	unsigned long flags;
+	LIST_HEAD(victims);
 
 	isys = pipe_av->isys;
 
@@ -230,23 +266,78 @@ static int alloc_fw_msg_bufs(struct ipu_isys_pipeline *ip, int amount)
 	if (i == amount)
 		return 0;
 	spin_lock_irqsave(&ip->listlock, flags);
-	while (!list_empty(&ip->framebuflist)) {
-		addr = list_first_entry(&ip->framebuflist,
-					struct isys_fw_msgs, head);
-		list_del(&addr->head);
-		spin_unlock_irqrestore(&ip->listlock, flags);
-		dma_free_attrs(&isys->adev->dev,
-			       sizeof(struct isys_fw_msgs),
-			       addr, addr->dma_addr,
+	list_for_each_entry_safe(addr, safe, &ip->framebuflist, head)
+		if (!fw_msg_in_pool(ip, addr))
+			list_move(&addr->head, &victims);
+	spin_unlock_irqrestore(&ip->listlock, flags);
+	list_for_each_entry_safe(addr, safe, &victims, head)
+		free_fw_msg(ip, addr);
+	return -ENOMEM;
+}
+
+/*
+ * Replace the firmware messages of a pipeline by a pool of @nr messages
+ * carved from one DMA allocation. The pipeline must not be streaming.
+ */
+static int alloc_fw_msg_pool(struct ipu_isys_pipeline *ip, unsigned int nr)
+{
+	struct ipu_isys_video *pipe_av =
+		container_of(ip, struct ipu_isys_video, ip);
+	struct ipu_isys *isys = pipe_av->isys;
+	struct isys_fw_msgs *msg;
+	dma_addr_t dma_addr;
+	unsigned long flags;
+	unsigned int i;
+	void *pool;
+
+	if (ip->fw_msg_pool && ip->fw_msg_pool_nr >= nr)
+		return 0;
+
+	pool = dma_alloc_attrs(&isys->adev->dev, nr * IPU_ISYS_FW_MSG_STRIDE,
+			       &dma_addr, GFP_KERNEL,
 #if LINUX_VERSION_CODE < KERNEL_VERSION(4, 8, 0)
 			       NULL);
 #else
 			       0);
 #endif
-		spin_lock_irqsave(&ip->listlock, flags);
-	}
+	if (!pool)
+		return -ENOMEM;
+
+	free_fw_msg_bufs(ip);
+	INIT_LIST_HEAD(&ip->framebuflist_fw);
+
+	spin_lock_irqsave(&ip->listlock, flags);
+	INIT_LIST_HEAD(&ip->framebuflist);
+	for (i = 0; i < nr; i++) {
+		msg = pool + i * IPU_ISYS_FW_MSG_STRIDE;
+		msg->dma_addr = dma_addr + i * IPU_ISYS_FW_MSG_STRIDE;
+		list_add_tail(&msg->head, &ip->framebuflist);
+	}
+	ip->fw_msg_pool = pool;
+	ip->fw_msg_pool_dma_addr = dma_addr;
+	ip->fw_msg_pool_nr = nr;
 	spin_unlock_irqrestore(&ip->listlock, flags);
-	return -ENOMEM;
+
+	dev_dbg(&isys->adev->dev, "%u firmware messages preallocated\n", nr);
+
+	return 0;
+}
+
+/*
+ * Every frame buffer set takes one buffer of the first queue to stream and
+ * one message per firmware stream, i.e. at most one per video node. The
+ * stream configurations take one message per firmware stream.
+ */
+static unsigned int fw_msg_pool_size(struct ipu_isys_video *av,
+				     unsigned int nr_nodes)
+{
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 8, 0)
+	unsigned int depth = vb2_get_num_buffers(&av->aq.vbq);
+#else
+	unsigned int depth = av->aq.vbq.num_buffers;
+#endif
+
+	return max(depth, 1U) * max(nr_nodes, 1U) + IPU_ISYS_MAX_VC;
 }
 
 struct isys_fw_msgs *ipu_get_fw_msg_buf(struct ipu_isys_pipeline *ip)
@@ -262,9 +353,15 @@ struct isys_fw_msgs *ipu_get_fw_msg_buf(struct ipu_isys_pipeline *ip)
 	spin_lock_irqsave(&ip->listlock, flags);
 	if (list_empty(&ip->framebuflist)) {
 		spin_unlock_irqrestore(&ip->listlock, flags);
+		atomic_inc(&isys->fw_msg_exhausted);
+		if (READ_ONCE(fw_msg_prealloc)) {
+			dev_err(&isys->adev->dev, "Frame list exhausted\n");
+			return NULL;
+		}
 		dev_dbg(&isys->adev->dev, "Frame list empty - Allocate more");
 
-		alloc_fw_msg_bufs(ip, 5);
+		if (!alloc_fw_msg_bufs(ip, 5))
+			atomic_inc(&isys->fw_msg_refills);
 
 		spin_lock_irqsave(&ip->listlock, flags);
 		if (list_empty(&ip->framebuflist)) {
@@ -421,6 +518,11 @@ static int video_release(struct file *file)
 	mutex_lock(&av->isys->mutex);
 
 	if (!--av->isys->video_opened) {
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(4, 8, 0)
+		/* Release the dma-bufs the closed queues left mapped */
+		ipu_dmabuf_cache_flush(&av->isys->adev->isp->dmabuf_cache,
+				       &av->isys->adev->dev);
+#endif
 		ipu_fw_isys_close(av->isys);
 		if (av->isys->fwcom) {
 			av->isys->reset_needed = true;
@@ -846,7 +948,8 @@ static void put_stream_opened(struct ipu_isys_video *av)
 		set_buttress_isys_freq(av, false);
 }
 
-static int get_stream_handle(struct ipu_isys_video *av)
+static int get_stream_handle(struct ipu_isys_video *av,
+			     struct ipu_isys_fw_stream *fs)
 {
 	struct media_pipeline *mp = media_entity_pipeline(&av->vdev.entity);
 	struct ipu_isys_pipeline *ip = to_ipu_isys_pipeline(mp);
@@ -862,24 +965,65 @@ static int get_stream_handle(struct ipu_isys_video *av)
 		spin_unlock_irqrestore(&av->isys->lock, flags);
 		return -EBUSY;
 	}
+	fs->stream_handle = stream_handle;
 	av->isys->pipes[stream_handle] = ip;
-	ip->stream_handle = stream_handle;
 	spin_unlock_irqrestore(&av->isys->lock, flags);
+
+	if (ip->csi2)
+		ipu_isys_csi2_set_vc_stream(ip->csi2, fs->vc, fs);
+
 	return 0;
 }
 
-static void put_stream_handle(struct ipu_isys_video *av)
+static void put_stream_handle(struct ipu_isys_video *av,
+			      struct ipu_isys_fw_stream *fs)
 {
 	struct media_pipeline *mp = media_entity_pipeline(&av->vdev.entity);
 	struct ipu_isys_pipeline *ip = to_ipu_isys_pipeline(mp);
 	unsigned long flags;
 
+	if (ip->csi2)
+		ipu_isys_csi2_set_vc_stream(ip->csi2, fs->vc, NULL);
+
 	spin_lock_irqsave(&av->isys->lock, flags);
-	av->isys->pipes[ip->stream_handle] = NULL;
-	ip->stream_handle = -1;
+	av->isys->pipes[fs->stream_handle] = NULL;
+	fs->stream_handle = -1;
 	spin_unlock_irqrestore(&av->isys->lock, flags);
 }
 
+struct ipu_isys_fw_stream *
+ipu_isys_pipeline_fw_stream(struct ipu_isys_pipeline *ip,
+			    unsigned int stream_handle)
+{
+	unsigned int i;
+
+	for (i = 0; i < ip->nr_fw_streams; i++)
+		if (ip->fw_streams[i].stream_handle == (int)stream_handle)
+			return &ip->fw_streams[i];
+
+	return NULL;
+}
+
+/* Output pin data for a firmware response, NULL if the pin is unknown */
+struct output_pin_data *
+ipu_isys_pipeline_output_pin(struct ipu_isys_pipeline *ip,
+			     struct ipu_fw_isys_resp_info_abi *info)
+{
+	struct ipu_isys_fw_stream *fs =
+		ipu_isys_pipeline_fw_stream(ip, info->stream_handle);
+
+	if (!fs || info->pin_id >= fs->nr_output_pins)
+		return NULL;
+
+	return &ip->output_pins[fs->first_pin + info->pin_id];
+}
+
+/* CSI-2 virtual channel captured by a video node */
+static unsigned int ipu_isys_video_vc(struct ipu_isys_video *av)
+{
+	return av->vc_ctrl ? v4l2_ctrl_g_ctrl(av->vc_ctrl) : 0;
+}
+
 static int get_external_facing_format(struct ipu_isys_pipeline *ip,
 				      struct v4l2_subdev_format *format)
 {
@@ -916,6 +1060,67 @@ static int get_external_facing_format(struct ipu_isys_pipeline *ip,
 	return v4l2_subdev_call(sd, pad, get_fmt, NULL, format);
 }
 
+/*
+ * Format of the CSI-2 stream a video node captures. This is the format of
+ * the external source unless the node is behind a BE-SOC routed to
+ * another virtual channel or data type, which is then described by the
+ * sink format of that BE-SOC.
+ */
+static int get_stream_format(struct ipu_isys_pipeline *ip,
+			     struct ipu_isys_video *av,
+			     struct v4l2_subdev_format *format)
+{
+	struct ipu_isys_csi2_be_soc *csi2_be_soc;
+	int rval;
+
+	rval = get_external_facing_format(ip, format);
+	if (rval || !av->vc_ctrl)
+		return rval;
+
+	csi2_be_soc = container_of(av, struct ipu_isys_csi2_be_soc, av);
+	if (!ipu_isys_csi2_be_soc_routed(csi2_be_soc, format->format.code))
+		return 0;
+
+	format->pad = CSI2_BE_SOC_PAD_SINK;
+
+	return v4l2_subdev_call(&csi2_be_soc->asd.sd, pad, get_fmt, NULL,
+				format);
+}
+
+/*
+ * Return the input pin of a firmware stream receiving the data type of
+ * @ffmt, adding one if there is none yet.
+ */
+static int get_fw_input_pin(struct ipu_isys_pipeline *ip,
+			    struct ipu_fw_isys_stream_cfg_data_abi *cfg,
+			    struct v4l2_mbus_framefmt *ffmt)
+{
+	struct ipu_fw_isys_input_pin_info_abi *input_pin;
+	unsigned int dt = ipu_isys_mbus_code_to_mipi(ffmt->code);
+	unsigned int i;
+
+	for (i = 0; i < cfg->nof_input_pins; i++)
+		if (cfg->input_pins[i].dt == dt)
+			return i;
+
+	if (cfg->nof_input_pins == IPU_MAX_IPINS)
+		return -ENOSPC;
+
+	input_pin = &cfg->input_pins[cfg->nof_input_pins];
+	input_pin->input_res.width = ffmt->width;
+	input_pin->input_res.height = ffmt->height;
+	input_pin->dt = dt;
+	input_pin->mapped_dt = N_IPU_FW_ISYS_MIPI_DATA_TYPE;
+	input_pin->mipi_decompression =
+	    IPU_FW_ISYS_MIPI_COMPRESSION_TYPE_NO_COMPRESSION;
+	input_pin->capture_mode = IPU_FW_ISYS_CAPTURE_MODE_REGULAR;
+	if (ip->csi2 && !v4l2_ctrl_g_ctrl(ip->csi2->store_csi2_header))
+		input_pin->mipi_store_mode =
+		    IPU_FW_ISYS_MIPI_STORE_MODE_DISCARD_LONG_HEADER;
+
+	return cfg->nof_input_pins++;
+}
+
 static void short_packet_queue_destroy(struct ipu_isys_pipeline *ip)
 {
 	struct ipu_isys_video *av = container_of(ip, struct ipu_isys_video, ip);
@@ -1049,6 +1254,7 @@ csi_short_packet_prepare_fw_cfg(struct ipu_isys_pipeline *ip,
 	    &cfg->input_pins[input_pin];
 	struct ipu_fw_isys_output_pin_info_abi *output_info =
 	    &cfg->output_pins[output_pin];
+	struct ipu_isys_fw_stream *fs = &ip->fw_streams[0];
 	struct ipu_isys *isys = ip->isys;
 
 	/*
@@ -1059,9 +1265,9 @@ csi_short_packet_prepare_fw_cfg(struct ipu_isys_pipeline *ip,
 	input_info->input_res.width = IPU_ISYS_SHORT_PACKET_WIDTH;
 	input_info->input_res.height = ip->num_short_packet_lines;
 
-	ip->output_pins[output_pin].pin_ready =
+	ip->output_pins[fs->first_pin + output_pin].pin_ready =
 	    ipu_isys_queue_short_packet_ready;
-	ip->output_pins[output_pin].aq = NULL;
+	ip->output_pins[fs->first_pin + output_pin].aq = NULL;
 	ip->short_packet_output_pin = output_pin;
 
 	output_info->input_pin_id = input_pin;
@@ -1089,17 +1295,19 @@ ipu_isys_prepare_fw_cfg_default(struct ipu_isys_video *av,
 	struct media_pipeline *mp = media_entity_pipeline(&av->vdev.entity);
 	struct ipu_isys_pipeline *ip = to_ipu_isys_pipeline(mp);
 	struct ipu_isys_queue *aq = &av->aq;
+	struct ipu_isys_fw_stream *fs = &ip->fw_streams[aq->fw_stream];
 	struct ipu_fw_isys_output_pin_info_abi *pin_info;
 	struct ipu_isys *isys = av->isys;
 	unsigned int type_index, type;
 	int pin = cfg->nof_output_pins++;
 
 	aq->fw_output = pin;
-	ip->output_pins[pin].pin_ready = ipu_isys_queue_buf_ready;
-	ip->output_pins[pin].aq = aq;
+	ip->output_pins[fs->first_pin + pin].pin_ready =
+	    ipu_isys_queue_buf_ready;
+	ip->output_pins[fs->first_pin + pin].aq = aq;
 
 	pin_info = &cfg->output_pins[pin];
-	pin_info->input_pin_id = 0;
+	pin_info->input_pin_id = aq->fw_input;
 	pin_info->output_res.width = av->mpix.width;
 	pin_info->output_res.height = av->mpix.height;
 
@@ -1119,7 +1327,6 @@ ipu_isys_prepare_fw_cfg_default(struct ipu_isys_video *av,
 	    S2M_PIXEL_SOC_PIXEL_REMAPPING_FLAG_NO_REMAPPING;
 	pin_info->csi_be_soc_pixel_remapping =
 	    CSI_BE_SOC_PIXEL_REMAPPING_FLAG_NO_REMAPPING;
-	cfg->vc = 0;
 
 	switch (pin_info->pt) {
 	/* non-snoopable sensor data to PSYS */
@@ -1213,75 +1420,88 @@ static unsigned int get_comp_format(u32 code)
 	    ((udt - IPU_ISYS_MIPI_CSI2_TYPE_USER_DEF(1)) * 4);
 }
 
-/* Create stream and start it using the CSS FW ABI. */
-static int start_stream_firmware(struct ipu_isys_video *av,
-				 struct ipu_isys_buffer_list *bl)
+static bool fw_stream_cfg_full(struct ipu_isys_fw_stream *fs,
+			       struct ipu_fw_isys_stream_cfg_data_abi *cfg)
 {
-	struct media_pipeline *mp = media_entity_pipeline(&av->vdev.entity);
-	struct ipu_isys_pipeline *ip = to_ipu_isys_pipeline(mp);
-	struct device *dev = &av->isys->adev->dev;
+	return cfg->nof_output_pins == IPU_MAX_OPINS ||
+	       fs->first_pin + cfg->nof_output_pins == IPU_ISYS_OUTPUT_PINS;
+}
+
+/* Configure firmware stream @stream from the queues capturing its VC. */
+static int prepare_fw_stream_cfg(struct ipu_isys_pipeline *ip,
+				 unsigned int stream,
+				 struct ipu_fw_isys_stream_cfg_data_abi *cfg)
+{
+	struct ipu_isys_fw_stream *fs = &ip->fw_streams[stream];
+	struct device *dev = &ip->isys->adev->dev;
 	struct v4l2_subdev_selection sel_fmt = {
 		.which = V4L2_SUBDEV_FORMAT_ACTIVE,
 		.target = V4L2_SEL_TGT_CROP,
 		.pad = CSI2_BE_PAD_SOURCE,
 	};
-	struct ipu_fw_isys_stream_cfg_data_abi *stream_cfg;
-	struct isys_fw_msgs *msg = NULL;
-	struct ipu_fw_isys_frame_buff_set_abi *buf = NULL;
-	struct ipu_isys_queue *aq;
-	struct ipu_isys_video *isl_av = NULL;
 	struct v4l2_subdev_format source_fmt = { 0 };
-	struct v4l2_subdev *be_sd = NULL;
-#if LINUX_VERSION_CODE < KERNEL_VERSION(6, 0, 0)
-	struct media_pad *source_pad = media_entity_remote_pad(&av->pad);
-#else
-	struct media_pad *source_pad = media_pad_remote_pad_first(&av->pad);
-#endif
 	struct ipu_fw_isys_cropping_abi *crop;
-	enum ipu_fw_isys_send_type send_type;
-	int rval, rvalout, tout;
+	struct v4l2_subdev *be_sd = NULL;
+	struct ipu_isys_queue *aq;
+	int rval;
 
-	rval = get_external_facing_format(ip, &source_fmt);
-	if (rval)
-		return rval;
+	cfg->src = ip->source;
+	cfg->vc = fs->vc;
+	/* The CSI-2 BE is always on the first stream, see the caller */
+	cfg->isl_use = stream ? IPU_ISL_OFF : ip->isl_mode;
+	cfg->sensor_type = IPU_FW_ISYS_SENSOR_MODE_NORMAL;
 
-	msg = ipu_get_fw_msg_buf(ip);
-	if (!msg)
-		return -ENOMEM;
+	/* Only CSI2-BE and SOC BE has the capability to do crop. */
+	if (!stream && ip->csi2_be)
+		be_sd = &ip->csi2_be->asd.sd;
 
-	stream_cfg = to_stream_cfg_msg_buf(msg);
-	stream_cfg->compfmt = get_comp_format(source_fmt.format.code);
-	stream_cfg->input_pins[0].input_res.width = source_fmt.format.width;
-	stream_cfg->input_pins[0].input_res.height = source_fmt.format.height;
-	stream_cfg->input_pins[0].dt =
-	    ipu_isys_mbus_code_to_mipi(source_fmt.format.code);
-	stream_cfg->input_pins[0].mapped_dt = N_IPU_FW_ISYS_MIPI_DATA_TYPE;
-	stream_cfg->input_pins[0].mipi_decompression =
-	    IPU_FW_ISYS_MIPI_COMPRESSION_TYPE_NO_COMPRESSION;
-	stream_cfg->input_pins[0].capture_mode =
-		IPU_FW_ISYS_CAPTURE_MODE_REGULAR;
-	if (ip->csi2 && !v4l2_ctrl_g_ctrl(ip->csi2->store_csi2_header))
-		stream_cfg->input_pins[0].mipi_store_mode =
-		    IPU_FW_ISYS_MIPI_STORE_MODE_DISCARD_LONG_HEADER;
+	list_for_each_entry(aq, &ip->queues, node) {
+		struct ipu_isys_video *av = ipu_isys_queue_to_video(aq);
+		struct v4l2_subdev_format fmt = { 0 };
 
-	stream_cfg->src = ip->source;
-	stream_cfg->vc = 0;
-	stream_cfg->isl_use = ip->isl_mode;
-	stream_cfg->nof_input_pins = 1;
-	stream_cfg->sensor_type = IPU_FW_ISYS_SENSOR_MODE_NORMAL;
+		if (aq->fw_stream != stream)
+			continue;
 
-	/*
-	 * Only CSI2-BE and SOC BE has the capability to do crop,
-	 * so get the crop info from csi2-be or csi2-be-soc.
-	 */
-	if (ip->csi2_be) {
-		be_sd = &ip->csi2_be->asd.sd;
-	} else if (ip->csi2_be_soc) {
-		be_sd = &ip->csi2_be_soc->asd.sd;
-		if (source_pad)
-			sel_fmt.pad = source_pad->index;
+		if (fw_stream_cfg_full(fs, cfg)) {
+			dev_err(dev, "too many output pins on vc %u\n", fs->vc);
+			return -EINVAL;
+		}
+
+		rval = get_stream_format(ip, av, &fmt);
+		if (rval)
+			return rval;
+
+		rval = get_fw_input_pin(ip, cfg, &fmt.format);
+		if (rval < 0) {
+			dev_err(dev, "too many data types on vc %u\n", fs->vc);
+			return -EINVAL;
+		}
+		aq->fw_input = rval;
+
+		if (!cfg->nof_output_pins)
+			source_fmt = fmt;
+
+		if (!be_sd && av->vc_ctrl) {
+			be_sd = &container_of(av, struct ipu_isys_csi2_be_soc,
+					      av)->asd.sd;
+			sel_fmt.pad = CSI2_BE_SOC_PAD_SOURCE;
+		}
+
+		av->prepare_fw_stream(av, cfg);
 	}
-	crop = &stream_cfg->crop;
+
+	if (!stream && ip->interlaced && ip->isys->short_packet_source ==
+	    IPU_ISYS_SHORT_PACKET_FROM_RECEIVER) {
+		if (fw_stream_cfg_full(fs, cfg) ||
+		    cfg->nof_input_pins == IPU_MAX_IPINS)
+			return -EINVAL;
+		csi_short_packet_prepare_fw_cfg(ip, cfg);
+	}
+
+	fs->nr_output_pins = cfg->nof_output_pins;
+	cfg->compfmt = get_comp_format(source_fmt.format.code);
+
+	crop = &cfg->crop;
 	if (be_sd &&
 	    !v4l2_subdev_call(be_sd, pad, get_selection, NULL, &sel_fmt)) {
 		crop->left_offset = sel_fmt.r.left;
@@ -1294,45 +1514,35 @@ static int start_stream_firmware(struct ipu_isys_video *av,
 		crop->bottom_offset = source_fmt.format.height;
 	}
 
-	/*
-	 * If the CSI-2 backend's video node is part of the pipeline
-	 * it must be arranged first in the output pin list. This is
-	 * the most probably a firmware requirement.
-	 */
-	if (ip->isl_mode == IPU_ISL_CSI2_BE)
-		isl_av = &ip->csi2_be->av;
-
-	if (isl_av) {
-		struct ipu_isys_queue *safe;
-
-		list_for_each_entry_safe(aq, safe, &ip->queues, node) {
-			struct ipu_isys_video *av = ipu_isys_queue_to_video(aq);
-
-			if (av != isl_av)
-				continue;
-
-			list_del(&aq->node);
-			list_add(&aq->node, &ip->queues);
-			break;
-		}
-	}
+	return 0;
+}
 
-	list_for_each_entry(aq, &ip->queues, node) {
-		struct ipu_isys_video *__av = ipu_isys_queue_to_video(aq);
+static int open_fw_stream(struct ipu_isys_video *av, unsigned int stream)
+{
+	struct media_pipeline *mp = media_entity_pipeline(&av->vdev.entity);
+	struct ipu_isys_pipeline *ip = to_ipu_isys_pipeline(mp);
+	struct ipu_isys_fw_stream *fs = &ip->fw_streams[stream];
+	struct device *dev = &av->isys->adev->dev;
+	struct ipu_fw_isys_stream_cfg_data_abi *stream_cfg;
+	struct isys_fw_msgs *msg;
+	int rval, tout;
 
-		__av->prepare_fw_stream(__av, stream_cfg);
-	}
+	/* Output pins of all streams share ip->output_pins */
+	fs->first_pin = stream ? fs[-1].first_pin + fs[-1].nr_output_pins : 0;
 
-	if (ip->interlaced && ip->isys->short_packet_source ==
-	    IPU_ISYS_SHORT_PACKET_FROM_RECEIVER)
-		csi_short_packet_prepare_fw_cfg(ip, stream_cfg);
+	msg = ipu_get_fw_msg_buf(ip);
+	if (!msg)
+		return -ENOMEM;
 
-	ip->nr_output_pins = stream_cfg->nof_output_pins;
+	stream_cfg = to_stream_cfg_msg_buf(msg);
+	rval = prepare_fw_stream_cfg(ip, stream, stream_cfg);
+	if (rval)
+		goto out_put_msg;
 
-	rval = get_stream_handle(av);
+	rval = get_stream_handle(av, fs);
 	if (rval) {
 		dev_dbg(dev, "Can't get stream_handle\n");
-		return rval;
+		goto out_put_msg;
 	}
 
 	reinit_completion(&ip->stream_open_completion);
@@ -1342,15 +1552,15 @@ static int start_stream_firmware(struct ipu_isys_video *av,
 	ipu_fw_isys_dump_stream_cfg(dev, stream_cfg);
 
 	rval = ipu_fw_isys_complex_cmd(av->isys,
-				       ip->stream_handle,
+				       fs->stream_handle,
 				       stream_cfg,
 				       to_dma_addr(msg),
 				       sizeof(*stream_cfg),
 				       IPU_FW_ISYS_SEND_TYPE_STREAM_OPEN);
 	if (rval < 0) {
 		dev_err(dev, "can't open stream (%d)\n", rval);
-		ipu_put_fw_msg_buf(ip, (uintptr_t)stream_cfg);
-		goto out_put_stream_handle;
+		put_stream_handle(av, fs);
+		goto out_put_msg;
 	}
 
 	get_stream_opened(av);
@@ -1372,97 +1582,25 @@ static int start_stream_firmware(struct ipu_isys_video *av,
 		rval = -EIO;
 		goto out_put_stream_opened;
 	}
-	dev_dbg(dev, "start stream open complete for entity %s\n",
-		av->vdev.entity.name);
-
-	if (bl) {
-		msg = ipu_get_fw_msg_buf(ip);
-		if (!msg) {
-			rval = -ENOMEM;
-			goto out_put_stream_opened;
-		}
-		buf = to_frame_msg_buf(msg);
-	}
-
-	if (bl) {
-		ipu_isys_buffer_to_fw_frame_buff(buf, ip, bl);
-		ipu_isys_buffer_list_queue(bl,
-					   IPU_ISYS_BUFFER_LIST_FL_ACTIVE, 0);
-	}
-
-	reinit_completion(&ip->stream_start_completion);
-
-	if (bl) {
-		send_type = IPU_FW_ISYS_SEND_TYPE_STREAM_START_AND_CAPTURE;
-		ipu_fw_isys_dump_frame_buff_set(dev, buf,
-						stream_cfg->nof_output_pins);
-		rval = ipu_fw_isys_complex_cmd(av->isys,
-					       ip->stream_handle,
-					       buf, to_dma_addr(msg),
-					       sizeof(*buf),
-					       send_type);
-	} else {
-		send_type = IPU_FW_ISYS_SEND_TYPE_STREAM_START;
-		rval = ipu_fw_isys_simple_cmd(av->isys,
-					      ip->stream_handle,
-					      send_type);
-	}
-
-	if (rval < 0) {
-		dev_err(dev, "can't start streaming (%d)\n", rval);
-		goto out_stream_close;
-	}
-
-	tout = wait_for_completion_timeout(&ip->stream_start_completion,
-					   IPU_LIB_CALL_TIMEOUT_JIFFIES);
-	if (!tout) {
-		dev_err(dev, "stream start time out for entity %s\n",
-			av->vdev.entity.name);
-		rval = -ETIMEDOUT;
-		goto out_stream_close;
-	}
-	if (ip->error) {
-		dev_err(dev, "stream start failed for entity %s with error %d\n",
-			av->vdev.entity.name, ip->error);
-		rval = -EIO;
-		goto out_stream_close;
-	}
-	dev_dbg(dev, "start stream: complete\n");
+	dev_dbg(dev, "start stream open complete for entity %s vc %u\n",
+		av->vdev.entity.name, fs->vc);
 
 	return 0;
 
-out_stream_close:
-	reinit_completion(&ip->stream_close_completion);
-
-	rvalout = ipu_fw_isys_simple_cmd(av->isys,
-					 ip->stream_handle,
-					 IPU_FW_ISYS_SEND_TYPE_STREAM_CLOSE);
-	if (rvalout < 0) {
-		dev_dbg(dev, "can't close stream (%d)\n", rvalout);
-		goto out_put_stream_opened;
-	}
-
-	tout = wait_for_completion_timeout(&ip->stream_close_completion,
-					   IPU_LIB_CALL_TIMEOUT_JIFFIES);
-	if (!tout)
-		dev_err(dev, "stream close time out for entity %s\n",
-			av->vdev.entity.name);
-	else if (ip->error)
-		dev_err(dev, "stream close failed for entity %s with error %d\n",
-			av->vdev.entity.name, ip->error);
-	else
-		dev_dbg(dev, "close stream: complete for entity %s\n",
-			av->vdev.entity.name);
-
 out_put_stream_opened:
 	put_stream_opened(av);
+	put_stream_handle(av, fs);
+
+	return rval;
+
+out_put_msg:
+	ipu_put_fw_msg_buf(ip, (uintptr_t)stream_cfg);
 
-out_put_stream_handle:
-	put_stream_handle(av);
 	return rval;
 }
 
-static void stop_streaming_firmware(struct ipu_isys_video *av)
+static void stop_fw_stream(struct ipu_isys_video *av,
+			   struct ipu_isys_fw_stream *fs)
 {
 	struct media_pipeline *mp = media_entity_pipeline(&av->vdev.entity);
 	struct ipu_isys_pipeline *ip = to_ipu_isys_pipeline(mp);
@@ -1473,7 +1611,7 @@ static void stop_streaming_firmware(struct ipu_isys_video *av)
 
 	reinit_completion(&ip->stream_stop_completion);
 
-	rval = ipu_fw_isys_simple_cmd(av->isys, ip->stream_handle,
+	rval = ipu_fw_isys_simple_cmd(av->isys, fs->stream_handle,
 				      send_type);
 
 	if (rval < 0) {
@@ -1490,11 +1628,12 @@ static void stop_streaming_firmware(struct ipu_isys_video *av)
 		dev_err(dev, "stream stop failed for entity %s with error %d\n",
 			av->vdev.entity.name, ip->error);
 	else
-		dev_dbg(dev, "stop stream complete for entity %s\n",
-			av->vdev.entity.name);
+		dev_dbg(dev, "stop stream complete for entity %s vc %u\n",
+			av->vdev.entity.name, fs->vc);
 }
 
-static void close_streaming_firmware(struct ipu_isys_video *av)
+static void close_fw_stream(struct ipu_isys_video *av,
+			    struct ipu_isys_fw_stream *fs)
 {
 	struct media_pipeline *mp = media_entity_pipeline(&av->vdev.entity);
 	struct ipu_isys_pipeline *ip = to_ipu_isys_pipeline(mp);
@@ -1503,11 +1642,11 @@ static void close_streaming_firmware(struct ipu_isys_video *av)
 
 	reinit_completion(&ip->stream_close_completion);
 
-	rval = ipu_fw_isys_simple_cmd(av->isys, ip->stream_handle,
+	rval = ipu_fw_isys_simple_cmd(av->isys, fs->stream_handle,
 				      IPU_FW_ISYS_SEND_TYPE_STREAM_CLOSE);
 	if (rval < 0) {
 		dev_err(dev, "can't close stream (%d)\n", rval);
-		return;
+		goto out_put_stream_handle;
 	}
 
 	tout = wait_for_completion_timeout(&ip->stream_close_completion,
@@ -1519,11 +1658,197 @@ static void close_streaming_firmware(struct ipu_isys_video *av)
 		dev_err(dev, "stream close failed for entity %s with error %d\n",
 			av->vdev.entity.name, ip->error);
 	else
-		dev_dbg(dev, "close stream complete for entity %s\n",
-			av->vdev.entity.name);
+		dev_dbg(dev, "close stream complete for entity %s vc %u\n",
+			av->vdev.entity.name, fs->vc);
 
+out_put_stream_handle:
 	put_stream_opened(av);
-	put_stream_handle(av);
+	put_stream_handle(av, fs);
+}
+
+/* Start a firmware stream, capturing into the frame set in @msg if any */
+static int start_fw_stream(struct ipu_isys_video *av,
+			   struct ipu_isys_fw_stream *fs,
+			   struct isys_fw_msgs *msg)
+{
+	struct media_pipeline *mp = media_entity_pipeline(&av->vdev.entity);
+	struct ipu_isys_pipeline *ip = to_ipu_isys_pipeline(mp);
+	struct device *dev = &av->isys->adev->dev;
+	struct ipu_fw_isys_frame_buff_set_abi *buf;
+	enum ipu_fw_isys_send_type send_type;
+	int rval, tout;
+
+	reinit_completion(&ip->stream_start_completion);
+
+	if (msg) {
+		send_type = IPU_FW_ISYS_SEND_TYPE_STREAM_START_AND_CAPTURE;
+		buf = to_frame_msg_buf(msg);
+		ipu_fw_isys_dump_frame_buff_set(dev, buf, fs->nr_output_pins);
+		rval = ipu_fw_isys_complex_cmd(av->isys,
+					       fs->stream_handle,
+					       buf, to_dma_addr(msg),
+					       sizeof(*buf),
+					       send_type);
+	} else {
+		send_type = IPU_FW_ISYS_SEND_TYPE_STREAM_START;
+		rval = ipu_fw_isys_simple_cmd(av->isys,
+					      fs->stream_handle,
+					      send_type);
+	}
+
+	if (rval < 0) {
+		dev_err(dev, "can't start streaming (%d)\n", rval);
+		/* The firmware never got the message */
+		if (msg)
+			ipu_put_fw_msg_buf(ip, (uintptr_t)buf);
+		return rval;
+	}
+
+	tout = wait_for_completion_timeout(&ip->stream_start_completion,
+					   IPU_LIB_CALL_TIMEOUT_JIFFIES);
+	if (!tout) {
+		dev_err(dev, "stream start time out for entity %s\n",
+			av->vdev.entity.name);
+		return -ETIMEDOUT;
+	}
+	if (ip->error) {
+		dev_err(dev, "stream start failed for entity %s with error %d\n",
+			av->vdev.entity.name, ip->error);
+		return -EIO;
+	}
+
+	return 0;
+}
+
+/*
+ * Create the firmware streams of the pipeline, one per CSI-2 virtual
+ * channel captured, and start them using the CSS FW ABI.
+ */
+static int start_stream_firmware(struct ipu_isys_video *av,
+				 struct ipu_isys_buffer_list *bl)
+{
+	struct media_pipeline *mp = media_entity_pipeline(&av->vdev.entity);
+	struct ipu_isys_pipeline *ip = to_ipu_isys_pipeline(mp);
+	struct device *dev = &av->isys->adev->dev;
+	struct isys_fw_msgs *msgs[IPU_ISYS_MAX_VC];
+	struct ipu_fw_isys_frame_buff_set_abi *buf;
+	struct ipu_isys_fw_stream *fs;
+	struct ipu_isys_queue *aq;
+	struct ipu_isys_video *isl_av = NULL;
+	unsigned int i, opened, started;
+	int rval;
+
+	/*
+	 * If the CSI-2 backend's video node is part of the pipeline
+	 * it must be arranged first in the output pin list. This is
+	 * the most probably a firmware requirement.
+	 */
+	if (ip->isl_mode == IPU_ISL_CSI2_BE)
+		isl_av = &ip->csi2_be->av;
+
+	if (isl_av) {
+		struct ipu_isys_queue *safe;
+
+		list_for_each_entry_safe(aq, safe, &ip->queues, node) {
+			struct ipu_isys_video *av = ipu_isys_queue_to_video(aq);
+
+			if (av != isl_av)
+				continue;
+
+			list_del(&aq->node);
+			list_add(&aq->node, &ip->queues);
+			break;
+		}
+	}
+
+	/* Group the queues into one firmware stream per virtual channel */
+	ip->nr_fw_streams = 0;
+	list_for_each_entry(aq, &ip->queues, node) {
+		struct ipu_isys_video *__av = ipu_isys_queue_to_video(aq);
+		unsigned int vc = ipu_isys_video_vc(__av);
+
+		for (i = 0; i < ip->nr_fw_streams; i++)
+			if (ip->fw_streams[i].vc == vc)
+				break;
+
+		fs = &ip->fw_streams[i];
+		if (i == ip->nr_fw_streams) {
+			memset(fs, 0, sizeof(*fs));
+			fs->stream_handle = -1;
+			fs->vc = vc;
+			ip->nr_fw_streams++;
+		}
+		fs->nr_queues++;
+		aq->fw_stream = i;
+	}
+
+	for (opened = 0; opened < ip->nr_fw_streams; opened++) {
+		rval = open_fw_stream(av, opened);
+		if (rval)
+			goto out_close_streams;
+	}
+
+	if (bl) {
+		for (i = 0; i < ip->nr_fw_streams; i++) {
+			msgs[i] = ipu_get_fw_msg_buf(ip);
+			if (!msgs[i]) {
+				while (i--) {
+					buf = to_frame_msg_buf(msgs[i]);
+					ipu_put_fw_msg_buf(ip, (uintptr_t)buf);
+				}
+				rval = -ENOMEM;
+				goto out_close_streams;
+			}
+			buf = to_frame_msg_buf(msgs[i]);
+			ipu_isys_buffer_to_fw_frame_buff(buf, ip, i, bl);
+		}
+		ipu_isys_buffer_list_queue(bl,
+					   IPU_ISYS_BUFFER_LIST_FL_ACTIVE, 0);
+	}
+
+	for (started = 0; started < ip->nr_fw_streams; started++) {
+		rval = start_fw_stream(av, &ip->fw_streams[started],
+				       bl ? msgs[started] : NULL);
+		if (rval)
+			goto out_stop_streams;
+	}
+	dev_dbg(dev, "start stream: complete\n");
+
+	return 0;
+
+out_stop_streams:
+	/* Messages of the streams not tried yet never left the driver */
+	for (i = started + 1; bl && i < ip->nr_fw_streams; i++)
+		ipu_put_fw_msg_buf(ip, (uintptr_t)to_frame_msg_buf(msgs[i]));
+
+	while (started--)
+		stop_fw_stream(av, &ip->fw_streams[started]);
+
+out_close_streams:
+	while (opened--)
+		close_fw_stream(av, &ip->fw_streams[opened]);
+
+	return rval;
+}
+
+static void stop_streaming_firmware(struct ipu_isys_video *av)
+{
+	struct media_pipeline *mp = media_entity_pipeline(&av->vdev.entity);
+	struct ipu_isys_pipeline *ip = to_ipu_isys_pipeline(mp);
+	unsigned int i;
+
+	for (i = 0; i < ip->nr_fw_streams; i++)
+		stop_fw_stream(av, &ip->fw_streams[i]);
+}
+
+static void close_streaming_firmware(struct ipu_isys_video *av)
+{
+	struct media_pipeline *mp = media_entity_pipeline(&av->vdev.entity);
+	struct ipu_isys_pipeline *ip = to_ipu_isys_pipeline(mp);
+	unsigned int i;
+
+	for (i = 0; i < ip->nr_fw_streams; i++)
+		close_fw_stream(av, &ip->fw_streams[i]);
 }
 
 void
@@ -1552,6 +1877,16 @@ ipu_isys_video_add_capture_done(struct ipu_isys_pipeline *ip,
 	WARN_ON(1);
 }
 
+/* Release the VC controls grabbed by BE-SOC link validation */
+static void ipu_isys_pipeline_release_vc(struct ipu_isys_pipeline *ip)
+{
+	unsigned int i;
+
+	for_each_set_bit(i, &ip->vc_grabbed, NR_OF_CSI2_BE_SOC_DEV)
+		v4l2_ctrl_grab(ip->isys->csi2_be_soc[i].av.vc_ctrl, false);
+	ip->vc_grabbed = 0;
+}
+
 int ipu_isys_video_prepare_streaming(struct ipu_isys_video *av,
 				     unsigned int state)
 {
@@ -1566,6 +1901,7 @@ int ipu_isys_video_prepare_streaming(struct ipu_isys_video *av,
 	struct media_entity *entity;
 	struct media_device *mdev = &av->isys->media_dev;
 	struct media_pipeline *mp;
+	unsigned int nr_nodes = 0;
 	int rval;
 	unsigned int i;
 
@@ -1590,6 +1926,7 @@ int ipu_isys_video_prepare_streaming(struct ipu_isys_video *av,
 		media_pipeline_stop(av->vdev.entity.pads);
 #endif
 		media_entity_enum_cleanup(&ip->entity_enum);
+		ipu_isys_pipeline_release_vc(ip);
 		return 0;
 	}
 
@@ -1599,7 +1936,8 @@ int ipu_isys_video_prepare_streaming(struct ipu_isys_video *av,
 	ip->has_sof = false;
 	ip->nr_queues = 0;
 	ip->external = NULL;
-	atomic_set(&ip->sequence, 0);
+	ip->nr_fw_streams = 0;
+	ip->vc_grabbed = 0;
 	ip->isl_mode = IPU_ISL_OFF;
 
 	for (i = 0; i < IPU_NUM_CAPTURE_DONE; i++)
@@ -1607,8 +1945,6 @@ int ipu_isys_video_prepare_streaming(struct ipu_isys_video *av,
 	ip->csi2_be = NULL;
 	ip->csi2_be_soc = NULL;
 	ip->csi2 = NULL;
-	ip->seq_index = 0;
-	memset(ip->seq, 0, sizeof(ip->seq));
 
 	WARN_ON(!list_empty(&ip->queues));
 	ip->interlaced = false;
@@ -1641,13 +1977,24 @@ int ipu_isys_video_prepare_streaming(struct ipu_isys_video *av,
 	/* Gather all entities in the graph. */
 	mutex_lock(&mdev->graph_mutex);
 	media_graph_walk_start(&graph, &av->vdev.entity);
-	while ((entity = media_graph_walk_next(&graph)))
+	while ((entity = media_graph_walk_next(&graph))) {
 		media_entity_enum_set(&ip->entity_enum, entity);
+		if (is_media_entity_v4l2_io(entity))
+			nr_nodes++;
+	}
 
 	mutex_unlock(&mdev->graph_mutex);
 
 	media_graph_walk_cleanup(&graph);
 
+	if (fw_msg_prealloc) {
+		rval = alloc_fw_msg_pool(ip, fw_msg_pool_size(av, nr_nodes));
+		if (rval) {
+			dev_err(dev, "Failed to allocate firmware messages\n");
+			goto out_pipeline_stop;
+		}
+	}
+
 	if (ip->interlaced) {
 		rval = short_packet_queue_setup(ip);
 		if (rval) {
@@ -1671,6 +2018,7 @@ out_pipeline_stop:
 
 out_enum_cleanup:
 	media_entity_enum_cleanup(&ip->entity_enum);
+	ipu_isys_pipeline_release_vc(ip);
 
 	return rval;
 }
@@ -1891,8 +2239,8 @@ int ipu_isys_video_set_streaming(struct ipu_isys_video *av,
 		if (rval)
 			goto out_update_stream_watermark;
 
-		dev_dbg(dev, "set stream: source %d, stream_handle %d\n",
-			ip->source, ip->stream_handle);
+		dev_dbg(dev, "set stream: source %d, %u firmware streams\n",
+			ip->source, ip->nr_fw_streams);
 
 		/* Start external sub-device now. */
 		dev_info(dev, "stream on %s\n", ip->external->entity->name);
@@ -16,6 +16,7 @@
 #define IPU_ISYS_OUTPUT_PINS 11
 #define IPU_NUM_CAPTURE_DONE 2
 #define IPU_ISYS_MAX_PARALLEL_SOF 2
+#define IPU_ISYS_MAX_VC 4	/* CSI-2 virtual channels per port */
 
 struct ipu_isys;
 struct ipu_isys_csi2_be_soc;
@@ -41,15 +42,29 @@ struct output_pin_data {
 	struct ipu_isys_queue *aq;
 };
 
-struct ipu_isys_pipeline {
-	struct media_pipeline pipe;
-	struct media_pad *external;
+/*
+ * The firmware takes a single CSI-2 virtual channel per stream, so a
+ * pipeline capturing several virtual channels of a port opens one
+ * firmware stream for each of them.
+ */
+struct ipu_isys_fw_stream {
+	int stream_handle;	/* stream handle for CSS API */
+	unsigned int vc;
+	unsigned int first_pin;	/* in ipu_isys_pipeline.output_pins */
+	unsigned int nr_output_pins;	/* How many firmware pins? */
+	unsigned int nr_queues;
 	atomic_t sequence;
 	unsigned int seq_index;
 	struct sequence_info seq[IPU_ISYS_MAX_PARALLEL_SOF];
+};
+
+struct ipu_isys_pipeline {
+	struct media_pipeline pipe;
+	struct media_pad *external;
 	int source;	/* SSI stream source */
-	int stream_handle;	/* stream handle for CSS API */
-	unsigned int nr_output_pins;	/* How many firmware pins? */
+	struct ipu_isys_fw_stream fw_streams[IPU_ISYS_MAX_VC];
+	unsigned int nr_fw_streams;
+	unsigned long vc_grabbed;	/* BE-SOC VC controls grabbed */
 	enum ipu_isl_mode isl_mode;
 	struct ipu_isys_csi2_be *csi2_be;
 	struct ipu_isys_csi2_be_soc *csi2_be_soc;
@@ -72,6 +87,10 @@ struct ipu_isys_pipeline {
 	spinlock_t listlock;	/* Protect framebuflist */
 	struct list_head framebuflist;
 	struct list_head framebuflist_fw;
+	/* Messages preallocated at stream start with fw_msg_prealloc */
+	void *fw_msg_pool;
+	dma_addr_t fw_msg_pool_dma_addr;
+	unsigned int fw_msg_pool_nr;
 
 	void (*capture_done[IPU_NUM_CAPTURE_DONE])
 	 (struct ipu_isys_pipeline *ip,
@@ -132,6 +151,7 @@ struct ipu_isys_video {
 	bool initialized;
 	struct v4l2_ctrl_handler ctrl_handler;
 	struct v4l2_ctrl *compression_ctrl;
+	struct v4l2_ctrl *vc_ctrl;	/* Only on nodes that can be routed */
 	unsigned int ts_offsets[VIDEO_MAX_PLANES];
 	unsigned int line_header_length;	/* bits */
 	unsigned int line_footer_length;	/* bits */
@@ -173,6 +193,12 @@ ipu_isys_video_try_fmt_vid_mplane(struct ipu_isys_video *av,
 void
 ipu_isys_prepare_fw_cfg_default(struct ipu_isys_video *av,
 				struct ipu_fw_isys_stream_cfg_data_abi *cfg);
+struct ipu_isys_fw_stream *
+ipu_isys_pipeline_fw_stream(struct ipu_isys_pipeline *ip,
+			    unsigned int stream_handle);
+struct output_pin_data *
+ipu_isys_pipeline_output_pin(struct ipu_isys_pipeline *ip,
+			     struct ipu_fw_isys_resp_info_abi *info);
 struct isys_fw_msgs *ipu_get_fw_msg_buf(struct ipu_isys_pipeline *ip);
 void ipu_put_fw_msg_buf(struct ipu_isys_pipeline *ip, u64 data);
 int ipu_isys_video_prepare_streaming(struct ipu_isys_video *av,
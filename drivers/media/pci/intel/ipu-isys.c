@@ -1177,6 +1177,7 @@ static void isys_remove(struct ipu_bus_device *adev)
 	ipu_trace_uninit(&adev->dev);
 	isys_notifier_cleanup(isys);
 	isys_unregister_devices(isys);
+	ipu_dmabuf_cache_flush(&isp->dmabuf_cache, &adev->dev);
 
 #if LINUX_VERSION_CODE >= KERNEL_VERSION(5, 9, 0)
 	cpu_latency_qos_remove_request(&isys->pm_qos);
@@ -1280,6 +1281,26 @@ DEFINE_SIMPLE_ATTRIBUTE(isys_iwake_control_fops,
 			isys_iwake_control_get,
 			isys_iwake_control_set, "%llu\n");
 
+static ssize_t isys_fw_msg_stats_read(struct file *file, char __user *buf,
+				      size_t len, loff_t *ppos)
+{
+	struct ipu_isys *isys = file->private_data;
+	char tmp[64];
+	int pos;
+
+	pos = scnprintf(tmp, sizeof(tmp), "exhausted: %d\nrefills: %d\n",
+			atomic_read(&isys->fw_msg_exhausted),
+			atomic_read(&isys->fw_msg_refills));
+
+	return simple_read_from_buffer(buf, len, ppos, tmp, pos);
+}
+
+static const struct file_operations isys_fw_msg_stats_fops = {
+	.open = simple_open,
+	.read = isys_fw_msg_stats_read,
+	.llseek = default_llseek,
+};
+
 static int ipu_isys_init_debugfs(struct ipu_isys *isys)
 {
 	struct dentry *file;
@@ -1302,6 +1323,11 @@ static int ipu_isys_init_debugfs(struct ipu_isys *isys)
 	if (IS_ERR(file))
 		goto err;
 
+	file = debugfs_create_file("fw_msg_stats", 0400,
+				   dir, isys, &isys_fw_msg_stats_fops);
+	if (IS_ERR(file))
+		goto err;
+
 	isys->debugfsdir = dir;
 
 #ifdef IPU_ISYS_GPC
@@ -1509,23 +1535,16 @@ static int resp_type_to_index(int type)
 	return i - 1;
 }
 
-int isys_isr_one(struct ipu_bus_device *adev)
+static void isys_isr_resp(struct ipu_bus_device *adev,
+			  struct ipu_fw_isys_resp_info_abi *resp)
 {
 	struct ipu_isys *isys = ipu_bus_get_drvdata(adev);
-	struct ipu_fw_isys_resp_info_abi resp_data;
-	struct ipu_fw_isys_resp_info_abi *resp;
 	struct ipu_isys_pipeline *pipe;
+	struct ipu_isys_fw_stream *fs;
+	struct output_pin_data *pin;
 	u64 ts;
 	unsigned int i;
 
-	if (!isys->fwcom)
-		return 0;
-
-	resp = ipu_fw_isys_get_resp(isys->fwcom, IPU_BASE_MSG_RECV_QUEUES,
-				    &resp_data);
-	if (!resp)
-		return 1;
-
 	ts = (u64)resp->timestamp[1] << 32 | resp->timestamp[0];
 
 	if (resp->error_info.error == IPU_FW_ISYS_ERROR_STREAM_IN_SUSPENSION)
@@ -1559,14 +1578,20 @@ int isys_isr_one(struct ipu_bus_device *adev)
 	if (resp->stream_handle >= IPU_ISYS_MAX_STREAMS) {
 		dev_err(&adev->dev, "bad stream handle %u\n",
 			resp->stream_handle);
-		goto leave;
+		return;
 	}
 
 	pipe = isys->pipes[resp->stream_handle];
 	if (!pipe) {
 		dev_err(&adev->dev, "no pipeline for stream %u\n",
 			resp->stream_handle);
-		goto leave;
+		return;
+	}
+	fs = ipu_isys_pipeline_fw_stream(pipe, resp->stream_handle);
+	if (!fs) {
+		dev_err(&adev->dev, "no firmware stream for stream %u\n",
+			resp->stream_handle);
+		return;
 	}
 	pipe->error = resp->error_info.error;
 
@@ -1595,9 +1620,9 @@ int isys_isr_one(struct ipu_bus_device *adev)
 		 * get pin_data_ready event
 		 */
 		ipu_put_fw_msg_buf(pipe, resp->buf_id);
-		if (resp->pin_id < IPU_ISYS_OUTPUT_PINS &&
-		    pipe->output_pins[resp->pin_id].pin_ready)
-			pipe->output_pins[resp->pin_id].pin_ready(pipe, resp);
+		pin = ipu_isys_pipeline_output_pin(pipe, resp);
+		if (pin && pin->pin_ready)
+			pin->pin_ready(pipe, resp);
 		else
 			dev_err(&adev->dev,
 				"%d:No data pin ready handler for pin id %d\n",
@@ -1655,26 +1680,26 @@ int isys_isr_one(struct ipu_bus_device *adev)
 		break;
 	case IPU_FW_ISYS_RESP_TYPE_FRAME_SOF:
 		if (pipe->csi2)
-			ipu_isys_csi2_sof_event(pipe->csi2);
+			ipu_isys_csi2_sof_event(pipe->csi2, fs->vc);
 
-		pipe->seq[pipe->seq_index].sequence =
-		    atomic_read(&pipe->sequence) - 1;
-		pipe->seq[pipe->seq_index].timestamp = ts;
+		fs->seq[fs->seq_index].sequence =
+		    atomic_read(&fs->sequence) - 1;
+		fs->seq[fs->seq_index].timestamp = ts;
 		dev_dbg(&adev->dev,
 			"sof: handle %d: (index %u), timestamp 0x%16.16llx\n",
 			resp->stream_handle,
-			pipe->seq[pipe->seq_index].sequence, ts);
-		pipe->seq_index = (pipe->seq_index + 1)
+			fs->seq[fs->seq_index].sequence, ts);
+		fs->seq_index = (fs->seq_index + 1)
 		    % IPU_ISYS_MAX_PARALLEL_SOF;
 		break;
 	case IPU_FW_ISYS_RESP_TYPE_FRAME_EOF:
 		if (pipe->csi2)
-			ipu_isys_csi2_eof_event(pipe->csi2);
+			ipu_isys_csi2_eof_event(pipe->csi2, fs->vc);
 
 		dev_dbg(&adev->dev,
 			"eof: handle %d: (index %u), timestamp 0x%16.16llx\n",
 			resp->stream_handle,
-			pipe->seq[pipe->seq_index].sequence, ts);
+			fs->seq[fs->seq_index].sequence, ts);
 		break;
 	case IPU_FW_ISYS_RESP_TYPE_STATS_DATA_READY:
 		break;
@@ -1683,9 +1708,34 @@ int isys_isr_one(struct ipu_bus_device *adev)
 			resp->stream_handle, resp->type);
 		break;
 	}
+}
+
+/*
+ * Handle all the responses pending in the firmware queue in place and
+ * release them with a single read index update. Returns 1 if there were
+ * none.
+ */
+int isys_isr_batch(struct ipu_bus_device *adev)
+{
+	struct ipu_isys *isys = ipu_bus_get_drvdata(adev);
+	struct ipu_fw_isys_resp_info_abi *resp;
+	unsigned int rd, n, i;
+
+	if (!isys->fwcom)
+		return 0;
+
+	n = ipu_fw_isys_get_resps(isys->fwcom, IPU_BASE_MSG_RECV_QUEUES, &rd);
+	if (!n)
+		return 1;
+
+	for (i = 0; i < n; i++) {
+		resp = ipu_fw_isys_resp(isys->fwcom, IPU_BASE_MSG_RECV_QUEUES,
+					rd, i);
+		isys_isr_resp(adev, resp);
+	}
+
+	ipu_fw_isys_put_resps(isys->fwcom, IPU_BASE_MSG_RECV_QUEUES, rd, n);
 
-leave:
-	ipu_fw_isys_put_resp(isys->fwcom, IPU_BASE_MSG_RECV_QUEUES);
 	return 0;
 }
 
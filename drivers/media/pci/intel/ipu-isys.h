@@ -195,6 +195,8 @@ struct ipu_isys {
 	u64 tunit_timer_base;
 	struct v4l2_async_notifier notifier;
 	struct isys_iwake_watermark *iwake_watermark;
+	atomic_t fw_msg_exhausted;	/* Firmware message list found empty */
+	atomic_t fw_msg_refills;	/* Firmware messages added at runtime */
 
 };
 
@@ -221,7 +223,7 @@ int ipu_pipeline_pm_use(struct media_entity *entity, int use);
 extern const struct v4l2_ioctl_ops ipu_isys_ioctl_ops;
 
 void isys_setup_hw(struct ipu_isys *isys);
-int isys_isr_one(struct ipu_bus_device *adev);
+int isys_isr_batch(struct ipu_bus_device *adev);
 irqreturn_t isys_isr(struct ipu_bus_device *adev);
 #ifdef IPU_ISYS_GPC
 int ipu_isys_gpc_init_debugfs(struct ipu_isys *isys);
@@ -3,6 +3,7 @@
 
 #include <asm/cacheflush.h>
 
+#include <linux/debugfs.h>
 #include <linux/device.h>
 #include <linux/iova.h>
 #include <linux/module.h>
@@ -42,6 +43,11 @@
 
 #define TBL_PHYS_ADDR(a)	((phys_addr_t)(a) << ISP_PADDR_SHIFT)
 
+static bool lazy_tlb_flush;
+module_param(lazy_tlb_flush, bool, 0444);
+MODULE_PARM_DESC(lazy_tlb_flush,
+		 "Batch TLB invalidations of unmaps (default: invalidate each)");
+
 static void tlb_invalidate(struct ipu_mmu *mmu)
 {
 	unsigned int i;
@@ -75,9 +81,165 @@ static void tlb_invalidate(struct ipu_mmu *mmu)
 		 */
 		wmb();
 	}
+	atomic64_inc(&mmu->tlb_invalidations);
 	spin_unlock_irqrestore(&mmu->ready_lock, flags);
 }
 
+/* Invalidate and hand the held back IOVAs to the allocator, fq_lock held */
+static void __ipu_mmu_fq_flush(struct ipu_mmu *mmu)
+{
+	unsigned int i;
+
+	if (!mmu->fq_count)
+		return;
+
+	mmu->tlb_invalidate(mmu);
+	for (i = 0; i < mmu->fq_count; i++)
+		free_iova_fast(&mmu->dmap->iovad, mmu->fq[i].pfn,
+			       mmu->fq[i].npages);
+	mmu->fq_count = 0;
+}
+
+void ipu_mmu_tlb_flush(struct ipu_mmu *mmu)
+{
+	unsigned long flags;
+
+	spin_lock_irqsave(&mmu->fq_lock, flags);
+	__ipu_mmu_fq_flush(mmu);
+	spin_unlock_irqrestore(&mmu->fq_lock, flags);
+}
+
+static void ipu_mmu_fq_work(struct work_struct *work)
+{
+	struct ipu_mmu *mmu = container_of(work, struct ipu_mmu,
+					   fq_work.work);
+
+	ipu_mmu_tlb_flush(mmu);
+}
+
+/*
+ * Release an IOVA range after its pages have been unmapped. In lazy mode
+ * the TLB invalidation is left to the next flush, which happens when the
+ * queue is full, IPU_MMU_FQ_TIMEOUT_MS later at the latest, or when an
+ * allocation fails. The range is not reused before that flush.
+ *
+ * @npages must be the size the range was allocated with.
+ */
+void ipu_mmu_free_iova(struct ipu_mmu *mmu, unsigned long pfn,
+		       unsigned long npages)
+{
+	unsigned long flags;
+
+	if (!lazy_tlb_flush) {
+		mmu->tlb_invalidate(mmu);
+		free_iova_fast(&mmu->dmap->iovad, pfn, npages);
+		return;
+	}
+
+	spin_lock_irqsave(&mmu->fq_lock, flags);
+	if (mmu->fq_count == IPU_MMU_FQ_SIZE)
+		__ipu_mmu_fq_flush(mmu);
+	mmu->fq[mmu->fq_count].pfn = pfn;
+	mmu->fq[mmu->fq_count].npages = npages;
+	mmu->fq_count++;
+	atomic64_inc(&mmu->tlb_deferred);
+	spin_unlock_irqrestore(&mmu->fq_lock, flags);
+
+	schedule_delayed_work(&mmu->fq_work,
+			      msecs_to_jiffies(IPU_MMU_FQ_TIMEOUT_MS));
+}
+
+static unsigned long __ipu_mmu_alloc_iova(struct ipu_mmu *mmu,
+					  unsigned long npages,
+					  unsigned long limit_pfn, bool flush)
+{
+#if LINUX_VERSION_CODE < KERNEL_VERSION(4, 19, 0)
+	return alloc_iova_fast(&mmu->dmap->iovad, npages, limit_pfn);
+#else
+	return alloc_iova_fast(&mmu->dmap->iovad, npages, limit_pfn, flush);
+#endif
+}
+
+/*
+ * Allocate an IOVA range from the per-CPU range caches, the rbtree is only
+ * locked when they run dry. Returns the first pfn of the range, 0 if there
+ * is no space.
+ */
+unsigned long ipu_mmu_alloc_iova(struct ipu_mmu *mmu, unsigned long npages,
+				 unsigned long limit_pfn)
+{
+	unsigned long pfn;
+
+	pfn = __ipu_mmu_alloc_iova(mmu, npages, limit_pfn, !lazy_tlb_flush);
+	if (pfn || !lazy_tlb_flush)
+		return pfn;
+
+	/* Space may be held back by the flush queue */
+	ipu_mmu_tlb_flush(mmu);
+
+	return __ipu_mmu_alloc_iova(mmu, npages, limit_pfn, true);
+}
+
+#ifdef CONFIG_DEBUG_FS
+static ssize_t ipu_mmu_tlb_stats_read(struct file *file, char __user *buf,
+				      size_t len, loff_t *ppos)
+{
+	struct ipu_mmu *mmu = file->private_data;
+	u64 count = atomic64_read(&mmu->tlb_invalidations);
+	unsigned long flags;
+	u64 rate = 0;
+	char tmp[128];
+	int pos;
+
+	/*
+	 * Rate since the previous read, the first one covers probe to now.
+	 * fq_lock keeps concurrent readers from mixing up the snapshot.
+	 */
+	if (*ppos == 0) {
+		ktime_t now;
+		u64 ns;
+
+		spin_lock_irqsave(&mmu->fq_lock, flags);
+		count = atomic64_read(&mmu->tlb_invalidations);
+		now = ktime_get();
+		ns = ktime_to_ns(ktime_sub(now, mmu->stats_ts));
+		if (ns)
+			rate = div64_u64((count - mmu->stats_last) *
+					 NSEC_PER_SEC, ns);
+		mmu->stats_last = count;
+		mmu->stats_ts = now;
+		spin_unlock_irqrestore(&mmu->fq_lock, flags);
+	}
+
+	pos = scnprintf(tmp, sizeof(tmp),
+			"lazy: %d\ninvalidations: %llu\n"
+			"deferred_unmaps: %llu\ninvalidations_per_sec: %llu\n",
+			lazy_tlb_flush, count,
+			atomic64_read(&mmu->tlb_deferred), rate);
+
+	return simple_read_from_buffer(buf, len, ppos, tmp, pos);
+}
+
+static const struct file_operations ipu_mmu_tlb_stats_fops = {
+	.open = simple_open,
+	.read = ipu_mmu_tlb_stats_read,
+	.llseek = default_llseek,
+};
+
+int ipu_mmu_debugfs_add(struct ipu_mmu *mmu, struct dentry *dir,
+			const char *name)
+{
+	struct dentry *file;
+
+	file = debugfs_create_file(name, 0400, dir, mmu,
+				   &ipu_mmu_tlb_stats_fops);
+	if (IS_ERR_OR_NULL(file))
+		return -ENOMEM;
+
+	return 0;
+}
+#endif
+
 #ifdef DEBUG
 static void page_table_dump(struct ipu_mmu_info *mmu_info)
 {
@@ -255,8 +417,9 @@ static int l2_map(struct ipu_mmu_info *mmu_info, unsigned long iova,
 	unsigned int l2_idx;
 	unsigned long flags;
 	dma_addr_t dma;
-	unsigned int l2_entries;
-	size_t mapped = 0;
+	unsigned int l2_entries, i;
+	u32 pteval;
+	size_t mapped = 0, chunk;
 	int err = 0;
 
 	spin_lock_irqsave(&mmu_info->lock, flags);
@@ -299,25 +462,26 @@ static int l2_map(struct ipu_mmu_info *mmu_info, unsigned long iova,
 		}
 
 		l2_pt = mmu_info->l2_pts[l1_idx];
-		l2_entries = 0;
+		l2_idx = (iova & ISP_L2PT_MASK) >> ISP_L2PT_SHIFT;
+		l2_entries = min_t(size_t, ISP_L2PT_PTES - l2_idx,
+				   size >> ISP_PAGE_SHIFT);
+		pteval = paddr >> ISP_PADDR_SHIFT;
 
-		for (l2_idx = (iova & ISP_L2PT_MASK) >> ISP_L2PT_SHIFT;
-		     size > 0 && l2_idx < ISP_L2PT_PTES; l2_idx++) {
-			l2_pt[l2_idx] = paddr >> ISP_PADDR_SHIFT;
+		dev_dbg(dev, "l2 index %u-%u mapped from 0x%8.8x\n", l2_idx,
+			l2_idx + l2_entries - 1, pteval);
 
-			dev_dbg(dev, "l2 index %u mapped as 0x%8.8x\n", l2_idx,
-				l2_pt[l2_idx]);
+		/* The range is physically contiguous, so are the PFNs */
+		for (i = 0; i < l2_entries; i++)
+			l2_pt[l2_idx + i] = pteval + i;
 
-			iova += ISP_PAGE_SIZE;
-			paddr += ISP_PAGE_SIZE;
-			mapped += ISP_PAGE_SIZE;
-			size -= ISP_PAGE_SIZE;
-
-			l2_entries++;
-		}
+		chunk = (size_t)l2_entries << ISP_PAGE_SHIFT;
+		iova += chunk;
+		paddr += chunk;
+		mapped += chunk;
+		size -= chunk;
 
 		WARN_ON_ONCE(!l2_entries);
-		clflush_cache_range(&l2_pt[l2_idx - l2_entries],
+		clflush_cache_range(&l2_pt[l2_idx],
 				    sizeof(l2_pt[0]) * l2_entries);
 	}
 
@@ -353,8 +517,8 @@ static void l2_unmap(struct ipu_mmu_info *mmu_info, unsigned long iova,
 	u32 l1_idx;
 	u32 *l2_pt;
 	unsigned int l2_idx;
-	unsigned int l2_entries;
-	size_t unmapped = 0;
+	unsigned int l2_entries, i;
+	size_t unmapped = 0, chunk;
 	unsigned long flags;
 
 	spin_lock_irqsave(&mmu_info->lock, flags);
@@ -371,24 +535,23 @@ static void l2_unmap(struct ipu_mmu_info *mmu_info, unsigned long iova,
 			continue;
 		}
 		l2_pt = mmu_info->l2_pts[l1_idx];
+		l2_idx = (iova & ISP_L2PT_MASK) >> ISP_L2PT_SHIFT;
+		l2_entries = min_t(size_t, ISP_L2PT_PTES - l2_idx,
+				   size >> ISP_PAGE_SHIFT);
 
-		l2_entries = 0;
-		for (l2_idx = (iova & ISP_L2PT_MASK) >> ISP_L2PT_SHIFT;
-		     size > 0 && l2_idx < ISP_L2PT_PTES; l2_idx++) {
-			dev_dbg(mmu_info->dev,
-				"unmap l2 index %u with pteval 0x%10.10llx\n",
-				l2_idx, TBL_PHYS_ADDR(l2_pt[l2_idx]));
-			l2_pt[l2_idx] = mmu_info->dummy_page_pteval;
+		dev_dbg(mmu_info->dev, "unmap l2 index %u-%u\n", l2_idx,
+			l2_idx + l2_entries - 1);
 
-			iova += ISP_PAGE_SIZE;
-			unmapped += ISP_PAGE_SIZE;
-			size -= ISP_PAGE_SIZE;
+		for (i = 0; i < l2_entries; i++)
+			l2_pt[l2_idx + i] = mmu_info->dummy_page_pteval;
 
-			l2_entries++;
-		}
+		chunk = (size_t)l2_entries << ISP_PAGE_SHIFT;
+		iova += chunk;
+		unmapped += chunk;
+		size -= chunk;
 
 		WARN_ON_ONCE(!l2_entries);
-		clflush_cache_range(&l2_pt[l2_idx - l2_entries],
+		clflush_cache_range(&l2_pt[l2_idx],
 				    sizeof(l2_pt[0]) * l2_entries);
 	}
 
@@ -611,8 +774,20 @@ static struct ipu_dma_mapping *alloc_dma_mapping(struct ipu_device *isp)
 	if (!dmap)
 		return NULL;
 
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(5, 19, 0)
+	/* The range caches behind alloc_iova_fast() are set up separately */
+	init_iova_domain(&dmap->iovad, SZ_4K, 1);
+	if (iova_domain_init_rcaches(&dmap->iovad)) {
+		kfree(dmap);
+		return NULL;
+	}
+#endif
+
 	dmap->mmu_info = ipu_mmu_alloc(isp);
 	if (!dmap->mmu_info) {
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(5, 19, 0)
+		put_iova_domain(&dmap->iovad);
+#endif
 		kfree(dmap);
 		return NULL;
 	}
@@ -622,7 +797,7 @@ static struct ipu_dma_mapping *alloc_dma_mapping(struct ipu_device *isp)
 #elif LINUX_VERSION_CODE < KERNEL_VERSION(4, 15, 0)
 	init_iova_domain(&dmap->iovad, SZ_4K, 1,
 			 dmap->mmu_info->aperture_end >> PAGE_SHIFT);
-#else
+#elif LINUX_VERSION_CODE < KERNEL_VERSION(5, 19, 0)
 	init_iova_domain(&dmap->iovad, SZ_4K, 1);
 #endif
 	dmap->mmu_info->dmap = dmap;
@@ -790,6 +965,9 @@ struct ipu_mmu *ipu_mmu_init(struct device *dev,
 	mmu->ready = false;
 	INIT_LIST_HEAD(&mmu->vma_list);
 	spin_lock_init(&mmu->ready_lock);
+	spin_lock_init(&mmu->fq_lock);
+	INIT_DELAYED_WORK(&mmu->fq_work, ipu_mmu_fq_work);
+	mmu->stats_ts = ktime_get();
 
 	mmu->dmap = alloc_dma_mapping(isp);
 	if (!mmu->dmap) {
@@ -804,6 +982,8 @@ void ipu_mmu_cleanup(struct ipu_mmu *mmu)
 {
 	struct ipu_dma_mapping *dmap = mmu->dmap;
 
+	cancel_delayed_work_sync(&mmu->fq_work);
+	ipu_mmu_tlb_flush(mmu);
 	ipu_mmu_destroy(mmu);
 	mmu->dmap = NULL;
 	iova_cache_put();
@@ -5,6 +5,9 @@
 #define IPU_MMU_H
 
 #include <linux/dma-mapping.h>
+#include <linux/iova.h>
+#include <linux/ktime.h>
+#include <linux/workqueue.h>
 
 #include "ipu.h"
 #include "ipu-pdata.h"
@@ -12,6 +15,15 @@
 #define ISYS_MMID 1
 #define PSYS_MMID 0
 
+/* Unmapped IOVAs held back in lazy TLB flush mode */
+#define IPU_MMU_FQ_SIZE		64
+#define IPU_MMU_FQ_TIMEOUT_MS	10
+
+struct ipu_mmu_fq_entry {
+	unsigned long pfn;
+	unsigned long npages;
+};
+
 /*
  * @pgtbl: virtual address of the l1 page table (one page)
  */
@@ -59,6 +71,18 @@ struct ipu_mmu {
 	spinlock_t ready_lock;	/* Serialize access to bool ready */
 
 	void (*tlb_invalidate)(struct ipu_mmu *mmu);
+
+	/* IOVAs unmapped since the last TLB invalidation, lazy mode only */
+	spinlock_t fq_lock;	/* Serialize fq and the flush */
+	struct ipu_mmu_fq_entry fq[IPU_MMU_FQ_SIZE];
+	unsigned int fq_count;
+	struct delayed_work fq_work;
+
+	atomic64_t tlb_invalidations;
+	atomic64_t tlb_deferred;	/* Unmaps left to a later flush */
+	/* tlb_invalidations and time at last debugfs read, under fq_lock */
+	u64 stats_last;
+	ktime_t stats_ts;
 };
 
 struct ipu_mmu *ipu_mmu_init(struct device *dev,
@@ -73,4 +97,14 @@ void ipu_mmu_unmap(struct ipu_mmu_info *mmu_info, unsigned long iova,
 		   size_t size);
 phys_addr_t ipu_mmu_iova_to_phys(struct ipu_mmu_info *mmu_info,
 				 dma_addr_t iova);
+unsigned long ipu_mmu_alloc_iova(struct ipu_mmu *mmu, unsigned long npages,
+				 unsigned long limit_pfn);
+void ipu_mmu_free_iova(struct ipu_mmu *mmu, unsigned long pfn,
+		       unsigned long npages);
+void ipu_mmu_tlb_flush(struct ipu_mmu *mmu);
+#ifdef CONFIG_DEBUG_FS
+struct dentry;
+int ipu_mmu_debugfs_add(struct ipu_mmu *mmu, struct dentry *dir,
+			const char *name);
+#endif
 #endif
@@ -342,6 +342,14 @@ static int ipu_init_debugfs(struct ipu_device *isp)
 	if (ipu_trace_debugfs_add(isp, dir))
 		goto err;
 
+	if (ipu_mmu_debugfs_add(isp->isys->mmu, dir, "isys_mmu_tlb") ||
+	    ipu_mmu_debugfs_add(isp->psys->mmu, dir, "psys_mmu_tlb"))
+		goto err;
+
+	if (ipu_dmabuf_cache_debugfs_add(&isp->dmabuf_cache, dir,
+					 "dmabuf_cache"))
+		goto err;
+
 	isp->ipu_dir = dir;
 
 	if (ipu_buttress_debugfs_init(isp))
@@ -468,6 +476,7 @@ static int ipu_pci_probe(struct pci_dev *pdev, const struct pci_device_id *id)
 
 	isp->pdev = pdev;
 	INIT_LIST_HEAD(&isp->devices);
+	ipu_dmabuf_cache_init(&isp->dmabuf_cache);
 
 	rval = pcim_enable_device(pdev);
 	if (rval) {
@@ -746,6 +755,9 @@ static void ipu_pci_remove(struct pci_dev *pdev)
 	isp->pkg_dir_dma_addr = 0;
 	isp->pkg_dir_size = 0;
 
+	/* Idle cached mappings must go while the MMUs are still around */
+	ipu_dmabuf_cache_flush(&isp->dmabuf_cache, NULL);
+
 	ipu_mmu_cleanup(isp->psys->mmu);
 	ipu_mmu_cleanup(isp->isys->mmu);
 
@@ -12,6 +12,7 @@
 #include "ipu-pdata.h"
 #include "ipu-bus.h"
 #include "ipu-buttress.h"
+#include "ipu-dmabuf-cache.h"
 #include "ipu-trace.h"
 
 #define IPU6_PCI_ID	0x9a19
@@ -87,6 +88,7 @@ struct ipu_device {
 	struct dentry *ipu_dir;
 #endif
 	struct ipu_trace *trace;
+	struct ipu_dmabuf_cache dmabuf_cache;	/* isys and psys */
 	bool flr_done;
 	bool ipc_reinit;
 	bool secure_mode;
@@ -612,10 +612,11 @@ void ipu_isys_csi2_isr(struct ipu_isys_csi2 *csi2)
 	writel(status, csi2->base + CSI_PORT_REG_BASE_IRQ_CSI_SYNC +
 	       CSI_PORT_REG_BASE_IRQ_CLEAR_OFFSET);
 
+	/* The receiver interrupt does not tell the VC, account it to VC 0 */
 	if (status & IPU_CSI_RX_IRQ_FS_VC)
-		ipu_isys_csi2_sof_event(csi2);
+		ipu_isys_csi2_sof_event(csi2, 0);
 	if (status & IPU_CSI_RX_IRQ_FE_VC)
-		ipu_isys_csi2_eof_event(csi2);
+		ipu_isys_csi2_eof_event(csi2, 0);
 }
 
 unsigned int ipu_isys_csi2_get_current_field(struct ipu_isys_pipeline *ip,
@@ -169,7 +169,7 @@ irqreturn_t isys_isr(struct ipu_bus_device *adev)
 
 		writel(0, base + IPU_REG_ISYS_UNISPART_SW_IRQ_REG);
 
-		if (!isys_isr_one(adev))
+		if (!isys_isr_batch(adev))
 			status_sw = IPU_ISYS_UNISPART_IRQ_SW;
 		else
 			status_sw = 0;
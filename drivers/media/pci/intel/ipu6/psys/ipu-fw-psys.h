@@ -297,9 +297,9 @@ struct ipu6_psys_hw_res_variant {
 				   u16 id, u32 bitmap, u32 active_bitmap);
 	int (*set_proc_ext_mem)(struct ipu_fw_psys_process *ptr,
 				u16 type_id, u16 mem_id, u16 offset);
-	int (*get_pgm_by_proc)(struct ipu_fw_generic_program_manifest *gen_pm,
-			       const struct ipu_fw_psys_pgm *pg_manifest,
-			       struct ipu_fw_psys_process *process);
+	int (*get_pgm_by_idx)(struct ipu_fw_generic_program_manifest *gen_pm,
+			      const struct ipu_fw_psys_pgm *pg_manifest,
+			      unsigned int program_idx);
 };
 
 struct ipu_psys_kcmd;
@@ -362,9 +362,9 @@ int ipu_fw_psys_set_proc_dev_chn(struct ipu_fw_psys_process *ptr, u16 offset,
 int ipu_fw_psys_set_process_ext_mem(struct ipu_fw_psys_process *ptr,
 				    u16 type_id, u16 mem_id, u16 offset);
 int
-ipu_fw_psys_get_pgm_by_process(struct ipu_fw_generic_program_manifest *gen_pm,
-			       const struct ipu_fw_psys_pgm *pg_manifest,
-			       struct ipu_fw_psys_process *process);
+ipu_fw_psys_get_pgm_by_index(struct ipu_fw_generic_program_manifest *gen_pm,
+			     const struct ipu_fw_psys_pgm *pg_manifest,
+			     unsigned int program_idx);
 int ipu6_fw_psys_set_proc_dev_chn(struct ipu_fw_psys_process *ptr, u16 offset,
 				  u16 value);
 int ipu6_fw_psys_set_proc_dfm_bitmap(struct ipu_fw_psys_process *ptr,
@@ -373,9 +373,9 @@ int ipu6_fw_psys_set_proc_dfm_bitmap(struct ipu_fw_psys_process *ptr,
 int ipu6_fw_psys_set_process_ext_mem(struct ipu_fw_psys_process *ptr,
 				     u16 type_id, u16 mem_id, u16 offset);
 int
-ipu6_fw_psys_get_pgm_by_process(struct ipu_fw_generic_program_manifest *gen_pm,
-				const struct ipu_fw_psys_pgm *pg_manifest,
-				struct ipu_fw_psys_process *process);
+ipu6_fw_psys_get_pgm_by_index(struct ipu_fw_generic_program_manifest *gen_pm,
+			      const struct ipu_fw_psys_pgm *pg_manifest,
+			      unsigned int program_idx);
 void ipu6_fw_psys_pg_dump(struct ipu_psys *psys,
 			  struct ipu_psys_kcmd *kcmd, const char *note);
 void ipu6_psys_hw_res_variant_init(void);
@@ -90,12 +90,12 @@ int ipu_fw_psys_set_process_ext_mem(struct ipu_fw_psys_process *ptr,
 }
 
 int
-ipu_fw_psys_get_pgm_by_process(struct ipu_fw_generic_program_manifest *gen_pm,
-			       const struct ipu_fw_psys_pgm *pg_manifest,
-			       struct ipu_fw_psys_process *process)
+ipu_fw_psys_get_pgm_by_index(struct ipu_fw_generic_program_manifest *gen_pm,
+			     const struct ipu_fw_psys_pgm *pg_manifest,
+			     unsigned int program_idx)
 {
-	if (var->get_pgm_by_proc)
-		return var->get_pgm_by_proc(gen_pm, pg_manifest, process);
+	if (var->get_pgm_by_idx)
+		return var->get_pgm_by_idx(gen_pm, pg_manifest, program_idx);
 
 	WARN(1, "ipu6 psys res var is not initialised correctly.");
 	return 0;
@@ -9,6 +9,9 @@
 
 #define IPU_PSYS_BUF_SET_POOL_SIZE 8
 #define IPU_PSYS_BUF_SET_MAX_SIZE 1024
+/* Buffer sets preallocated per PPG, i.e. frames in flight per PPG */
+#define IPU_PSYS_PPG_BUF_SET_DEPTH 8
+#define IPU_PSYS_PPG_BUF_SET_ALIGN 64
 
 struct ipu_fw_psys_buffer_set;
 
@@ -46,9 +49,12 @@ struct ipu_psys_ppg {
 	struct ipu_psys_pg *kpg;
 	struct ipu_psys_fh *fh;
 	struct list_head list;
-	struct list_head sched_list;
+	struct list_head sched_list;	/* start, stop or halt list by state */
+	struct list_head sched_kcmd_list;	/* Has kcmds in kcmds_new_list */
+	struct hlist_node hnode;	/* psys->ppg_hash, keyed by pg address */
 	u64 token;
-	void *manifest;
+	struct ipu_psys_manifest *manifest;
+	struct ipu_psys_resource_plan *res_plan;
 	struct mutex mutex;     /* Protects kcmd and ppg state field */
 	struct list_head kcmds_new_list;
 	struct list_head kcmds_processing_list;
@@ -56,10 +62,20 @@ struct ipu_psys_ppg {
 	enum ipu_psys_ppg_state state;
 	u32 pri_base;
 	int pri_dynamic;
+	ktime_t deadline;	/* Earliest one of pending kcmds, 0 if none */
+	ktime_t state_ts;	/* Set on entering SUSPEND or RESUME */
+	/* Buffer sets preallocated at PPG start, handed out round robin */
+	struct ipu_psys_buffer_set *bs_ring;
+	unsigned int bs_ring_size;
+	unsigned int bs_ring_next;	/* Protected by fh->sched.bs_mutex */
+	void *bs_ring_kaddr;
+	dma_addr_t bs_ring_dma_addr;
+	size_t bs_ring_bytes;
 };
 
 struct ipu_psys_buffer_set {
 	struct list_head list;
+	struct hlist_node hnode;	/* psys->bufset_hash, keyed by dma_addr */
 	struct ipu_fw_psys_buffer_set *buf_set;
 	size_t size;
 	size_t buf_set_size;
@@ -72,6 +88,10 @@ int ipu_psys_kcmd_start(struct ipu_psys *psys, struct ipu_psys_kcmd *kcmd);
 void ipu_psys_kcmd_complete(struct ipu_psys_ppg *kppg,
 			    struct ipu_psys_kcmd *kcmd,
 			    int error);
+void ipu_psys_hash_buf_set(struct ipu_psys *psys,
+			   struct ipu_psys_buffer_set *kbuf_set);
+void ipu_psys_unhash_buf_set(struct ipu_psys *psys,
+			     struct ipu_psys_buffer_set *kbuf_set);
 int ipu_psys_fh_init(struct ipu_psys_fh *fh);
 int ipu_psys_fh_deinit(struct ipu_psys_fh *fh);
 
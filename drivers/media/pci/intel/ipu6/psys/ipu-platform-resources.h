@@ -63,9 +63,11 @@ struct ipu_fw_psys_program_manifest {
 struct ipu_psys_resource_pool;
 struct ipu_psys_resource_alloc;
 struct ipu_fw_psys_process_group;
+struct ipu_psys_manifest;
+struct ipu_psys_resource_plan;
 int ipu_psys_allocate_resources(const struct device *dev,
 				struct ipu_fw_psys_process_group *pg,
-				void *pg_manifest,
+				struct ipu_psys_manifest *manifest,
 				struct ipu_psys_resource_alloc *alloc,
 				struct ipu_psys_resource_pool *pool);
 int ipu_psys_move_resources(const struct device *dev,
@@ -78,15 +80,28 @@ void ipu_psys_resource_copy(struct ipu_psys_resource_pool *src,
 
 int ipu_psys_try_allocate_resources(struct device *dev,
 				    struct ipu_fw_psys_process_group *pg,
-				    void *pg_manifest,
+				    struct ipu_psys_manifest *manifest,
 				    struct ipu_psys_resource_pool *pool);
 
+struct ipu_psys_resource_plan *
+ipu_psys_resource_plan_build(struct ipu_fw_psys_process_group *pg,
+			     struct ipu_psys_manifest *manifest);
+void ipu_psys_resource_plan_free(struct ipu_psys_resource_plan *plan);
+int ipu_psys_resource_plan_try(struct device *dev,
+			       struct ipu_psys_resource_plan *plan,
+			       struct ipu_fw_psys_process_group *pg,
+			       struct ipu_psys_manifest *manifest,
+			       struct ipu_psys_resource_pool *pool,
+			       struct ipu_psys_resource_pool *try_pool);
+
 void ipu_psys_reset_process_cell(const struct device *dev,
 				 struct ipu_fw_psys_process_group *pg,
-				 void *pg_manifest,
+				 struct ipu_psys_manifest *manifest,
 				 int process_count);
 void ipu_psys_free_resources(struct ipu_psys_resource_alloc *alloc,
 			     struct ipu_psys_resource_pool *pool);
+void ipu_psys_resource_release(struct ipu_psys_resource_alloc *alloc,
+			       struct ipu_psys_resource_pool *pool);
 
 int ipu_fw_psys_set_proc_dfm_bitmap(struct ipu_fw_psys_process *ptr,
 				    u16 id, u32 bitmap,
@@ -3,6 +3,7 @@
 
 #include <linux/compat.h>
 #include <linux/errno.h>
+#include <linux/slab.h>
 #include <linux/uaccess.h>
 
 #include <uapi/linux/ipu-psys.h>
@@ -43,7 +44,20 @@ struct ipu_psys_command32 {
 	u32 bufcount;
 	u32 min_psys_freq;
 	u32 frame_counter;
-	u32 reserved[2];
+	u32 deadline_us;
+	u32 flags;
+} __packed;
+
+struct ipu_psys_command_batch32 {
+	compat_uptr_t commands;
+	u32 count;
+	u32 reserved[3];
+} __packed;
+
+struct ipu_psys_event_batch32 {
+	compat_uptr_t events;
+	u32 count;
+	u32 reserved[3];
 } __packed;
 
 struct ipu_psys_manifest32 {
@@ -75,7 +89,9 @@ get_ipu_psys_command32(struct ipu_psys_command *kp,
 	    get_user(kp->pg_manifest_size, &up->pg_manifest_size) ||
 	    get_user(kp->bufcount, &up->bufcount) ||
 	    get_user(kp->min_psys_freq, &up->min_psys_freq) ||
-	    get_user(kp->frame_counter, &up->frame_counter)
+	    get_user(kp->frame_counter, &up->frame_counter) ||
+	    get_user(kp->deadline_us, &up->deadline_us) ||
+	    get_user(kp->flags, &up->flags)
 	    )
 		return -EFAULT;
 
@@ -85,6 +101,59 @@ get_ipu_psys_command32(struct ipu_psys_command *kp,
 	return 0;
 }
 
+static long ipu_psys_qcmd_batch32(struct file *file,
+				  struct ipu_psys_command_batch32 __user *up)
+{
+	struct ipu_psys_command32 __user *ucmds;
+	struct ipu_psys_command *cmds;
+	compat_uptr_t ptr;
+	u32 count, i;
+	long ret;
+
+	if (get_user(ptr, &up->commands) || get_user(count, &up->count))
+		return -EFAULT;
+
+	if (!count || count > IPU_PSYS_CMD_BATCH_MAX)
+		return -EINVAL;
+
+	cmds = kcalloc(count, sizeof(*cmds), GFP_KERNEL);
+	if (!cmds)
+		return -ENOMEM;
+
+	ucmds = compat_ptr(ptr);
+	for (i = 0; i < count; i++) {
+		ret = get_ipu_psys_command32(&cmds[i], &ucmds[i]);
+		if (ret)
+			goto out;
+	}
+
+	/*
+	 * The native ioctl would copy the array in native layout, so hand
+	 * the converted commands straight to the batch queueing instead.
+	 */
+	ret = ipu_psys_kcmd_new_batch(cmds, count, file->private_data);
+
+out:
+	kfree(cmds);
+	return ret;
+}
+
+static long ipu_psys_dqevent_batch32(struct file *file,
+				     struct ipu_psys_event_batch32 __user *up)
+{
+	struct ipu_psys_event_batch batch = { 0 };
+	compat_uptr_t ptr;
+
+	if (get_user(ptr, &up->events) || get_user(batch.count, &up->count))
+		return -EFAULT;
+
+	/* struct ipu_psys_event has the same layout for 32-bit callers */
+	batch.events = compat_ptr(ptr);
+
+	return ipu_ioctl_dqevent_batch(&batch, file->private_data,
+				       file->f_flags);
+}
+
 static int
 get_ipu_psys_buffer32(struct ipu_psys_buffer *kp,
 		      struct ipu_psys_buffer32 __user *up)
@@ -179,6 +248,8 @@ put_ipu_psys_manifest32(struct ipu_psys_manifest *kp,
 #define IPU_IOC_QCMD32 _IOWR('A', 6, struct ipu_psys_command32)
 #define IPU_IOC_CMD_CANCEL32 _IOWR('A', 8, struct ipu_psys_command32)
 #define IPU_IOC_GET_MANIFEST32 _IOWR('A', 9, struct ipu_psys_manifest32)
+#define IPU_IOC_QCMD_BATCH32 _IOW('A', 10, struct ipu_psys_command_batch32)
+#define IPU_IOC_DQEVENT_BATCH32 _IOW('A', 11, struct ipu_psys_event_batch32)
 
 long ipu_psys_compat_ioctl32(struct file *file, unsigned int cmd,
 			     unsigned long arg)
@@ -193,6 +264,11 @@ long ipu_psys_compat_ioctl32(struct file *file, unsigned int cmd,
 	int err = 0;
 	void __user *up = compat_ptr(arg);
 
+	if (cmd == IPU_IOC_QCMD_BATCH32)
+		return ipu_psys_qcmd_batch32(file, up);
+	if (cmd == IPU_IOC_DQEVENT_BATCH32)
+		return ipu_psys_dqevent_batch32(file, up);
+
 	switch (cmd) {
 	case IPU_IOC_GETBUF32:
 		cmd = IPU_IOC_GETBUF;
@@ -9,6 +9,7 @@
 #include <linux/fs.h>
 #include <linux/highmem.h>
 #include <linux/init_task.h>
+#include <linux/jhash.h>
 #include <linux/kthread.h>
 #include <linux/mm.h>
 #include <linux/module.h>
@@ -58,6 +59,15 @@ static bool async_fw_init;
 module_param(async_fw_init, bool, 0664);
 MODULE_PARM_DESC(async_fw_init, "Enable asynchronous firmware initialization");
 
+static int sched_cmd_cpu = -1;
+module_param(sched_cmd_cpu, int, 0444);
+MODULE_PARM_DESC(sched_cmd_cpu,
+		 "CPU to bind the l-scheduler thread to, -1 for any");
+
+static bool sched_cmd_fifo;
+module_param(sched_cmd_fifo, bool, 0444);
+MODULE_PARM_DESC(sched_cmd_fifo, "Run the l-scheduler thread as SCHED_FIFO");
+
 #if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 10, 0)
 #define SYSCOM_BUTTRESS_FW_PARAMS_PSYS_OFFSET	7
 
@@ -75,6 +85,10 @@ static dev_t ipu_psys_dev_t;
 static DECLARE_BITMAP(ipu_psys_devices, IPU_PSYS_NUM_DEVICES);
 static DEFINE_MUTEX(ipu_psys_mutex);
 
+struct kmem_cache *ipu_psys_kcmd_cache;
+static struct kmem_cache *ipu_psys_kbuf_cache;
+static struct kmem_cache *ipu_psys_desc_cache;
+
 static struct fw_init_task {
 	struct delayed_work work;
 	struct ipu_psys *psys;
@@ -137,13 +151,13 @@ static void ipu_desc_add(struct ipu_psys_fh *fh, struct ipu_psys_desc *desc)
 	fh->num_descs++;
 
 	WARN_ON_ONCE(fh->num_descs >= IPU_PSYS_MAX_NUM_DESCS);
-	list_add(&desc->list, &fh->descs_list);
+	hash_add(fh->descs_hash, &desc->hnode, desc->fd);
 }
 
 static void ipu_desc_del(struct ipu_psys_fh *fh, struct ipu_psys_desc *desc)
 {
 	fh->num_descs--;
-	list_del_init(&desc->list);
+	hash_del(&desc->hnode);
 }
 
 static void ipu_buffer_add(struct ipu_psys_fh *fh,
@@ -153,6 +167,7 @@ static void ipu_buffer_add(struct ipu_psys_fh *fh,
 
 	WARN_ON_ONCE(fh->num_bufs >= IPU_PSYS_MAX_NUM_BUFS);
 	list_add(&kbuf->list, &fh->bufs_list);
+	hash_add(fh->bufs_hash, &kbuf->hnode, (unsigned long)kbuf->dbuf);
 }
 
 static void ipu_buffer_del(struct ipu_psys_fh *fh,
@@ -160,6 +175,7 @@ static void ipu_buffer_del(struct ipu_psys_fh *fh,
 {
 	fh->num_bufs--;
 	list_del_init(&kbuf->list);
+	hash_del(&kbuf->hnode);
 }
 
 static void ipu_buffer_lru_add(struct ipu_psys_fh *fh,
@@ -180,12 +196,13 @@ static struct ipu_psys_kbuffer *ipu_psys_kbuffer_alloc(void)
 {
 	struct ipu_psys_kbuffer *kbuf;
 
-	kbuf = kzalloc(sizeof(*kbuf), GFP_KERNEL);
+	kbuf = kmem_cache_zalloc(ipu_psys_kbuf_cache, GFP_KERNEL);
 	if (!kbuf)
 		return NULL;
 
 	atomic_set(&kbuf->map_count, 0);
 	INIT_LIST_HEAD(&kbuf->list);
+	INIT_HLIST_NODE(&kbuf->hnode);
 	return kbuf;
 }
 
@@ -193,45 +210,41 @@ static struct ipu_psys_desc *ipu_psys_desc_alloc(int fd)
 {
 	struct ipu_psys_desc *desc;
 
-	desc = kzalloc(sizeof(*desc), GFP_KERNEL);
+	desc = kmem_cache_zalloc(ipu_psys_desc_cache, GFP_KERNEL);
 	if (!desc)
 		return NULL;
 
 	desc->fd = fd;
-	INIT_LIST_HEAD(&desc->list);
+	INIT_HLIST_NODE(&desc->hnode);
 	return desc;
 }
 
-struct ipu_psys_pg *__get_pg_buf(struct ipu_psys *psys, size_t pg_size)
+static unsigned int ipu_psys_pg_class(size_t size)
+{
+	return min_t(unsigned int, get_order(size),
+		     IPU_PSYS_PG_NR_CLASSES - 1);
+}
+
+static struct ipu_psys_pg *ipu_psys_pg_alloc(struct ipu_psys *psys,
+					     size_t size)
 {
 #if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 10, 0) && LINUX_VERSION_CODE < KERNEL_VERSION(6, 12, 5)
 	struct device *dev = &psys->adev->auxdev.dev;
 #endif
 	struct ipu_psys_pg *kpg;
-	unsigned long flags;
 
-	spin_lock_irqsave(&psys->pgs_lock, flags);
-	list_for_each_entry(kpg, &psys->pgs, list) {
-		if (!kpg->pg_size && kpg->size >= pg_size) {
-			kpg->pg_size = pg_size;
-			spin_unlock_irqrestore(&psys->pgs_lock, flags);
-			return kpg;
-		}
-	}
-	spin_unlock_irqrestore(&psys->pgs_lock, flags);
-	/* no big enough buffer available, allocate new one */
 	kpg = kzalloc(sizeof(*kpg), GFP_KERNEL);
 	if (!kpg)
 		return NULL;
 
 #if LINUX_VERSION_CODE < KERNEL_VERSION(6, 10, 0)
-	kpg->pg = dma_alloc_attrs(&psys->adev->dev, pg_size,
+	kpg->pg = dma_alloc_attrs(&psys->adev->dev, size,
 				  &kpg->pg_dma_addr, GFP_KERNEL, 0);
 #elif LINUX_VERSION_CODE < KERNEL_VERSION(6, 12, 5)
-	kpg->pg = dma_alloc_attrs(dev, pg_size,  &kpg->pg_dma_addr,
+	kpg->pg = dma_alloc_attrs(dev, size,  &kpg->pg_dma_addr,
 				  GFP_KERNEL, 0);
 #else
-	kpg->pg = ipu6_dma_alloc(psys->adev, pg_size,  &kpg->pg_dma_addr,
+	kpg->pg = ipu6_dma_alloc(psys->adev, size,  &kpg->pg_dma_addr,
 				 GFP_KERNEL, 0);
 #endif
 	if (!kpg->pg) {
@@ -239,20 +252,287 @@ struct ipu_psys_pg *__get_pg_buf(struct ipu_psys *psys, size_t pg_size)
 		return NULL;
 	}
 
+	kpg->size = size;
+
+	return kpg;
+}
+
+static void ipu_psys_pg_free(struct ipu_psys *psys, struct ipu_psys_pg *kpg)
+{
+#if LINUX_VERSION_CODE < KERNEL_VERSION(6, 10, 0)
+	dma_free_attrs(&psys->adev->dev, kpg->size, kpg->pg,
+		       kpg->pg_dma_addr, 0);
+#elif LINUX_VERSION_CODE < KERNEL_VERSION(6, 12, 5)
+	dma_free_attrs(&psys->adev->auxdev.dev, kpg->size, kpg->pg,
+		       kpg->pg_dma_addr, 0);
+#else
+	ipu6_dma_free(psys->adev, kpg->size, kpg->pg, kpg->pg_dma_addr, 0);
+#endif
+	kfree(kpg);
+}
+
+struct ipu_psys_pg *__get_pg_buf(struct ipu_psys *psys, size_t pg_size)
+{
+	unsigned int class = ipu_psys_pg_class(pg_size);
+	struct ipu_psys_pg *kpg;
+	unsigned long flags;
+	size_t size;
+
+	spin_lock_irqsave(&psys->pgs_lock, flags);
+	/* All but the last class hold buffers of one size only */
+	list_for_each_entry(kpg, &psys->pgs_free[class], list) {
+		if (kpg->size < pg_size)
+			continue;
+
+		list_move(&kpg->list, &psys->pgs);
+		psys->pgs_nr_free[class]--;
+		kpg->pg_size = pg_size;
+		psys->pg_stats.hits++;
+		psys->pg_stats.wasted += kpg->size - pg_size;
+		spin_unlock_irqrestore(&psys->pgs_lock, flags);
+		return kpg;
+	}
+	psys->pg_stats.misses++;
+	spin_unlock_irqrestore(&psys->pgs_lock, flags);
+
+	/* no buffer of this class available, allocate new one */
+	if (class < IPU_PSYS_PG_NR_CLASSES - 1)
+		size = PAGE_SIZE << class;
+	else
+		size = PAGE_ALIGN(pg_size);
+
+	kpg = ipu_psys_pg_alloc(psys, size);
+	if (!kpg)
+		return NULL;
+
 	kpg->pg_size = pg_size;
-	kpg->size = pg_size;
 	spin_lock_irqsave(&psys->pgs_lock, flags);
 	list_add(&kpg->list, &psys->pgs);
+	psys->pg_stats.wasted += kpg->size - pg_size;
 	spin_unlock_irqrestore(&psys->pgs_lock, flags);
 
 	return kpg;
 }
 
+void __put_pg_buf(struct ipu_psys *psys, struct ipu_psys_pg *kpg)
+{
+	unsigned int class = ipu_psys_pg_class(kpg->size);
+	unsigned long flags;
+
+	spin_lock_irqsave(&psys->pgs_lock, flags);
+	psys->pg_stats.wasted -= kpg->size - kpg->pg_size;
+	kpg->pg_size = 0;
+	if (psys->pgs_nr_free[class] < IPU_PSYS_PG_POOL_HWM) {
+		list_move(&kpg->list, &psys->pgs_free[class]);
+		psys->pgs_nr_free[class]++;
+		spin_unlock_irqrestore(&psys->pgs_lock, flags);
+		return;
+	}
+
+	list_del(&kpg->list);
+	psys->pg_stats.released++;
+	spin_unlock_irqrestore(&psys->pgs_lock, flags);
+
+	ipu_psys_pg_free(psys, kpg);
+}
+
+static int ipu_psys_pg_pool_init(struct ipu_psys *psys)
+{
+	unsigned int class = ipu_psys_pg_class(IPU_PSYS_PG_MAX_SIZE);
+	struct ipu_psys_pg *kpg;
+	int i;
+
+	for (i = 0; i < IPU_PSYS_PG_NR_CLASSES; i++)
+		INIT_LIST_HEAD(&psys->pgs_free[i]);
+
+	/* allocate and map memory for process groups */
+	for (i = 0; i < IPU_PSYS_PG_POOL_SIZE; i++) {
+		kpg = ipu_psys_pg_alloc(psys, PAGE_SIZE << class);
+		if (!kpg)
+			return -ENOMEM;
+		list_add(&kpg->list, &psys->pgs_free[class]);
+		psys->pgs_nr_free[class]++;
+	}
+
+	return 0;
+}
+
+/*
+ * Give back the free buffers that the pool grew beyond what probe
+ * preallocated. Called when the last user is gone.
+ */
+static void ipu_psys_pg_pool_trim(struct ipu_psys *psys)
+{
+	unsigned int keep_class = ipu_psys_pg_class(IPU_PSYS_PG_MAX_SIZE);
+	struct ipu_psys_pg *kpg, *kpg0;
+	unsigned long flags;
+	LIST_HEAD(trim);
+	int i;
+
+	spin_lock_irqsave(&psys->pgs_lock, flags);
+	for (i = 0; i < IPU_PSYS_PG_NR_CLASSES; i++) {
+		unsigned int keep = i == keep_class ? IPU_PSYS_PG_POOL_SIZE : 0;
+
+		while (psys->pgs_nr_free[i] > keep) {
+			kpg = list_last_entry(&psys->pgs_free[i],
+					      struct ipu_psys_pg, list);
+			list_move(&kpg->list, &trim);
+			psys->pgs_nr_free[i]--;
+			psys->pg_stats.released++;
+		}
+	}
+	spin_unlock_irqrestore(&psys->pgs_lock, flags);
+
+	list_for_each_entry_safe(kpg, kpg0, &trim, list)
+		ipu_psys_pg_free(psys, kpg);
+}
+
+static void ipu_psys_pg_pool_cleanup(struct ipu_psys *psys)
+{
+	struct ipu_psys_pg *kpg, *kpg0;
+	int i;
+
+	list_for_each_entry_safe(kpg, kpg0, &psys->pgs, list)
+		ipu_psys_pg_free(psys, kpg);
+
+	for (i = 0; i < IPU_PSYS_PG_NR_CLASSES; i++) {
+		list_for_each_entry_safe(kpg, kpg0, &psys->pgs_free[i], list)
+			ipu_psys_pg_free(psys, kpg);
+		psys->pgs_nr_free[i] = 0;
+	}
+}
+
+/*
+ * Take a reference on the cached manifest with the same hash and size.
+ * Contents are compared by the caller, outside of the lock.
+ */
+static struct ipu_psys_manifest *
+ipu_psys_manifest_lookup(struct ipu_psys *psys, size_t size, u32 hash)
+{
+	struct ipu_psys_manifest *manifest, *found = NULL;
+
+	spin_lock(&psys->manifest_lock);
+	hash_for_each_possible(psys->manifest_hash, manifest, hnode, hash) {
+		if (manifest->hash == hash && manifest->size == size) {
+			refcount_inc(&manifest->ref);
+			found = manifest;
+			break;
+		}
+	}
+	spin_unlock(&psys->manifest_lock);
+
+	return found;
+}
+
+static struct ipu_psys_manifest *
+ipu_psys_manifest_create(void *data, size_t size, u32 hash)
+{
+	const struct ipu_fw_psys_pgm *pgm = data;
+	struct ipu_psys_manifest *manifest;
+	unsigned int i;
+
+	if (size < sizeof(*pgm))
+		return ERR_PTR(-EINVAL);
+
+	manifest = kzalloc(struct_size(manifest, pms, pgm->program_count),
+			   GFP_KERNEL);
+	if (!manifest)
+		return ERR_PTR(-ENOMEM);
+
+	for (i = 0; i < pgm->program_count; i++) {
+		if (ipu_fw_psys_get_pgm_by_index(&manifest->pms[i], pgm, i)) {
+			kfree(manifest);
+			return ERR_PTR(-EINVAL);
+		}
+	}
+
+	refcount_set(&manifest->ref, 1);
+	manifest->hash = hash;
+	manifest->size = size;
+	manifest->data = data;
+	manifest->program_count = pgm->program_count;
+
+	return manifest;
+}
+
+/*
+ * Return the cached manifest with the same contents as the one at
+ * @umanifest, creating and decoding it if it is not known yet.
+ */
+struct ipu_psys_manifest *
+ipu_psys_manifest_get(struct ipu_psys *psys, const void __user *umanifest,
+		      size_t size)
+{
+	struct ipu_psys_manifest *manifest, *found;
+	void *data;
+	u32 hash;
+
+	data = kmalloc(size, GFP_KERNEL);
+	if (!data)
+		return ERR_PTR(-ENOMEM);
+	atomic64_inc(&psys->alloc_stats.heap);
+
+	if (copy_from_user(data, umanifest, size)) {
+		kfree(data);
+		return ERR_PTR(-EFAULT);
+	}
+
+	hash = jhash(data, size, 0);
+
+	found = ipu_psys_manifest_lookup(psys, size, hash);
+	if (found && !memcmp(found->data, data, size)) {
+		kfree(data);
+		return found;
+	}
+	/* A hash collision is a miss, the new one is added next to it */
+	ipu_psys_manifest_put(psys, found);
+
+	manifest = ipu_psys_manifest_create(data, size, hash);
+	if (IS_ERR(manifest)) {
+		kfree(data);
+		return manifest;
+	}
+	atomic64_inc(&psys->alloc_stats.heap);
+
+	/*
+	 * Somebody else may have added the same one meanwhile. Both stay
+	 * valid, the duplicate goes away with its last user.
+	 */
+	spin_lock(&psys->manifest_lock);
+	hash_add(psys->manifest_hash, &manifest->hnode, hash);
+	spin_unlock(&psys->manifest_lock);
+
+	return manifest;
+}
+
+struct ipu_psys_manifest *
+ipu_psys_manifest_ref(struct ipu_psys_manifest *manifest)
+{
+	refcount_inc(&manifest->ref);
+	return manifest;
+}
+
+void ipu_psys_manifest_put(struct ipu_psys *psys,
+			   struct ipu_psys_manifest *manifest)
+{
+	if (!manifest)
+		return;
+
+	if (!refcount_dec_and_lock(&manifest->ref, &psys->manifest_lock))
+		return;
+
+	hash_del(&manifest->hnode);
+	spin_unlock(&psys->manifest_lock);
+
+	kfree(manifest->data);
+	kfree(manifest);
+}
+
 static struct ipu_psys_desc *psys_desc_lookup(struct ipu_psys_fh *fh, int fd)
 {
 	struct ipu_psys_desc *desc;
 
-	list_for_each_entry(desc, &fh->descs_list, list) {
+	hash_for_each_possible(fh->descs_hash, desc, hnode, fd) {
 		if (desc->fd == fd)
 			return desc;
 	}
@@ -265,40 +545,34 @@ static bool dmabuf_cmp(struct dma_buf *lb, struct dma_buf *rb)
 	return lb == rb && lb->size == rb->size;
 }
 
-static struct ipu_psys_kbuffer *psys_buf_lookup(struct ipu_psys_fh *fh, int fd)
+static struct ipu_psys_kbuffer *psys_buf_lookup(struct ipu_psys_fh *fh,
+					       struct dma_buf *dma_buf)
 {
 	struct ipu_psys_kbuffer *kbuf;
-	struct dma_buf *dma_buf;
-
-	dma_buf = dma_buf_get(fd);
-	if (IS_ERR(dma_buf))
-		return NULL;
 
 	/*
 	 * First lookup so-called `active` list, that is the list of
-	 * referenced buffers
+	 * referenced buffers, through its dma_buf index
 	 */
-	list_for_each_entry(kbuf, &fh->bufs_list, list) {
-		if (dmabuf_cmp(kbuf->dbuf, dma_buf)) {
-			dma_buf_put(dma_buf);
+	hash_for_each_possible(fh->bufs_hash, kbuf, hnode,
+			       (unsigned long)dma_buf) {
+		if (dmabuf_cmp(kbuf->dbuf, dma_buf))
 			return kbuf;
-		}
 	}
 
 	/*
 	 * We didn't find anything on the `active` list, try the LRU list
-	 * (list of unreferenced buffers) and possibly resurrect a buffer
+	 * (list of unreferenced buffers, at most IPU_PSYS_MAX_NUM_BUFS_LRU
+	 * entries) and possibly resurrect a buffer
 	 */
 	list_for_each_entry(kbuf, &fh->bufs_lru, list) {
 		if (dmabuf_cmp(kbuf->dbuf, dma_buf)) {
-			dma_buf_put(dma_buf);
 			ipu_buffer_lru_del(fh, kbuf);
 			ipu_buffer_add(fh, kbuf);
 			return kbuf;
 		}
 	}
 
-	dma_buf_put(dma_buf);
 	return NULL;
 }
 
@@ -712,7 +986,7 @@ static void ipu_dma_buf_release(struct dma_buf *buf)
 	if (kbuf->db_attach)
 		ipu_psys_put_userpages(kbuf->db_attach->priv);
 
-	kfree(kbuf);
+	kmem_cache_free(ipu_psys_kbuf_cache, kbuf);
 }
 
 static int ipu_dma_buf_begin_cpu_access(struct dma_buf *dma_buf,
@@ -900,8 +1174,12 @@ static int ipu_psys_open(struct inode *inode, struct file *file)
 
 	mutex_init(&fh->mutex);
 	INIT_LIST_HEAD(&fh->bufs_list);
-	INIT_LIST_HEAD(&fh->descs_list);
+	hash_init(fh->descs_hash);
 	INIT_LIST_HEAD(&fh->bufs_lru);
+	hash_init(fh->bufs_hash);
+	INIT_LIST_HEAD(&fh->kcmds_done);
+	INIT_LIST_HEAD(&fh->kcmds_reap);
+	spin_lock_init(&fh->done_lock);
 	init_waitqueue_head(&fh->wait);
 
 	rval = ipu_psys_fh_init(fh);
@@ -955,6 +1233,14 @@ static inline void ipu_psys_kbuf_unmap(struct ipu_psys_fh *fh,
 	if (kbuf->kaddr)
 		dma_buf_vunmap(kbuf->dbuf, kbuf->kaddr);
 #endif
+#if LINUX_VERSION_CODE < KERNEL_VERSION(6, 10, 0)
+	if (kbuf->cmap) {
+		ipu_dmabuf_cache_put(kbuf->cmap);
+		kbuf->cmap = NULL;
+		kbuf->sgt = NULL;
+		kbuf->db_attach = NULL;
+	}
+#endif
 #if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 1, 255) && LINUX_VERSION_CODE < KERNEL_VERSION(6, 12, 5)
 	if (!IS_ERR_OR_NULL(kbuf->sgt))
 		dma_buf_unmap_attachment_unlocked(kbuf->db_attach,
@@ -995,7 +1281,7 @@ static void __ipu_psys_unmapbuf(struct ipu_psys_fh *fh,
 #endif
 	ipu_buffer_del(fh, kbuf);
 	if (!kbuf->userptr)
-		kfree(kbuf);
+		kmem_cache_free(ipu_psys_kbuf_cache, kbuf);
 }
 
 static int ipu_psys_unmapbuf_locked(int fd, struct ipu_psys_fh *fh)
@@ -1020,7 +1306,7 @@ static int ipu_psys_unmapbuf_locked(int fd, struct ipu_psys_fh *fh)
 	kbuf = desc->kbuf;
 	/* descriptor is gone now */
 	ipu_desc_del(fh, desc);
-	kfree(desc);
+	kmem_cache_free(ipu_psys_desc_cache, desc);
 
 	if (WARN_ON_ONCE(!kbuf || !kbuf->dbuf)) {
 #if LINUX_VERSION_CODE < KERNEL_VERSION(6, 10, 0)
@@ -1045,17 +1331,15 @@ static int ipu_psys_release(struct inode *inode, struct file *file)
 {
 	struct ipu_psys *psys = inode_to_ipu_psys(inode);
 	struct ipu_psys_fh *fh = file->private_data;
+	struct ipu_psys_desc *desc;
+	struct hlist_node *tmp;
+	bool last;
+	int bkt;
 
 	mutex_lock(&fh->mutex);
-	while (!list_empty(&fh->descs_list)) {
-		struct ipu_psys_desc *desc;
-
-		desc = list_first_entry(&fh->descs_list,
-					struct ipu_psys_desc,
-					list);
-
+	hash_for_each_safe(fh->descs_hash, bkt, tmp, desc, hnode) {
 		ipu_desc_del(fh, desc);
-		kfree(desc);
+		kmem_cache_free(ipu_psys_desc_cache, desc);
 	}
 
 	while (!list_empty(&fh->bufs_lru)) {
@@ -1090,7 +1374,7 @@ static int ipu_psys_release(struct inode *inode, struct file *file)
 		} else {
 			if (db_attach)
 				ipu_psys_put_userpages(db_attach->priv);
-			kfree(kbuf);
+			kmem_cache_free(ipu_psys_kbuf_cache, kbuf);
 		}
 	}
 	mutex_unlock(&fh->mutex);
@@ -1102,10 +1386,20 @@ static int ipu_psys_release(struct inode *inode, struct file *file)
 	ipu_psys_fh_deinit(fh);
 
 	mutex_lock(&psys->mutex);
-	if (list_empty(&psys->fhs))
+	last = list_empty(&psys->fhs);
+	if (last)
 		psys->power_gating = 0;
 	mutex_unlock(&psys->mutex);
+#if LINUX_VERSION_CODE < KERNEL_VERSION(6, 10, 0)
+	/* No user left to bring the cached buffers back */
+	if (last)
+		ipu_dmabuf_cache_flush(&psys->adev->isp->dmabuf_cache,
+				       &psys->adev->dev);
+#endif
+	if (last)
+		ipu_psys_pg_pool_trim(psys);
 	mutex_destroy(&fh->mutex);
+	vfree(fh->ring);
 	kfree(fh);
 
 	return 0;
@@ -1147,7 +1441,7 @@ static int ipu_psys_getbuf(struct ipu_psys_buffer *buf, struct ipu_psys_fh *fh)
 
 	dbuf = dma_buf_export(&exp_info);
 	if (IS_ERR(dbuf)) {
-		kfree(kbuf);
+		kmem_cache_free(ipu_psys_kbuf_cache, kbuf);
 		return PTR_ERR(dbuf);
 	}
 
@@ -1238,11 +1532,13 @@ struct ipu_psys_kbuffer *ipu_psys_mapbuf_locked(int fd, struct ipu_psys_fh *fh)
 		ipu_desc_add(fh, desc);
 	}
 
-	kbuf = psys_buf_lookup(fh, fd);
+	kbuf = psys_buf_lookup(fh, dbuf);
 	if (!kbuf) {
 		kbuf = ipu_psys_kbuffer_alloc();
 		if (!kbuf)
 			goto buf_alloc_fail;
+		/* bufs_hash is keyed by dbuf, so set it before adding */
+		kbuf->dbuf = dbuf;
 		ipu_buffer_add(fh, kbuf);
 	}
 
@@ -1279,6 +1575,22 @@ struct ipu_psys_kbuffer *ipu_psys_mapbuf_locked(int fd, struct ipu_psys_fh *fh)
 		kbuf->len = kbuf->dbuf->size;
 
 #if LINUX_VERSION_CODE < KERNEL_VERSION(6, 10, 0)
+	if (!kbuf->userptr) {
+		/* Imported buffer, reuse the device-wide mapping if cached */
+		struct ipu_dmabuf_cache *cache = &psys->adev->isp->dmabuf_cache;
+
+		kbuf->cmap = ipu_dmabuf_cache_get(cache, &psys->adev->dev,
+						  kbuf->dbuf);
+		if (IS_ERR(kbuf->cmap)) {
+			kbuf->cmap = NULL;
+			dev_dbg(&psys->adev->dev, "dma buf cache map failed\n");
+			goto kbuf_map_fail;
+		}
+		kbuf->db_attach = kbuf->cmap->attach;
+		kbuf->sgt = kbuf->cmap->sgt;
+		goto kbuf_mapped;
+	}
+
 	kbuf->db_attach = dma_buf_attach(kbuf->dbuf, &psys->adev->dev);
 	if (IS_ERR(kbuf->db_attach)) {
 		dev_dbg(&psys->adev->dev, "dma buf attach failed\n");
@@ -1325,6 +1637,9 @@ struct ipu_psys_kbuffer *ipu_psys_mapbuf_locked(int fd, struct ipu_psys_fh *fh)
 	}
 #endif
 
+#if LINUX_VERSION_CODE < KERNEL_VERSION(6, 10, 0)
+kbuf_mapped:
+#endif
 	kbuf->dma_addr = sg_dma_address(kbuf->sgt->sgl);
 
 #if LINUX_VERSION_CODE >= KERNEL_VERSION(5, 10, 0) && LINUX_VERSION_CODE != KERNEL_VERSION(5, 10, 46)
@@ -1387,11 +1702,11 @@ attach_fail:
 #endif
 	dbuf = ERR_PTR(-EINVAL);
 	if (!kbuf->userptr)
-		kfree(kbuf);
+		kmem_cache_free(ipu_psys_kbuf_cache, kbuf);
 
 buf_alloc_fail:
 	ipu_desc_del(fh, desc);
-	kfree(desc);
+	kmem_cache_free(ipu_psys_desc_cache, desc);
 
 desc_alloc_fail:
 	if (!IS_ERR(dbuf))
@@ -1446,7 +1761,8 @@ static unsigned int ipu_psys_poll(struct file *file,
 
 	poll_wait(file, &fh->wait, wait);
 
-	if (ipu_get_completed_kcmd(fh))
+	ipu_psys_reap_kcmds(fh);
+	if (ipu_psys_events_pending(fh))
 		res = POLLIN;
 
 	dev_dbg(&psys->adev->dev, "ipu psys poll res %u\n", res);
@@ -1466,7 +1782,8 @@ static __poll_t ipu_psys_poll(struct file *file,
 
 	poll_wait(file, &fh->wait, wait);
 
-	if (ipu_get_completed_kcmd(fh))
+	ipu_psys_reap_kcmds(fh);
+	if (ipu_psys_events_pending(fh))
 		ret = POLLIN;
 
 	dev_dbg(dev, "ipu psys poll ret %u\n", ret);
@@ -1475,6 +1792,49 @@ static __poll_t ipu_psys_poll(struct file *file,
 }
 #endif
 
+static int ipu_psys_mmap(struct file *file, struct vm_area_struct *vma)
+{
+	struct ipu_psys_fh *fh = file->private_data;
+	struct ipu_psys_event_ring *ring;
+	size_t size = PAGE_ALIGN(sizeof(*ring));
+	int ret;
+
+	if (vma->vm_pgoff || vma->vm_end - vma->vm_start != size)
+		return -EINVAL;
+
+	mutex_lock(&fh->mutex);
+	ring = fh->ring;
+	if (!ring) {
+		ring = vmalloc_user(size);
+		if (!ring) {
+			mutex_unlock(&fh->mutex);
+			return -ENOMEM;
+		}
+		ring->entries = IPU_PSYS_EVENT_RING_ENTRIES;
+	}
+
+	ret = remap_vmalloc_range(vma, ring, 0);
+	if (ret) {
+		if (!fh->ring)
+			vfree(ring);
+		mutex_unlock(&fh->mutex);
+		return ret;
+	}
+
+	if (!fh->ring) {
+		/* From now on completion events go to the ring */
+		spin_lock(&fh->done_lock);
+		fh->ring = ring;
+		spin_unlock(&fh->done_lock);
+	}
+	mutex_unlock(&fh->mutex);
+
+	/* Publish whatever completed before the ring existed */
+	ipu_psys_reap_kcmds(fh);
+
+	return 0;
+}
+
 static long ipu_get_manifest(struct ipu_psys_manifest *manifest,
 			     struct ipu_psys_fh *fh)
 {
@@ -1549,13 +1909,40 @@ static long ipu_get_manifest(struct ipu_psys_manifest *manifest,
 	return 0;
 }
 
+static long ipu_psys_qcmd_batch(struct ipu_psys_command_batch *batch,
+				struct ipu_psys_fh *fh)
+{
+	struct ipu_psys_command *cmds;
+	long ret;
+
+	if (!batch->count || batch->count > IPU_PSYS_CMD_BATCH_MAX)
+		return -EINVAL;
+
+	cmds = kcalloc(batch->count, sizeof(*cmds), GFP_KERNEL);
+	if (!cmds)
+		return -ENOMEM;
+
+	if (copy_from_user(cmds, batch->commands,
+			   batch->count * sizeof(*cmds))) {
+		kfree(cmds);
+		return -EFAULT;
+	}
+
+	ret = ipu_psys_kcmd_new_batch(cmds, batch->count, fh);
+	kfree(cmds);
+
+	return ret;
+}
+
 static long ipu_psys_ioctl(struct file *file, unsigned int cmd,
 			   unsigned long arg)
 {
 	union {
 		struct ipu_psys_buffer buf;
 		struct ipu_psys_command cmd;
+		struct ipu_psys_command_batch batch;
 		struct ipu_psys_event ev;
+		struct ipu_psys_event_batch ev_batch;
 		struct ipu_psys_capability caps;
 		struct ipu_psys_manifest m;
 	} karg;
@@ -1564,6 +1951,8 @@ static long ipu_psys_ioctl(struct file *file, unsigned int cmd,
 	void __user *up = (void __user *)arg;
 	bool copy = (cmd != IPU_IOC_MAPBUF && cmd != IPU_IOC_UNMAPBUF);
 
+	ipu_psys_reap_kcmds(fh);
+
 	if (copy) {
 		if (_IOC_SIZE(cmd) > sizeof(karg))
 			return -ENOTTY;
@@ -1594,9 +1983,16 @@ static long ipu_psys_ioctl(struct file *file, unsigned int cmd,
 	case IPU_IOC_QCMD:
 		err = ipu_psys_kcmd_new(&karg.cmd, fh);
 		break;
+	case IPU_IOC_QCMD_BATCH:
+		/* Number of queued commands, nothing to copy back */
+		return ipu_psys_qcmd_batch(&karg.batch, fh);
 	case IPU_IOC_DQEVENT:
 		err = ipu_ioctl_dqevent(&karg.ev, fh, file->f_flags);
 		break;
+	case IPU_IOC_DQEVENT_BATCH:
+		/* Number of dequeued events, nothing to copy back */
+		return ipu_ioctl_dqevent_batch(&karg.ev_batch, fh,
+					       file->f_flags);
 	case IPU_IOC_GET_MANIFEST:
 		err = ipu_get_manifest(&karg.m, fh);
 		break;
@@ -1620,6 +2016,7 @@ static const struct file_operations ipu_psys_fops = {
 	.release = ipu_psys_release,
 	.unlocked_ioctl = ipu_psys_ioctl,
 	.poll = ipu_psys_poll,
+	.mmap = ipu_psys_mmap,
 	.owner = THIS_MODULE,
 };
 
@@ -1901,6 +2298,213 @@ DEFINE_SIMPLE_ATTRIBUTE(psys_icache_prefetch_isp_fops,
 			ipu_psys_icache_prefetch_isp_get,
 			ipu_psys_icache_prefetch_isp_set, "%llu\n");
 
+static ssize_t ipu_psys_pg_pool_read(struct file *file, char __user *buf,
+				     size_t len, loff_t *ppos)
+{
+	struct ipu_psys *psys = file->private_data;
+	struct ipu_psys_pg_pool_stats stats;
+	unsigned int nr_free[IPU_PSYS_PG_NR_CLASSES];
+	unsigned long flags;
+	char tmp[256];
+	int i, pos;
+
+	spin_lock_irqsave(&psys->pgs_lock, flags);
+	stats = psys->pg_stats;
+	memcpy(nr_free, psys->pgs_nr_free, sizeof(nr_free));
+	spin_unlock_irqrestore(&psys->pgs_lock, flags);
+
+	pos = scnprintf(tmp, sizeof(tmp),
+			"hits: %llu\nmisses: %llu\nreleased: %llu\n"
+			"bytes_wasted: %zu\nfree:",
+			stats.hits, stats.misses, stats.released,
+			stats.wasted);
+	for (i = 0; i < IPU_PSYS_PG_NR_CLASSES; i++)
+		pos += scnprintf(tmp + pos, sizeof(tmp) - pos, " %u",
+				 nr_free[i]);
+	pos += scnprintf(tmp + pos, sizeof(tmp) - pos, "\n");
+
+	return simple_read_from_buffer(buf, len, ppos, tmp, pos);
+}
+
+static const struct file_operations psys_pg_pool_fops = {
+	.open = simple_open,
+	.read = ipu_psys_pg_pool_read,
+	.llseek = default_llseek,
+};
+
+static ssize_t ipu_psys_bufset_pool_read(struct file *file, char __user *buf,
+					 size_t len, loff_t *ppos)
+{
+	struct ipu_psys *psys = file->private_data;
+	u64 hits = atomic64_read(&psys->bs_ring_hits);
+	u64 misses = atomic64_read(&psys->bs_ring_misses);
+	u64 reuse = hits + misses ? div64_u64(hits * 100, hits + misses) : 0;
+	char tmp[96];
+	int pos;
+
+	pos = scnprintf(tmp, sizeof(tmp),
+			"ring_hits: %llu\nring_misses: %llu\nreuse: %llu%%\n",
+			hits, misses, reuse);
+
+	return simple_read_from_buffer(buf, len, ppos, tmp, pos);
+}
+
+static const struct file_operations psys_bufset_pool_fops = {
+	.open = simple_open,
+	.read = ipu_psys_bufset_pool_read,
+	.llseek = default_llseek,
+};
+
+static ssize_t ipu_psys_alloc_stats_read(struct file *file,
+					 char __user *buf, size_t len,
+					 loff_t *ppos)
+{
+	struct ipu_psys *psys = file->private_data;
+	u64 cmds = atomic64_read(&psys->alloc_stats.cmds);
+	u64 heap = atomic64_read(&psys->alloc_stats.heap);
+	u64 cache = atomic64_read(&psys->alloc_stats.cache);
+	u64 per_cmd = cmds ? div64_u64((heap + cache) * 100, cmds) : 0;
+	char tmp[128];
+	int pos;
+
+	pos = scnprintf(tmp, sizeof(tmp),
+			"cmds: %llu\nheap_allocs: %llu\ncache_allocs: %llu\n"
+			"allocs_per_cmd: %llu.%02llu\n",
+			cmds, heap, cache, div_u64(per_cmd, 100),
+			per_cmd % 100);
+
+	return simple_read_from_buffer(buf, len, ppos, tmp, pos);
+}
+
+static const struct file_operations psys_alloc_stats_fops = {
+	.open = simple_open,
+	.read = ipu_psys_alloc_stats_read,
+	.llseek = default_llseek,
+};
+
+static int ipu_psys_lat_hist_print(char *buf, size_t size, const char *name,
+				   atomic_t *hist)
+{
+	int i, pos;
+
+	pos = scnprintf(buf, size, "%s:", name);
+	for (i = 0; i < IPU_PSYS_LAT_HIST_BUCKETS; i++)
+		pos += scnprintf(buf + pos, size - pos, " %d",
+				 atomic_read(&hist[i]));
+	pos += scnprintf(buf + pos, size - pos, "\n");
+
+	return pos;
+}
+
+static ssize_t ipu_psys_preempt_stats_read(struct file *file,
+					   char __user *buf, size_t len,
+					   loff_t *ppos)
+{
+	struct ipu_psys *psys = file->private_data;
+	struct ipu_psys_preempt_stats *stats = &psys->preempt_stats;
+	char tmp[512];
+	int pos;
+
+	pos = scnprintf(tmp, sizeof(tmp),
+			"plans: %llu\nmisses: %llu\nsuspended: %llu\n"
+			"# latency buckets: [2^(n-1), 2^n) us\n",
+			atomic64_read(&stats->plans),
+			atomic64_read(&stats->misses),
+			atomic64_read(&stats->suspended));
+	pos += ipu_psys_lat_hist_print(tmp + pos, sizeof(tmp) - pos,
+				       "suspend_us", stats->suspend_lat);
+	pos += ipu_psys_lat_hist_print(tmp + pos, sizeof(tmp) - pos,
+				       "resume_us", stats->resume_lat);
+
+	return simple_read_from_buffer(buf, len, ppos, tmp, pos);
+}
+
+static const struct file_operations psys_preempt_stats_fops = {
+	.open = simple_open,
+	.read = ipu_psys_preempt_stats_read,
+	.llseek = default_llseek,
+};
+
+/*
+ * Latency percentile from a histogram, as the upper bound of the bucket
+ * it falls into. U64_MAX if it is in the last, unbounded bucket.
+ */
+static u64 ipu_psys_lat_hist_pct(atomic_t *hist, unsigned int pct)
+{
+	u64 total = 0, sum = 0, rank;
+	int i;
+
+	for (i = 0; i < IPU_PSYS_LAT_HIST_BUCKETS; i++)
+		total += atomic_read(&hist[i]);
+	if (!total)
+		return 0;
+
+	rank = DIV_ROUND_UP_ULL(total * pct, 100);
+	for (i = 0; i < IPU_PSYS_LAT_HIST_BUCKETS - 1; i++) {
+		sum += atomic_read(&hist[i]);
+		if (sum >= rank)
+			return 1ULL << i;
+	}
+
+	return U64_MAX;
+}
+
+static int ipu_psys_lat_pct_print(char *buf, size_t size, const char *name,
+				  atomic_t *hist)
+{
+	static const unsigned int pcts[] = { 50, 90, 99 };
+	int i, pos;
+
+	pos = scnprintf(buf, size, "%s:", name);
+	for (i = 0; i < ARRAY_SIZE(pcts); i++) {
+		u64 us = ipu_psys_lat_hist_pct(hist, pcts[i]);
+
+		if (us == U64_MAX)
+			pos += scnprintf(buf + pos, size - pos, " p%u=inf",
+					 pcts[i]);
+		else
+			pos += scnprintf(buf + pos, size - pos, " p%u<%llu",
+					 pcts[i], us);
+	}
+	pos += scnprintf(buf + pos, size - pos, "\n");
+
+	return pos;
+}
+
+static ssize_t ipu_psys_cmd_stats_read(struct file *file, char __user *buf,
+				       size_t len, loff_t *ppos)
+{
+	struct ipu_psys *psys = file->private_data;
+	struct ipu_psys_cmd_stats *stats = &psys->cmd_stats;
+	char tmp[1536];
+	int pos;
+
+	pos = scnprintf(tmp, sizeof(tmp),
+			"timeouts: %llu\n"
+			"# latency buckets: [2^(n-1), 2^n) us\n",
+			atomic64_read(&stats->timeouts));
+	pos += ipu_psys_lat_hist_print(tmp + pos, sizeof(tmp) - pos,
+				       "queue_us", stats->queue_lat);
+	pos += ipu_psys_lat_hist_print(tmp + pos, sizeof(tmp) - pos,
+				       "fw_us", stats->fw_lat);
+	pos += ipu_psys_lat_hist_print(tmp + pos, sizeof(tmp) - pos,
+				       "total_us", stats->total_lat);
+	pos += ipu_psys_lat_pct_print(tmp + pos, sizeof(tmp) - pos,
+				      "queue_us", stats->queue_lat);
+	pos += ipu_psys_lat_pct_print(tmp + pos, sizeof(tmp) - pos,
+				      "fw_us", stats->fw_lat);
+	pos += ipu_psys_lat_pct_print(tmp + pos, sizeof(tmp) - pos,
+				      "total_us", stats->total_lat);
+
+	return simple_read_from_buffer(buf, len, ppos, tmp, pos);
+}
+
+static const struct file_operations psys_cmd_stats_fops = {
+	.open = simple_open,
+	.read = ipu_psys_cmd_stats_read,
+	.llseek = default_llseek,
+};
+
 static int ipu_psys_init_debugfs(struct ipu_psys *psys)
 {
 	struct dentry *file;
@@ -1920,6 +2524,31 @@ static int ipu_psys_init_debugfs(struct ipu_psys *psys)
 	if (IS_ERR(file))
 		goto err;
 
+	file = debugfs_create_file("pg_pool", 0400,
+				   dir, psys, &psys_pg_pool_fops);
+	if (IS_ERR(file))
+		goto err;
+
+	file = debugfs_create_file("bufset_pool", 0400,
+				   dir, psys, &psys_bufset_pool_fops);
+	if (IS_ERR(file))
+		goto err;
+
+	file = debugfs_create_file("alloc_stats", 0400,
+				   dir, psys, &psys_alloc_stats_fops);
+	if (IS_ERR(file))
+		goto err;
+
+	file = debugfs_create_file("preempt_stats", 0400,
+				   dir, psys, &psys_preempt_stats_fops);
+	if (IS_ERR(file))
+		goto err;
+
+	file = debugfs_create_file("cmd_stats", 0400,
+				   dir, psys, &psys_cmd_stats_fops);
+	if (IS_ERR(file))
+		goto err;
+
 	psys->debugfsdir = dir;
 
 	return 0;
@@ -1930,25 +2559,31 @@ err:
 #endif
 #endif
 
+static bool ipu_psys_sched_cmd_pending(struct ipu_psys *psys)
+{
+	return atomic_read(&psys->wakeup_count) ||
+		!llist_empty(&psys->sched_submit);
+}
+
 static int ipu_psys_sched_cmd(void *ptr)
 {
 	struct ipu_psys *psys = ptr;
-	size_t pending = 0;
 
 	while (1) {
 		wait_event_interruptible(psys->sched_cmd_wq,
 					 (kthread_should_stop() ||
-					  (pending =
-					   atomic_read(&psys->wakeup_count))));
+					  ipu_psys_sched_cmd_pending(psys)));
 
 		if (kthread_should_stop())
 			break;
 
-		if (pending == 0)
+		if (!ipu_psys_sched_cmd_pending(psys))
 			continue;
 
+		/* Everything submitted so far is handled in a single pass */
 		mutex_lock(&psys->mutex);
 		atomic_set(&psys->wakeup_count, 0);
+		ipu_psys_kcmd_drain(psys);
 		ipu_psys_run_next(psys);
 		mutex_unlock(&psys->mutex);
 	}
@@ -1956,6 +2591,34 @@ static int ipu_psys_sched_cmd(void *ptr)
 	return 0;
 }
 
+static struct task_struct *ipu_psys_sched_cmd_create(struct ipu_psys *psys)
+{
+#if LINUX_VERSION_CODE < KERNEL_VERSION(5, 9, 0)
+	struct sched_param param = {
+		.sched_priority = MAX_RT_PRIO / 2,
+	};
+#endif
+	struct task_struct *thread;
+
+	thread = kthread_create(ipu_psys_sched_cmd, psys, "psys_sched_cmd");
+	if (IS_ERR(thread))
+		return thread;
+
+	if (sched_cmd_cpu >= 0 && sched_cmd_cpu < nr_cpu_ids &&
+	    cpu_online(sched_cmd_cpu))
+		kthread_bind(thread, sched_cmd_cpu);
+	if (sched_cmd_fifo)
+#if LINUX_VERSION_CODE < KERNEL_VERSION(5, 9, 0)
+		sched_setscheduler_nocheck(thread, SCHED_FIFO, &param);
+#else
+		sched_set_fifo(thread);
+#endif
+
+	wake_up_process(thread);
+
+	return thread;
+}
+
 #if LINUX_VERSION_CODE < KERNEL_VERSION(6, 10, 0)
 static void start_sp(struct ipu_bus_device *adev)
 {
@@ -2166,10 +2829,9 @@ static void run_fw_init_work(struct work_struct *work)
 static int ipu_psys_probe(struct ipu_bus_device *adev)
 {
 	struct ipu_device *isp = adev->isp;
-	struct ipu_psys_pg *kpg, *kpg0;
 	struct ipu_psys *psys;
 	unsigned int minor;
-	int i, rval = -E2BIG;
+	int rval = -E2BIG;
 
 	/* firmware is not ready, so defer the probe */
 	if (!isp->pkg_dir)
@@ -2204,6 +2866,11 @@ static int ipu_psys_probe(struct ipu_bus_device *adev)
 
 	spin_lock_init(&psys->ready_lock);
 	spin_lock_init(&psys->pgs_lock);
+	spin_lock_init(&psys->addr_lock);
+	hash_init(psys->bufset_hash);
+	hash_init(psys->ppg_hash);
+	spin_lock_init(&psys->manifest_lock);
+	hash_init(psys->manifest_hash);
 	psys->ready = 0;
 	psys->timeout = IPU_PSYS_CMD_TIMEOUT_MS;
 
@@ -2211,6 +2878,7 @@ static int ipu_psys_probe(struct ipu_bus_device *adev)
 	INIT_LIST_HEAD(&psys->fhs);
 	INIT_LIST_HEAD(&psys->pgs);
 	INIT_LIST_HEAD(&psys->started_kcmds_list);
+	ipu_psys_scheduler_init(psys);
 
 	init_waitqueue_head(&psys->sched_cmd_wq);
 	atomic_set(&psys->wakeup_count, 0);
@@ -2219,11 +2887,11 @@ static int ipu_psys_probe(struct ipu_bus_device *adev)
 	 * The thread reduces the coupling between the command scheduler
 	 * and queueing commands from the user to driver.
 	 */
-	psys->sched_cmd_thread = kthread_run(ipu_psys_sched_cmd, psys,
-					     "psys_sched_cmd");
+	psys->sched_cmd_thread = ipu_psys_sched_cmd_create(psys);
 
 	if (IS_ERR(psys->sched_cmd_thread)) {
 		psys->sched_cmd_thread = NULL;
+		ipu_psys_scheduler_cleanup(psys);
 		mutex_destroy(&psys->mutex);
 		goto out_unlock;
 	}
@@ -2237,28 +2905,32 @@ static int ipu_psys_probe(struct ipu_bus_device *adev)
 		goto out_mutex_destroy;
 	}
 
+	rval = ipu_psys_res_pool_init(&psys->res_pool_try);
+	if (rval < 0) {
+		dev_err(&psys->dev,
+			"unable to alloc process group resources\n");
+		ipu_psys_res_pool_cleanup(&psys->res_pool_running);
+		goto out_mutex_destroy;
+	}
+
+	rval = ipu_psys_res_pool_init(&psys->res_pool_preempt);
+	if (rval < 0) {
+		dev_err(&psys->dev,
+			"unable to alloc process group resources\n");
+		ipu_psys_res_pool_cleanup(&psys->res_pool_try);
+		ipu_psys_res_pool_cleanup(&psys->res_pool_running);
+		goto out_mutex_destroy;
+	}
+
 	ipu6_psys_hw_res_variant_init();
 	psys->pkg_dir = isp->pkg_dir;
 	psys->pkg_dir_dma_addr = isp->pkg_dir_dma_addr;
 	psys->pkg_dir_size = isp->pkg_dir_size;
 	psys->fw_sgt = isp->fw_sgt;
 
-	/* allocate and map memory for process groups */
-	for (i = 0; i < IPU_PSYS_PG_POOL_SIZE; i++) {
-		kpg = kzalloc(sizeof(*kpg), GFP_KERNEL);
-		if (!kpg)
-			goto out_free_pgs;
-		kpg->pg = dma_alloc_attrs(&adev->dev,
-					  IPU_PSYS_PG_MAX_SIZE,
-					  &kpg->pg_dma_addr,
-					  GFP_KERNEL, 0);
-		if (!kpg->pg) {
-			kfree(kpg);
-			goto out_free_pgs;
-		}
-		kpg->size = IPU_PSYS_PG_MAX_SIZE;
-		list_add(&kpg->list, &psys->pgs);
-	}
+	rval = ipu_psys_pg_pool_init(psys);
+	if (rval)
+		goto out_free_pgs;
 
 	psys->caps.pg_count = ipu_cpd_pkg_dir_get_num_entries(psys->pkg_dir);
 
@@ -2317,14 +2989,13 @@ static int ipu_psys_probe(struct ipu_bus_device *adev)
 out_release_fw_com:
 	ipu_fw_com_release(psys->fwcom, 1);
 out_free_pgs:
-	list_for_each_entry_safe(kpg, kpg0, &psys->pgs, list) {
-		dma_free_attrs(&adev->dev, kpg->size, kpg->pg,
-			       kpg->pg_dma_addr, 0);
-		kfree(kpg);
-	}
+	ipu_psys_pg_pool_cleanup(psys);
 
+	ipu_psys_res_pool_cleanup(&psys->res_pool_preempt);
+	ipu_psys_res_pool_cleanup(&psys->res_pool_try);
 	ipu_psys_res_pool_cleanup(&psys->res_pool_running);
 out_mutex_destroy:
+	ipu_psys_scheduler_cleanup(psys);
 	mutex_destroy(&psys->mutex);
 	if (psys->sched_cmd_thread) {
 		kthread_stop(psys->sched_cmd_thread);
@@ -2345,10 +3016,9 @@ static int ipu6_psys_probe(struct auxiliary_device *auxdev,
 {
 	struct ipu6_bus_device *adev = auxdev_to_adev(auxdev);
 	struct device *dev = &auxdev->dev;
-	struct ipu_psys_pg *kpg, *kpg0;
 	struct ipu_psys *psys;
 	unsigned int minor;
-	int i, rval = -E2BIG;
+	int rval = -E2BIG;
 
 	if (!adev->isp->bus_ready_to_probe)
 		return -EPROBE_DEFER;
@@ -2388,6 +3058,11 @@ static int ipu6_psys_probe(struct auxiliary_device *auxdev,
 
 	spin_lock_init(&psys->ready_lock);
 	spin_lock_init(&psys->pgs_lock);
+	spin_lock_init(&psys->addr_lock);
+	hash_init(psys->bufset_hash);
+	hash_init(psys->ppg_hash);
+	spin_lock_init(&psys->manifest_lock);
+	hash_init(psys->manifest_hash);
 	psys->ready = 0;
 	psys->timeout = IPU_PSYS_CMD_TIMEOUT_MS;
 
@@ -2395,6 +3070,7 @@ static int ipu6_psys_probe(struct auxiliary_device *auxdev,
 	INIT_LIST_HEAD(&psys->fhs);
 	INIT_LIST_HEAD(&psys->pgs);
 	INIT_LIST_HEAD(&psys->started_kcmds_list);
+	ipu_psys_scheduler_init(psys);
 
 	init_waitqueue_head(&psys->sched_cmd_wq);
 	atomic_set(&psys->wakeup_count, 0);
@@ -2403,11 +3079,11 @@ static int ipu6_psys_probe(struct auxiliary_device *auxdev,
 	 * The thread reduces the coupling between the command scheduler
 	 * and queueing commands from the user to driver.
 	 */
-	psys->sched_cmd_thread = kthread_run(ipu_psys_sched_cmd, psys,
-					     "psys_sched_cmd");
+	psys->sched_cmd_thread = ipu_psys_sched_cmd_create(psys);
 
 	if (IS_ERR(psys->sched_cmd_thread)) {
 		psys->sched_cmd_thread = NULL;
+		ipu_psys_scheduler_cleanup(psys);
 		mutex_destroy(&psys->mutex);
 		goto out_unlock;
 	}
@@ -2421,30 +3097,29 @@ static int ipu6_psys_probe(struct auxiliary_device *auxdev,
 		goto out_mutex_destroy;
 	}
 
-	ipu6_psys_hw_res_variant_init();
+	rval = ipu_psys_res_pool_init(&psys->res_pool_try);
+	if (rval < 0) {
+		dev_err(&psys->dev,
+			"unable to alloc process group resources\n");
+		ipu_psys_res_pool_cleanup(&psys->res_pool_running);
+		goto out_mutex_destroy;
+	}
 
-	/* allocate and map memory for process groups */
-	for (i = 0; i < IPU_PSYS_PG_POOL_SIZE; i++) {
-		kpg = kzalloc(sizeof(*kpg), GFP_KERNEL);
-		if (!kpg)
-			goto out_free_pgs;
-#if LINUX_VERSION_CODE < KERNEL_VERSION(6, 12, 5)
-		kpg->pg = dma_alloc_attrs(dev, IPU_PSYS_PG_MAX_SIZE,
-					  &kpg->pg_dma_addr,
-					  GFP_KERNEL, 0);
-#else
-		kpg->pg = ipu6_dma_alloc(adev, IPU_PSYS_PG_MAX_SIZE,
-					 &kpg->pg_dma_addr,
-					 GFP_KERNEL, 0);
-#endif
-		if (!kpg->pg) {
-			kfree(kpg);
-			goto out_free_pgs;
-		}
-		kpg->size = IPU_PSYS_PG_MAX_SIZE;
-		list_add(&kpg->list, &psys->pgs);
+	rval = ipu_psys_res_pool_init(&psys->res_pool_preempt);
+	if (rval < 0) {
+		dev_err(&psys->dev,
+			"unable to alloc process group resources\n");
+		ipu_psys_res_pool_cleanup(&psys->res_pool_try);
+		ipu_psys_res_pool_cleanup(&psys->res_pool_running);
+		goto out_mutex_destroy;
 	}
 
+	ipu6_psys_hw_res_variant_init();
+
+	rval = ipu_psys_pg_pool_init(psys);
+	if (rval)
+		goto out_free_pgs;
+
 	psys->caps.pg_count = ipu6_cpd_pkg_dir_get_num_entries(adev->pkg_dir);
 
 	dev_info(dev, "pkg_dir entry count:%d\n", psys->caps.pg_count);
@@ -2495,17 +3170,13 @@ static int ipu6_psys_probe(struct auxiliary_device *auxdev,
 out_release_fw_com:
 	ipu6_fw_com_release(psys->fwcom, 1);
 out_free_pgs:
-	list_for_each_entry_safe(kpg, kpg0, &psys->pgs, list) {
-#if LINUX_VERSION_CODE < KERNEL_VERSION(6, 12, 5)
-		dma_free_attrs(dev, kpg->size, kpg->pg, kpg->pg_dma_addr, 0);
-#else
-		ipu6_dma_free(adev, kpg->size, kpg->pg, kpg->pg_dma_addr, 0);
-#endif
-		kfree(kpg);
-	}
+	ipu_psys_pg_pool_cleanup(psys);
 
+	ipu_psys_res_pool_cleanup(&psys->res_pool_preempt);
+	ipu_psys_res_pool_cleanup(&psys->res_pool_try);
 	ipu_psys_res_pool_cleanup(&psys->res_pool_running);
 out_mutex_destroy:
+	ipu_psys_scheduler_cleanup(psys);
 	mutex_destroy(&psys->mutex);
 	if (psys->sched_cmd_thread) {
 		kthread_stop(psys->sched_cmd_thread);
@@ -2527,13 +3198,9 @@ static void ipu_psys_remove(struct ipu_bus_device *adev)
 #else
 static void ipu6_psys_remove(struct auxiliary_device *auxdev)
 {
-#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 12, 5)
-	struct ipu6_bus_device *adev = auxdev_to_adev(auxdev);
-#endif
 	struct device *dev = &auxdev->dev;
 	struct ipu_psys *psys = dev_get_drvdata(&auxdev->dev);
 #endif
-	struct ipu_psys_pg *kpg, *kpg0;
 
 #if LINUX_VERSION_CODE < KERNEL_VERSION(6, 10, 0)
 #ifdef CONFIG_DEBUG_FS
@@ -2549,17 +3216,7 @@ static void ipu6_psys_remove(struct auxiliary_device *auxdev)
 
 	mutex_lock(&ipu_psys_mutex);
 
-	list_for_each_entry_safe(kpg, kpg0, &psys->pgs, list) {
-#if LINUX_VERSION_CODE < KERNEL_VERSION(6, 10, 0)
-		dma_free_attrs(&adev->dev, kpg->size, kpg->pg,
-			       kpg->pg_dma_addr, 0);
-#elif LINUX_VERSION_CODE < KERNEL_VERSION(6, 12, 5)
-		dma_free_attrs(dev, kpg->size, kpg->pg, kpg->pg_dma_addr, 0);
-#else
-		ipu6_dma_free(adev, kpg->size, kpg->pg, kpg->pg_dma_addr, 0);
-#endif
-		kfree(kpg);
-	}
+	ipu_psys_pg_pool_cleanup(psys);
 
 #if LINUX_VERSION_CODE < KERNEL_VERSION(6, 10, 0)
 	if (psys->fwcom && ipu_fw_com_release(psys->fwcom, 1))
@@ -2575,6 +3232,8 @@ static void ipu6_psys_remove(struct auxiliary_device *auxdev)
 #if LINUX_VERSION_CODE < KERNEL_VERSION(6, 10, 0)
 	ipu_trace_uninit(&adev->dev);
 #endif
+	ipu_psys_res_pool_cleanup(&psys->res_pool_preempt);
+	ipu_psys_res_pool_cleanup(&psys->res_pool_try);
 	ipu_psys_res_pool_cleanup(&psys->res_pool_running);
 
 	cdev_device_del(&psys->cdev, &psys->dev);
@@ -2583,6 +3242,7 @@ static void ipu6_psys_remove(struct auxiliary_device *auxdev)
 
 	mutex_unlock(&ipu_psys_mutex);
 
+	ipu_psys_scheduler_cleanup(psys);
 	mutex_destroy(&psys->mutex);
 
 #if LINUX_VERSION_CODE < KERNEL_VERSION(6, 10, 0)
@@ -2701,12 +3361,41 @@ static struct auxiliary_driver ipu6_psys_aux_driver = {
 };
 #endif
 
+static void ipu_psys_destroy_caches(void)
+{
+	kmem_cache_destroy(ipu_psys_desc_cache);
+	kmem_cache_destroy(ipu_psys_kbuf_cache);
+	kmem_cache_destroy(ipu_psys_kcmd_cache);
+}
+
+static int ipu_psys_create_caches(void)
+{
+	ipu_psys_kcmd_cache = KMEM_CACHE(ipu_psys_kcmd, 0);
+	ipu_psys_kbuf_cache = KMEM_CACHE(ipu_psys_kbuffer, 0);
+	ipu_psys_desc_cache = KMEM_CACHE(ipu_psys_desc, 0);
+	if (!ipu_psys_kcmd_cache || !ipu_psys_kbuf_cache ||
+	    !ipu_psys_desc_cache) {
+		ipu_psys_destroy_caches();
+		return -ENOMEM;
+	}
+
+	return 0;
+}
+
 static int __init ipu_psys_init(void)
 {
-	int rval = alloc_chrdev_region(&ipu_psys_dev_t, 0,
-				       IPU_PSYS_NUM_DEVICES, ipu_psys_bus.name);
+	int rval = ipu_psys_create_caches();
+
+	if (rval) {
+		pr_err("can't create psys caches (%d)\n", rval);
+		return rval;
+	}
+
+	rval = alloc_chrdev_region(&ipu_psys_dev_t, 0,
+				   IPU_PSYS_NUM_DEVICES, ipu_psys_bus.name);
 	if (rval) {
 		pr_err("can't alloc psys chrdev region (%d)\n", rval);
+		ipu_psys_destroy_caches();
 		return rval;
 	}
 
@@ -2714,6 +3403,7 @@ static int __init ipu_psys_init(void)
 	if (rval) {
 		pr_err("can't register psys bus (%d)\n", rval);
 		unregister_chrdev_region(ipu_psys_dev_t, IPU_PSYS_NUM_DEVICES);
+		ipu_psys_destroy_caches();
 		return rval;
 	}
 
@@ -2735,6 +3425,7 @@ static void __exit ipu_psys_exit(void)
 #endif
 	bus_unregister(&ipu_psys_bus);
 	unregister_chrdev_region(ipu_psys_dev_t, IPU_PSYS_NUM_DEVICES);
+	ipu_psys_destroy_caches();
 }
 module_exit(ipu_psys_exit);
 
@@ -5,6 +5,11 @@
 #define IPU_PSYS_H
 
 #include <linux/cdev.h>
+#include <linux/hashtable.h>
+#include <linux/hrtimer.h>
+#include <linux/ktime.h>
+#include <linux/llist.h>
+#include <linux/refcount.h>
 #include <linux/workqueue.h>
 
 #include <linux/version.h>
@@ -122,7 +127,17 @@ enum ipu_device_buttress_psys_domain_pos {
 
 #define IPU_PSYS_PG_POOL_SIZE 16
 #define IPU_PSYS_PG_MAX_SIZE 8192
+/*
+ * PG buffers are pooled in power-of-two size classes starting at a page,
+ * the last class takes everything larger. At most IPU_PSYS_PG_POOL_HWM
+ * free buffers are kept per class, the rest is given back. When the last
+ * file handle is closed the pool shrinks back to its preallocated size.
+ */
+#define IPU_PSYS_PG_NR_CLASSES 6
+#define IPU_PSYS_PG_POOL_HWM IPU_PSYS_PG_POOL_SIZE
 #define IPU_MAX_PSYS_CMD_BUFFERS 32
+/* Terminal arrays up to this size are kept inside the kcmd */
+#define IPU_PSYS_KCMD_INLINE_BUFS 16
 #define IPU_PSYS_EVENT_CMD_COMPLETE IPU_FW_PSYS_EVENT_TYPE_SUCCESS
 #define IPU_PSYS_EVENT_FRAGMENT_COMPLETE IPU_FW_PSYS_EVENT_TYPE_SUCCESS
 #define IPU_PSYS_CLOSE_TIMEOUT_US   50
@@ -133,6 +148,8 @@ enum ipu_device_buttress_psys_domain_pos {
 extern enum ipu6_version ipu_ver;
 
 #endif
+extern struct kmem_cache *ipu_psys_kcmd_cache;
+
 /* Opaque structure. Do not access fields. */
 struct ipu_resource {
 	u32 id;
@@ -187,6 +204,113 @@ struct ipu_psys_resource_alloc {
 	int resources;
 };
 
+/*
+ * Resource plan of a PG, built once from its processes and manifest.
+ * Everything placed at a fixed position is folded into one mask per
+ * resource, so checking a plan against a pool is a handful of bitmap
+ * intersections plus a word-wide search for cells picked by type.
+ */
+#define IPU_PSYS_PLAN_MAX_MASKS	64
+
+struct ipu_psys_plan_mask {
+	enum ipu_resource_type type;
+	u32 id;
+	unsigned long *bits;
+};
+
+struct ipu_psys_plan_cell {
+	u32 fixed;		/* Cell named by the manifest, if any */
+	u32 candidates;		/* Cells of the wanted type otherwise */
+};
+
+struct ipu_psys_resource_plan {
+	bool infeasible;	/* Conflicts with itself */
+	bool ordered;		/* Relocatable requests, try them in order */
+	u32 fixed_cells;
+	unsigned int nr_reqs;	/* Resource handles the PG needs */
+	unsigned int nr_masks;
+	struct ipu_psys_plan_mask masks[IPU_PSYS_PLAN_MAX_MASKS];
+	unsigned int nr_cells;
+	struct ipu_psys_plan_cell cells[];
+};
+
+struct ipu_psys_pg_pool_stats {
+	u64 hits;
+	u64 misses;
+	u64 released;		/* Freed above the high-water mark */
+	size_t wasted;		/* Unused bytes of the buffers in use */
+};
+
+/* Allocations done while copying commands from userspace */
+struct ipu_psys_alloc_stats {
+	atomic64_t cmds;
+	atomic64_t heap;	/* kmalloc() */
+	atomic64_t cache;	/* kmem_cache_alloc() */
+};
+
+/* log2 buckets of microseconds, the last one takes everything above */
+#define IPU_PSYS_LAT_HIST_BUCKETS	20
+
+/* Preemptions done by the l-scheduler when a PPG does not fit */
+struct ipu_psys_preempt_stats {
+	atomic64_t plans;	/* Sets of running PPGs suspended */
+	atomic64_t misses;	/* No set of running PPGs would do */
+	atomic64_t suspended;	/* Running PPGs suspended by plans */
+	atomic_t suspend_lat[IPU_PSYS_LAT_HIST_BUCKETS]; /* to SUSPENDED */
+	atomic_t resume_lat[IPU_PSYS_LAT_HIST_BUCKETS];	/* to RUNNING */
+};
+
+/* kcmd watchdog and latencies, all taken from the kcmd timestamps */
+struct ipu_psys_cmd_stats {
+	atomic64_t timeouts;	/* kcmds overdue at firmware */
+	atomic_t queue_lat[IPU_PSYS_LAT_HIST_BUCKETS];	/* QCMD to firmware */
+	atomic_t fw_lat[IPU_PSYS_LAT_HIST_BUCKETS];	/* firmware to done */
+	atomic_t total_lat[IPU_PSYS_LAT_HIST_BUCKETS];	/* QCMD to done */
+};
+
+static inline void ipu_psys_lat_hist_add(atomic_t *hist, s64 us)
+{
+	atomic_inc(&hist[min_t(unsigned int, fls64(max_t(s64, us, 0)),
+			       IPU_PSYS_LAT_HIST_BUCKETS - 1)]);
+}
+
+/* Buckets of the device wide buffer set and PPG address tables */
+#define IPU_PSYS_ADDR_HASH_BITS		6
+#define IPU_PSYS_MANIFEST_HASH_BITS	4
+
+/*
+ * A PG manifest shared by every command and PPG using the same one, keyed
+ * by a hash of its contents. The program manifests are decoded once when
+ * the entry is created, pms[] is indexed by process->program_idx and
+ * points into data.
+ */
+struct ipu_psys_manifest {
+	struct hlist_node hnode;	/* psys->manifest_hash */
+	refcount_t ref;
+	u32 hash;
+	size_t size;
+	void *data;
+	unsigned int program_count;
+	struct ipu_fw_generic_program_manifest pms[];
+};
+
+static inline struct ipu_fw_generic_program_manifest *
+ipu_psys_manifest_get_pm(struct ipu_psys_manifest *manifest,
+			 struct ipu_fw_psys_process *process)
+{
+	if (process->program_idx >= manifest->program_count)
+		return NULL;
+
+	return &manifest->pms[process->program_idx];
+}
+
+/* A list of kppgs kept by the l-scheduler */
+struct ipu_psys_sched_list {
+	struct list_head list;
+	/* to protect the list */
+	struct mutex lock;
+};
+
 struct task_struct;
 struct ipu_psys {
 	struct ipu_psys_capability caps;
@@ -198,10 +322,38 @@ struct ipu_psys {
 	bool icache_prefetch_sp;
 	bool icache_prefetch_isp;
 	spinlock_t ready_lock;	/* protect psys firmware state */
-	spinlock_t pgs_lock;	/* Protect pgs list access */
+	spinlock_t pgs_lock;	/* Protect pgs lists and pg_stats access */
 	struct list_head fhs;
-	struct list_head pgs;
+	struct list_head pgs;	/* PG buffers in use */
+	struct list_head pgs_free[IPU_PSYS_PG_NR_CLASSES];
+	unsigned int pgs_nr_free[IPU_PSYS_PG_NR_CLASSES];
+	struct ipu_psys_pg_pool_stats pg_stats;
+	/* Buffer sets taken from a PPG ring vs. from the fh pool */
+	atomic64_t bs_ring_hits;
+	atomic64_t bs_ring_misses;
+	struct ipu_psys_alloc_stats alloc_stats;
+	/* l-scheduler state, see ipu6-l-scheduler.c */
+	struct ipu_psys_sched_list sched_start;
+	struct ipu_psys_sched_list sched_stop;
+	struct ipu_psys_sched_list sched_halt;
+	struct ipu_psys_sched_list sched_kcmd;
+	struct ipu_psys_preempt_stats preempt_stats;
+	/* Watchdog of kcmds at firmware, ordered by expiry */
+	spinlock_t wd_lock;	/* Protects wd_list, taken from wd_timer */
+	struct list_head wd_list;
+	struct hrtimer wd_timer;	/* Armed for the head of wd_list */
+	struct ipu_psys_cmd_stats cmd_stats;
+	/* Maintained on kcmd queueing and PPG state changes */
+	atomic_t sched_kcmds_pending;	/* kcmds on new or processing lists */
+	atomic_t sched_ppgs_stopping;	/* PPGs SUSPENDING or STOPPING */
+	atomic_t sched_ppgs_unsettled;	/* PPGs not RUNNING/SUSPENDED/STOPPED */
 	struct list_head started_kcmds_list;
+	/* Buffer sets and PPGs of all fhs keyed by their IPU address */
+	spinlock_t addr_lock;	/* Protects bufset_hash and ppg_hash */
+	DECLARE_HASHTABLE(bufset_hash, IPU_PSYS_ADDR_HASH_BITS);
+	DECLARE_HASHTABLE(ppg_hash, IPU_PSYS_ADDR_HASH_BITS);
+	spinlock_t manifest_lock;	/* Protects manifest_hash */
+	DECLARE_HASHTABLE(manifest_hash, IPU_PSYS_MANIFEST_HASH_BITS);
 #if LINUX_VERSION_CODE < KERNEL_VERSION(6, 10, 0)
 	struct ipu_psys_pdata *pdata;
 	struct ipu_bus_device *adev;
@@ -215,6 +367,7 @@ struct ipu_psys {
 	struct task_struct *sched_cmd_thread;
 	wait_queue_head_t sched_cmd_wq;
 	atomic_t wakeup_count;  /* Psys schedule thread wakeup count */
+	struct llist_head sched_submit;	/* kcmds not yet on their PPG */
 #if LINUX_VERSION_CODE < KERNEL_VERSION(6, 10, 0)
 #ifdef CONFIG_DEBUG_FS
 	struct dentry *debugfsdir;
@@ -223,6 +376,8 @@ struct ipu_psys {
 
 	/* Resources needed to be managed for process groups */
 	struct ipu_psys_resource_pool res_pool_running;
+	struct ipu_psys_resource_pool res_pool_try;	/* Scheduler scratch */
+	struct ipu_psys_resource_pool res_pool_preempt;	/* Planner scratch */
 
 	const struct firmware *fw;
 	struct sg_table fw_sgt;
@@ -237,15 +392,28 @@ struct ipu_psys {
 	int power_gating;
 };
 
+/* Buckets of the per-fh dma-buf and fd lookup tables */
+#define IPU_PSYS_BUF_HASH_BITS		6
+#define IPU_PSYS_DESC_HASH_BITS		6
+
 struct ipu_psys_fh {
 	struct ipu_psys *psys;
 	struct mutex mutex;/* Protects bufs_list & kcmds fields */
 	struct list_head list;
 	/* Holds all buffers that this fh owns */
 	struct list_head bufs_list;
-	/* Holds all descriptors (fd:kbuffer associations) */
-	struct list_head descs_list;
+	/* Holds all descriptors (fd:kbuffer associations), keyed by fd */
+	DECLARE_HASHTABLE(descs_hash, IPU_PSYS_DESC_HASH_BITS);
 	struct list_head bufs_lru;
+	/* bufs_list entries keyed by their struct dma_buf */
+	DECLARE_HASHTABLE(bufs_hash, IPU_PSYS_BUF_HASH_BITS);
+	/* Completed kcmds of all PPGs in completion order */
+	struct list_head kcmds_done;
+	/* Completed kcmds already published to the event ring */
+	struct list_head kcmds_reap;
+	spinlock_t done_lock;	/* Protects kcmds_done/reap and ring_head */
+	struct ipu_psys_event_ring *ring;	/* mmap()ed event ring */
+	u32 ring_head;
 	wait_queue_head_t wait;
 	struct ipu_psys_scheduler sched;
 
@@ -273,18 +441,25 @@ struct ipu6_psys_constraint {
 struct ipu_psys_kcmd {
 	struct ipu_psys_fh *fh;
 	struct list_head list;
+	struct list_head done_list;	/* fh->kcmds_done once completed */
 	struct ipu_psys_buffer_set *kbuf_set;
 	enum ipu_psys_cmd_state state;
-	void *pg_manifest;
-	size_t pg_manifest_size;
+	struct ipu_psys_manifest *pg_manifest;
+	bool pending;	/* Counted in psys->sched_kcmds_pending */
+	struct llist_node sched_node;	/* psys->sched_submit */
+	struct ipu_psys_ppg *sched_kppg;	/* Target PPG while submitted */
 	struct ipu_psys_kbuffer **kbufs;
 	struct ipu_psys_buffer *buffers;
 	size_t nbuffers;
+	struct ipu_psys_kbuffer *kbufs_inline[IPU_PSYS_KCMD_INLINE_BUFS];
+	struct ipu_psys_buffer buffers_inline[IPU_PSYS_KCMD_INLINE_BUFS];
 	struct ipu_fw_psys_process_group *pg_user;
 	struct ipu_psys_pg *kpg;
+	bool kpg_owned;	/* kpg is not handed over to a PPG yet */
 	u64 user_token;
 	u64 issue_id;
 	u32 priority;
+	ktime_t deadline;	/* Absolute, 0 if none */
 	u32 kernel_enable_bitmap[4];
 	u32 terminal_enable_bitmap[4];
 	u32 routing_enable_bitmap[4];
@@ -295,7 +470,10 @@ struct ipu_psys_kcmd {
 	struct ipu6_psys_constraint constraint;
 #endif
 	struct ipu_psys_event ev;
-	struct timer_list watchdog;
+	struct list_head wd_list;	/* psys->wd_list while at firmware */
+	ktime_t wd_expires;
+	ktime_t ts_submit;	/* QCMD */
+	ktime_t ts_start;	/* Handed to firmware, 0 if never */
 };
 
 struct ipu_dma_buf_attach {
@@ -315,10 +493,14 @@ struct ipu_psys_kbuffer {
 	unsigned long userptr;
 	void *kaddr;
 	struct list_head list;
+	struct hlist_node hnode;	/* fh->bufs_hash while on bufs_list */
 	dma_addr_t dma_addr;
 	struct sg_table *sgt;
 	struct dma_buf_attachment *db_attach;
 	struct dma_buf *dbuf;
+#if LINUX_VERSION_CODE < KERNEL_VERSION(6, 10, 0)
+	struct ipu_dmabuf_map *cmap;	/* Imported buffers only */
+#endif
 	u32 flags;
 	atomic_t map_count; /* The number of times this buffer is mapped */
 	bool valid;	/* True when buffer is usable */
@@ -326,7 +508,7 @@ struct ipu_psys_kbuffer {
 
 struct ipu_psys_desc {
 	struct ipu_psys_kbuffer *kbuf;
-	struct list_head list;
+	struct hlist_node hnode;	/* fh->descs_hash, keyed by fd */
 	u32 fd;
 };
 
@@ -337,8 +519,21 @@ void ipu_psys_setup_hw(struct ipu_psys *psys);
 void ipu_psys_subdomains_power(struct ipu_psys *psys, bool on);
 void ipu_psys_handle_events(struct ipu_psys *psys);
 int ipu_psys_kcmd_new(struct ipu_psys_command *cmd, struct ipu_psys_fh *fh);
+int ipu_psys_kcmd_new_batch(struct ipu_psys_command *cmds, u32 count,
+			    struct ipu_psys_fh *fh);
+void ipu_psys_kcmd_drain(struct ipu_psys *psys);
+void ipu_psys_scheduler_init(struct ipu_psys *psys);
+void ipu_psys_scheduler_cleanup(struct ipu_psys *psys);
 void ipu_psys_run_next(struct ipu_psys *psys);
 struct ipu_psys_pg *__get_pg_buf(struct ipu_psys *psys, size_t pg_size);
+void __put_pg_buf(struct ipu_psys *psys, struct ipu_psys_pg *kpg);
+struct ipu_psys_manifest *
+ipu_psys_manifest_get(struct ipu_psys *psys, const void __user *umanifest,
+		      size_t size);
+struct ipu_psys_manifest *
+ipu_psys_manifest_ref(struct ipu_psys_manifest *manifest);
+void ipu_psys_manifest_put(struct ipu_psys *psys,
+			   struct ipu_psys_manifest *manifest);
 struct ipu_psys_kbuffer *
 ipu_psys_lookup_kbuffer(struct ipu_psys_fh *fh, int fd);
 struct ipu_psys_kbuffer *
@@ -350,5 +545,9 @@ void ipu_psys_res_pool_cleanup(struct ipu_psys_resource_pool *pool);
 struct ipu_psys_kcmd *ipu_get_completed_kcmd(struct ipu_psys_fh *fh);
 long ipu_ioctl_dqevent(struct ipu_psys_event *event,
 		       struct ipu_psys_fh *fh, unsigned int f_flags);
+void ipu_psys_reap_kcmds(struct ipu_psys_fh *fh);
+bool ipu_psys_events_pending(struct ipu_psys_fh *fh);
+long ipu_ioctl_dqevent_batch(struct ipu_psys_event_batch *batch,
+			     struct ipu_psys_fh *fh, unsigned int f_flags);
 
 #endif /* IPU_PSYS_H */
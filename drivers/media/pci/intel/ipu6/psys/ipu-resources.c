@@ -32,8 +32,7 @@ void ipu6_psys_hw_res_variant_init(void)
 	hw_var.set_proc_dev_chn = ipu6_fw_psys_set_proc_dev_chn;
 	hw_var.set_proc_dfm_bitmap = ipu6_fw_psys_set_proc_dfm_bitmap;
 	hw_var.set_proc_ext_mem = ipu6_fw_psys_set_process_ext_mem;
-	hw_var.get_pgm_by_proc =
-		ipu6_fw_psys_get_pgm_by_process;
+	hw_var.get_pgm_by_idx = ipu6_fw_psys_get_pgm_by_index;
 }
 
 static const struct ipu_fw_resource_definitions *get_res(void)
@@ -65,7 +64,7 @@ void ipu6_psys_hw_res_variant_init(void)
 	hw_var.set_proc_dev_chn = ipu6_fw_psys_set_proc_dev_chn;
 	hw_var.set_proc_dfm_bitmap = ipu6_fw_psys_set_proc_dfm_bitmap;
 	hw_var.set_proc_ext_mem = ipu6_fw_psys_set_process_ext_mem;
-	hw_var.get_pgm_by_proc = ipu6_fw_psys_get_pgm_by_process;
+	hw_var.get_pgm_by_idx = ipu6_fw_psys_get_pgm_by_index;
 }
 
 static const struct ipu_fw_resource_definitions *get_res(void)
@@ -167,6 +166,13 @@ static void ipu_resource_free(struct ipu_resource_alloc *alloc)
 	alloc->resource = NULL;
 }
 
+static void ipu_resource_copy(struct ipu_resource *src,
+			      struct ipu_resource *dest)
+{
+	if (src->bitmap && dest->bitmap)
+		bitmap_copy(dest->bitmap, src->bitmap, src->elements);
+}
+
 static void ipu_resource_cleanup(struct ipu_resource *res)
 {
 	bitmap_free(res->bitmap);
@@ -243,13 +249,14 @@ void ipu_psys_resource_copy(struct ipu_psys_resource_pool *src,
 
 	dest->cells = src->cells;
 	for (i = 0; i < res_defs->num_dev_channels; i++)
-		*dest->dev_channels[i].bitmap = *src->dev_channels[i].bitmap;
+		ipu_resource_copy(&src->dev_channels[i],
+				  &dest->dev_channels[i]);
 
 	for (i = 0; i < res_defs->num_ext_mem_ids; i++)
-		*dest->ext_memory[i].bitmap = *src->ext_memory[i].bitmap;
+		ipu_resource_copy(&src->ext_memory[i], &dest->ext_memory[i]);
 
 	for (i = 0; i < res_defs->num_dfm_ids; i++)
-		*dest->dfms[i].bitmap = *src->dfms[i].bitmap;
+		ipu_resource_copy(&src->dfms[i], &dest->dfms[i]);
 }
 
 void ipu_psys_res_pool_cleanup(struct ipu_psys_resource_pool *pool)
@@ -451,7 +458,7 @@ void ipu_psys_free_cmd_queue_res(struct ipu_psys_resource_pool *pool,
 
 int ipu_psys_try_allocate_resources(struct device *dev,
 				    struct ipu_fw_psys_process_group *pg,
-				    void *pg_manifest,
+				    struct ipu_psys_manifest *manifest,
 				    struct ipu_psys_resource_pool *pool)
 {
 	u32 id, idx;
@@ -478,9 +485,7 @@ int ipu_psys_try_allocate_resources(struct device *dev,
 		struct ipu_fw_psys_process *process =
 			(struct ipu_fw_psys_process *)
 			((char *)pg + process_offset_table[i]);
-		struct ipu_fw_generic_program_manifest pm;
-
-		memset(&pm, 0, sizeof(pm));
+		struct ipu_fw_generic_program_manifest *pm;
 
 		if (!process) {
 			dev_err(dev, "can not get process\n");
@@ -488,21 +493,22 @@ int ipu_psys_try_allocate_resources(struct device *dev,
 			goto free_out;
 		}
 
-		ret = ipu_fw_psys_get_pgm_by_process(&pm, pg_manifest, process);
-		if (ret < 0) {
+		pm = ipu_psys_manifest_get_pm(manifest, process);
+		if (!pm) {
 			dev_err(dev, "can not get manifest\n");
+			ret = -ENOENT;
 			goto free_out;
 		}
 
-		if (pm.cell_id == res_defs->num_cells &&
-		    pm.cell_type_id == res_defs->num_cells_type) {
+		if (pm->cell_id == res_defs->num_cells &&
+		    pm->cell_type_id == res_defs->num_cells_type) {
 			cell = res_defs->num_cells;
-		} else if ((pm.cell_id != res_defs->num_cells &&
-			    pm.cell_type_id == res_defs->num_cells_type)) {
-			cell = pm.cell_id;
+		} else if ((pm->cell_id != res_defs->num_cells &&
+			    pm->cell_type_id == res_defs->num_cells_type)) {
+			cell = pm->cell_id;
 		} else {
 			/* Find a free cell of desired type */
-			u32 type = pm.cell_type_id;
+			u32 type = pm->cell_type_id;
 
 			for (cell = 0; cell < res_defs->num_cells; cell++)
 				if (res_defs->cells[cell] == type &&
@@ -522,11 +528,11 @@ int ipu_psys_try_allocate_resources(struct device *dev,
 			goto free_out;
 		}
 
-		if (pm.dev_chn_size) {
+		if (pm->dev_chn_size) {
 			for (id = 0; id < res_defs->num_dev_channels; id++) {
 				ret = __alloc_one_resrc(dev, process,
 							&pool->dev_channels[id],
-							&pm, id, alloc);
+							pm, id, alloc);
 				if (ret == -ENXIO)
 					continue;
 
@@ -535,11 +541,11 @@ int ipu_psys_try_allocate_resources(struct device *dev,
 			}
 		}
 
-		if (pm.dfm_port_bitmap) {
+		if (pm->dfm_port_bitmap) {
 			for (id = 0; id < res_defs->num_dfm_ids; id++) {
 				ret = ipu_psys_allocate_one_dfm
 					(dev, process,
-					 &pool->dfms[id], &pm, id, alloc);
+					 &pool->dfms[id], pm, id, alloc);
 				if (ret == -ENXIO)
 					continue;
 
@@ -548,7 +554,7 @@ int ipu_psys_try_allocate_resources(struct device *dev,
 			}
 		}
 
-		if (pm.ext_mem_size) {
+		if (pm->ext_mem_size) {
 			for (mem_type_id = 0;
 			     mem_type_id < res_defs->num_ext_mem_types;
 			     mem_type_id++) {
@@ -565,7 +571,7 @@ int ipu_psys_try_allocate_resources(struct device *dev,
 
 				ret = __alloc_mem_resrc(dev, process,
 							&pool->ext_memory[bank],
-							&pm, mem_type_id, bank,
+							pm, mem_type_id, bank,
 							alloc);
 				if (ret == -ENXIO)
 					continue;
@@ -587,6 +593,306 @@ free_out:
 	return ret;
 }
 
+static struct ipu_resource *
+ipu_psys_plan_resource(struct ipu_psys_resource_pool *pool,
+		       enum ipu_resource_type type, u32 id)
+{
+	switch (type) {
+	case IPU_RESOURCE_DEV_CHN:
+		return &pool->dev_channels[id];
+	case IPU_RESOURCE_EXT_MEM:
+		return &pool->ext_memory[id];
+	default:
+		return &pool->dfms[id];
+	}
+}
+
+static unsigned long *
+ipu_psys_plan_mask(struct ipu_psys_resource_plan *plan,
+		   enum ipu_resource_type type, u32 id, int elements)
+{
+	struct ipu_psys_plan_mask *mask;
+	unsigned int i;
+
+	for (i = 0; i < plan->nr_masks; i++) {
+		mask = &plan->masks[i];
+		if (mask->type == type && mask->id == id)
+			return mask->bits;
+	}
+
+	if (plan->nr_masks == IPU_PSYS_PLAN_MAX_MASKS || elements <= 0)
+		return NULL;
+
+	mask = &plan->masks[plan->nr_masks];
+	/* DFM requests are a port bitmap in a single word */
+	mask->bits = bitmap_zalloc(type == IPU_RESOURCE_DFM ?
+				   BITS_PER_LONG : elements, GFP_KERNEL);
+	if (!mask->bits)
+		return NULL;
+	mask->type = type;
+	mask->id = id;
+	plan->nr_masks++;
+
+	return mask->bits;
+}
+
+/* Add a fixed span, a span that cannot be placed makes the plan infeasible */
+static int ipu_psys_plan_add_span(struct ipu_psys_resource_plan *plan,
+				  enum ipu_resource_type type, u32 id,
+				  int elements, u16 size, u16 offset)
+{
+	unsigned long *bits;
+
+	if (offset >= elements || offset + size > elements) {
+		plan->infeasible = true;
+		return 0;
+	}
+
+	bits = ipu_psys_plan_mask(plan, type, id, elements);
+	if (!bits)
+		return elements > 0 ? -ENOMEM : 0;
+
+	if (find_next_bit(bits, offset + size, offset) < offset + size)
+		plan->infeasible = true;
+	bitmap_set(bits, offset, size);
+
+	return 0;
+}
+
+static int ipu_psys_plan_add_dfm(struct ipu_psys_resource_plan *plan,
+				 u32 id, int elements, u32 req)
+{
+	unsigned long *bits;
+
+	bits = ipu_psys_plan_mask(plan, IPU_RESOURCE_DFM, id, elements);
+	if (!bits) {
+		if (elements > 0)
+			return -ENOMEM;
+		plan->infeasible = true;
+		return 0;
+	}
+
+	if (*bits & req)
+		plan->infeasible = true;
+	*bits |= req;
+
+	return 0;
+}
+
+static int ipu_psys_plan_process(struct ipu_psys_resource_plan *plan,
+				 struct ipu_fw_generic_program_manifest *pm,
+				 struct ipu_psys_plan_cell *pcell)
+{
+	const struct ipu_fw_resource_definitions *res_defs = get_res();
+	u32 cell = res_defs->num_cells;
+	u32 id, bank;
+	int ret;
+
+	if (pm->cell_id == res_defs->num_cells &&
+	    pm->cell_type_id == res_defs->num_cells_type) {
+		/* No cell */
+	} else if (pm->cell_type_id == res_defs->num_cells_type) {
+		cell = pm->cell_id;
+		if (cell > res_defs->num_cells) {
+			plan->ordered = true;
+			return 0;
+		}
+		pcell->fixed = 1 << cell;
+		plan->fixed_cells |= pcell->fixed;
+	} else {
+		for (id = 0; id < res_defs->num_cells; id++)
+			if (res_defs->cells[id] == pm->cell_type_id)
+				pcell->candidates |= 1 << id;
+		if (!pcell->candidates)
+			plan->infeasible = true;
+	}
+
+	if (pm->dev_chn_size) {
+		for (id = 0; id < res_defs->num_dev_channels; id++) {
+			if (!pm->dev_chn_size[id])
+				continue;
+			plan->nr_reqs++;
+			if (pm->dev_chn_offset[id] == (u16)(-1)) {
+				plan->ordered = true;
+				continue;
+			}
+			ret = ipu_psys_plan_add_span(plan, IPU_RESOURCE_DEV_CHN,
+						     id,
+						     res_defs->dev_channels[id],
+						     pm->dev_chn_size[id],
+						     pm->dev_chn_offset[id]);
+			if (ret)
+				return ret;
+		}
+	}
+
+	if (pm->dfm_port_bitmap) {
+		for (id = 0; id < res_defs->num_dfm_ids; id++) {
+			if (!pm->dfm_port_bitmap[id])
+				continue;
+			plan->nr_reqs++;
+			if (pm->is_dfm_relocatable[id]) {
+				plan->ordered = true;
+				continue;
+			}
+			ret = ipu_psys_plan_add_dfm(plan, id,
+						    res_defs->dfms[id],
+						    pm->dfm_port_bitmap[id]);
+			if (ret)
+				return ret;
+		}
+	}
+
+	if (pm->ext_mem_size) {
+		for (id = 0; id < res_defs->num_ext_mem_types; id++) {
+			if (!pm->ext_mem_size[id])
+				continue;
+			/* The bank follows the cell picked at run time */
+			if (pcell->candidates) {
+				plan->ordered = true;
+				continue;
+			}
+			if (cell == res_defs->num_cells)
+				continue;
+			bank = res_defs->cell_mem[res_defs->cell_mem_row * cell +
+						  id];
+			if (bank == res_defs->num_ext_mem_ids)
+				continue;
+			plan->nr_reqs++;
+			if (pm->ext_mem_offset[id] == (u16)(-1)) {
+				plan->ordered = true;
+				continue;
+			}
+			ret = ipu_psys_plan_add_span(plan, IPU_RESOURCE_EXT_MEM,
+						     bank,
+						     res_defs->ext_mem_ids[bank],
+						     pm->ext_mem_size[id],
+						     pm->ext_mem_offset[id]);
+			if (ret)
+				return ret;
+		}
+	}
+
+	return 0;
+}
+
+struct ipu_psys_resource_plan *
+ipu_psys_resource_plan_build(struct ipu_fw_psys_process_group *pg,
+			     struct ipu_psys_manifest *manifest)
+{
+	struct ipu_psys_resource_plan *plan;
+	u16 *process_offset_table;
+	unsigned int i;
+	int ret;
+
+	if (!pg)
+		return ERR_PTR(-EINVAL);
+
+	process_offset_table = (u16 *)((u8 *)pg + pg->processes_offset);
+
+	plan = kzalloc(struct_size(plan, cells, pg->process_count),
+		       GFP_KERNEL);
+	if (!plan)
+		return ERR_PTR(-ENOMEM);
+	plan->nr_cells = pg->process_count;
+
+	for (i = 0; i < pg->process_count; i++) {
+		struct ipu_fw_psys_process *process =
+			(struct ipu_fw_psys_process *)
+			((char *)pg + process_offset_table[i]);
+		struct ipu_fw_generic_program_manifest *pm;
+
+		pm = ipu_psys_manifest_get_pm(manifest, process);
+		if (!pm) {
+			ret = -ENOENT;
+			goto err;
+		}
+
+		ret = ipu_psys_plan_process(plan, pm, &plan->cells[i]);
+		if (ret)
+			goto err;
+	}
+
+	/* Leave running out of resource handles to the full search */
+	if (plan->nr_reqs > IPU_MAX_RESOURCES)
+		plan->ordered = true;
+
+	return plan;
+
+err:
+	ipu_psys_resource_plan_free(plan);
+	return ERR_PTR(ret);
+}
+
+void ipu_psys_resource_plan_free(struct ipu_psys_resource_plan *plan)
+{
+	unsigned int i;
+
+	if (!plan)
+		return;
+
+	for (i = 0; i < plan->nr_masks; i++)
+		bitmap_free(plan->masks[i].bits);
+	kfree(plan);
+}
+
+/*
+ * Check whether the PG of @plan fits into @pool without changing it.
+ * Fixed spans and cells are checked against the pool directly. Plans
+ * with relocatable requests are then tried in order on @try_pool, a
+ * scratch pool owned by the caller.
+ */
+int ipu_psys_resource_plan_try(struct device *dev,
+			       struct ipu_psys_resource_plan *plan,
+			       struct ipu_fw_psys_process_group *pg,
+			       struct ipu_psys_manifest *manifest,
+			       struct ipu_psys_resource_pool *pool,
+			       struct ipu_psys_resource_pool *try_pool)
+{
+	struct ipu_psys_plan_mask *mask;
+	struct ipu_resource *res;
+	unsigned int i;
+	u32 avail, cells = 0;
+
+	if (plan->infeasible || (pool->cells & plan->fixed_cells))
+		return -ENOSPC;
+
+	for (i = 0; i < plan->nr_masks; i++) {
+		mask = &plan->masks[i];
+		res = ipu_psys_plan_resource(pool, mask->type, mask->id);
+		if (!res->bitmap)
+			return -ENOSPC;
+		if (mask->type == IPU_RESOURCE_DFM) {
+			if (*res->bitmap & *mask->bits)
+				return -ENOSPC;
+		} else if (bitmap_intersects(res->bitmap, mask->bits,
+					     res->elements)) {
+			return -ENOSPC;
+		}
+	}
+
+	if (plan->ordered) {
+		ipu_psys_resource_copy(pool, try_pool);
+		return ipu_psys_try_allocate_resources(dev, pg, manifest,
+						       try_pool);
+	}
+
+	/* Same first fit, in process order, as the full search */
+	for (i = 0; i < plan->nr_cells; i++) {
+		if (plan->cells[i].candidates) {
+			avail = plan->cells[i].candidates &
+				~(pool->cells | cells);
+			if (!avail)
+				return -ENOSPC;
+			cells |= 1 << __ffs(avail);
+		} else {
+			cells |= plan->cells[i].fixed;
+		}
+	}
+
+	return 0;
+}
+
 /*
  * Allocate resources for pg from `pool'. Mark the allocated
  * resources into `alloc'. Returns 0 on success, -ENOSPC
@@ -595,7 +901,7 @@ free_out:
  */
 int ipu_psys_allocate_resources(const struct device *dev,
 				struct ipu_fw_psys_process_group *pg,
-				void *pg_manifest,
+				struct ipu_psys_manifest *manifest,
 				struct ipu_psys_resource_alloc *alloc,
 				struct ipu_psys_resource_pool *pool)
 {
@@ -621,30 +927,30 @@ int ipu_psys_allocate_resources(const struct device *dev,
 		struct ipu_fw_psys_process *process =
 		    (struct ipu_fw_psys_process *)
 		    ((char *)pg + process_offset_table[i]);
-		struct ipu_fw_generic_program_manifest pm;
+		struct ipu_fw_generic_program_manifest *pm;
 
-		memset(&pm, 0, sizeof(pm));
 		if (!process) {
 			dev_err(dev, "can not get process\n");
 			ret = -ENOENT;
 			goto free_out;
 		}
 
-		ret = ipu_fw_psys_get_pgm_by_process(&pm, pg_manifest, process);
-		if (ret < 0) {
+		pm = ipu_psys_manifest_get_pm(manifest, process);
+		if (!pm) {
 			dev_err(dev, "can not get manifest\n");
+			ret = -ENOENT;
 			goto free_out;
 		}
 
-		if (pm.cell_id == res_defs->num_cells &&
-		    pm.cell_type_id == res_defs->num_cells_type) {
+		if (pm->cell_id == res_defs->num_cells &&
+		    pm->cell_type_id == res_defs->num_cells_type) {
 			cell = res_defs->num_cells;
-		} else if ((pm.cell_id != res_defs->num_cells &&
-			    pm.cell_type_id == res_defs->num_cells_type)) {
-			cell = pm.cell_id;
+		} else if ((pm->cell_id != res_defs->num_cells &&
+			    pm->cell_type_id == res_defs->num_cells_type)) {
+			cell = pm->cell_id;
 		} else {
 			/* Find a free cell of desired type */
-			u32 type = pm.cell_type_id;
+			u32 type = pm->cell_type_id;
 
 			for (cell = 0; cell < res_defs->num_cells; cell++)
 				if (res_defs->cells[cell] == type &&
@@ -667,11 +973,11 @@ int ipu_psys_allocate_resources(const struct device *dev,
 			goto free_out;
 		}
 
-		if (pm.dev_chn_size) {
+		if (pm->dev_chn_size) {
 			for (id = 0; id < res_defs->num_dev_channels; id++) {
 				ret = __alloc_one_resrc(dev, process,
 							&pool->dev_channels[id],
-							&pm, id, alloc);
+							pm, id, alloc);
 				if (ret == -ENXIO)
 					continue;
 
@@ -687,11 +993,11 @@ int ipu_psys_allocate_resources(const struct device *dev,
 			}
 		}
 
-		if (pm.dfm_port_bitmap) {
+		if (pm->dfm_port_bitmap) {
 			for (id = 0; id < res_defs->num_dfm_ids; id++) {
 				ret = ipu_psys_allocate_one_dfm(dev, process,
 								&pool->dfms[id],
-								&pm, id, alloc);
+								pm, id, alloc);
 				if (ret == -ENXIO)
 					continue;
 
@@ -700,9 +1006,9 @@ int ipu_psys_allocate_resources(const struct device *dev,
 
 				idx = alloc->resources - 1;
 				p = alloc->resource_alloc[idx].pos;
-				bmp = pm.dfm_port_bitmap[id];
+				bmp = pm->dfm_port_bitmap[id];
 				bmp = bmp << p;
-				a_bmp = pm.dfm_active_port_bitmap[id];
+				a_bmp = pm->dfm_active_port_bitmap[id];
 				a_bmp = a_bmp << p;
 				ret = ipu_fw_psys_set_proc_dfm_bitmap(process,
 								      id, bmp,
@@ -712,7 +1018,7 @@ int ipu_psys_allocate_resources(const struct device *dev,
 			}
 		}
 
-		if (pm.ext_mem_size) {
+		if (pm->ext_mem_size) {
 			for (mem_type_id = 0;
 			     mem_type_id < res_defs->num_ext_mem_types;
 			     mem_type_id++) {
@@ -728,7 +1034,7 @@ int ipu_psys_allocate_resources(const struct device *dev,
 
 				ret = __alloc_mem_resrc(dev, process,
 							&pool->ext_memory[bank],
-							&pm, mem_type_id,
+							pm, mem_type_id,
 							bank, alloc);
 				if (ret == -ENXIO)
 					continue;
@@ -756,7 +1062,7 @@ int ipu_psys_allocate_resources(const struct device *dev,
 
 free_out:
 	dev_err(dev, "failed to allocate resources, ret %d\n", ret);
-	ipu_psys_reset_process_cell(dev, pg, pg_manifest, i + 1);
+	ipu_psys_reset_process_cell(dev, pg, manifest, i + 1);
 	ipu_psys_free_resources(alloc, pool);
 	return ret;
 }
@@ -852,7 +1158,7 @@ int ipu_psys_move_resources(const struct device *dev,
 
 void ipu_psys_reset_process_cell(const struct device *dev,
 				 struct ipu_fw_psys_process_group *pg,
-				 void *pg_manifest,
+				 struct ipu_psys_manifest *manifest,
 				 int process_count)
 {
 	int i;
@@ -868,19 +1174,18 @@ void ipu_psys_reset_process_cell(const struct device *dev,
 		struct ipu_fw_psys_process *process =
 		    (struct ipu_fw_psys_process *)
 		    ((char *)pg + process_offset_table[i]);
-		struct ipu_fw_generic_program_manifest pm;
-		int ret;
+		struct ipu_fw_generic_program_manifest *pm;
 
 		if (!process)
 			break;
 
-		ret = ipu_fw_psys_get_pgm_by_process(&pm, pg_manifest, process);
-		if (ret < 0) {
+		pm = ipu_psys_manifest_get_pm(manifest, process);
+		if (!pm) {
 			dev_err(dev, "can not get manifest\n");
 			break;
 		}
-		if ((pm.cell_id != res_defs->num_cells &&
-		     pm.cell_type_id == res_defs->num_cells_type))
+		if ((pm->cell_id != res_defs->num_cells &&
+		     pm->cell_type_id == res_defs->num_cells_type))
 			continue;
 		/* no return value check here because if finding free cell
 		 * failed, process cell would not set then calling clear_cell
@@ -902,3 +1207,32 @@ void ipu_psys_free_resources(struct ipu_psys_resource_alloc
 		ipu_resource_free(&alloc->resource_alloc[i]);
 	alloc->resources = 0;
 }
+
+/*
+ * Clear what `alloc' holds from the same resources of `pool', a copy of
+ * the pool it was allocated from, as if it was freed there. `alloc' itself
+ * is left untouched.
+ */
+void ipu_psys_resource_release(struct ipu_psys_resource_alloc *alloc,
+			       struct ipu_psys_resource_pool *pool)
+{
+	struct ipu_resource_alloc *ra;
+	struct ipu_resource *res;
+	unsigned int i;
+
+	pool->cells &= ~alloc->cells;
+	for (i = 0; i < alloc->resources; i++) {
+		ra = &alloc->resource_alloc[i];
+		if (ra->elements <= 0 || !ra->resource)
+			continue;
+
+		res = ipu_psys_plan_resource(pool, ra->type, ra->resource->id);
+		if (!res->bitmap)
+			continue;
+
+		if (ra->type == IPU_RESOURCE_DFM)
+			*res->bitmap &= ~(unsigned long)ra->elements;
+		else
+			bitmap_clear(res->bitmap, ra->pos, ra->elements);
+	}
+}
@@ -505,15 +505,14 @@ get_program_manifest(const struct ipu_fw_psys_pgm *manifest,
 }
 
 int
-ipu6_fw_psys_get_pgm_by_process(struct ipu_fw_generic_program_manifest *gen_pm,
-				const struct ipu_fw_psys_pgm *pg_manifest,
-				struct ipu_fw_psys_process *process)
+ipu6_fw_psys_get_pgm_by_index(struct ipu_fw_generic_program_manifest *gen_pm,
+			      const struct ipu_fw_psys_pgm *pg_manifest,
+			      unsigned int program_idx)
 {
-	u32 program_id = process->program_idx;
 	struct ipu_fw_psys_program_manifest *pm;
 	struct ipu6_fw_psys_program_manifest_ext *pm_ext;
 
-	pm = get_program_manifest(pg_manifest, program_id);
+	pm = get_program_manifest(pg_manifest, program_idx);
 
 	if (!pm)
 		return -ENOENT;
@@ -1,88 +1,222 @@
 // SPDX-License-Identifier: GPL-2.0
 // Copyright (C) 2020 - 2024 Intel Corporation
 
+#include <linux/module.h>
+
 #include "ipu-psys.h"
 #include "ipu6-ppg.h"
 
 extern bool enable_power_gating;
 
-struct sched_list {
-	struct list_head list;
-	/* to protect the list */
-	struct mutex lock;
-};
+/* Running ppgs considered for suspending at once */
+#define IPU_PSYS_PREEMPT_MAX_PPGS	32
 
-static struct sched_list start_list = {
-	.list	= LIST_HEAD_INIT(start_list.list),
-	.lock	= __MUTEX_INITIALIZER(start_list.lock),
+enum ipu_psys_sched_policy {
+	IPU_PSYS_SCHED_PRIORITY,
+	IPU_PSYS_SCHED_EDF,
 };
 
-static struct sched_list stop_list = {
-	.list	= LIST_HEAD_INIT(stop_list.list),
-	.lock	= __MUTEX_INITIALIZER(stop_list.lock),
+static unsigned int sched_policy = IPU_PSYS_SCHED_PRIORITY;
+module_param(sched_policy, uint, 0664);
+MODULE_PARM_DESC(sched_policy,
+		 "PPG scheduling policy (0: priority, 1: deadline)");
+
+static const char *const sc_list_names[] = {
+	[SCHED_START_LIST] = "start",
+	[SCHED_STOP_LIST] = "stop",
+	[SCHED_HALT_LIST] = "halt",
+	[SCHED_KCMD_LIST] = "kcmd",
 };
 
-static struct sched_list *get_sc_list(enum SCHED_LIST type)
+static struct ipu_psys_sched_list *get_sc_list(struct ipu_psys *psys,
+					      enum SCHED_LIST type)
 {
+	switch (type) {
+	case SCHED_START_LIST:
+		return &psys->sched_start;
+	case SCHED_STOP_LIST:
+		return &psys->sched_stop;
+	case SCHED_HALT_LIST:
+		return &psys->sched_halt;
+	case SCHED_KCMD_LIST:
+		return &psys->sched_kcmd;
+	}
+
 	/* for debug purposes */
-	WARN_ON(type != SCHED_START_LIST && type != SCHED_STOP_LIST);
+	WARN_ON(1);
+	return &psys->sched_start;
+}
 
-	if (type == SCHED_START_LIST)
-		return &start_list;
-	return &stop_list;
+static void ipu_psys_sched_list_init(struct ipu_psys_sched_list *sc_list)
+{
+	INIT_LIST_HEAD(&sc_list->list);
+	mutex_init(&sc_list->lock);
 }
 
-static bool is_kppg_in_list(struct ipu_psys_ppg *kppg, struct list_head *head)
+static enum hrtimer_restart ipu_psys_watchdog_fn(struct hrtimer *timer);
+
+void ipu_psys_scheduler_init(struct ipu_psys *psys)
 {
-	struct ipu_psys_ppg *tmp;
+	ipu_psys_sched_list_init(&psys->sched_start);
+	ipu_psys_sched_list_init(&psys->sched_stop);
+	ipu_psys_sched_list_init(&psys->sched_halt);
+	ipu_psys_sched_list_init(&psys->sched_kcmd);
+	init_llist_head(&psys->sched_submit);
+	spin_lock_init(&psys->wd_lock);
+	INIT_LIST_HEAD(&psys->wd_list);
+#if LINUX_VERSION_CODE < KERNEL_VERSION(6, 13, 0)
+	hrtimer_init(&psys->wd_timer, CLOCK_MONOTONIC, HRTIMER_MODE_ABS);
+	psys->wd_timer.function = ipu_psys_watchdog_fn;
+#else
+	hrtimer_setup(&psys->wd_timer, ipu_psys_watchdog_fn, CLOCK_MONOTONIC,
+		      HRTIMER_MODE_ABS);
+#endif
+	atomic_set(&psys->sched_kcmds_pending, 0);
+	atomic_set(&psys->sched_ppgs_stopping, 0);
+	atomic_set(&psys->sched_ppgs_unsettled, 0);
+}
 
-	list_for_each_entry(tmp, head, sched_list) {
-		if (kppg == tmp)
-			return true;
-	}
+void ipu_psys_scheduler_cleanup(struct ipu_psys *psys)
+{
+	hrtimer_cancel(&psys->wd_timer);
+	mutex_destroy(&psys->sched_start.lock);
+	mutex_destroy(&psys->sched_stop.lock);
+	mutex_destroy(&psys->sched_halt.lock);
+	mutex_destroy(&psys->sched_kcmd.lock);
+}
 
-	return false;
+/* A kppg is on the kcmd list independently of its state list */
+static struct list_head *get_sc_node(struct ipu_psys_ppg *kppg,
+				     enum SCHED_LIST type)
+{
+	if (type == SCHED_KCMD_LIST)
+		return &kppg->sched_kcmd_list;
+	return &kppg->sched_list;
+}
+
+/*
+ * List the l-scheduler keeps a kppg on while it is in @state, 0 for none:
+ * START/RESUME wait to be started, RUNNING can be switched out and
+ * STOP/SUSPEND wait to be halted.
+ */
+static int ipu_psys_ppg_state_list(int state)
+{
+	if (state == PPG_STATE_START || state == PPG_STATE_RESUME)
+		return SCHED_START_LIST;
+	if (state == PPG_STATE_RUNNING)
+		return SCHED_STOP_LIST;
+	if (state & PPG_STATE_STOP || state == PPG_STATE_SUSPEND)
+		return SCHED_HALT_LIST;
+	return 0;
 }
 
-void ipu_psys_scheduler_remove_kppg(struct ipu_psys_ppg *kppg,
-				    enum SCHED_LIST type)
+/*
+ * sc_list->lock only keeps one list consistent. The l-scheduler walks
+ * drop it around the work on each kppg, which is safe as psys->mutex
+ * serialises all mutators: kcmd drain, firmware events, fh_deinit and
+ * the l-scheduler run itself all hold it.
+ */
+static void ipu_psys_scheduler_remove_kppg(struct ipu_psys_ppg *kppg,
+					   enum SCHED_LIST type)
 {
-	struct sched_list *sc_list = get_sc_list(type);
-	struct ipu_psys_ppg *tmp0, *tmp1;
 	struct ipu_psys *psys = kppg->fh->psys;
+	struct ipu_psys_sched_list *sc_list = get_sc_list(psys, type);
+	struct list_head *node = get_sc_node(kppg, type);
 #if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 10, 0)
 	struct device *dev = &psys->adev->auxdev.dev;
 #endif
 
 	mutex_lock(&sc_list->lock);
-	list_for_each_entry_safe(tmp0, tmp1, &sc_list->list, sched_list) {
-		if (tmp0 == kppg) {
+	if (!list_empty(node)) {
 #if LINUX_VERSION_CODE < KERNEL_VERSION(6, 10, 0)
-			dev_dbg(&psys->adev->dev,
-				 "remove from %s list, kppg(%d 0x%p) state %d\n",
-				 type == SCHED_START_LIST ? "start" : "stop",
-				 kppg->kpg->pg->ID, kppg, kppg->state);
+		dev_dbg(&psys->adev->dev,
+			"remove from %s list, kppg(%d 0x%p) state %d\n",
+			sc_list_names[type],
+			kppg->kpg->pg->ID, kppg, kppg->state);
 #else
-			dev_dbg(dev, "remove from %s list, kppg(%d 0x%p) state %d\n",
-				type == SCHED_START_LIST ? "start" : "stop",
-				kppg->kpg->pg->ID, kppg, kppg->state);
+		dev_dbg(dev, "remove from %s list, kppg(%d 0x%p) state %d\n",
+			sc_list_names[type],
+			kppg->kpg->pg->ID, kppg, kppg->state);
 #endif
-			list_del_init(&kppg->sched_list);
-		}
+		list_del_init(node);
 	}
 	mutex_unlock(&sc_list->lock);
 }
 
-void ipu_psys_scheduler_add_kppg(struct ipu_psys_ppg *kppg,
-				 enum SCHED_LIST type)
+static bool ipu_psys_sched_edf(void)
+{
+	return READ_ONCE(sched_policy) == IPU_PSYS_SCHED_EDF;
+}
+
+/* 0 is no deadline, which is later than any deadline */
+static bool ipu_psys_deadline_before(ktime_t a, ktime_t b)
+{
+	if (!a)
+		return false;
+	return !b || ktime_before(a, b);
+}
+
+/*
+ * Whether kppg goes in front of tmp in start list: by deadline with EDF
+ * policy, by priority otherwise or when deadlines are equal.
+ */
+static bool ipu_psys_ppg_start_before(struct ipu_psys_ppg *kppg,
+				      struct ipu_psys_ppg *tmp)
+{
+	int cur_pri = kppg->pri_base + kppg->pri_dynamic;
+	int tmp_pri = tmp->pri_base + tmp->pri_dynamic;
+	ktime_t deadline = READ_ONCE(kppg->deadline);
+	ktime_t tmp_deadline = READ_ONCE(tmp->deadline);
+
+	if (ipu_psys_sched_edf() && deadline != tmp_deadline)
+		return ipu_psys_deadline_before(deadline, tmp_deadline);
+
+	return tmp_pri > cur_pri;
+}
+
+/*
+ * Start list is kept in ascending priority (or deadline) and stop list in
+ * descending priority order, halt and kcmd lists in arrival order.
+ * sc_list->lock must be held.
+ */
+static void ipu_psys_sched_list_insert(struct ipu_psys_sched_list *sc_list,
+				       struct ipu_psys_ppg *kppg,
+				       enum SCHED_LIST type)
 {
 	int cur_pri = kppg->pri_base + kppg->pri_dynamic;
-	struct sched_list *sc_list = get_sc_list(type);
+	struct list_head *node = get_sc_node(kppg, type);
+	struct ipu_psys_ppg *tmp0;
+
+	if (type != SCHED_START_LIST && type != SCHED_STOP_LIST) {
+		list_add_tail(node, &sc_list->list);
+		return;
+	}
+
+	list_for_each_entry(tmp0, &sc_list->list, sched_list) {
+		int tmp_pri = tmp0->pri_base + tmp0->pri_dynamic;
+
+		if (type == SCHED_START_LIST &&
+		    ipu_psys_ppg_start_before(kppg, tmp0)) {
+			list_add(node, tmp0->sched_list.prev);
+			return;
+		} else if (type == SCHED_STOP_LIST && tmp_pri < cur_pri) {
+			list_add(node, tmp0->sched_list.prev);
+			return;
+		}
+	}
+
+	list_add_tail(node, &sc_list->list);
+}
+
+static void ipu_psys_scheduler_add_kppg(struct ipu_psys_ppg *kppg,
+					enum SCHED_LIST type)
+{
 	struct ipu_psys *psys = kppg->fh->psys;
+	struct ipu_psys_sched_list *sc_list = get_sc_list(psys, type);
+	struct list_head *node = get_sc_node(kppg, type);
 #if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 10, 0)
 	struct device *dev = &psys->adev->auxdev.dev;
 #endif
-	struct ipu_psys_ppg *tmp0, *tmp1;
 
 #if LINUX_VERSION_CODE < KERNEL_VERSION(6, 10, 0)
 	dev_dbg(&psys->adev->dev,
@@ -90,17 +224,12 @@ void ipu_psys_scheduler_add_kppg(struct ipu_psys_ppg *kppg,
 	dev_dbg(dev,
 #endif
 		"add to %s list, kppg(%d 0x%p) state %d prio(%d %d) fh 0x%p\n",
-		type == SCHED_START_LIST ? "start" : "stop",
+		sc_list_names[type],
 		kppg->kpg->pg->ID, kppg, kppg->state,
 		kppg->pri_base, kppg->pri_dynamic, kppg->fh);
 
 	mutex_lock(&sc_list->lock);
-	if (list_empty(&sc_list->list)) {
-		list_add(&kppg->sched_list, &sc_list->list);
-		goto out;
-	}
-
-	if (is_kppg_in_list(kppg, &sc_list->list)) {
+	if (!list_empty(node)) {
 #if LINUX_VERSION_CODE < KERNEL_VERSION(6, 10, 0)
 		dev_dbg(&psys->adev->dev, "kppg already in list\n");
 #else
@@ -109,122 +238,287 @@ void ipu_psys_scheduler_add_kppg(struct ipu_psys_ppg *kppg,
 		goto out;
 	}
 
-	list_for_each_entry_safe(tmp0, tmp1, &sc_list->list, sched_list) {
-		int tmp_pri = tmp0->pri_base + tmp0->pri_dynamic;
+	ipu_psys_sched_list_insert(sc_list, kppg, type);
+out:
+	mutex_unlock(&sc_list->lock);
+}
 
-#if LINUX_VERSION_CODE < KERNEL_VERSION(6, 10, 0)
-		dev_dbg(&psys->adev->dev,
-#else
-		dev_dbg(dev,
-#endif
-			"found kppg(%d 0x%p), state %d pri(%d %d) fh 0x%p\n",
-			tmp0->kpg->pg->ID, tmp0, tmp0->state,
-			tmp0->pri_base, tmp0->pri_dynamic, tmp0->fh);
+/*
+ * Move a kppg to its place again after its sort key changed. Done under
+ * one lock hold, the l-scheduler may be walking the list meanwhile.
+ */
+static void ipu_psys_scheduler_requeue_kppg(struct ipu_psys_ppg *kppg,
+					    enum SCHED_LIST type)
+{
+	struct ipu_psys_sched_list *sc_list =
+		get_sc_list(kppg->fh->psys, type);
+	struct list_head *node = get_sc_node(kppg, type);
 
-		if (type == SCHED_START_LIST && tmp_pri > cur_pri) {
-			list_add(&kppg->sched_list, tmp0->sched_list.prev);
-			goto out;
-		} else if (type == SCHED_STOP_LIST && tmp_pri < cur_pri) {
-			list_add(&kppg->sched_list, tmp0->sched_list.prev);
-			goto out;
-		}
+	mutex_lock(&sc_list->lock);
+	if (!list_empty(node)) {
+		list_del_init(node);
+		ipu_psys_sched_list_insert(sc_list, kppg, type);
 	}
+	mutex_unlock(&sc_list->lock);
+}
 
-	list_add_tail(&kppg->sched_list, &sc_list->list);
-out:
+static bool ipu_psys_scheduler_list_empty(struct ipu_psys *psys,
+					  enum SCHED_LIST type)
+{
+	struct ipu_psys_sched_list *sc_list = get_sc_list(psys, type);
+	bool empty;
+
+	mutex_lock(&sc_list->lock);
+	empty = list_empty(&sc_list->list);
 	mutex_unlock(&sc_list->lock);
+
+	return empty;
 }
 
-static int ipu_psys_detect_resource_contention(struct ipu_psys_ppg *kppg)
+static void ipu_psys_ppg_count_state(struct ipu_psys *psys, int state,
+				     int delta)
+{
+	/* 0 is a kppg which is not created or already forgotten */
+	if (!state)
+		return;
+
+	if (state == PPG_STATE_SUSPENDING || state == PPG_STATE_STOPPING)
+		atomic_add(delta, &psys->sched_ppgs_stopping);
+	if (state != PPG_STATE_RUNNING && state != PPG_STATE_SUSPENDED &&
+	    state != PPG_STATE_STOPPED)
+		atomic_add(delta, &psys->sched_ppgs_unsettled);
+}
+
+/*
+ * All kppg state changes go through here with kppg->mutex held, so that
+ * the l-scheduler lists and counters follow the state without rescanning
+ * every kppg of every fh on each run.
+ */
+void ipu_psys_ppg_set_state(struct ipu_psys_ppg *kppg,
+			    enum ipu_psys_ppg_state state)
 {
-	struct ipu_psys_resource_pool *try_res_pool;
 	struct ipu_psys *psys = kppg->fh->psys;
+	int old_state = kppg->state;
+	int old_list = ipu_psys_ppg_state_list(old_state);
+	int new_list = ipu_psys_ppg_state_list(state);
+
+	if (old_state == state)
+		return;
+
+	if (old_list && old_list != new_list)
+		ipu_psys_scheduler_remove_kppg(kppg, old_list);
+	kppg->state = state;
+	if (new_list && old_list != new_list)
+		ipu_psys_scheduler_add_kppg(kppg, new_list);
+
+	ipu_psys_ppg_count_state(psys, old_state, -1);
+	ipu_psys_ppg_count_state(psys, state, 1);
+
+	if (state == PPG_STATE_SUSPEND || state == PPG_STATE_RESUME) {
+		kppg->state_ts = ktime_get();
+	} else if (kppg->state_ts && state == PPG_STATE_SUSPENDED) {
+		ipu_psys_lat_hist_add(psys->preempt_stats.suspend_lat,
+				      ktime_us_delta(ktime_get(),
+						     kppg->state_ts));
+		kppg->state_ts = 0;
+	} else if (kppg->state_ts && state == PPG_STATE_RUNNING &&
+		   old_state == PPG_STATE_RESUMED) {
+		ipu_psys_lat_hist_add(psys->preempt_stats.resume_lat,
+				      ktime_us_delta(ktime_get(),
+						     kppg->state_ts));
+		kppg->state_ts = 0;
+	}
+}
+
+/* Called with kppg->mutex held */
+void ipu_psys_scheduler_queue_kcmd(struct ipu_psys_ppg *kppg,
+				   struct ipu_psys_kcmd *kcmd, bool head)
+{
+	if (head)
+		list_add(&kcmd->list, &kppg->kcmds_new_list);
+	else
+		list_add_tail(&kcmd->list, &kppg->kcmds_new_list);
+
+	kcmd->pending = true;
+	atomic_inc(&kppg->fh->psys->sched_kcmds_pending);
+	ipu_psys_scheduler_add_kppg(kppg, SCHED_KCMD_LIST);
+
+	if (ipu_psys_deadline_before(kcmd->deadline, kppg->deadline)) {
+		WRITE_ONCE(kppg->deadline, kcmd->deadline);
+		if (ipu_psys_ppg_state_list(kppg->state) == SCHED_START_LIST)
+			ipu_psys_scheduler_requeue_kppg(kppg,
+							SCHED_START_LIST);
+	}
+}
+
+/*
+ * One hrtimer watches all kcmds at firmware. wd_list is kept in order of
+ * expiry and the timer always targets its head. The timer is not pulled
+ * back when the head completes, it then fires early once and moves on to
+ * the new head.
+ */
+static enum hrtimer_restart ipu_psys_watchdog_fn(struct hrtimer *timer)
+{
+	struct ipu_psys *psys = container_of(timer, struct ipu_psys, wd_timer);
 #if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 10, 0)
 	struct device *dev = &psys->adev->auxdev.dev;
 #endif
-	int ret = 0;
-	int state;
-
-	try_res_pool = kzalloc(sizeof(*try_res_pool), GFP_KERNEL);
-	if (IS_ERR_OR_NULL(try_res_pool))
-		return -ENOMEM;
-
-	mutex_lock(&kppg->mutex);
-	state = kppg->state;
-	mutex_unlock(&kppg->mutex);
-	if (state == PPG_STATE_STARTED || state == PPG_STATE_RUNNING ||
-	    state == PPG_STATE_RESUMED)
-		goto exit;
+	struct ipu_psys_kcmd *kcmd, *tmp;
+	ktime_t now = ktime_get();
+	unsigned long flags;
+
+	spin_lock_irqsave(&psys->wd_lock, flags);
+	list_for_each_entry_safe(kcmd, tmp, &psys->wd_list, wd_list) {
+		if (ktime_after(kcmd->wd_expires, now)) {
+			hrtimer_start(timer, kcmd->wd_expires,
+				      HRTIMER_MODE_ABS);
+			break;
+		}
 
-	ret = ipu_psys_res_pool_init(try_res_pool);
-	if (ret < 0) {
+		/*
+		 * A frame cannot be taken back from a running PPG, firmware
+		 * still owns its buffers. Report it once, completion is left
+		 * to firmware or to stopping the PPG.
+		 */
+		list_del_init(&kcmd->wd_list);
+		atomic64_inc(&psys->cmd_stats.timeouts);
 #if LINUX_VERSION_CODE < KERNEL_VERSION(6, 10, 0)
-		dev_err(&psys->adev->dev, "unable to alloc pg resources\n");
+		dev_warn_ratelimited(&psys->adev->dev,
 #else
-		dev_err(dev, "unable to alloc pg resources\n");
+		dev_warn_ratelimited(dev,
 #endif
-		WARN_ON(1);
-		goto exit;
+				     "kcmd 0x%p issue_id 0x%llx timed out\n",
+				     kcmd, kcmd->issue_id);
 	}
+	spin_unlock_irqrestore(&psys->wd_lock, flags);
 
-	ipu_psys_resource_copy(&psys->res_pool_running, try_res_pool);
-#if LINUX_VERSION_CODE < KERNEL_VERSION(6, 10, 0)
-	ret = ipu_psys_try_allocate_resources(&psys->adev->dev,
-					      kppg->kpg->pg,
-#else
-	ret = ipu_psys_try_allocate_resources(dev, kppg->kpg->pg,
-#endif
-					      kppg->manifest,
-					      try_res_pool);
+	return HRTIMER_NORESTART;
+}
 
-	ipu_psys_res_pool_cleanup(try_res_pool);
-exit:
-	kfree(try_res_pool);
+/* kcmd has been handed to firmware */
+void ipu_psys_scheduler_watch_kcmd(struct ipu_psys_kcmd *kcmd)
+{
+	struct ipu_psys *psys = kcmd->fh->psys;
+	struct ipu_psys_kcmd *pos;
+	unsigned long flags;
+
+	kcmd->ts_start = ktime_get();
+	kcmd->wd_expires = ktime_add_ms(kcmd->ts_start, psys->timeout);
+
+	spin_lock_irqsave(&psys->wd_lock, flags);
+	/* Nearly always the latest expiry, look from the tail */
+	list_for_each_entry_reverse(pos, &psys->wd_list, wd_list)
+		if (!ktime_after(pos->wd_expires, kcmd->wd_expires))
+			break;
+	list_add(&kcmd->wd_list, &pos->wd_list);
+	if (psys->wd_list.next == &kcmd->wd_list)
+		hrtimer_start(&psys->wd_timer, kcmd->wd_expires,
+			      HRTIMER_MODE_ABS);
+	spin_unlock_irqrestore(&psys->wd_lock, flags);
+}
 
-	return ret;
+void ipu_psys_scheduler_unwatch_kcmd(struct ipu_psys_kcmd *kcmd)
+{
+	struct ipu_psys *psys = kcmd->fh->psys;
+	unsigned long flags;
+
+	spin_lock_irqsave(&psys->wd_lock, flags);
+	if (!list_empty(&kcmd->wd_list))
+		list_del_init(&kcmd->wd_list);
+	spin_unlock_irqrestore(&psys->wd_lock, flags);
 }
 
-static void ipu_psys_scheduler_ppg_sort(struct ipu_psys *psys, bool *stopping)
+/*
+ * kcmd left kcmds_new_list/kcmds_processing_list, kppg->mutex held.
+ * kppg is NULL if it is already gone from psys->ppg_hash.
+ */
+void ipu_psys_scheduler_kcmd_done(struct ipu_psys_ppg *kppg,
+				  struct ipu_psys_kcmd *kcmd)
 {
-	struct ipu_psys_ppg *kppg, *tmp;
-	struct ipu_psys_scheduler *sched;
-	struct ipu_psys_fh *fh;
+	struct ipu_psys_kcmd *tmp;
+	ktime_t deadline = 0;
 
-	list_for_each_entry(fh, &psys->fhs, list) {
-		mutex_lock(&fh->mutex);
-		sched = &fh->sched;
+	ipu_psys_scheduler_unwatch_kcmd(kcmd);
 
-		if (list_empty(&sched->ppgs)) {
-			mutex_unlock(&fh->mutex);
-			continue;
-		}
+	if (!kcmd->pending)
+		return;
 
-		list_for_each_entry_safe(kppg, tmp, &sched->ppgs, list) {
-			mutex_lock(&kppg->mutex);
-			if (kppg->state == PPG_STATE_START ||
-			    kppg->state == PPG_STATE_RESUME) {
-				ipu_psys_scheduler_add_kppg(kppg,
-							    SCHED_START_LIST);
-			} else if (kppg->state == PPG_STATE_RUNNING) {
-				ipu_psys_scheduler_add_kppg(kppg,
-							    SCHED_STOP_LIST);
-			} else if (kppg->state == PPG_STATE_SUSPENDING ||
-				   kppg->state == PPG_STATE_STOPPING) {
-				/* there are some suspending/stopping ppgs */
-				*stopping = true;
-			} else if (kppg->state == PPG_STATE_RESUMING ||
-				   kppg->state == PPG_STATE_STARTING) {
-				   /* how about kppg are resuming/starting? */
-			}
-			mutex_unlock(&kppg->mutex);
-		}
-		mutex_unlock(&fh->mutex);
+	kcmd->pending = false;
+	atomic_dec(&kcmd->fh->psys->sched_kcmds_pending);
+
+	if (!kppg || !kcmd->deadline || kcmd->deadline != kppg->deadline)
+		return;
+
+	/* The earliest deadline is gone, look for the next one */
+	list_for_each_entry(tmp, &kppg->kcmds_new_list, list)
+		if (ipu_psys_deadline_before(tmp->deadline, deadline))
+			deadline = tmp->deadline;
+	list_for_each_entry(tmp, &kppg->kcmds_processing_list, list)
+		if (ipu_psys_deadline_before(tmp->deadline, deadline))
+			deadline = tmp->deadline;
+	if (deadline == kppg->deadline)
+		return;
+
+	/* The deadline only moves later, so does the kppg in start list */
+	WRITE_ONCE(kppg->deadline, deadline);
+	if (ipu_psys_ppg_state_list(kppg->state) == SCHED_START_LIST)
+		ipu_psys_scheduler_requeue_kppg(kppg, SCHED_START_LIST);
+}
+
+/*
+ * Drop a kppg from all l-scheduler lists and counters before it is freed.
+ * psys->mutex must be held so that no l-scheduler run is walking them.
+ */
+void ipu_psys_scheduler_forget_kppg(struct ipu_psys_ppg *kppg)
+{
+	int type = ipu_psys_ppg_state_list(kppg->state);
+
+	if (type)
+		ipu_psys_scheduler_remove_kppg(kppg, type);
+	ipu_psys_scheduler_remove_kppg(kppg, SCHED_KCMD_LIST);
+	ipu_psys_ppg_count_state(kppg->fh->psys, kppg->state, -1);
+	kppg->state = 0;
+}
+
+static int ipu_psys_detect_resource_contention(struct ipu_psys_ppg *kppg)
+{
+	struct ipu_psys *psys = kppg->fh->psys;
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 10, 0)
+	struct device *dev = &psys->adev->auxdev.dev;
+#endif
+	struct ipu_psys_resource_plan *plan;
+	int state;
+
+	mutex_lock(&kppg->mutex);
+	state = kppg->state;
+	mutex_unlock(&kppg->mutex);
+	if (state == PPG_STATE_STARTED || state == PPG_STATE_RUNNING ||
+	    state == PPG_STATE_RESUMED)
+		return 0;
+
+	/* The PG and manifest of a PPG never change, plan only once */
+	if (!kppg->res_plan) {
+		plan = ipu_psys_resource_plan_build(kppg->kpg->pg,
+						    kppg->manifest);
+		if (IS_ERR(plan))
+			return PTR_ERR(plan);
+		kppg->res_plan = plan;
 	}
+
+#if LINUX_VERSION_CODE < KERNEL_VERSION(6, 10, 0)
+	return ipu_psys_resource_plan_try(&psys->adev->dev, kppg->res_plan,
+#else
+	return ipu_psys_resource_plan_try(dev, kppg->res_plan,
+#endif
+					  kppg->kpg->pg, kppg->manifest,
+					  &psys->res_pool_running,
+					  &psys->res_pool_try);
 }
 
-static void ipu_psys_scheduler_update_start_ppg_priority(void)
+static void ipu_psys_scheduler_update_start_ppg_priority(struct ipu_psys *psys)
 {
-	struct sched_list *sc_list = get_sc_list(SCHED_START_LIST);
+	struct ipu_psys_sched_list *sc_list =
+		get_sc_list(psys, SCHED_START_LIST);
 	struct ipu_psys_ppg *kppg, *tmp;
 
 	mutex_lock(&sc_list->lock);
@@ -234,63 +528,144 @@ static void ipu_psys_scheduler_update_start_ppg_priority(void)
 	mutex_unlock(&sc_list->lock);
 }
 
-static bool ipu_psys_scheduler_switch_ppg(struct ipu_psys *psys)
+/* Whether start_kppg fits once the chosen victims are gone */
+static int ipu_psys_preempt_try(struct ipu_psys *psys,
+				struct ipu_psys_ppg *start_kppg,
+				struct ipu_psys_ppg **victims,
+				unsigned long chosen)
 {
-	struct sched_list *sc_list = get_sc_list(SCHED_STOP_LIST);
+	struct ipu_psys_resource_pool *pool = &psys->res_pool_preempt;
 #if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 10, 0)
 	struct device *dev = &psys->adev->auxdev.dev;
 #endif
+	unsigned int i;
+
+	ipu_psys_resource_copy(&psys->res_pool_running, pool);
+	for_each_set_bit(i, &chosen, IPU_PSYS_PREEMPT_MAX_PPGS)
+		ipu_psys_resource_release(&victims[i]->kpg->resource_alloc,
+					  pool);
+
+#if LINUX_VERSION_CODE < KERNEL_VERSION(6, 10, 0)
+	return ipu_psys_resource_plan_try(&psys->adev->dev,
+#else
+	return ipu_psys_resource_plan_try(dev,
+#endif
+					  start_kppg->res_plan,
+					  start_kppg->kpg->pg,
+					  start_kppg->manifest, pool,
+					  &psys->res_pool_try);
+}
+
+/*
+ * start_kppg does not fit next to the running ppgs. Take running ppgs in
+ * suspend order, the lowest priority or with EDF policy the latest
+ * deadline first, until start_kppg fits, then drop the ones it still
+ * fits without. What is left is suspended in one go.
+ */
+static bool ipu_psys_scheduler_preempt(struct ipu_psys *psys,
+				       struct ipu_psys_ppg *start_kppg)
+{
+	struct ipu_psys_sched_list *sc_list =
+		get_sc_list(psys, SCHED_STOP_LIST);
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 10, 0)
+	struct device *dev = &psys->adev->auxdev.dev;
+#endif
+	struct ipu_psys_ppg *victims[IPU_PSYS_PREEMPT_MAX_PPGS];
+	ktime_t deadline = READ_ONCE(start_kppg->deadline);
+	bool edf = ipu_psys_sched_edf() && deadline;
 	struct ipu_psys_ppg *kppg;
-	bool resched = false;
+	unsigned long chosen = 0;
+	unsigned int i, j, n = 0, nr = 0;
+
+	lockdep_assert_held(&psys->mutex);
 
 	mutex_lock(&sc_list->lock);
-	if (list_empty(&sc_list->list)) {
+	list_for_each_entry(kppg, &sc_list->list, sched_list) {
+		if (n == IPU_PSYS_PREEMPT_MAX_PPGS)
+			break;
+		/* EDF only preempts ppgs due later than start_kppg */
+		if (edf && !ipu_psys_deadline_before(deadline,
+						     READ_ONCE(kppg->deadline)))
+			continue;
+
+		/* stop list order is kept for equal deadlines */
+		for (i = n++; edf && i; i--) {
+			if (!ipu_psys_deadline_before(victims[i - 1]->deadline,
+						      kppg->deadline))
+				break;
+			victims[i] = victims[i - 1];
+		}
+		victims[i] = kppg;
+	}
+	mutex_unlock(&sc_list->lock);
+
+	for (i = 0; i < n; i++) {
+		chosen |= BIT(i);
+		if (!ipu_psys_preempt_try(psys, start_kppg, victims, chosen))
+			break;
+	}
+
+	if (i == n) {
 		/* some ppgs are RESUMING/STARTING */
 #if LINUX_VERSION_CODE < KERNEL_VERSION(6, 10, 0)
 		dev_dbg(&psys->adev->dev, "no candidated stop ppg\n");
 #else
 		dev_dbg(dev, "no candidated stop ppg\n");
 #endif
-		mutex_unlock(&sc_list->lock);
+		atomic64_inc(&psys->preempt_stats.misses);
 		return false;
 	}
-	kppg = list_first_entry(&sc_list->list, struct ipu_psys_ppg,
-				sched_list);
-	mutex_unlock(&sc_list->lock);
 
-	mutex_lock(&kppg->mutex);
-	if (!(kppg->state & PPG_STATE_STOP)) {
+	for (j = 0; j < i; j++)
+		if (!ipu_psys_preempt_try(psys, start_kppg, victims,
+					  chosen & ~BIT(j)))
+			chosen &= ~BIT(j);
+
+	for_each_set_bit(i, &chosen, IPU_PSYS_PREEMPT_MAX_PPGS) {
+		kppg = victims[i];
+		mutex_lock(&kppg->mutex);
+		if (kppg->state == PPG_STATE_RUNNING) {
 #if LINUX_VERSION_CODE < KERNEL_VERSION(6, 10, 0)
-		dev_dbg(&psys->adev->dev, "s_change:%s: %p %d -> %d\n",
+			dev_dbg(&psys->adev->dev, "s_change:%s: %p %d -> %d\n",
 #else
-		dev_dbg(dev, "s_change:%s: %p %d -> %d\n",
+			dev_dbg(dev, "s_change:%s: %p %d -> %d\n",
 #endif
-			__func__, kppg, kppg->state, PPG_STATE_SUSPEND);
-		kppg->state = PPG_STATE_SUSPEND;
-		resched = true;
+				__func__, kppg, kppg->state, PPG_STATE_SUSPEND);
+			ipu_psys_ppg_set_state(kppg, PPG_STATE_SUSPEND);
+			nr++;
+		}
+		mutex_unlock(&kppg->mutex);
 	}
-	mutex_unlock(&kppg->mutex);
 
-	return resched;
+	if (nr) {
+		atomic64_inc(&psys->preempt_stats.plans);
+		atomic64_add(nr, &psys->preempt_stats.suspended);
+	}
+
+	return nr;
 }
 
 /*
- * search all kppgs and sort them into start_list and stop_list, always start
- * first kppg(high priority) in start_list;
+ * always start first kppg(high priority) in start_list;
  * if there is resource contention, it would switch kppgs in stop_list
  * to suspend state one by one
  */
 static bool ipu_psys_scheduler_ppg_start(struct ipu_psys *psys)
 {
-	struct sched_list *sc_list = get_sc_list(SCHED_START_LIST);
+	struct ipu_psys_sched_list *sc_list =
+		get_sc_list(psys, SCHED_START_LIST);
 #if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 10, 0)
 	struct device *dev = &psys->adev->auxdev.dev;
 #endif
 	struct ipu_psys_ppg *kppg, *kppg0;
-	bool stopping_existed = false;
+	bool stopping_existed;
 	int ret;
 
-	ipu_psys_scheduler_ppg_sort(psys, &stopping_existed);
+	lockdep_assert_held(&psys->mutex);
+
+	/* A kppg waiting in halt list is on its way out as well */
+	stopping_existed = atomic_read(&psys->sched_ppgs_stopping) ||
+		!ipu_psys_scheduler_list_empty(psys, SCHED_HALT_LIST);
 
 	mutex_lock(&sc_list->lock);
 	if (list_empty(&sc_list->list)) {
@@ -323,7 +698,7 @@ static bool ipu_psys_scheduler_ppg_start(struct ipu_psys *psys)
 			 */
 			if (ret == -ENOSPC) {
 				if (!stopping_existed &&
-				    ipu_psys_scheduler_switch_ppg(psys)) {
+				    ipu_psys_scheduler_preempt(psys, kppg)) {
 					return true;
 				}
 #if LINUX_VERSION_CODE < KERNEL_VERSION(6, 10, 0)
@@ -350,9 +725,7 @@ static bool ipu_psys_scheduler_ppg_start(struct ipu_psys *psys)
 				ipu_psys_ppg_resume(kppg);
 			mutex_unlock(&kppg->mutex);
 
-			ipu_psys_scheduler_remove_kppg(kppg,
-						       SCHED_START_LIST);
-			ipu_psys_scheduler_update_start_ppg_priority();
+			ipu_psys_scheduler_update_start_ppg_priority(psys);
 		}
 		mutex_lock(&sc_list->lock);
 	}
@@ -363,69 +736,57 @@ static bool ipu_psys_scheduler_ppg_start(struct ipu_psys *psys)
 
 static bool ipu_psys_scheduler_ppg_enqueue_bufset(struct ipu_psys *psys)
 {
-	struct ipu_psys_scheduler *sched;
-	struct ipu_psys_ppg *kppg;
-	struct ipu_psys_fh *fh;
+	struct ipu_psys_sched_list *sc_list =
+		get_sc_list(psys, SCHED_KCMD_LIST);
+	struct ipu_psys_ppg *kppg, *tmp;
 	bool resched = false;
 
-	list_for_each_entry(fh, &psys->fhs, list) {
-		mutex_lock(&fh->mutex);
-		sched = &fh->sched;
-		if (list_empty(&sched->ppgs)) {
-			mutex_unlock(&fh->mutex);
-			continue;
-		}
+	lockdep_assert_held(&psys->mutex);
 
-		list_for_each_entry(kppg, &sched->ppgs, list) {
-			if (ipu_psys_ppg_enqueue_bufsets(kppg))
-				resched = true;
-		}
-		mutex_unlock(&fh->mutex);
+	mutex_lock(&sc_list->lock);
+	list_for_each_entry_safe(kppg, tmp, &sc_list->list, sched_kcmd_list) {
+		mutex_unlock(&sc_list->lock);
+		if (ipu_psys_ppg_enqueue_bufsets(kppg))
+			resched = true;
+		mutex_lock(&sc_list->lock);
 	}
+	mutex_unlock(&sc_list->lock);
 
 	return resched;
 }
 
 /*
- * This function will check all kppgs within fhs, and if kppg state
- * is STOP or SUSPEND, l-scheduler will call ppg function to stop
- * or suspend it and update stop list
+ * This function will check kppgs in halt list, which are in STOP or
+ * SUSPEND state, l-scheduler will call ppg function to stop or suspend
+ * them and they leave the list by the state change
  */
 
 static bool ipu_psys_scheduler_ppg_halt(struct ipu_psys *psys)
 {
-	struct ipu_psys_scheduler *sched;
+	struct ipu_psys_sched_list *sc_list =
+		get_sc_list(psys, SCHED_HALT_LIST);
 	struct ipu_psys_ppg *kppg, *tmp;
-	struct ipu_psys_fh *fh;
-	bool stopping_exit = false;
-
-	list_for_each_entry(fh, &psys->fhs, list) {
-		mutex_lock(&fh->mutex);
-		sched = &fh->sched;
-		if (list_empty(&sched->ppgs)) {
-			mutex_unlock(&fh->mutex);
-			continue;
-		}
+	bool stopping_exit;
 
-		list_for_each_entry_safe(kppg, tmp, &sched->ppgs, list) {
-			mutex_lock(&kppg->mutex);
-			if (kppg->state & PPG_STATE_STOP) {
-				ipu_psys_ppg_stop(kppg);
-				ipu_psys_scheduler_remove_kppg(kppg,
-							       SCHED_STOP_LIST);
-			} else if (kppg->state == PPG_STATE_SUSPEND &&
-				   list_empty(&kppg->kcmds_processing_list)) {
-				ipu_psys_ppg_suspend(kppg);
-				ipu_psys_scheduler_remove_kppg(kppg,
-							       SCHED_STOP_LIST);
-			} else if (kppg->state == PPG_STATE_SUSPENDING ||
-				   kppg->state == PPG_STATE_STOPPING) {
-				stopping_exit = true;
-			}
-			mutex_unlock(&kppg->mutex);
-		}
-		mutex_unlock(&fh->mutex);
+	lockdep_assert_held(&psys->mutex);
+
+	/* Only count the kppgs which were already waiting for FW */
+	stopping_exit = atomic_read(&psys->sched_ppgs_stopping);
+
+	mutex_lock(&sc_list->lock);
+	list_for_each_entry_safe(kppg, tmp, &sc_list->list, sched_list) {
+		mutex_unlock(&sc_list->lock);
+		mutex_lock(&kppg->mutex);
+		if (kppg->state & PPG_STATE_STOP)
+			ipu_psys_ppg_stop(kppg);
+		else if (kppg->state == PPG_STATE_SUSPEND &&
+			 list_empty(&kppg->kcmds_processing_list))
+			ipu_psys_ppg_suspend(kppg);
+		mutex_unlock(&kppg->mutex);
+		mutex_lock(&sc_list->lock);
 	}
+	mutex_unlock(&sc_list->lock);
+
 	return stopping_exit;
 }
 
@@ -450,7 +811,7 @@ static void ipu_psys_update_ppg_state_by_kcmd(struct ipu_psys *psys,
 		if (kcmd->state == KCMD_STATE_PPG_START)
 			ipu_psys_kcmd_complete(kppg, kcmd, 0);
 		else if (kcmd->state == KCMD_STATE_PPG_STOP)
-			kppg->state = PPG_STATE_STOP;
+			ipu_psys_ppg_set_state(kppg, PPG_STATE_STOP);
 	} else if (kppg->state == PPG_STATE_SUSPENDED) {
 		if (kcmd->state == KCMD_STATE_PPG_START)
 			ipu_psys_kcmd_complete(kppg, kcmd, 0);
@@ -459,12 +820,13 @@ static void ipu_psys_update_ppg_state_by_kcmd(struct ipu_psys *psys,
 			 * Record the previous state
 			 * because here need resume at first
 			 */
-			kppg->state |= PPG_STATE_STOP;
+			ipu_psys_ppg_set_state(kppg,
+					       kppg->state | PPG_STATE_STOP);
 		else if (kcmd->state == KCMD_STATE_PPG_ENQUEUE)
-			kppg->state = PPG_STATE_RESUME;
+			ipu_psys_ppg_set_state(kppg, PPG_STATE_RESUME);
 	} else if (kppg->state == PPG_STATE_STOPPED) {
 		if (kcmd->state == KCMD_STATE_PPG_START) {
-			kppg->state = PPG_STATE_START;
+			ipu_psys_ppg_set_state(kppg, PPG_STATE_START);
 		} else if (kcmd->state == KCMD_STATE_PPG_STOP) {
 			ipu_psys_kcmd_complete(kppg, kcmd, 0);
 		} else if (kcmd->state == KCMD_STATE_PPG_ENQUEUE) {
@@ -482,102 +844,46 @@ static void ipu_psys_update_ppg_state_by_kcmd(struct ipu_psys *psys,
 			__func__, kppg, old_ppg_state, kppg->state);
 }
 
+/*
+ * Only kppgs with new kcmds are in kcmd list, a kppg leaves it once all
+ * its new kcmds are processed. kcmd list is never locked with kppg->mutex
+ * held inside it, queueing a kcmd takes them the other way around.
+ */
 static void ipu_psys_scheduler_kcmd_set(struct ipu_psys *psys)
 {
+	struct ipu_psys_sched_list *sc_list =
+		get_sc_list(psys, SCHED_KCMD_LIST);
 	struct ipu_psys_kcmd *kcmd;
-	struct ipu_psys_scheduler *sched;
 	struct ipu_psys_ppg *kppg, *tmp;
-	struct ipu_psys_fh *fh;
 
-	list_for_each_entry(fh, &psys->fhs, list) {
-		mutex_lock(&fh->mutex);
-		sched = &fh->sched;
-		if (list_empty(&sched->ppgs)) {
-			mutex_unlock(&fh->mutex);
-			continue;
-		}
-
-		list_for_each_entry_safe(kppg, tmp, &sched->ppgs, list) {
-			mutex_lock(&kppg->mutex);
-			if (list_empty(&kppg->kcmds_new_list)) {
-				mutex_unlock(&kppg->mutex);
-				continue;
-			};
+	lockdep_assert_held(&psys->mutex);
 
+	mutex_lock(&sc_list->lock);
+	list_for_each_entry_safe(kppg, tmp, &sc_list->list, sched_kcmd_list) {
+		mutex_unlock(&sc_list->lock);
+		mutex_lock(&kppg->mutex);
+		if (list_empty(&kppg->kcmds_new_list)) {
+			ipu_psys_scheduler_remove_kppg(kppg, SCHED_KCMD_LIST);
+		} else {
 			kcmd = list_first_entry(&kppg->kcmds_new_list,
 						struct ipu_psys_kcmd, list);
 			ipu_psys_update_ppg_state_by_kcmd(psys, kppg, kcmd);
-			mutex_unlock(&kppg->mutex);
 		}
-		mutex_unlock(&fh->mutex);
+		mutex_unlock(&kppg->mutex);
+		mutex_lock(&sc_list->lock);
 	}
+	mutex_unlock(&sc_list->lock);
 }
 
 static bool is_ready_to_enter_power_gating(struct ipu_psys *psys)
 {
-	struct ipu_psys_scheduler *sched;
-	struct ipu_psys_ppg *kppg, *tmp;
-	struct ipu_psys_fh *fh;
-
-	list_for_each_entry(fh, &psys->fhs, list) {
-		mutex_lock(&fh->mutex);
-		sched = &fh->sched;
-		if (list_empty(&sched->ppgs)) {
-			mutex_unlock(&fh->mutex);
-			continue;
-		}
-
-		list_for_each_entry_safe(kppg, tmp, &sched->ppgs, list) {
-			mutex_lock(&kppg->mutex);
-			if (!list_empty(&kppg->kcmds_new_list) ||
-			    !list_empty(&kppg->kcmds_processing_list)) {
-				mutex_unlock(&kppg->mutex);
-				mutex_unlock(&fh->mutex);
-				return false;
-			}
-			if (!(kppg->state == PPG_STATE_RUNNING ||
-			      kppg->state == PPG_STATE_STOPPED ||
-			      kppg->state == PPG_STATE_SUSPENDED)) {
-				mutex_unlock(&kppg->mutex);
-				mutex_unlock(&fh->mutex);
-				return false;
-			}
-			mutex_unlock(&kppg->mutex);
-		}
-		mutex_unlock(&fh->mutex);
-	}
-
-	return true;
+	return !atomic_read(&psys->sched_kcmds_pending) &&
+		!atomic_read(&psys->sched_ppgs_unsettled);
 }
 
 static bool has_pending_kcmd(struct ipu_psys *psys)
 {
-	struct ipu_psys_scheduler *sched;
-	struct ipu_psys_ppg *kppg, *tmp;
-	struct ipu_psys_fh *fh;
-
-	list_for_each_entry(fh, &psys->fhs, list) {
-		mutex_lock(&fh->mutex);
-		sched = &fh->sched;
-		if (list_empty(&sched->ppgs)) {
-			mutex_unlock(&fh->mutex);
-			continue;
-		}
-
-		list_for_each_entry_safe(kppg, tmp, &sched->ppgs, list) {
-			mutex_lock(&kppg->mutex);
-			if (!list_empty(&kppg->kcmds_new_list) ||
-			    !list_empty(&kppg->kcmds_processing_list)) {
-				mutex_unlock(&kppg->mutex);
-				mutex_unlock(&fh->mutex);
-				return true;
-			}
-			mutex_unlock(&kppg->mutex);
-		}
-		mutex_unlock(&fh->mutex);
-	}
-
-	return false;
+	return atomic_read(&psys->sched_kcmds_pending);
 }
 
 static bool ipu_psys_scheduler_exit_power_gating(struct ipu_psys *psys)
@@ -604,9 +910,8 @@ static bool ipu_psys_scheduler_enter_power_gating(struct ipu_psys *psys)
 #if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 10, 0)
 	struct device *dev = &psys->adev->auxdev.dev;
 #endif
-	struct ipu_psys_scheduler *sched;
-	struct ipu_psys_ppg *kppg, *tmp;
-	struct ipu_psys_fh *fh;
+	struct ipu_psys_sched_list *sc_list;
+	struct ipu_psys_ppg *kppg;
 
 	if (!enable_power_gating)
 		return false;
@@ -626,37 +931,22 @@ static bool ipu_psys_scheduler_enter_power_gating(struct ipu_psys *psys)
 		return false;
 
 	/* Suspend ppgs one by one */
-	list_for_each_entry(fh, &psys->fhs, list) {
-		mutex_lock(&fh->mutex);
-		sched = &fh->sched;
-		if (list_empty(&sched->ppgs)) {
-			mutex_unlock(&fh->mutex);
-			continue;
-		}
-
-		list_for_each_entry_safe(kppg, tmp, &sched->ppgs, list) {
-			mutex_lock(&kppg->mutex);
-			if (kppg->state == PPG_STATE_RUNNING) {
-				kppg->state = PPG_STATE_SUSPEND;
-				mutex_unlock(&kppg->mutex);
-				mutex_unlock(&fh->mutex);
-				return true;
-			}
-
-			if (kppg->state != PPG_STATE_SUSPENDED &&
-			    kppg->state != PPG_STATE_STOPPED) {
-				/* Can't enter power gating */
-				mutex_unlock(&kppg->mutex);
-				mutex_unlock(&fh->mutex);
-				/* Need re-run l-scheduler to suspend ppg? */
-				return (kppg->state & PPG_STATE_STOP ||
-					kppg->state == PPG_STATE_SUSPEND);
-			}
-			mutex_unlock(&kppg->mutex);
-		}
-		mutex_unlock(&fh->mutex);
+	sc_list = get_sc_list(psys, SCHED_STOP_LIST);
+	mutex_lock(&sc_list->lock);
+	kppg = list_first_entry_or_null(&sc_list->list, struct ipu_psys_ppg,
+					sched_list);
+	mutex_unlock(&sc_list->lock);
+	if (kppg) {
+		mutex_lock(&kppg->mutex);
+		ipu_psys_ppg_set_state(kppg, PPG_STATE_SUSPEND);
+		mutex_unlock(&kppg->mutex);
+		return true;
 	}
 
+	/* Can't enter power gating, need re-run l-scheduler to halt ppg? */
+	if (atomic_read(&psys->sched_ppgs_unsettled))
+		return !ipu_psys_scheduler_list_empty(psys, SCHED_HALT_LIST);
+
 	psys->power_gating = PSYS_POWER_GATED;
 	ipu_psys_enter_power_gating(psys);
 
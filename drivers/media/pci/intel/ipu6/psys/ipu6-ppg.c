@@ -100,10 +100,123 @@ __get_buf_set(struct ipu_psys_fh *fh, size_t buf_set_size)
 	mutex_lock(&sched->bs_mutex);
 	list_add(&kbuf_set->list, &sched->buf_sets);
 	mutex_unlock(&sched->bs_mutex);
+	ipu_psys_hash_buf_set(fh->psys, kbuf_set);
 
 	return kbuf_set;
 }
 
+/*
+ * Preallocate IPU_PSYS_PPG_BUF_SET_DEPTH buffer sets for the PPG in one
+ * DMA allocation. All frames of a PPG use the same buffer set size, so
+ * the steady state path only has to take the next ring entry.
+ */
+int ipu_psys_ppg_bufset_ring_init(struct ipu_psys_ppg *kppg,
+				  struct ipu_psys_kcmd *kcmd)
+{
+	struct ipu_psys *psys = kppg->fh->psys;
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 10, 0) && LINUX_VERSION_CODE < KERNEL_VERSION(6, 12, 5)
+	struct device *dev = &psys->adev->auxdev.dev;
+#endif
+	struct ipu_psys_buffer_set *ring;
+	size_t stride;
+	unsigned int i;
+
+	stride = ALIGN(ipu_fw_psys_ppg_get_buffer_set_size(kcmd),
+		       IPU_PSYS_PPG_BUF_SET_ALIGN);
+
+	ring = kcalloc(IPU_PSYS_PPG_BUF_SET_DEPTH, sizeof(*ring), GFP_KERNEL);
+	if (!ring)
+		return -ENOMEM;
+
+	kppg->bs_ring_bytes = stride * IPU_PSYS_PPG_BUF_SET_DEPTH;
+#if LINUX_VERSION_CODE < KERNEL_VERSION(6, 10, 0)
+	kppg->bs_ring_kaddr = dma_alloc_attrs(&psys->adev->dev,
+					      kppg->bs_ring_bytes,
+					      &kppg->bs_ring_dma_addr,
+					      GFP_KERNEL, 0);
+#elif LINUX_VERSION_CODE < KERNEL_VERSION(6, 12, 5)
+	kppg->bs_ring_kaddr = dma_alloc_attrs(dev, kppg->bs_ring_bytes,
+					      &kppg->bs_ring_dma_addr,
+					      GFP_KERNEL, 0);
+#else
+	kppg->bs_ring_kaddr = ipu6_dma_alloc(psys->adev, kppg->bs_ring_bytes,
+					     &kppg->bs_ring_dma_addr,
+					     GFP_KERNEL, 0);
+#endif
+	if (!kppg->bs_ring_kaddr) {
+		kfree(ring);
+		return -ENOMEM;
+	}
+
+	for (i = 0; i < IPU_PSYS_PPG_BUF_SET_DEPTH; i++) {
+		INIT_LIST_HEAD(&ring[i].list);
+		ring[i].size = stride;
+		ring[i].kaddr = kppg->bs_ring_kaddr + i * stride;
+		ring[i].dma_addr = kppg->bs_ring_dma_addr + i * stride;
+		ipu_psys_hash_buf_set(psys, &ring[i]);
+	}
+
+	kppg->bs_ring = ring;
+	kppg->bs_ring_size = IPU_PSYS_PPG_BUF_SET_DEPTH;
+	kppg->bs_ring_next = 0;
+
+	return 0;
+}
+
+void ipu_psys_ppg_bufset_ring_free(struct ipu_psys_ppg *kppg)
+{
+	struct ipu_psys *psys = kppg->fh->psys;
+	unsigned int i;
+
+	if (!kppg->bs_ring)
+		return;
+
+	for (i = 0; i < kppg->bs_ring_size; i++)
+		ipu_psys_unhash_buf_set(psys, &kppg->bs_ring[i]);
+
+#if LINUX_VERSION_CODE < KERNEL_VERSION(6, 10, 0)
+	dma_free_attrs(&psys->adev->dev, kppg->bs_ring_bytes,
+		       kppg->bs_ring_kaddr, kppg->bs_ring_dma_addr, 0);
+#elif LINUX_VERSION_CODE < KERNEL_VERSION(6, 12, 5)
+	dma_free_attrs(&psys->adev->auxdev.dev, kppg->bs_ring_bytes,
+		       kppg->bs_ring_kaddr, kppg->bs_ring_dma_addr, 0);
+#else
+	ipu6_dma_free(psys->adev, kppg->bs_ring_bytes, kppg->bs_ring_kaddr,
+		      kppg->bs_ring_dma_addr, 0);
+#endif
+	kfree(kppg->bs_ring);
+	kppg->bs_ring = NULL;
+	kppg->bs_ring_size = 0;
+}
+
+static struct ipu_psys_buffer_set *
+__get_ring_buf_set(struct ipu_psys_ppg *kppg, size_t buf_set_size)
+{
+	struct ipu_psys_scheduler *sched = &kppg->fh->sched;
+	struct ipu_psys_buffer_set *kbuf_set;
+	unsigned int i;
+
+	if (!kppg->bs_ring)
+		return NULL;
+
+	/* Frames retire in order, so the next entry is normally free */
+	mutex_lock(&sched->bs_mutex);
+	for (i = 0; i < kppg->bs_ring_size; i++) {
+		kbuf_set = &kppg->bs_ring[kppg->bs_ring_next];
+		kppg->bs_ring_next = (kppg->bs_ring_next + 1) %
+			kppg->bs_ring_size;
+		if (!kbuf_set->buf_set_size &&
+		    kbuf_set->size >= buf_set_size) {
+			kbuf_set->buf_set_size = buf_set_size;
+			mutex_unlock(&sched->bs_mutex);
+			return kbuf_set;
+		}
+	}
+	mutex_unlock(&sched->bs_mutex);
+
+	return NULL;
+}
+
 static struct ipu_psys_buffer_set *
 ipu_psys_create_buffer_set(struct ipu_psys_kcmd *kcmd,
 			   struct ipu_psys_ppg *kppg)
@@ -119,7 +232,15 @@ ipu_psys_create_buffer_set(struct ipu_psys_kcmd *kcmd,
 
 	buf_set_size = ipu_fw_psys_ppg_get_buffer_set_size(kcmd);
 
-	kbuf_set = __get_buf_set(fh, buf_set_size);
+	kbuf_set = __get_ring_buf_set(kppg, buf_set_size);
+	if (kbuf_set) {
+		atomic64_inc(&psys->bs_ring_hits);
+	} else {
+		/* Only a ring that ran out counts, not a PPG without one */
+		if (kppg->bs_ring)
+			atomic64_inc(&psys->bs_ring_misses);
+		kbuf_set = __get_buf_set(fh, buf_set_size);
+	}
 	if (!kbuf_set) {
 #if LINUX_VERSION_CODE < KERNEL_VERSION(6, 10, 0)
 		dev_err(&psys->adev->dev, "failed to create buffer set\n");
@@ -201,7 +322,7 @@ void ipu_psys_ppg_complete(struct ipu_psys *psys, struct ipu_psys_ppg *kppg)
 			.kpg = kppg->kpg,
 		};
 
-		kppg->state = PPG_STATE_STOPPED;
+		ipu_psys_ppg_set_state(kppg, PPG_STATE_STOPPED);
 		ipu_psys_free_resources(&kppg->kpg->resource_alloc,
 					&psys->res_pool_running);
 		queue_id = ipu_fw_psys_ppg_get_base_queue_id(&tmp_kcmd);
@@ -210,12 +331,12 @@ void ipu_psys_ppg_complete(struct ipu_psys *psys, struct ipu_psys_ppg *kppg)
 		pm_runtime_put(&psys->adev->dev);
 	} else {
 		if (kppg->state == PPG_STATE_SUSPENDING) {
-			kppg->state = PPG_STATE_SUSPENDED;
+			ipu_psys_ppg_set_state(kppg, PPG_STATE_SUSPENDED);
 			ipu_psys_free_resources(&kppg->kpg->resource_alloc,
 						&psys->res_pool_running);
 		} else if (kppg->state == PPG_STATE_STARTED ||
 			   kppg->state == PPG_STATE_RESUMED) {
-			kppg->state = PPG_STATE_RUNNING;
+			ipu_psys_ppg_set_state(kppg, PPG_STATE_RUNNING);
 		}
 
 		/* Kick l-scheduler thread for FW callback,
@@ -247,7 +368,7 @@ int ipu_psys_ppg_start(struct ipu_psys_ppg *kppg)
 	dev_dbg(&psys->adev->dev, "start ppg id %d, addr 0x%p\n",
 		ipu_fw_psys_pg_get_id(kcmd), kppg);
 
-	kppg->state = PPG_STATE_STARTING;
+	ipu_psys_ppg_set_state(kppg, PPG_STATE_STARTING);
 	for (i = 0; i < kcmd->nbuffers; i++) {
 		struct ipu_fw_psys_terminal *terminal;
 
@@ -293,7 +414,7 @@ int ipu_psys_ppg_start(struct ipu_psys_ppg *kppg)
 
 	dev_dbg(&psys->adev->dev, "s_change:%s: %p %d -> %d\n",
 		__func__, kppg, kppg->state, PPG_STATE_STARTED);
-	kppg->state = PPG_STATE_STARTED;
+	ipu_psys_ppg_set_state(kppg, PPG_STATE_STARTED);
 	ipu_psys_kcmd_complete(kppg, kcmd, 0);
 
 	return 0;
@@ -323,7 +444,7 @@ int ipu_psys_ppg_resume(struct ipu_psys_ppg *kppg)
 	dev_dbg(&psys->adev->dev, "resume ppg id %d, addr 0x%p\n",
 		ipu_fw_psys_pg_get_id(&tmp_kcmd), kppg);
 
-	kppg->state = PPG_STATE_RESUMING;
+	ipu_psys_ppg_set_state(kppg, PPG_STATE_RESUMING);
 	if (enable_suspend_resume) {
 		ret = ipu_psys_allocate_resources(&psys->adev->dev,
 						  kppg->kpg->pg,
@@ -366,7 +487,7 @@ int ipu_psys_ppg_resume(struct ipu_psys_ppg *kppg)
 	}
 	dev_dbg(&psys->adev->dev, "s_change:%s: %p %d -> %d\n",
 		__func__, kppg, kppg->state, PPG_STATE_RESUMED);
-	kppg->state = PPG_STATE_RESUMED;
+	ipu_psys_ppg_set_state(kppg, PPG_STATE_RESUMED);
 
 	return 0;
 
@@ -396,8 +517,6 @@ int ipu_psys_ppg_stop(struct ipu_psys_ppg *kppg)
 		kcmd_temp.kpg = kppg->kpg;
 		kcmd_temp.fh = kppg->fh;
 		kcmd = &kcmd_temp;
-		/* delete kppg in stop list to avoid this ppg resuming */
-		ipu_psys_scheduler_remove_kppg(kppg, SCHED_STOP_LIST);
 	}
 
 	ppg_id = ipu_fw_psys_pg_get_id(kcmd);
@@ -421,7 +540,7 @@ int ipu_psys_ppg_stop(struct ipu_psys_ppg *kppg)
 				"s_change:%s %p %d -> %d\n", __func__,
 				kppg, kppg->state, PPG_STATE_STOPPED);
 			pm_runtime_put(&psys->adev->dev);
-			kppg->state = PPG_STATE_STOPPED;
+			ipu_psys_ppg_set_state(kppg, PPG_STATE_STOPPED);
 			return 0;
 		} else {
 			return 0;
@@ -429,10 +548,12 @@ int ipu_psys_ppg_stop(struct ipu_psys_ppg *kppg)
 	}
 	dev_dbg(&psys->adev->dev, "s_change:%s %p %d -> %d\n",
 		__func__, kppg, kppg->state, PPG_STATE_STOPPING);
-	kppg->state = PPG_STATE_STOPPING;
+	ipu_psys_ppg_set_state(kppg, PPG_STATE_STOPPING);
 	ret = ipu_fw_psys_pg_abort(kcmd);
 	if (ret)
 		dev_err(&psys->adev->dev, "ppg(%d) failed to abort\n", ppg_id);
+	else if (kcmd != &kcmd_temp)
+		ipu_psys_scheduler_watch_kcmd(kcmd);
 
 	return ret;
 }
@@ -451,7 +572,7 @@ int ipu_psys_ppg_suspend(struct ipu_psys_ppg *kppg)
 
 	dev_dbg(&psys->adev->dev, "s_change:%s %p %d -> %d\n",
 		__func__, kppg, kppg->state, PPG_STATE_SUSPENDING);
-	kppg->state = PPG_STATE_SUSPENDING;
+	ipu_psys_ppg_set_state(kppg, PPG_STATE_SUSPENDING);
 	if (enable_suspend_resume)
 		ret = ipu_fw_psys_ppg_suspend(&tmp_kcmd);
 	else
@@ -523,7 +644,7 @@ void ipu_psys_ppg_complete(struct ipu_psys *psys, struct ipu_psys_ppg *kppg)
 			.kpg = kppg->kpg,
 		};
 
-		kppg->state = PPG_STATE_STOPPED;
+		ipu_psys_ppg_set_state(kppg, PPG_STATE_STOPPED);
 		ipu_psys_free_resources(&kppg->kpg->resource_alloc,
 					&psys->res_pool_running);
 		queue_id = ipu_fw_psys_ppg_get_base_queue_id(&tmp_kcmd);
@@ -531,12 +652,12 @@ void ipu_psys_ppg_complete(struct ipu_psys *psys, struct ipu_psys_ppg *kppg)
 		pm_runtime_put(dev);
 	} else {
 		if (kppg->state == PPG_STATE_SUSPENDING) {
-			kppg->state = PPG_STATE_SUSPENDED;
+			ipu_psys_ppg_set_state(kppg, PPG_STATE_SUSPENDED);
 			ipu_psys_free_resources(&kppg->kpg->resource_alloc,
 						&psys->res_pool_running);
 		} else if (kppg->state == PPG_STATE_STARTED ||
 			   kppg->state == PPG_STATE_RESUMED) {
-			kppg->state = PPG_STATE_RUNNING;
+			ipu_psys_ppg_set_state(kppg, PPG_STATE_RUNNING);
 		}
 
 		/* Kick l-scheduler thread for FW callback,
@@ -569,7 +690,7 @@ int ipu_psys_ppg_start(struct ipu_psys_ppg *kppg)
 	dev_dbg(dev, "start ppg id %d, addr 0x%p\n",
 		ipu_fw_psys_pg_get_id(kcmd), kppg);
 
-	kppg->state = PPG_STATE_STARTING;
+	ipu_psys_ppg_set_state(kppg, PPG_STATE_STARTING);
 	for (i = 0; i < kcmd->nbuffers; i++) {
 		struct ipu_fw_psys_terminal *terminal;
 
@@ -613,7 +734,7 @@ int ipu_psys_ppg_start(struct ipu_psys_ppg *kppg)
 
 	dev_dbg(dev, "s_change:%s: %p %d -> %d\n",
 		__func__, kppg, kppg->state, PPG_STATE_STARTED);
-	kppg->state = PPG_STATE_STARTED;
+	ipu_psys_ppg_set_state(kppg, PPG_STATE_STARTED);
 	ipu_psys_kcmd_complete(kppg, kcmd, 0);
 
 	return 0;
@@ -642,7 +763,7 @@ int ipu_psys_ppg_resume(struct ipu_psys_ppg *kppg)
 	dev_dbg(dev, "resume ppg id %d, addr 0x%p\n",
 		ipu_fw_psys_pg_get_id(&tmp_kcmd), kppg);
 
-	kppg->state = PPG_STATE_RESUMING;
+	ipu_psys_ppg_set_state(kppg, PPG_STATE_RESUMING);
 	if (enable_suspend_resume) {
 		ret = ipu_psys_allocate_resources(dev, kppg->kpg->pg,
 						  kppg->manifest,
@@ -683,7 +804,7 @@ int ipu_psys_ppg_resume(struct ipu_psys_ppg *kppg)
 	}
 	dev_dbg(dev, "s_change:%s: %p %d -> %d\n",
 		__func__, kppg, kppg->state, PPG_STATE_RESUMED);
-	kppg->state = PPG_STATE_RESUMED;
+	ipu_psys_ppg_set_state(kppg, PPG_STATE_RESUMED);
 
 	return 0;
 
@@ -712,8 +833,6 @@ int ipu_psys_ppg_stop(struct ipu_psys_ppg *kppg)
 		kcmd_temp.kpg = kppg->kpg;
 		kcmd_temp.fh = kppg->fh;
 		kcmd = &kcmd_temp;
-		/* delete kppg in stop list to avoid this ppg resuming */
-		ipu_psys_scheduler_remove_kppg(kppg, SCHED_STOP_LIST);
 	}
 
 	ppg_id = ipu_fw_psys_pg_get_id(kcmd);
@@ -737,7 +856,7 @@ int ipu_psys_ppg_stop(struct ipu_psys_ppg *kppg)
 			dev_dbg(dev, "s_change:%s %p %d -> %d\n", __func__,
 				kppg, kppg->state, PPG_STATE_STOPPED);
 			pm_runtime_put(dev);
-			kppg->state = PPG_STATE_STOPPED;
+			ipu_psys_ppg_set_state(kppg, PPG_STATE_STOPPED);
 
 			return 0;
 		} else {
@@ -746,10 +865,12 @@ int ipu_psys_ppg_stop(struct ipu_psys_ppg *kppg)
 	}
 	dev_dbg(dev, "s_change:%s %p %d -> %d\n", __func__, kppg, kppg->state,
 		PPG_STATE_STOPPING);
-	kppg->state = PPG_STATE_STOPPING;
+	ipu_psys_ppg_set_state(kppg, PPG_STATE_STOPPING);
 	ret = ipu_fw_psys_pg_abort(kcmd);
 	if (ret)
 		dev_err(dev, "ppg(%d) failed to abort\n", ppg_id);
+	else if (kcmd != &kcmd_temp)
+		ipu_psys_scheduler_watch_kcmd(kcmd);
 
 	return ret;
 }
@@ -769,7 +890,7 @@ int ipu_psys_ppg_suspend(struct ipu_psys_ppg *kppg)
 
 	dev_dbg(dev, "s_change:%s %p %d -> %d\n", __func__, kppg, kppg->state,
 		PPG_STATE_SUSPENDING);
-	kppg->state = PPG_STATE_SUSPENDING;
+	ipu_psys_ppg_set_state(kppg, PPG_STATE_SUSPENDING);
 	if (enable_suspend_resume)
 		ret = ipu_fw_psys_ppg_suspend(&tmp_kcmd);
 	else
@@ -829,6 +950,7 @@ bool ipu_psys_ppg_enqueue_bufsets(struct ipu_psys_ppg *kppg)
 				}
 				list_move_tail(&kcmd->list,
 					       &kppg->kcmds_processing_list);
+				ipu_psys_scheduler_watch_kcmd(kcmd);
 #if LINUX_VERSION_CODE < KERNEL_VERSION(6, 10, 0)
 				dev_dbg(&psys->adev->dev,
 #else
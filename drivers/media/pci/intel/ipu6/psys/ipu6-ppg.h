@@ -10,7 +10,9 @@
 /* starting from '2' in case of someone passes true or false */
 enum SCHED_LIST {
 	SCHED_START_LIST = 2,
-	SCHED_STOP_LIST
+	SCHED_STOP_LIST,
+	SCHED_HALT_LIST,
+	SCHED_KCMD_LIST
 };
 
 enum ipu_psys_power_gating_state {
@@ -19,13 +21,21 @@ enum ipu_psys_power_gating_state {
 	PSYS_POWER_GATED
 };
 
+int ipu_psys_ppg_bufset_ring_init(struct ipu_psys_ppg *kppg,
+				  struct ipu_psys_kcmd *kcmd);
+void ipu_psys_ppg_bufset_ring_free(struct ipu_psys_ppg *kppg);
 int ipu_psys_ppg_get_bufset(struct ipu_psys_kcmd *kcmd,
 			    struct ipu_psys_ppg *kppg);
 struct ipu_psys_kcmd *ipu_psys_ppg_get_stop_kcmd(struct ipu_psys_ppg *kppg);
-void ipu_psys_scheduler_remove_kppg(struct ipu_psys_ppg *kppg,
-				    enum SCHED_LIST type);
-void ipu_psys_scheduler_add_kppg(struct ipu_psys_ppg *kppg,
-				 enum SCHED_LIST type);
+void ipu_psys_ppg_set_state(struct ipu_psys_ppg *kppg,
+			    enum ipu_psys_ppg_state state);
+void ipu_psys_scheduler_queue_kcmd(struct ipu_psys_ppg *kppg,
+				   struct ipu_psys_kcmd *kcmd, bool head);
+void ipu_psys_scheduler_kcmd_done(struct ipu_psys_ppg *kppg,
+				  struct ipu_psys_kcmd *kcmd);
+void ipu_psys_scheduler_watch_kcmd(struct ipu_psys_kcmd *kcmd);
+void ipu_psys_scheduler_unwatch_kcmd(struct ipu_psys_kcmd *kcmd);
+void ipu_psys_scheduler_forget_kppg(struct ipu_psys_ppg *kppg);
 int ipu_psys_ppg_start(struct ipu_psys_ppg *kppg);
 int ipu_psys_ppg_resume(struct ipu_psys_ppg *kppg);
 int ipu_psys_ppg_stop(struct ipu_psys_ppg *kppg);
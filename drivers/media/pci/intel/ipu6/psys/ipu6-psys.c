@@ -255,7 +255,8 @@ static void ipu_psys_kcmd_free(struct ipu_psys_kcmd *kcmd)
 	if (!kcmd)
 		return;
 
-	kppg = ipu_psys_identify_kppg(kcmd);
+	/* kpg is gone if the kcmd never made it to a PPG */
+	kppg = kcmd->kpg ? ipu_psys_identify_kppg(kcmd) : NULL;
 	sched = &kcmd->fh->sched;
 
 	if (kcmd->kbuf_set) {
@@ -269,13 +270,54 @@ static void ipu_psys_kcmd_free(struct ipu_psys_kcmd *kcmd)
 		mutex_lock(&kppg->mutex);
 		if (!list_empty(&kcmd->list))
 			list_del(&kcmd->list);
+		ipu_psys_scheduler_kcmd_done(kppg, kcmd);
 		mutex_unlock(&kppg->mutex);
+	} else {
+		ipu_psys_scheduler_kcmd_done(NULL, kcmd);
+	}
+
+	spin_lock(&kcmd->fh->done_lock);
+	if (!list_empty(&kcmd->done_list))
+		list_del(&kcmd->done_list);
+	spin_unlock(&kcmd->fh->done_lock);
+
+	ipu_psys_manifest_put(kcmd->fh->psys, kcmd->pg_manifest);
+	if (kcmd->kpg_owned)
+		__put_pg_buf(kcmd->fh->psys, kcmd->kpg);
+	if (kcmd->kbufs != kcmd->kbufs_inline)
+		kfree(kcmd->kbufs);
+	if (kcmd->buffers != kcmd->buffers_inline)
+		kfree(kcmd->buffers);
+	kmem_cache_free(ipu_psys_kcmd_cache, kcmd);
+}
+
+/*
+ * Later commands of a PPG carry the manifest of its START command, they
+ * share the PPG's one without copying it. Everything else goes through
+ * the device manifest cache.
+ */
+static int ipu_psys_kcmd_get_manifest(struct ipu_psys_kcmd *kcmd,
+				      struct ipu_psys_command *cmd)
+{
+	struct ipu_psys_manifest *manifest;
+	struct ipu_psys_ppg *kppg;
+
+	if (kcmd->state != KCMD_STATE_PPG_START) {
+		kppg = ipu_psys_identify_kppg(kcmd);
+		if (kppg && kppg->manifest->size == cmd->pg_manifest_size) {
+			kcmd->pg_manifest =
+				ipu_psys_manifest_ref(kppg->manifest);
+			return 0;
+		}
 	}
 
-	kfree(kcmd->pg_manifest);
-	kfree(kcmd->kbufs);
-	kfree(kcmd->buffers);
-	kfree(kcmd);
+	manifest = ipu_psys_manifest_get(kcmd->fh->psys, cmd->pg_manifest,
+					 cmd->pg_manifest_size);
+	if (IS_ERR(manifest))
+		return PTR_ERR(manifest);
+
+	kcmd->pg_manifest = manifest;
+	return 0;
 }
 
 static struct ipu_psys_kcmd *ipu_psys_copy_cmd(struct ipu_psys_command *cmd,
@@ -299,13 +341,18 @@ static struct ipu_psys_kcmd *ipu_psys_copy_cmd(struct ipu_psys_command *cmd,
 	if (!cmd->pg_manifest_size)
 		return NULL;
 
-	kcmd = kzalloc(sizeof(*kcmd), GFP_KERNEL);
+	kcmd = kmem_cache_zalloc(ipu_psys_kcmd_cache, GFP_KERNEL);
 	if (!kcmd)
 		return NULL;
+	atomic64_inc(&psys->alloc_stats.cmds);
+	atomic64_inc(&psys->alloc_stats.cache);
 
 	kcmd->state = KCMD_STATE_PPG_NEW;
 	kcmd->fh = fh;
+	kcmd->ts_submit = ktime_get();
 	INIT_LIST_HEAD(&kcmd->list);
+	INIT_LIST_HEAD(&kcmd->done_list);
+	INIT_LIST_HEAD(&kcmd->wd_list);
 
 	mutex_lock(&fh->mutex);
 	fd = cmd->pg;
@@ -338,25 +385,18 @@ static struct ipu_psys_kcmd *ipu_psys_copy_cmd(struct ipu_psys_command *cmd,
 	kcmd->kpg = __get_pg_buf(psys, kpgbuf->len);
 	if (!kcmd->kpg)
 		goto error;
+	kcmd->kpg_owned = true;
 
 	memcpy(kcmd->kpg->pg, kcmd->pg_user, kcmd->kpg->pg_size);
 
-	kcmd->pg_manifest = kzalloc(cmd->pg_manifest_size, GFP_KERNEL);
-	if (!kcmd->pg_manifest)
-		goto error;
-
-	ret = copy_from_user(kcmd->pg_manifest, cmd->pg_manifest,
-			     cmd->pg_manifest_size);
-	if (ret)
-		goto error;
-
-	kcmd->pg_manifest_size = cmd->pg_manifest_size;
-
 	kcmd->user_token = cmd->user_token;
 	kcmd->issue_id = cmd->issue_id;
 	kcmd->priority = cmd->priority;
 	if (kcmd->priority >= IPU_PSYS_CMD_PRIORITY_NUM)
 		goto error;
+	if (cmd->flags & IPU_PSYS_CMD_FLAG_DEADLINE && cmd->deadline_us)
+		kcmd->deadline = ktime_add_us(kcmd->ts_submit,
+					      cmd->deadline_us);
 
 	/*
 	 * Kernel enable bitmap be used only.
@@ -365,19 +405,27 @@ static struct ipu_psys_kcmd *ipu_psys_copy_cmd(struct ipu_psys_command *cmd,
 	       sizeof(cmd->kernel_enable_bitmap));
 
 	kcmd->nbuffers = ipu_fw_psys_pg_get_terminal_count(kcmd);
-	kcmd->buffers = kcalloc(kcmd->nbuffers, sizeof(*kcmd->buffers),
-				GFP_KERNEL);
-	if (!kcmd->buffers)
-		goto error;
+	if (kcmd->nbuffers <= IPU_PSYS_KCMD_INLINE_BUFS) {
+		kcmd->buffers = kcmd->buffers_inline;
+		kcmd->kbufs = kcmd->kbufs_inline;
+	} else {
+		kcmd->buffers = kcalloc(kcmd->nbuffers,
+					sizeof(*kcmd->buffers), GFP_KERNEL);
+		if (!kcmd->buffers)
+			goto error;
 
-	kcmd->kbufs = kcalloc(kcmd->nbuffers, sizeof(kcmd->kbufs[0]),
-			      GFP_KERNEL);
-	if (!kcmd->kbufs)
-		goto error;
+		kcmd->kbufs = kcalloc(kcmd->nbuffers, sizeof(kcmd->kbufs[0]),
+				      GFP_KERNEL);
+		if (!kcmd->kbufs)
+			goto error;
+		atomic64_add(2, &psys->alloc_stats.heap);
+	}
 
 	/* should be stop cmd for ppg */
 	if (!cmd->buffers) {
 		kcmd->state = KCMD_STATE_PPG_STOP;
+		if (ipu_psys_kcmd_get_manifest(kcmd, cmd))
+			goto error;
 		return kcmd;
 	}
 
@@ -473,6 +521,9 @@ static struct ipu_psys_kcmd *ipu_psys_copy_cmd(struct ipu_psys_command *cmd,
 	if (kcmd->state != KCMD_STATE_PPG_START)
 		kcmd->state = KCMD_STATE_PPG_ENQUEUE;
 
+	if (ipu_psys_kcmd_get_manifest(kcmd, cmd))
+		goto error;
+
 	return kcmd;
 error:
 	ipu_psys_kcmd_free(kcmd);
@@ -486,25 +537,36 @@ error:
 	return NULL;
 }
 
+void ipu_psys_hash_buf_set(struct ipu_psys *psys,
+			   struct ipu_psys_buffer_set *kbuf_set)
+{
+	spin_lock(&psys->addr_lock);
+	hash_add(psys->bufset_hash, &kbuf_set->hnode, (u32)kbuf_set->dma_addr);
+	spin_unlock(&psys->addr_lock);
+}
+
+void ipu_psys_unhash_buf_set(struct ipu_psys *psys,
+			     struct ipu_psys_buffer_set *kbuf_set)
+{
+	spin_lock(&psys->addr_lock);
+	hash_del(&kbuf_set->hnode);
+	spin_unlock(&psys->addr_lock);
+}
+
 static struct ipu_psys_buffer_set *
 ipu_psys_lookup_kbuffer_set(struct ipu_psys *psys, u32 addr)
 {
-	struct ipu_psys_fh *fh;
 	struct ipu_psys_buffer_set *kbuf_set;
-	struct ipu_psys_scheduler *sched;
 
-	list_for_each_entry(fh, &psys->fhs, list) {
-		sched = &fh->sched;
-		mutex_lock(&sched->bs_mutex);
-		list_for_each_entry(kbuf_set, &sched->buf_sets, list) {
-			if (kbuf_set->buf_set &&
-			    kbuf_set->buf_set->ipu_virtual_address == addr) {
-				mutex_unlock(&sched->bs_mutex);
-				return kbuf_set;
-			}
+	spin_lock(&psys->addr_lock);
+	hash_for_each_possible(psys->bufset_hash, kbuf_set, hnode, addr) {
+		if (kbuf_set->buf_set &&
+		    kbuf_set->buf_set->ipu_virtual_address == addr) {
+			spin_unlock(&psys->addr_lock);
+			return kbuf_set;
 		}
-		mutex_unlock(&sched->bs_mutex);
 	}
+	spin_unlock(&psys->addr_lock);
 
 	return NULL;
 }
@@ -512,26 +574,16 @@ ipu_psys_lookup_kbuffer_set(struct ipu_psys *psys, u32 addr)
 static struct ipu_psys_ppg *ipu_psys_lookup_ppg(struct ipu_psys *psys,
 						dma_addr_t pg_addr)
 {
-	struct ipu_psys_scheduler *sched;
-	struct ipu_psys_ppg *kppg, *tmp;
-	struct ipu_psys_fh *fh;
+	struct ipu_psys_ppg *kppg;
 
-	list_for_each_entry(fh, &psys->fhs, list) {
-		sched = &fh->sched;
-		mutex_lock(&fh->mutex);
-		if (list_empty(&sched->ppgs)) {
-			mutex_unlock(&fh->mutex);
+	spin_lock(&psys->addr_lock);
+	hash_for_each_possible(psys->ppg_hash, kppg, hnode, (u32)pg_addr) {
+		if (pg_addr != kppg->kpg->pg_dma_addr)
 			continue;
-		}
-
-		list_for_each_entry_safe(kppg, tmp, &sched->ppgs, list) {
-			if (pg_addr != kppg->kpg->pg_dma_addr)
-				continue;
-			mutex_unlock(&fh->mutex);
-			return kppg;
-		}
-		mutex_unlock(&fh->mutex);
+		spin_unlock(&psys->addr_lock);
+		return kppg;
 	}
+	spin_unlock(&psys->addr_lock);
 
 	return NULL;
 }
@@ -608,6 +660,86 @@ ipu_buttress_remove_psys_constraint(struct ipu6_device *isp,
 }
 #endif
 
+/*
+ * Publish completed kcmds to the event ring, oldest first, as long as
+ * there is room. Published kcmds are moved to kcmds_reap to be freed
+ * outside of the completion path. Called with fh->done_lock held.
+ */
+static void ipu_psys_event_ring_flush(struct ipu_psys_fh *fh)
+{
+	struct ipu_psys_event_ring *ring = fh->ring;
+	struct ipu_psys_kcmd *kcmd, *kcmd0;
+	u32 tail;
+
+	if (!ring)
+		return;
+
+	/* Order reading the consumer index before reusing its entries */
+	tail = smp_load_acquire(&ring->tail);
+	list_for_each_entry_safe(kcmd, kcmd0, &fh->kcmds_done, done_list) {
+		if (fh->ring_head - tail >= IPU_PSYS_EVENT_RING_ENTRIES)
+			break;
+
+		ring->events[fh->ring_head % IPU_PSYS_EVENT_RING_ENTRIES] =
+			kcmd->ev;
+		fh->ring_head++;
+		list_move_tail(&kcmd->done_list, &fh->kcmds_reap);
+	}
+
+	smp_store_release(&ring->head, fh->ring_head);
+	WRITE_ONCE(ring->flags, list_empty(&fh->kcmds_done) ?
+		   0 : IPU_PSYS_EVENT_RING_OVERFLOW);
+}
+
+/* Free kcmds whose events went to the ring, and retry the overflow */
+void ipu_psys_reap_kcmds(struct ipu_psys_fh *fh)
+{
+	struct ipu_psys_kcmd *kcmd, *kcmd0;
+	LIST_HEAD(reap);
+
+	spin_lock(&fh->done_lock);
+	if (!fh->ring) {
+		spin_unlock(&fh->done_lock);
+		return;
+	}
+	ipu_psys_event_ring_flush(fh);
+	list_splice_init(&fh->kcmds_reap, &reap);
+	spin_unlock(&fh->done_lock);
+
+	list_for_each_entry_safe(kcmd, kcmd0, &reap, done_list)
+		ipu_psys_kcmd_free(kcmd);
+}
+
+bool ipu_psys_events_pending(struct ipu_psys_fh *fh)
+{
+	bool pending;
+
+	spin_lock(&fh->done_lock);
+	pending = !list_empty(&fh->kcmds_done) ||
+		(fh->ring && fh->ring_head != READ_ONCE(fh->ring->tail));
+	spin_unlock(&fh->done_lock);
+
+	return pending;
+}
+
+static void ipu_psys_kcmd_account(struct ipu_psys *psys,
+				  struct ipu_psys_kcmd *kcmd)
+{
+	struct ipu_psys_cmd_stats *stats = &psys->cmd_stats;
+	ktime_t now = ktime_get();
+
+	ipu_psys_lat_hist_add(stats->total_lat,
+			      ktime_us_delta(now, kcmd->ts_submit));
+	/* START commands are done by the time they reach firmware */
+	if (!kcmd->ts_start)
+		return;
+
+	ipu_psys_lat_hist_add(stats->queue_lat,
+			      ktime_us_delta(kcmd->ts_start, kcmd->ts_submit));
+	ipu_psys_lat_hist_add(stats->fw_lat,
+			      ktime_us_delta(now, kcmd->ts_start));
+}
+
 /*
  * Move kcmd into completed state (due to running finished or failure).
  * Fill up the event struct and notify waiters.
@@ -626,6 +758,8 @@ void ipu_psys_kcmd_complete(struct ipu_psys_ppg *kppg,
 	kcmd->ev.issue_id = kcmd->issue_id;
 	kcmd->ev.error = error;
 	list_move_tail(&kcmd->list, &kppg->kcmds_finished_list);
+	ipu_psys_scheduler_kcmd_done(kppg, kcmd);
+	ipu_psys_kcmd_account(psys, kcmd);
 
 	if (kcmd->constraint.min_freq)
 		ipu_buttress_remove_psys_constraint(psys->adev->isp,
@@ -648,6 +782,12 @@ void ipu_psys_kcmd_complete(struct ipu_psys_ppg *kppg,
 	}
 
 	kcmd->state = KCMD_STATE_PPG_COMPLETE;
+
+	spin_lock(&fh->done_lock);
+	list_move_tail(&kcmd->done_list, &fh->kcmds_done);
+	ipu_psys_event_ring_flush(fh);
+	spin_unlock(&fh->done_lock);
+
 	wake_up_interruptible(&fh->wait);
 }
 
@@ -656,8 +796,7 @@ void ipu_psys_kcmd_complete(struct ipu_psys_ppg *kppg,
  * with an error.
  *
  * Found a runnable PG. Move queue to the list tail for round-robin
- * scheduling and run the PG. Start the watchdog timer if the PG was
- * started successfully. Enable PSYS power if requested.
+ * scheduling and run the PG. Enable PSYS power if requested.
  */
 int ipu_psys_kcmd_start(struct ipu_psys *psys, struct ipu_psys_kcmd *kcmd)
 {
@@ -699,7 +838,22 @@ int ipu_psys_kcmd_start(struct ipu_psys *psys, struct ipu_psys_kcmd *kcmd)
 	return 0;
 }
 
-static int ipu_psys_kcmd_send_to_ppg_start(struct ipu_psys_kcmd *kcmd)
+/*
+ * Hand kcmd over to the l-scheduler thread, which moves it onto @kppg in
+ * ipu_psys_kcmd_drain(). Returns true if the thread has to be kicked, i.e.
+ * if the submission queue was empty. Otherwise an earlier submitter has
+ * kicked it already and it will pick up this kcmd in the same pass.
+ */
+static bool ipu_psys_kcmd_submit(struct ipu_psys_ppg *kppg,
+				 struct ipu_psys_kcmd *kcmd)
+{
+	kcmd->sched_kppg = kppg;
+
+	return llist_add(&kcmd->sched_node, &kppg->fh->psys->sched_submit);
+}
+
+static int ipu_psys_kcmd_send_to_ppg_start(struct ipu_psys_kcmd *kcmd,
+					   bool *resched)
 {
 	struct ipu_psys_fh *fh = kcmd->fh;
 	struct ipu_psys_scheduler *sched = &fh->sched;
@@ -720,7 +874,6 @@ static int ipu_psys_kcmd_send_to_ppg_start(struct ipu_psys_kcmd *kcmd)
 
 	kppg->fh = fh;
 	kppg->kpg = kcmd->kpg;
-	kppg->state = PPG_STATE_START;
 	kppg->pri_base = kcmd->priority;
 	kppg->pri_dynamic = 0;
 	INIT_LIST_HEAD(&kppg->list);
@@ -730,14 +883,7 @@ static int ipu_psys_kcmd_send_to_ppg_start(struct ipu_psys_kcmd *kcmd)
 	INIT_LIST_HEAD(&kppg->kcmds_processing_list);
 	INIT_LIST_HEAD(&kppg->kcmds_finished_list);
 	INIT_LIST_HEAD(&kppg->sched_list);
-
-	kppg->manifest = kzalloc(kcmd->pg_manifest_size, GFP_KERNEL);
-	if (!kppg->manifest) {
-		kfree(kppg);
-		return -ENOMEM;
-	}
-	memcpy(kppg->manifest, kcmd->pg_manifest,
-	       kcmd->pg_manifest_size);
+	INIT_LIST_HEAD(&kppg->sched_kcmd_list);
 
 	queue_id = ipu_psys_allocate_cmd_queue_res(rpr);
 	if (queue_id == -ENOSPC) {
@@ -746,10 +892,8 @@ static int ipu_psys_kcmd_send_to_ppg_start(struct ipu_psys_kcmd *kcmd)
 #else
 		dev_err(dev, "no available queue\n");
 #endif
-		kfree(kppg->manifest);
 		kfree(kppg);
-		mutex_unlock(&psys->mutex);
-		return -ENOMEM;
+		return -ENOSPC;
 	}
 
 	/*
@@ -764,19 +908,33 @@ static int ipu_psys_kcmd_send_to_ppg_start(struct ipu_psys_kcmd *kcmd)
 	if (ret) {
 		ipu_psys_free_cmd_queue_res(rpr, queue_id);
 
-		kfree(kppg->manifest);
 		kfree(kppg);
 		return -EIO;
 	}
 	memcpy(kcmd->pg_user, kcmd->kpg->pg, kcmd->kpg->pg_size);
 
+	kppg->manifest = ipu_psys_manifest_ref(kcmd->pg_manifest);
+
+	/* Not fatal, frames fall back to the fh buffer set pool */
+	if (ipu_psys_ppg_bufset_ring_init(kppg, kcmd))
+#if LINUX_VERSION_CODE < KERNEL_VERSION(6, 10, 0)
+		dev_dbg(&psys->adev->dev, "no buffer set ring for ppg\n");
+#else
+		dev_dbg(dev, "no buffer set ring for ppg\n");
+#endif
+
 	mutex_lock(&fh->mutex);
 	list_add_tail(&kppg->list, &sched->ppgs);
 	mutex_unlock(&fh->mutex);
 
-	mutex_lock(&kppg->mutex);
-	list_add(&kcmd->list, &kppg->kcmds_new_list);
-	mutex_unlock(&kppg->mutex);
+	spin_lock(&psys->addr_lock);
+	hash_add(psys->ppg_hash, &kppg->hnode, (u32)kppg->kpg->pg_dma_addr);
+	spin_unlock(&psys->addr_lock);
+
+	/* The PPG owns the PG buffer from now on */
+	kcmd->kpg_owned = false;
+	if (ipu_psys_kcmd_submit(kppg, kcmd))
+		*resched = true;
 
 #if LINUX_VERSION_CODE < KERNEL_VERSION(6, 10, 0)
 	dev_dbg(&psys->adev->dev,
@@ -786,14 +944,16 @@ static int ipu_psys_kcmd_send_to_ppg_start(struct ipu_psys_kcmd *kcmd)
 #endif
 		ipu_fw_psys_pg_get_id(kcmd), kppg, kcmd, queue_id);
 
-	/* Kick l-scheduler thread */
-	atomic_set(&psys->wakeup_count, 1);
-	wake_up_interruptible(&psys->sched_cmd_wq);
-
 	return 0;
 }
 
-static int ipu_psys_kcmd_send_to_ppg(struct ipu_psys_kcmd *kcmd)
+/*
+ * Hand kcmd over to its PPG. The l-scheduler is not kicked from here,
+ * @resched is set instead so that a caller queueing several kcmds can
+ * wake it up only once.
+ */
+static int ipu_psys_kcmd_send_to_ppg(struct ipu_psys_kcmd *kcmd,
+				     bool *resched)
 {
 	struct ipu_psys_fh *fh = kcmd->fh;
 	struct ipu_psys *psys = fh->psys;
@@ -801,20 +961,16 @@ static int ipu_psys_kcmd_send_to_ppg(struct ipu_psys_kcmd *kcmd)
 	struct device *dev = &psys->adev->auxdev.dev;
 #endif
 	struct ipu_psys_ppg *kppg;
-	struct ipu_psys_resource_pool *rpr;
-	unsigned long flags;
-	u8 id;
-	bool resche = true;
+	int ret;
 
-	rpr = &psys->res_pool_running;
 	if (kcmd->state == KCMD_STATE_PPG_START)
-		return ipu_psys_kcmd_send_to_ppg_start(kcmd);
+		return ipu_psys_kcmd_send_to_ppg_start(kcmd, resched);
 
 	kppg = ipu_psys_identify_kppg(kcmd);
-	spin_lock_irqsave(&psys->pgs_lock, flags);
-	kcmd->kpg->pg_size = 0;
-	spin_unlock_irqrestore(&psys->pgs_lock, flags);
+	__put_pg_buf(psys, kcmd->kpg);
+	kcmd->kpg_owned = false;
 	if (!kppg) {
+		kcmd->kpg = NULL;
 #if LINUX_VERSION_CODE < KERNEL_VERSION(6, 10, 0)
 		dev_err(&psys->adev->dev, "token not match\n");
 #else
@@ -833,9 +989,53 @@ static int ipu_psys_kcmd_send_to_ppg(struct ipu_psys_kcmd *kcmd)
 		(kcmd->state == KCMD_STATE_PPG_STOP) ? "STOP" : "ENQUEUE",
 		ipu_fw_psys_pg_get_id(kcmd), kppg, kcmd);
 
-	if (kcmd->state == KCMD_STATE_PPG_STOP) {
+	if (kcmd->state != KCMD_STATE_PPG_STOP) {
+		ret = ipu_psys_ppg_get_bufset(kcmd, kppg);
+		if (ret)
+			return ret;
+	}
+
+	if (ipu_psys_kcmd_submit(kppg, kcmd))
+		*resched = true;
+	return 0;
+}
+
+/*
+ * Move all submitted kcmds onto their PPGs, in submission order, so that
+ * a START is always seen before the ENQUEUE and STOP commands following
+ * it. Called with psys->mutex held, by the l-scheduler thread before each
+ * pass and by ipu_psys_fh_deinit() before the PPGs are torn down.
+ */
+void ipu_psys_kcmd_drain(struct ipu_psys *psys)
+{
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 10, 0)
+	struct device *dev = &psys->adev->auxdev.dev;
+#endif
+	struct ipu_psys_kcmd *kcmd, *tmp;
+	struct ipu_psys_ppg *kppg;
+	struct llist_node *list;
+	u8 id;
+
+	list = llist_del_all(&psys->sched_submit);
+	if (!list)
+		return;
+
+	list = llist_reverse_order(list);
+	llist_for_each_entry_safe(kcmd, tmp, list, sched_node) {
+		kppg = kcmd->sched_kppg;
+		kcmd->sched_kppg = NULL;
+
 		mutex_lock(&kppg->mutex);
-		if (kppg->state == PPG_STATE_STOPPED) {
+		switch (kcmd->state) {
+		case KCMD_STATE_PPG_START:
+			ipu_psys_scheduler_queue_kcmd(kppg, kcmd, true);
+			ipu_psys_ppg_set_state(kppg, PPG_STATE_START);
+			break;
+		case KCMD_STATE_PPG_STOP:
+			if (kppg->state != PPG_STATE_STOPPED) {
+				ipu_psys_scheduler_queue_kcmd(kppg, kcmd, true);
+				break;
+			}
 #if LINUX_VERSION_CODE < KERNEL_VERSION(6, 10, 0)
 			dev_dbg(&psys->adev->dev,
 				"kppg 0x%p  stopped!\n", kppg);
@@ -843,39 +1043,38 @@ static int ipu_psys_kcmd_send_to_ppg(struct ipu_psys_kcmd *kcmd)
 			dev_dbg(dev, "kppg 0x%p  stopped!\n", kppg);
 #endif
 			id = ipu_fw_psys_ppg_get_base_queue_id(kcmd);
-			ipu_psys_free_cmd_queue_res(rpr, id);
+			ipu_psys_free_cmd_queue_res(&psys->res_pool_running,
+						    id);
 			ipu_psys_kcmd_complete(kppg, kcmd, 0);
 #if LINUX_VERSION_CODE < KERNEL_VERSION(6, 10, 0)
 			pm_runtime_put(&psys->adev->dev);
 #else
 			pm_runtime_put(dev);
 #endif
-			resche = false;
-		} else {
-			list_add(&kcmd->list, &kppg->kcmds_new_list);
+			break;
+		default:
+			ipu_psys_scheduler_queue_kcmd(kppg, kcmd, false);
+			break;
 		}
 		mutex_unlock(&kppg->mutex);
-	} else {
-		int ret;
-
-		ret = ipu_psys_ppg_get_bufset(kcmd, kppg);
-		if (ret)
-			return ret;
-
-		mutex_lock(&kppg->mutex);
-		list_add_tail(&kcmd->list, &kppg->kcmds_new_list);
-		mutex_unlock(&kppg->mutex);
 	}
+}
 
-	if (resche) {
-		/* Kick l-scheduler thread */
-		atomic_set(&psys->wakeup_count, 1);
-		wake_up_interruptible(&psys->sched_cmd_wq);
-	}
-	return 0;
+static void ipu_psys_kick_sched(struct ipu_psys *psys)
+{
+	/* Kick l-scheduler thread */
+	atomic_set(&psys->wakeup_count, 1);
+	wake_up_interruptible(&psys->sched_cmd_wq);
 }
 
-int ipu_psys_kcmd_new(struct ipu_psys_command *cmd, struct ipu_psys_fh *fh)
+/*
+ * Copy a command from userspace and check everything that can be checked
+ * before it is handed over to a PPG. Nothing is queued from here, so a
+ * failing command can simply be freed.
+ */
+static int ipu_psys_kcmd_prepare(struct ipu_psys_command *cmd,
+				 struct ipu_psys_fh *fh,
+				 struct ipu_psys_kcmd **kcmdp)
 {
 	struct ipu_psys *psys = fh->psys;
 #if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 10, 0)
@@ -883,7 +1082,6 @@ int ipu_psys_kcmd_new(struct ipu_psys_command *cmd, struct ipu_psys_fh *fh)
 #endif
 	struct ipu_psys_kcmd *kcmd;
 	size_t pg_size;
-	int ret;
 
 #if LINUX_VERSION_CODE < KERNEL_VERSION(6, 10, 0)
 	if (psys->adev->isp->flr_done)
@@ -902,7 +1100,6 @@ int ipu_psys_kcmd_new(struct ipu_psys_command *cmd, struct ipu_psys_fh *fh)
 		dev_dbg(dev, "pg size mismatch %lu %lu\n", pg_size,
 			kcmd->kpg->pg_size);
 #endif
-		ret = -EINVAL;
 		goto error;
 	}
 
@@ -913,19 +1110,36 @@ int ipu_psys_kcmd_new(struct ipu_psys_command *cmd, struct ipu_psys_fh *fh)
 #else
 		dev_err(dev, "No support legacy pg now\n");
 #endif
-		ret = -EINVAL;
 		goto error;
 	}
 
+	*kcmdp = kcmd;
+	return 0;
+
+error:
+	ipu_psys_kcmd_free(kcmd);
+
+	return -EINVAL;
+}
+
+static int ipu_psys_kcmd_queue(struct ipu_psys_command *cmd,
+			       struct ipu_psys_kcmd *kcmd, bool *resched)
+{
+	struct ipu_psys *psys = kcmd->fh->psys;
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 10, 0)
+	struct device *dev = &psys->adev->auxdev.dev;
+#endif
+	int ret;
+
 	if (cmd->min_psys_freq) {
 		kcmd->constraint.min_freq = cmd->min_psys_freq;
 		ipu_buttress_add_psys_constraint(psys->adev->isp,
 						 &kcmd->constraint);
 	}
 
-	ret = ipu_psys_kcmd_send_to_ppg(kcmd);
+	ret = ipu_psys_kcmd_send_to_ppg(kcmd, resched);
 	if (ret)
-		goto error;
+		return ret;
 
 #if LINUX_VERSION_CODE < KERNEL_VERSION(6, 10, 0)
 	dev_dbg(&psys->adev->dev,
@@ -936,43 +1150,155 @@ int ipu_psys_kcmd_new(struct ipu_psys_command *cmd, struct ipu_psys_fh *fh)
 		cmd->user_token, cmd->issue_id, cmd->priority);
 
 	return 0;
+}
 
-error:
-	ipu_psys_kcmd_free(kcmd);
+int ipu_psys_kcmd_new(struct ipu_psys_command *cmd, struct ipu_psys_fh *fh)
+{
+	struct ipu_psys_kcmd *kcmd;
+	bool resched = false;
+	int ret;
+
+	ret = ipu_psys_kcmd_prepare(cmd, fh, &kcmd);
+	if (ret)
+		return ret;
+
+	ret = ipu_psys_kcmd_queue(cmd, kcmd, &resched);
+	if (ret)
+		ipu_psys_kcmd_free(kcmd);
+
+	if (resched)
+		ipu_psys_kick_sched(fh->psys);
 
 	return ret;
 }
 
-static bool ipu_psys_kcmd_is_valid(struct ipu_psys *psys,
-				   struct ipu_psys_kcmd *kcmd)
+/*
+ * Index of the START command earlier in a batch that starts the PPG of
+ * kcmds[i], matched by the PG buffer both commands come from.
+ */
+static int ipu_psys_batch_find_start(struct ipu_psys_kcmd **kcmds, u32 i)
 {
-	struct ipu_psys_fh *fh;
-	struct ipu_psys_kcmd *kcmd0;
-	struct ipu_psys_ppg *kppg, *tmp;
-	struct ipu_psys_scheduler *sched;
+	u32 j;
 
-	list_for_each_entry(fh, &psys->fhs, list) {
-		sched = &fh->sched;
-		mutex_lock(&fh->mutex);
-		if (list_empty(&sched->ppgs)) {
-			mutex_unlock(&fh->mutex);
+	for (j = i; j > 0; j--)
+		if (kcmds[j - 1]->state == KCMD_STATE_PPG_START &&
+		    kcmds[j - 1]->pg_user == kcmds[i]->pg_user)
+			return j - 1;
+
+	return -ENOENT;
+}
+
+/*
+ * Queue @count commands with a single l-scheduler wakeup. All commands
+ * are copied and validated before the first one is queued, so a bad
+ * command rejects the whole batch. ENQUEUE and STOP commands refer to a
+ * PPG that is already started or to one started by an earlier command
+ * of the batch. The latter do not carry the token of their PPG yet, it
+ * is set once the START command has been queued.
+ *
+ * Returns the number of commands queued. Fewer than @count are queued
+ * only when queueing itself fails (e.g. no free buffer set), the
+ * remaining commands are dropped then. An error is returned if no
+ * command could be queued.
+ */
+int ipu_psys_kcmd_new_batch(struct ipu_psys_command *cmds, u32 count,
+			    struct ipu_psys_fh *fh)
+{
+	struct ipu_psys *psys = fh->psys;
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 10, 0)
+	struct device *dev = &psys->adev->auxdev.dev;
+#endif
+	struct ipu_psys_kcmd **kcmds;
+	bool resched = false;
+	u64 *tokens;
+	u32 i, queued;
+	int ret = 0;
+	int start;
+
+	if (!count || count > IPU_PSYS_CMD_BATCH_MAX)
+		return -EINVAL;
+
+	kcmds = kcalloc(count, sizeof(*kcmds), GFP_KERNEL);
+	if (!kcmds)
+		return -ENOMEM;
+
+	tokens = kcalloc(count, sizeof(*tokens), GFP_KERNEL);
+	if (!tokens) {
+		kfree(kcmds);
+		return -ENOMEM;
+	}
+
+	for (i = 0; i < count; i++) {
+		ret = ipu_psys_kcmd_prepare(&cmds[i], fh, &kcmds[i]);
+		if (ret)
+			break;
+
+		if (kcmds[i]->state == KCMD_STATE_PPG_START ||
+		    ipu_psys_identify_kppg(kcmds[i]))
 			continue;
+
+		start = ipu_psys_batch_find_start(kcmds, i);
+		if (start < 0) {
+#if LINUX_VERSION_CODE < KERNEL_VERSION(6, 10, 0)
+			dev_err(&psys->adev->dev,
+				"batch cmd %u: token not match\n", i);
+#else
+			dev_err(dev, "batch cmd %u: token not match\n", i);
+#endif
+			ipu_psys_kcmd_free(kcmds[i]);
+			ret = -EINVAL;
+			break;
 		}
-		list_for_each_entry_safe(kppg, tmp, &sched->ppgs, list) {
-			mutex_lock(&kppg->mutex);
-			list_for_each_entry(kcmd0,
-					    &kppg->kcmds_processing_list,
-					    list) {
-				if (kcmd0 == kcmd) {
-					mutex_unlock(&kppg->mutex);
-					mutex_unlock(&fh->mutex);
-					return true;
-				}
-			}
+		/* The token of a PPG is the address of its PG buffer */
+		tokens[i] = (u64)kcmds[start]->kpg;
+	}
+
+	if (ret) {
+		while (i--)
+			ipu_psys_kcmd_free(kcmds[i]);
+		goto out_free;
+	}
+
+	for (queued = 0; queued < count; queued++) {
+		if (tokens[queued])
+			ipu_fw_psys_pg_set_token(kcmds[queued],
+						 tokens[queued]);
+
+		ret = ipu_psys_kcmd_queue(&cmds[queued], kcmds[queued],
+					  &resched);
+		if (ret)
+			break;
+	}
+
+	for (i = queued; i < count; i++)
+		ipu_psys_kcmd_free(kcmds[i]);
+
+	if (resched)
+		ipu_psys_kick_sched(psys);
+
+	if (queued)
+		ret = queued;
+
+out_free:
+	kfree(tokens);
+	kfree(kcmds);
+
+	return ret;
+}
+
+static bool ipu_psys_kcmd_is_valid(struct ipu_psys_ppg *kppg,
+				   struct ipu_psys_kcmd *kcmd)
+{
+	struct ipu_psys_kcmd *kcmd0;
+
+	mutex_lock(&kppg->mutex);
+	list_for_each_entry(kcmd0, &kppg->kcmds_processing_list, list) {
+		if (kcmd0 == kcmd) {
 			mutex_unlock(&kppg->mutex);
+			return true;
 		}
-		mutex_unlock(&fh->mutex);
 	}
+	mutex_unlock(&kppg->mutex);
 
 	return false;
 }
@@ -1078,7 +1404,7 @@ void ipu_psys_handle_events(struct ipu_psys *psys)
 
 		ipu_psys_ppg_complete(psys, kppg);
 
-		if (kcmd && ipu_psys_kcmd_is_valid(psys, kcmd)) {
+		if (kcmd && ipu_psys_kcmd_is_valid(kppg, kcmd)) {
 			res = (status == IPU_PSYS_EVENT_CMD_COMPLETE ||
 			       status == IPU_PSYS_EVENT_FRAGMENT_COMPLETE) ?
 				0 : -EIO;
@@ -1131,6 +1457,7 @@ int ipu_psys_fh_init(struct ipu_psys_fh *fh)
 		}
 		kbuf_set->size = IPU_PSYS_BUF_SET_MAX_SIZE;
 		list_add(&kbuf_set->list, &sched->buf_sets);
+		ipu_psys_hash_buf_set(psys, kbuf_set);
 	}
 
 	return 0;
@@ -1138,6 +1465,7 @@ int ipu_psys_fh_init(struct ipu_psys_fh *fh)
 out_free_buf_sets:
 	list_for_each_entry_safe(kbuf_set, kbuf_set_tmp,
 				 &sched->buf_sets, list) {
+		ipu_psys_unhash_buf_set(psys, kbuf_set);
 #if LINUX_VERSION_CODE < KERNEL_VERSION(6, 10, 0)
 		dma_free_attrs(&psys->adev->dev,
 			       kbuf_set->size, kbuf_set->kaddr,
@@ -1169,11 +1497,13 @@ int ipu_psys_fh_deinit(struct ipu_psys_fh *fh)
 	struct ipu_psys_resource_alloc *alloc;
 	u8 id;
 
+	/* Keep l-scheduler off the kppgs while they leave its lists */
+	mutex_lock(&psys->mutex);
+	/* No kcmd of ours may still be on its way to a kppg */
+	ipu_psys_kcmd_drain(psys);
 	mutex_lock(&fh->mutex);
 	if (!list_empty(&sched->ppgs)) {
 		list_for_each_entry_safe(kppg, kppg0, &sched->ppgs, list) {
-			unsigned long flags;
-
 			mutex_lock(&kppg->mutex);
 			if (!(kppg->state &
 			      (PPG_STATE_STOPPED |
@@ -1196,7 +1526,7 @@ int ipu_psys_fh_deinit(struct ipu_psys_fh *fh)
 				    "s_change:%s %p %d -> %d\n",
 					__func__, kppg, kppg->state,
 					PPG_STATE_STOPPED);
-				kppg->state = PPG_STATE_STOPPED;
+				ipu_psys_ppg_set_state(kppg, PPG_STATE_STOPPED);
 				if (psys->power_gating != PSYS_POWER_GATED)
 #if LINUX_VERSION_CODE < KERNEL_VERSION(6, 10, 0)
 					pm_runtime_put(&psys->adev->dev);
@@ -1204,9 +1534,14 @@ int ipu_psys_fh_deinit(struct ipu_psys_fh *fh)
 					pm_runtime_put(dev);
 #endif
 			}
+			ipu_psys_scheduler_forget_kppg(kppg);
 			list_del(&kppg->list);
 			mutex_unlock(&kppg->mutex);
 
+			spin_lock(&psys->addr_lock);
+			hash_del(&kppg->hnode);
+			spin_unlock(&psys->addr_lock);
+
 			list_for_each_entry_safe(kcmd, kcmd0,
 						 &kppg->kcmds_new_list, list) {
 				kcmd->pg_user = NULL;
@@ -1233,19 +1568,21 @@ int ipu_psys_fh_deinit(struct ipu_psys_fh *fh)
 				mutex_lock(&fh->mutex);
 			}
 
-			spin_lock_irqsave(&psys->pgs_lock, flags);
-			kppg->kpg->pg_size = 0;
-			spin_unlock_irqrestore(&psys->pgs_lock, flags);
+			__put_pg_buf(psys, kppg->kpg);
+			ipu_psys_ppg_bufset_ring_free(kppg);
 
 			mutex_destroy(&kppg->mutex);
-			kfree(kppg->manifest);
+			ipu_psys_resource_plan_free(kppg->res_plan);
+			ipu_psys_manifest_put(psys, kppg->manifest);
 			kfree(kppg);
 		}
 	}
 	mutex_unlock(&fh->mutex);
+	mutex_unlock(&psys->mutex);
 
 	mutex_lock(&sched->bs_mutex);
 	list_for_each_entry_safe(kbuf_set, kbuf_set0, &sched->buf_sets, list) {
+		ipu_psys_unhash_buf_set(psys, kbuf_set);
 #if LINUX_VERSION_CODE < KERNEL_VERSION(6, 10, 0)
 		dma_free_attrs(&psys->adev->dev,
 			       kbuf_set->size, kbuf_set->kaddr,
@@ -1266,41 +1603,40 @@ int ipu_psys_fh_deinit(struct ipu_psys_fh *fh)
 
 struct ipu_psys_kcmd *ipu_get_completed_kcmd(struct ipu_psys_fh *fh)
 {
-	struct ipu_psys_scheduler *sched = &fh->sched;
+	struct ipu_psys_kcmd *kcmd;
+
+	spin_lock(&fh->done_lock);
+	kcmd = list_first_entry_or_null(&fh->kcmds_done,
+					struct ipu_psys_kcmd, done_list);
+	spin_unlock(&fh->done_lock);
+
+	return kcmd;
+}
+
+/* Take the oldest completed kcmd off the fh, the caller frees it */
+static struct ipu_psys_kcmd *ipu_psys_dq_completed_kcmd(struct ipu_psys_fh *fh)
+{
 #if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 10, 0)
 	struct device *dev = &fh->psys->adev->auxdev.dev;
 #endif
 	struct ipu_psys_kcmd *kcmd;
-	struct ipu_psys_ppg *kppg;
 
-	mutex_lock(&fh->mutex);
-	if (list_empty(&sched->ppgs)) {
-		mutex_unlock(&fh->mutex);
-		return NULL;
-	}
+	spin_lock(&fh->done_lock);
+	kcmd = list_first_entry_or_null(&fh->kcmds_done,
+					struct ipu_psys_kcmd, done_list);
+	if (kcmd)
+		list_del_init(&kcmd->done_list);
+	spin_unlock(&fh->done_lock);
 
-	list_for_each_entry(kppg, &sched->ppgs, list) {
-		mutex_lock(&kppg->mutex);
-		if (list_empty(&kppg->kcmds_finished_list)) {
-			mutex_unlock(&kppg->mutex);
-			continue;
-		}
-
-		kcmd = list_first_entry(&kppg->kcmds_finished_list,
-					struct ipu_psys_kcmd, list);
-		mutex_unlock(&fh->mutex);
-		mutex_unlock(&kppg->mutex);
+	if (kcmd)
 #if LINUX_VERSION_CODE < KERNEL_VERSION(6, 10, 0)
 		dev_dbg(&fh->psys->adev->dev,
 			"get completed kcmd 0x%p\n", kcmd);
 #else
 		dev_dbg(dev, "get completed kcmd 0x%p\n", kcmd);
 #endif
-		return kcmd;
-	}
-	mutex_unlock(&fh->mutex);
 
-	return NULL;
+	return kcmd;
 }
 
 long ipu_ioctl_dqevent(struct ipu_psys_event *event,
@@ -1322,13 +1658,13 @@ long ipu_ioctl_dqevent(struct ipu_psys_event *event,
 	if (!(f_flags & O_NONBLOCK)) {
 		rval = wait_event_interruptible(fh->wait,
 						(kcmd =
-						 ipu_get_completed_kcmd(fh)));
+						 ipu_psys_dq_completed_kcmd(fh)));
 		if (rval == -ERESTARTSYS)
 			return rval;
 	}
 
 	if (!kcmd) {
-		kcmd = ipu_get_completed_kcmd(fh);
+		kcmd = ipu_psys_dq_completed_kcmd(fh);
 		if (!kcmd)
 			return -ENODATA;
 	}
@@ -1338,3 +1674,73 @@ long ipu_ioctl_dqevent(struct ipu_psys_event *event,
 
 	return 0;
 }
+
+long ipu_ioctl_dqevent_batch(struct ipu_psys_event_batch *batch,
+			     struct ipu_psys_fh *fh, unsigned int f_flags)
+{
+	struct ipu_psys *psys = fh->psys;
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 10, 0)
+	struct device *dev = &psys->adev->auxdev.dev;
+#endif
+	struct ipu_psys_event *events;
+	struct ipu_psys_kcmd *kcmd = NULL, *tmp;
+	LIST_HEAD(dequeued);
+	u32 n = 0;
+	int rval;
+
+	if (!batch->count || batch->count > IPU_PSYS_EVENT_BATCH_MAX)
+		return -EINVAL;
+
+	events = kcalloc(batch->count, sizeof(*events), GFP_KERNEL);
+	if (!events)
+		return -ENOMEM;
+
+	if (!(f_flags & O_NONBLOCK)) {
+		rval = wait_event_interruptible(fh->wait,
+						(kcmd =
+						 ipu_psys_dq_completed_kcmd(fh)));
+		if (rval == -ERESTARTSYS) {
+			kfree(events);
+			return rval;
+		}
+	}
+
+	do {
+		if (!kcmd)
+			kcmd = ipu_psys_dq_completed_kcmd(fh);
+		if (!kcmd)
+			break;
+
+		events[n++] = kcmd->ev;
+		list_add_tail(&kcmd->done_list, &dequeued);
+		kcmd = NULL;
+	} while (n < batch->count);
+
+#if LINUX_VERSION_CODE < KERNEL_VERSION(6, 10, 0)
+	dev_dbg(&psys->adev->dev, "IOC_DQEVENT_BATCH: %u events\n", n);
+#else
+	dev_dbg(dev, "IOC_DQEVENT_BATCH: %u events\n", n);
+#endif
+
+	if (!n) {
+		kfree(events);
+		return -ENODATA;
+	}
+
+	rval = copy_to_user(batch->events, events, n * sizeof(*events));
+	kfree(events);
+	if (rval) {
+		/* Keep the events for the next dequeue, in order */
+		spin_lock(&fh->done_lock);
+		list_splice(&dequeued, &fh->kcmds_done);
+		spin_unlock(&fh->done_lock);
+		return -EFAULT;
+	}
+
+	list_for_each_entry_safe(kcmd, tmp, &dequeued, done_list) {
+		list_del_init(&kcmd->done_list);
+		ipu_psys_kcmd_free(kcmd);
+	}
+
+	return n;
+}
@@ -30,6 +30,52 @@ struct ipu_psys_event {
 #define IPU_PSYS_EVENT_TYPE_CMD_COMPLETE	1
 #define IPU_PSYS_EVENT_TYPE_BUFFER_COMPLETE	2
 
+#define IPU_PSYS_EVENT_BATCH_MAX		64
+
+/**
+ * struct ipu_psys_event_batch - array of events to dequeue
+ * @events:	userspace pointer to array of events
+ * @count:	size of the array, IPU_PSYS_EVENT_BATCH_MAX at most
+ *
+ * IPU_IOC_DQEVENT_BATCH fills @events in completion order and returns
+ * the number of events dequeued. Unless the file is opened O_NONBLOCK,
+ * it waits for at least one event.
+ */
+struct ipu_psys_event_batch {
+	struct ipu_psys_event __user *events;
+	uint32_t count;
+	uint32_t reserved[3];
+} __attribute__ ((packed));
+
+#define IPU_PSYS_EVENT_RING_ENTRIES		64
+#define IPU_PSYS_EVENT_RING_OVERFLOW		(1 << 0)
+
+/**
+ * struct ipu_psys_event_ring - completion events shared through mmap()
+ * @head:	producer index, only written by the driver
+ * @tail:	consumer index, only written by userspace
+ * @entries:	number of entries in @events
+ * @flags:	IPU_PSYS_EVENT_RING_OVERFLOW while completed commands are
+ *		waiting for space in the ring, these are also returned by
+ *		IPU_IOC_DQEVENT
+ * @events:	event with index i is at events[i % entries]
+ *
+ * The ring is mapped by mmap() of the PSYS device at offset 0 with a
+ * length of sizeof(struct ipu_psys_event_ring) rounded up to the page
+ * size. Once mapped, completion events are published here instead of
+ * being queued for IPU_IOC_DQEVENT. Both indices are free running, the
+ * ring is empty when @head equals @tail. poll() reports POLLIN while
+ * the ring is not empty.
+ */
+struct ipu_psys_event_ring {
+	uint32_t head;
+	uint32_t tail;
+	uint32_t entries;
+	uint32_t flags;
+	uint32_t reserved[12];
+	struct ipu_psys_event events[IPU_PSYS_EVENT_RING_ENTRIES];
+} __attribute__ ((packed));
+
 /**
  * struct ipu_psys_buffer - for input/output terminals
  * @len:	total allocated size @ base address
@@ -80,6 +126,10 @@ struct ipu_psys_buffer {
  * @terminal_enable_bitmap:     enable bits for each individual terminals
  * @routing_enable_bitmap:      enable bits for each individual routing
  * @rbm:                        enable bits for routing
+ * @deadline_us:	deadline in microseconds from queueing the command,
+ *			only used with IPU_PSYS_CMD_FLAG_DEADLINE and by the
+ *			deadline scheduling policy of the driver
+ * @flags:		IPU_PSYS_CMD_FLAG_*
  *
  * Specifies a processing command with input and output buffers.
  */
@@ -98,7 +148,34 @@ struct ipu_psys_command {
 	uint32_t terminal_enable_bitmap[4];
 	uint32_t routing_enable_bitmap[4];
 	uint32_t rbm[5];
-	uint32_t reserved[2];
+	uint32_t deadline_us;
+	uint32_t flags;
+} __attribute__ ((packed));
+
+#define IPU_PSYS_CMD_FLAG_DEADLINE	(1 << 0)
+
+#define IPU_PSYS_CMD_BATCH_MAX		32
+
+/**
+ * struct ipu_psys_command_batch - array of processing commands
+ * @commands:	userspace pointer to array of processing commands
+ * @count:	number of commands in the array, IPU_PSYS_CMD_BATCH_MAX at most
+ *
+ * All commands are validated before any of them is queued, a command
+ * failing validation rejects the whole batch. A command may use a PPG
+ * started by an earlier command of the same batch from the same @pg
+ * buffer, e.g. a START followed by the ENQUEUE of its first frame.
+ *
+ * The commands are then queued in order. If queueing one fails, e.g.
+ * because no buffer set is free, it and all the commands after it are
+ * dropped without any event. IPU_IOC_QCMD_BATCH returns the number of
+ * commands queued, which is then less than @count, or an error if none
+ * was queued.
+ */
+struct ipu_psys_command_batch {
+	struct ipu_psys_command __user *commands;
+	uint32_t count;
+	uint32_t reserved[3];
 } __attribute__ ((packed));
 
 struct ipu_psys_manifest {
@@ -117,5 +194,7 @@ struct ipu_psys_manifest {
 #define IPU_IOC_DQEVENT _IOWR('A', 7, struct ipu_psys_event)
 #define IPU_IOC_CMD_CANCEL _IOWR('A', 8, struct ipu_psys_command)
 #define IPU_IOC_GET_MANIFEST _IOWR('A', 9, struct ipu_psys_manifest)
+#define IPU_IOC_QCMD_BATCH _IOW('A', 10, struct ipu_psys_command_batch)
+#define IPU_IOC_DQEVENT_BATCH _IOW('A', 11, struct ipu_psys_event_batch)
 
 #endif /* _UAPI_IPU_PSYS_H */